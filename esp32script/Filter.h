@@ -0,0 +1,45 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+// Robust averages over the few conversions that make up one sample, see
+// take_sample().
+//
+// Both sort the values in place. An insertion sort, the firmware filters
+// at most acquisitionMax values, where it beats anything cleverer and needs
+// no memory. The median ignores up to half the values being wild, the
+// trimmed mean drops trim values at each end and averages the rest, so it
+// ignores up to trim glitches on either side and still averages the noise
+// down like a plain mean.
+//
+// No Arduino dependencies, this header also builds on a desktop compiler.
+
+inline void filter_sort(double* values, int count) {
+  for (int i = 1; i < count; ++i) {
+    double value = values[i];
+    int j = i;
+    for (; j > 0 && values[j - 1] > value; --j) values[j] = values[j - 1];
+    values[j] = value;
+  }
+}
+
+// the middle value, the mean of the middle two for an even count, 0 without any
+inline double filter_median(double* values, int count) {
+  if (count <= 0) return 0;
+  filter_sort(values, count);
+  int middle = count / 2;
+  return count % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// the mean without the trim lowest and trim highest values, the median
+// when that would leave none
+inline double filter_trimmed_mean(double* values, int count, int trim) {
+  if (count <= 0) return 0;
+  if (trim < 0) trim = 0;
+  if (count - 2 * trim < 1) return filter_median(values, count);
+  filter_sort(values, count);
+  double sum = 0;
+  for (int i = trim; i < count - trim; ++i) sum += values[i];
+  return sum / (count - 2 * trim);
+}
+
+#endif
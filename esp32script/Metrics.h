@@ -0,0 +1,102 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Counters and histograms the firmware keeps about itself, read over the
+// control port with STATS, see control_step().
+//
+// A histogram has one bucket per power of two: bucket 0 counts zeros,
+// bucket i counts values in [2^(i-1), 2^i). Quantiles come out as the top
+// of their bucket, so they are at most twice the real value, which is
+// enough to tell 20 ms from 2 s and costs 136 bytes.
+//
+// Each value is written by one task only, and reading them from another
+// is allowed to be a sample behind. Nothing here takes a lock.
+//
+// No Arduino dependencies, this header also builds on a desktop compiler.
+
+#include <stdint.h>
+#include <stdio.h>
+
+const int histogramBuckets = 32;
+
+struct Histogram {
+  uint32_t buckets[histogramBuckets];
+  uint32_t count;
+  uint32_t max;
+
+  void clear() {
+    for (int i = 0; i < histogramBuckets; ++i) buckets[i] = 0;
+    count = 0;
+    max = 0;
+  }
+
+  void record(uint32_t value) {
+    int bucket = 0;
+    while (bucket < histogramBuckets - 1 && value >> bucket) ++bucket;
+    ++buckets[bucket];
+    ++count;
+    if (value > max) max = value;
+  }
+
+  // the top of the bucket the q-th value is in, never more than max
+  uint32_t quantile(float q) const {
+    if (count == 0) return 0;
+    uint32_t rank = (uint32_t)(q * (count - 1));
+    uint32_t seen = 0;
+    for (int i = 0; i < histogramBuckets; ++i) {
+      seen += buckets[i];
+      if (seen > rank) {
+        uint32_t top = (uint32_t)((1ULL << i) - 1);
+        return top < max ? top : max;
+      }
+    }
+    return max;
+  }
+};
+
+struct FirmwareMetrics {
+  // sampling task
+  uint32_t samplesTaken;
+  uint32_t samplesStored; // into the reservoir, past the deadband
+  uint32_t samplesHeld; // samples or period means inside the deadband
+  uint32_t sensorFailures; // conversions
+  uint32_t depthMax; // most samples the reservoir ever held
+
+  // network task
+  uint32_t samplesSent; // acknowledged by the server
+  uint32_t samplesExpired; // dropped from the reservoir before their time wrapped
+  uint32_t requests;
+  uint32_t requestFailures; // no answer, or not a 200
+  Histogram roundTrip; // ms per HTTP request, answered or not
+  Histogram sendDelay; // s from taking a sample to the server acknowledging it
+
+  void clear() {
+    samplesTaken = samplesStored = samplesHeld = sensorFailures = depthMax = 0;
+    samplesSent = samplesExpired = requests = requestFailures = 0;
+    roundTrip.clear();
+    sendDelay.clear();
+  }
+};
+
+// One line of "key=value" pairs, what STATS answers with, histograms as
+// p50/p90/p99/max. Returns the length like snprintf. depth and capacity are
+// the reservoir's, the heap numbers are the free bytes now and the least
+// there ever were.
+inline int format_metrics(char* out, size_t size, const FirmwareMetrics& m, uint32_t uptime, uint32_t depth,
+                          uint32_t capacity, uint32_t dropped, uint32_t heapFree, uint32_t heapMinFree) {
+  return snprintf(out, size,
+                  "up=%lu taken=%lu stored=%lu held=%lu sensor_failed=%lu depth=%lu/%lu depth_max=%lu "
+                  "dropped=%lu expired=%lu sent=%lu requests=%lu failed=%lu rtt_ms=%lu/%lu/%lu/%lu delay_s=%lu/%lu/%lu/%lu "
+                  "heap_free=%lu heap_min=%lu",
+                  (unsigned long)uptime, (unsigned long)m.samplesTaken, (unsigned long)m.samplesStored,
+                  (unsigned long)m.samplesHeld, (unsigned long)m.sensorFailures,
+                  (unsigned long)depth, (unsigned long)capacity, (unsigned long)m.depthMax,
+                  (unsigned long)dropped, (unsigned long)m.samplesExpired, (unsigned long)m.samplesSent, (unsigned long)m.requests,
+                  (unsigned long)m.requestFailures, (unsigned long)m.roundTrip.quantile(0.5f),
+                  (unsigned long)m.roundTrip.quantile(0.9f), (unsigned long)m.roundTrip.quantile(0.99f),
+                  (unsigned long)m.roundTrip.max, (unsigned long)m.sendDelay.quantile(0.5f),
+                  (unsigned long)m.sendDelay.quantile(0.9f), (unsigned long)m.sendDelay.quantile(0.99f),
+                  (unsigned long)m.sendDelay.max, (unsigned long)heapFree, (unsigned long)heapMinFree);
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef RESERVOIR_H
+#define RESERVOIR_H
+
+// Fixed-capacity ring buffer holding samples while the board is offline.
+//
+// One producer (the sampling side) pushes, one consumer (the network side)
+// drains, and neither ever blocks or takes a lock. When the buffer is full a
+// push drops the oldest sample instead of shifting the whole array, so every
+// push is O(1) no matter how long the outage lasts.
+//
+// Head and tail are free-running 32 bit counters. The slot for a counter is
+// counter % capacity, which stays consistent across counter wrap-around only
+// after 2^32 pushes -- about 680 years at one sample every 5 seconds.
+//
+// Draining is two-phase: peek() copies the oldest samples out without
+// removing them, and consume() drops them once they were delivered. If the
+// producer overwrote a sample while peek() was copying it, peek() notices the
+// moved tail and copies again, so a torn sample is never handed out.
+//
+// No Arduino dependencies, this header also builds on a desktop compiler.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+
+template <typename T>
+class Reservoir {
+public:
+  Reservoir() : buffer(NULL), cap(0), head(0), tail(0), peekTail(0), dropped(0) {}
+  ~Reservoir() { free(buffer); }
+
+  // allocate room for capacity samples, returns false if the heap is too small
+  bool begin(uint32_t capacity) {
+    free(buffer);
+    buffer = (T*)malloc(capacity * sizeof(T));
+    cap = buffer ? capacity : 0;
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    peekTail = 0;
+    dropped.store(0, std::memory_order_relaxed);
+    return buffer != NULL;
+  }
+
+  uint32_t capacity() const { return cap; }
+
+  uint32_t size() const {
+    uint32_t t = tail.load(std::memory_order_acquire);
+    uint32_t h = head.load(std::memory_order_acquire);
+    return h - t;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // number of samples lost to overflow since begin()
+  uint32_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+  // producer side, returns false if the oldest sample had to be dropped
+  bool push(const T& item) {
+    if (cap == 0) return false;
+    bool kept = true;
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t t = tail.load(std::memory_order_acquire);
+    // the consumer may move tail at the same time, so drop the oldest
+    // sample with a CAS, and only write the slot once it is really free
+    while (h - t >= cap) {
+      if (tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        kept = false;
+        break;
+      }
+    }
+    buffer[h % cap] = item;
+    head.store(h + 1, std::memory_order_release);
+    return kept;
+  }
+
+  // consumer side, copies up to maxCount of the oldest samples into out,
+  // oldest first, without removing them. Returns the number copied.
+  uint32_t peek(T* out, uint32_t maxCount) {
+    for (;;) {
+      uint32_t t = tail.load(std::memory_order_acquire);
+      uint32_t h = head.load(std::memory_order_acquire);
+      uint32_t n = h - t;
+      if (n > maxCount) n = maxCount;
+      uint32_t slot = t % cap;
+      for (uint32_t i = 0; i < n; ++i) {
+        out[i] = buffer[slot];
+        if (++slot == cap) slot = 0;
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (tail.load(std::memory_order_relaxed) == t) {
+        peekTail = t;
+        return n;
+      }
+      // the producer dropped samples under us, some copies may be torn
+    }
+  }
+
+  // consumer side, removes the first count samples returned by the last peek().
+  // Samples the producer already dropped in the meantime are skipped.
+  void consume(uint32_t count) {
+    uint32_t target = peekTail + count;
+    uint32_t t = tail.load(std::memory_order_acquire);
+    while ((int32_t)(target - t) > 0) {
+      if (tail.compare_exchange_weak(t, target, std::memory_order_acq_rel, std::memory_order_acquire)) break;
+    }
+    peekTail = target;
+  }
+
+  // consumer side, pops a single sample, returns false when empty
+  bool pop(T& out) {
+    if (peek(&out, 1) == 0) return false;
+    consume(1);
+    return true;
+  }
+
+private:
+  Reservoir(const Reservoir&);
+  Reservoir& operator=(const Reservoir&);
+
+  T* buffer;
+  uint32_t cap;
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  uint32_t peekTail;
+  std::atomic<uint32_t> dropped;
+};
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef ROLLING_STATS_H
+#define ROLLING_STATS_H
+
+// Statistics over a sliding time window, updated one sample at a time.
+//
+// Each rolling_stat keeps the samples of the last `window` seconds in a
+// ring, with running sums for the mean and variance and two monotonic
+// deques for the min and max. Pushing a sample evicts whatever fell out of
+// the window, every sample goes in and out once, so a push is O(1)
+// amortized however long the window is. The sums are taken relative to a
+// recent value and rebuilt from the ring every ROLLING_CAPACITY evictions,
+// so adding and subtracting doesn't drift.
+//
+// The mean weights every sample the same, the held mean weights each one by
+// how long it stood until the next, up to ROLLING_HOLD_MAX seconds. The two
+// agree on evenly spaced samples. A board that only sends what changed
+// sends a burst while things move and little otherwise, there only the held
+// mean is the mean over time. The newest sample hasn't stood yet and
+// weighs nothing until the next one comes.
+//
+// The ring holds ROLLING_CAPACITY samples. If more than that arrive within
+// the window, the oldest ones leave early and the window is that many
+// samples instead. Define ROLLING_CAPACITY before including to change it.
+// A power of two keeps the slots put when the sequence numbers wrap, any
+// other size is fine where they can't, 2^32 pushes are 680 years at 5 s.
+//
+// Plain C, so the monitor and the firmware build the same code and the
+// board makes the same window decision as the monitor when it's offline.
+// No Arduino dependencies.
+
+#include <stdint.h>
+#include <math.h>
+
+#ifndef ROLLING_CAPACITY
+#define ROLLING_CAPACITY 1024
+#endif
+// longer between two samples is a gap, not a value that held, the same
+// as the monitor's AGGREGATE_GAP_SECONDS
+#define ROLLING_HOLD_MAX 300
+
+typedef struct {
+  uint32_t window;   // seconds
+  double ewmaPeriod; // seconds, time constant of the moving average
+  // ring of samples, sequence numbers count every push, seq % ROLLING_CAPACITY is the slot
+  uint32_t time[ROLLING_CAPACITY];
+  float value[ROLLING_CAPACITY];
+  float hold[ROLLING_CAPACITY]; // seconds until the next sample, capped
+  uint32_t first; // sequence number of the oldest sample
+  uint32_t next;  // sequence number of the next push
+  // sums of value - shift
+  double shift;
+  double sum;
+  double sumsq;
+  double heldSum; // of hold * (value - shift)
+  double heldTime;
+  uint32_t evictions; // since the sums were rebuilt
+  // sequence numbers with increasing values (min) and decreasing values (max)
+  uint32_t minQueue[ROLLING_CAPACITY];
+  uint32_t minFirst, minNext;
+  uint32_t maxQueue[ROLLING_CAPACITY];
+  uint32_t maxFirst, maxNext;
+  double ewma;
+} rolling_stat;
+
+static inline void rolling_init(rolling_stat* s, uint32_t window, double ewmaPeriod) {
+  s->window = window;
+  s->ewmaPeriod = ewmaPeriod;
+  s->first = s->next = 0;
+  s->shift = s->sum = s->sumsq = 0;
+  s->heldSum = s->heldTime = 0;
+  s->evictions = 0;
+  s->minFirst = s->minNext = 0;
+  s->maxFirst = s->maxNext = 0;
+  s->ewma = 0;
+}
+
+static inline uint32_t rolling_count(const rolling_stat* s) {
+  return s->next - s->first;
+}
+
+static inline float rolling_value(const rolling_stat* s, uint32_t seq) {
+  return s->value[seq % ROLLING_CAPACITY];
+}
+
+static inline uint32_t rolling_time(const rolling_stat* s, uint32_t seq) {
+  return s->time[seq % ROLLING_CAPACITY];
+}
+
+static inline float rolling_hold(const rolling_stat* s, uint32_t seq) {
+  return s->hold[seq % ROLLING_CAPACITY];
+}
+
+static inline void rolling_rebuild(rolling_stat* s) {
+  s->shift = rolling_count(s) ? rolling_value(s, s->next - 1) : 0;
+  s->sum = s->sumsq = 0;
+  s->heldSum = s->heldTime = 0;
+  for (uint32_t seq = s->first; seq != s->next; ++seq) {
+    double d = rolling_value(s, seq) - s->shift;
+    s->sum += d;
+    s->sumsq += d * d;
+    s->heldSum += rolling_hold(s, seq) * d;
+    s->heldTime += rolling_hold(s, seq);
+  }
+  s->evictions = 0;
+}
+
+static inline void rolling_evict(rolling_stat* s) {
+  double d = rolling_value(s, s->first) - s->shift;
+  s->sum -= d;
+  s->sumsq -= d * d;
+  s->heldSum -= rolling_hold(s, s->first) * d;
+  s->heldTime -= rolling_hold(s, s->first);
+  ++s->first;
+  if (s->minFirst != s->minNext && s->minQueue[s->minFirst % ROLLING_CAPACITY] == s->first - 1) ++s->minFirst;
+  if (s->maxFirst != s->maxNext && s->maxQueue[s->maxFirst % ROLLING_CAPACITY] == s->first - 1) ++s->maxFirst;
+  if (++s->evictions >= ROLLING_CAPACITY) rolling_rebuild(s);
+}
+
+// time in seconds, never going backwards
+static inline void rolling_push(rolling_stat* s, uint32_t time, double value) {
+  if (rolling_count(s) == 0) {
+    s->shift = value;
+    s->ewma = value;
+  } else {
+    uint32_t last = s->next - 1;
+    double dt = (double)(time - rolling_time(s, last));
+    double alpha = s->ewmaPeriod > 0 ? 1.0 - exp(-dt / s->ewmaPeriod) : 1.0;
+    s->ewma += alpha * (value - s->ewma);
+    // the last sample stood until now
+    float hold = dt < ROLLING_HOLD_MAX ? (float)dt : ROLLING_HOLD_MAX;
+    s->hold[last % ROLLING_CAPACITY] = hold;
+    s->heldSum += hold * (rolling_value(s, last) - s->shift);
+    s->heldTime += hold;
+  }
+  while (rolling_count(s) > 0 && (time - rolling_time(s, s->first) >= s->window || rolling_count(s) == ROLLING_CAPACITY)) {
+    rolling_evict(s);
+  }
+
+  uint32_t seq = s->next++;
+  s->time[seq % ROLLING_CAPACITY] = time;
+  s->value[seq % ROLLING_CAPACITY] = (float)value;
+  s->hold[seq % ROLLING_CAPACITY] = 0;
+  double d = rolling_value(s, seq) - s->shift;
+  s->sum += d;
+  s->sumsq += d * d;
+
+  float v = rolling_value(s, seq);
+  while (s->minNext != s->minFirst && rolling_value(s, s->minQueue[(s->minNext - 1) % ROLLING_CAPACITY]) >= v) --s->minNext;
+  s->minQueue[s->minNext++ % ROLLING_CAPACITY] = seq;
+  while (s->maxNext != s->maxFirst && rolling_value(s, s->maxQueue[(s->maxNext - 1) % ROLLING_CAPACITY]) <= v) --s->maxNext;
+  s->maxQueue[s->maxNext++ % ROLLING_CAPACITY] = seq;
+}
+
+static inline double rolling_mean(const rolling_stat* s) {
+  uint32_t n = rolling_count(s);
+  return n ? s->shift + s->sum / n : 0;
+}
+
+// the mean over time, each value counted for as long as it held
+static inline double rolling_held_mean(const rolling_stat* s) {
+  return s->heldTime > 0 ? s->shift + s->heldSum / s->heldTime : rolling_mean(s);
+}
+
+static inline double rolling_variance(const rolling_stat* s) {
+  uint32_t n = rolling_count(s);
+  if (n == 0) return 0;
+  double mean = s->sum / n;
+  double variance = s->sumsq / n - mean * mean;
+  return variance > 0 ? variance : 0;
+}
+
+static inline double rolling_std(const rolling_stat* s) {
+  return sqrt(rolling_variance(s));
+}
+
+static inline double rolling_min(const rolling_stat* s) {
+  return s->minFirst != s->minNext ? rolling_value(s, s->minQueue[s->minFirst % ROLLING_CAPACITY]) : 0;
+}
+
+static inline double rolling_max(const rolling_stat* s) {
+  return s->maxFirst != s->maxNext ? rolling_value(s, s->maxQueue[s->maxFirst % ROLLING_CAPACITY]) : 0;
+}
+
+static inline double rolling_ewma(const rolling_stat* s) {
+  return s->ewma;
+}
+
+// change per second from the oldest to the newest sample in the window
+static inline double rolling_rate(const rolling_stat* s) {
+  if (rolling_count(s) < 2) return 0;
+  uint32_t dt = rolling_time(s, s->next - 1) - rolling_time(s, s->first);
+  if (dt == 0) return 0;
+  return (rolling_value(s, s->next - 1) - rolling_value(s, s->first)) / dt;
+}
+
+// The window decision, on the last hour of samples: open while the
+// temperature isn't climbing above its average and the pressure is low or
+// near its average, averages over time so it holds for thinned out
+// samples too. The monitor shows it, the board acts on it.
+#define WINDOW_BASELINE_SECONDS 3600
+#define WINDOW_EWMA_SECONDS 300
+#define WINDOW_LOW_PRESSURE 1000.0
+#define WINDOW_PRESSURE_MARGIN 10.0
+#define WINDOW_TEMPERATURE_MARGIN 0.5
+
+typedef struct {
+  rolling_stat temperature;
+  rolling_stat pressure;
+} window_model;
+
+static inline void window_init(window_model* model) {
+  rolling_init(&model->temperature, WINDOW_BASELINE_SECONDS, WINDOW_EWMA_SECONDS);
+  rolling_init(&model->pressure, WINDOW_BASELINE_SECONDS, WINDOW_EWMA_SECONDS);
+}
+
+static inline void window_push(window_model* model, uint32_t time, double temperature, double pressure) {
+  rolling_push(&model->temperature, time, temperature);
+  rolling_push(&model->pressure, time, pressure);
+}
+
+static inline int window_should_open(const window_model* model, double temperature, double pressure) {
+  if (rolling_count(&model->temperature) == 0) return 0;
+  return (pressure < WINDOW_LOW_PRESSURE || pressure - rolling_held_mean(&model->pressure) < WINDOW_PRESSURE_MARGIN) &&
+    temperature - rolling_held_mean(&model->temperature) < WINDOW_TEMPERATURE_MARGIN;
+}
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+// 6 byte packed sample as stored in the reservoir and sent in batches.
+//
+// 48 bits, little endian:
+//   bits  0-16  capture time, seconds since boot modulo 2^17 (about 36 hours)
+//   bits 17-30  temperature, signed hundredths of a degree C (+-81.91)
+//   bits 31-47  pressure, Pa, i.e. hundredths of a millibar (0-1310.71 mb)
+//
+// The capture time only keeps its low bits. It is recovered against the
+// current uptime, so a sample must be sent within sampleTimeRange seconds of
+// being taken, the board drops the ones that get close, see sampleMaxAge.
+//
+// No Arduino dependencies, this header also builds on a desktop compiler.
+
+#include <stdint.h>
+#include <math.h>
+
+const uint32_t sampleTimeBits = 17;
+const uint32_t sampleTimeRange = 1UL << sampleTimeBits;
+const int sampleTemperatureMax = (1 << 13) - 1;
+const uint32_t samplePressureMax = (1UL << 17) - 1;
+
+struct Sample {
+  uint8_t bytes[6];
+};
+
+inline Sample pack_sample(uint32_t capturedAt, double temperature, double pressure) {
+  long centiDegrees = lround(temperature * 100.0);
+  if (centiDegrees > sampleTemperatureMax) centiDegrees = sampleTemperatureMax;
+  if (centiDegrees < -sampleTemperatureMax - 1) centiDegrees = -sampleTemperatureMax - 1;
+  long pascal = lround(pressure * 100.0);
+  if (pascal < 0) pascal = 0;
+  if (pascal > (long)samplePressureMax) pascal = samplePressureMax;
+
+  uint64_t bits = (uint64_t)(capturedAt & (sampleTimeRange - 1))
+    | ((uint64_t)(centiDegrees & 0x3FFF) << 17)
+    | ((uint64_t)pascal << 31);
+  Sample sample;
+  for (int i = 0; i < 6; ++i) {
+    sample.bytes[i] = (bits >> (8 * i)) & 0xFF;
+  }
+  return sample;
+}
+
+inline uint64_t sample_bits(const Sample& sample) {
+  uint64_t bits = 0;
+  for (int i = 0; i < 6; ++i) {
+    bits |= (uint64_t)sample.bytes[i] << (8 * i);
+  }
+  return bits;
+}
+
+// seconds since boot, given the current uptime
+inline uint32_t sample_time(const Sample& sample, uint32_t now) {
+  uint32_t low = sample_bits(sample) & (sampleTimeRange - 1);
+  return now - ((now - low) & (sampleTimeRange - 1));
+}
+
+inline double sample_temperature(const Sample& sample) {
+  int32_t centiDegrees = (sample_bits(sample) >> 17) & 0x3FFF;
+  if (centiDegrees & 0x2000) centiDegrees -= 0x4000;
+  return centiDegrees / 100.0;
+}
+
+inline double sample_pressure(const Sample& sample) {
+  return ((sample_bits(sample) >> 31) & samplePressureMax) / 100.0;
+}
+
+#endif
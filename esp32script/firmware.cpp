@@ -0,0 +1,644 @@
+#include "firmware.h"
+#include <Wire.h>
+#include <HTTPClient.h>
+#include <WiFiClient.h>
+#include <esp_timer.h>
+
+SFE_BMP180 sensor;
+LiquidCrystal LCD(2, 13, 14, 0, 26, 25); //[RS,EN,D4,D5,D6,D7]
+
+#define PERTH_ALTITUDE 0
+//deployment location altitude in meters
+
+const int wifiSets = 2;
+const char* ssid[wifiSets] = {"oi"};
+const char* password[wifiSets] = {"okokokok"};
+const char* serverUrl = "http://192.168.130.71:8000";
+const char* ntpServer = "pool.ntp.org";
+WiFiServer server(80);
+volatile bool online = false;
+
+// Sent with every upload so the server keeps each board's data apart,
+// the station MAC in lowercase hex, set in setup()
+const char* deviceHeader = "X-Device-Id";
+char deviceId[13] = "";
+
+// Timing, all in ms
+const uint32_t samplePeriod = 5000;
+const unsigned long connectTimeout = 10000; // per SSID
+const unsigned long reconnectInterval = 60000; // 1min = 60s = 60,000ms
+const unsigned long uploadRetryInterval = 5000;
+const unsigned long networkPeriod = 50;
+
+// Samples are stamped with seconds since boot, which never jumps. Once NTP
+// answers, bootEpoch anchors that clock so the server gets real capture times,
+// until then the server places samples by their age when the batch arrives.
+const time_t syncedEpoch = 1577836800; // 2020-01-01, earlier means NTP has not answered yet
+time_t bootEpoch = 0;
+
+volatile OverrideState override = OFF;
+
+// the reservoir keeps samples packed, see Sample.h
+Reservoir<Sample> reservoir;
+const int dataMax = 100000 / sizeof(Sample); // esp32 has 160k heap memory
+
+// A Sample only keeps its capture time modulo sampleTimeRange, about 36
+// hours. With the deadband storing as little as one sample a heartbeat, a
+// full reservoir spans up to dataMax heartbeats, 57 days at 300 s, so the
+// reservoir's size no longer bounds a sample's age. The network task drops
+// samples once they are sampleMaxAge old instead, see drop_expired(), and
+// checks before every request. The oldest a sample can be when it is sent
+// is then sampleMaxAge plus one request and one retry wait.
+const uint32_t sampleMaxAge = sampleTimeRange - 3600; // s
+const unsigned long requestTimeout = 5000; // ms, HTTPClient's default
+static_assert(sampleMaxAge + (requestTimeout + uploadRetryInterval) / 1000 < sampleTimeRange,
+              "a sample must be sent before its capture time wraps");
+
+// The last hour of readings, ROLLING_CAPACITY samples at samplePeriod, about
+// 29 kB, fed by the sampling task only. Without an override the board
+// decides the window itself with the monitor's rule, so it keeps working
+// while the server is away.
+window_model windowModel;
+static_assert(ROLLING_CAPACITY * (samplePeriod / 1000) >= WINDOW_BASELINE_SECONDS,
+              "the window model has to hold an hour of samples");
+
+// Acquisition, see take_sample(). Each sample is oversample conversions of
+// both sensors filtered down to one value each, a BMP180 at its highest
+// resolution takes 30ms a pair, so 8 cost a quarter of a second of the
+// period. The LCD and the window model get every sample. What is stored
+// for the server is thinned out: with aggregateSeconds each period is
+// averaged into one, and a sample or mean is only stored once it is a
+// deadband away from the last one stored, or a heartbeat after it.
+//
+// So the server's view, each value held until the next, stays within the
+// deadband of what the board reads, well inside the window decision's
+// margins, for about a tenth of the samples. The heartbeat is the
+// monitor's AGGREGATE_GAP_SECONDS, so a quiet board isn't a gap in its
+// statistics, and the decision there weighs values by how long they held.
+Acquisition acquisition = {
+  8, // oversample
+  FILTER_TRIMMED_MEAN,
+  2, // trim
+  0, // aggregateSeconds
+  0.15, // temperatureDeadband, C
+  0.2, // pressureDeadband, mb
+  300, // heartbeat, s
+};
+
+// the sampling task's side of it: the last sample stored and the period being averaged
+Data lastStored;
+bool haveStored = false;
+
+struct Period {
+  uint32_t id;
+  uint32_t count;
+  double time; // sums
+  double temperature;
+  double pressure;
+};
+
+Period period;
+
+// What the board knows about how it is doing, see Metrics.h. Sampling
+// writes the sample counts and depthMax, the network task the rest.
+FirmwareMetrics metrics;
+
+// Batched upload, see decode_batch() in server.py for the format.
+// When false every sample is posted as text on its own, like old boards do.
+const bool batchUpload = true;
+const int batchMax = 256; // samples per POST
+const int batchHeaderSize = 14;
+const int batchSampleSize = sizeof(Sample);
+Sample batchData[batchMax];
+uint8_t batchBuffer[batchHeaderSize + batchMax * batchSampleSize];
+
+bool firmware_begin() {
+  window_init(&windowModel);
+  metrics.clear();
+  haveStored = false;
+  period.count = 0;
+  return reservoir.begin(dataMax);
+}
+
+uint32_t uptime_seconds() {
+  return esp_timer_get_time() / 1000000;
+}
+
+void anchor_clock() {
+  if (bootEpoch != 0) return;
+  time_t now = time(NULL);
+  if (now > syncedEpoch) {
+    bootEpoch = now - uptime_seconds();
+    Serial.print("Clock synced, boot epoch: ");
+    Serial.println((unsigned long)bootEpoch);
+  }
+}
+
+bool openWindow(double temperature, double pressure) {
+  if (override == ON_OPEN) {
+    return true;
+  } else if (override == ON_CLOSE) {
+    return false;
+  }
+  return window_should_open(&windowModel, temperature, pressure);
+}
+
+// Wifi connection, advanced by wifi_step() from the network task.
+// Each SSID gets connectTimeout to come up, if none does we wait
+// reconnectInterval before going through the list again.
+enum WifiState {
+  WIFI_IDLE,
+  WIFI_CONNECTING,
+  WIFI_ONLINE
+};
+
+WifiState wifiState = WIFI_IDLE;
+int wifiSet = 0;
+unsigned long wifiDeadline = 0;
+
+bool deadline_passed(unsigned long deadline) {
+  return (long)(millis() - deadline) >= 0;
+}
+
+// start connecting to the next configured SSID, false once the list is exhausted
+bool begin_wifi() {
+  while (wifiSet < wifiSets && ssid[wifiSet] == NULL) ++wifiSet;
+  if (wifiSet >= wifiSets) return false;
+  Serial.print("Connecting to WiFi ");
+  Serial.println(ssid[wifiSet]);
+  WiFi.begin(ssid[wifiSet], password[wifiSet]);
+  wifiDeadline = millis() + connectTimeout;
+  wifiState = WIFI_CONNECTING;
+  return true;
+}
+
+// never waits, returns right after checking or starting one connection step
+void wifi_step() {
+  switch (wifiState) {
+  case WIFI_IDLE:
+    if (deadline_passed(wifiDeadline)) {
+      wifiSet = 0;
+      if (!begin_wifi()) wifiDeadline = millis() + reconnectInterval;
+    }
+    break;
+  case WIFI_CONNECTING:
+    if (WiFi.status() == WL_CONNECTED) {
+      online = true;
+      wifiState = WIFI_ONLINE;
+      Serial.print("Connected to ");
+      Serial.println(ssid[wifiSet]);
+      Serial.print("IP:");
+      Serial.print(WiFi.localIP());
+      Serial.print(", MAC:");
+      Serial.println(WiFi.macAddress());
+      configTime(0, 0, ntpServer);
+    } else if (deadline_passed(wifiDeadline)) {
+      WiFi.disconnect();
+      ++wifiSet;
+      if (!begin_wifi()) {
+        Serial.println("wifi not connected, operating in offline mode");
+        wifiState = WIFI_IDLE;
+        wifiDeadline = millis() + reconnectInterval;
+      }
+    }
+    break;
+  case WIFI_ONLINE:
+    if (WiFi.status() != WL_CONNECTED) {
+      online = false;
+      Serial.println("wifi connection lost");
+      wifiState = WIFI_IDLE;
+      wifiDeadline = millis(); // try again right away
+    }
+    break;
+  }
+}
+
+void record_request(unsigned long sentAt, int httpCode) {
+  ++metrics.requests;
+  if (httpCode != 200) ++metrics.requestFailures;
+  metrics.roundTrip.record(millis() - sentAt);
+}
+
+int send_data(Data data) {
+  // Send data to the server
+  HTTPClient http;
+  http.begin(serverUrl);
+  http.addHeader("Content-Type", "application/x-www-form-urlencoded");
+  http.addHeader(deviceHeader, deviceId);
+  char tempStr[6];
+  dtostrf(data.temperature, 5, 2, tempStr);
+  char presStr[8];
+  dtostrf(data.pressure, 7, 2, presStr);
+  String sendString = String(tempStr) + " " + String(presStr);
+  if (bootEpoch != 0) {
+    sendString += " ";
+    sendString += String((unsigned long)(bootEpoch + data.capturedAt));
+  }
+  Serial.print("Data:");
+  Serial.println(sendString);
+  unsigned long sentAt = millis();
+  int httpCode = http.POST(sendString);
+  String payload = http.getString();
+  record_request(sentAt, httpCode);
+  if (httpCode == 200) {
+    ++metrics.samplesSent;
+    metrics.sendDelay.record(uptime_seconds() - data.capturedAt);
+  }
+  Serial.print("http code:");
+  Serial.println(httpCode);
+  Serial.print("payload:");
+  Serial.println(payload);
+  http.end();
+  return httpCode;
+}
+
+void push_reservoir(Data data) {
+  if (!reservoir.push(pack_sample(data.capturedAt, data.temperature, data.pressure))) {
+    Serial.println("Reservoir full, oldest data dropped");
+  }
+  uint32_t depth = reservoir.size();
+  if (depth > metrics.depthMax) metrics.depthMax = depth;
+  Serial.print("Data pushed to reservoir, capacity: [");
+  Serial.print(reservoir.size());
+  Serial.print("/");
+  Serial.print(reservoir.capacity());
+  Serial.println("]");
+}
+
+void put_u16(uint8_t* out, uint16_t value) {
+  out[0] = value & 0xFF;
+  out[1] = value >> 8;
+}
+
+void put_u32(uint8_t* out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+// pack count samples into batchBuffer, returns the body length
+size_t pack_batch(const Sample* items, uint16_t count) {
+  uint8_t* out = batchBuffer;
+  out[0] = 'W';
+  out[1] = 'B';
+  out[2] = 3; // version
+  out[3] = bootEpoch != 0 ? 0x01 : 0; // anchored
+  put_u16(out + 4, count);
+  put_u32(out + 6, bootEpoch);
+  put_u32(out + 10, uptime_seconds());
+  out += batchHeaderSize;
+  memcpy(out, items, count * sizeof(Sample));
+  return batchHeaderSize + count * sizeof(Sample);
+}
+
+// Drops the samples too old to be told apart from younger ones, see
+// sampleMaxAge. They are the oldest, so they are at the front.
+void drop_expired() {
+  uint32_t now = uptime_seconds();
+  Sample oldest;
+  uint32_t expired = 0;
+  while (reservoir.peek(&oldest, 1) == 1 && now - sample_time(oldest, now) >= sampleMaxAge) {
+    reservoir.consume(1);
+    ++expired;
+  }
+  if (expired > 0) {
+    metrics.samplesExpired += expired;
+    Serial.print(expired);
+    Serial.println(" samples expired in the reservoir");
+  }
+}
+
+// send stored data oldest first, batchMax samples per POST over one connection
+bool dump_batches() {
+  HTTPClient http;
+  http.setReuse(true);
+  http.begin(String(serverUrl) + "/batch");
+  http.addHeader("Content-Type", "application/octet-stream");
+  http.addHeader(deviceHeader, deviceId);
+  bool dumped = true;
+  for (;;) {
+    drop_expired();
+    uint32_t count = reservoir.peek(batchData, batchMax);
+    if (count == 0) break;
+    size_t length = pack_batch(batchData, count);
+    unsigned long sentAt = millis();
+    int httpCode = http.POST(batchBuffer, length);
+    record_request(sentAt, httpCode);
+    Serial.print("Batch of ");
+    Serial.print(count);
+    Serial.print(", http code:");
+    Serial.println(httpCode);
+    if (httpCode != 200) {
+      dumped = false;
+      break;
+    }
+    reservoir.consume(count);
+    uint32_t now = uptime_seconds();
+    metrics.samplesSent += count;
+    for (uint32_t i = 0; i < count; ++i) {
+      metrics.sendDelay.record(now - sample_time(batchData[i], now));
+    }
+  }
+  http.end();
+  return dumped;
+}
+
+// send stored data oldest first, stops at the first failed send so nothing is lost
+// returns false if the reservoir could not be emptied
+bool dump_reservoir() {
+  Serial.print("Dumping ");
+  Serial.print(reservoir.size());
+  Serial.println(" items from reservoir");
+  if (batchUpload) {
+    if (!dump_batches()) {
+      Serial.println("Dump failed, cancel dump");
+      return false;
+    }
+  } else {
+    Sample stored;
+    for (;;) {
+      drop_expired();
+      if (reservoir.peek(&stored, 1) != 1) break;
+      Data data;
+      data.capturedAt = sample_time(stored, uptime_seconds());
+      data.temperature = sample_temperature(stored);
+      data.pressure = sample_pressure(stored);
+      if (send_data(data) < 0) {
+        Serial.println("Dump failed, cancel dump");
+        return false;
+      }
+      reservoir.consume(1);
+    }
+  }
+  Serial.println("Reservoir dumped");
+  return true;
+}
+
+
+// wait for a BMP180 conversion, sleeping the task instead of spinning
+void wait_until(TickType_t deadline) {
+  TickType_t now = xTaskGetTickCount();
+  if ((int32_t)(deadline - now) > 0) {
+    vTaskDelay(deadline - now);
+  }
+}
+
+// One conversion of each sensor per round, the pressure one needs the
+// temperature taken right before it. A failed conversion is counted and
+// skipped, returns how many pairs were read.
+int read_sensor(double* temperatures, double* pressures) {
+  int count = 0;
+  for (int i = 0; i < acquisition.oversample && i < acquisitionMax; ++i) {
+    // if startTemperature() successful, number of ms to wait is returned
+    // otherwise 0 is returned
+    char tempQueryReturn = sensor.startTemperature();
+    if (tempQueryReturn == 0) {
+      Serial.println("startTemperature failed and returned 0");
+      ++metrics.sensorFailures;
+      continue;
+    }
+    wait_until(xTaskGetTickCount() + pdMS_TO_TICKS(tempQueryReturn) + 1);
+    double temperature;
+    if (sensor.getTemperature(temperature) == 0) {
+      Serial.println("getTemperature failed and returned 0");
+      ++metrics.sensorFailures;
+      continue;
+    }
+
+    char presQueryReturn = sensor.startPressure(3);
+    if (presQueryReturn == 0) {
+      Serial.println("startPressure failed and returned 0");
+      ++metrics.sensorFailures;
+      continue;
+    }
+    wait_until(xTaskGetTickCount() + pdMS_TO_TICKS(presQueryReturn) + 1);
+    double pressure;
+    if (sensor.getPressure(pressure, temperature) == 0) {
+      Serial.println("getPressure failed and returned 0");
+      ++metrics.sensorFailures;
+      continue;
+    }
+    temperatures[count] = temperature;
+    pressures[count] = pressure;
+    ++count;
+  }
+  return count;
+}
+
+double filter(double* values, int count) {
+  if (acquisition.filter == FILTER_MEDIAN) return filter_median(values, count);
+  return filter_trimmed_mean(values, count, acquisition.trim);
+}
+
+// The deadband, every sample or period mean ends up here. Only what moved
+// away from the last stored value, or went a heartbeat without being
+// stored, goes into the reservoir.
+void offer_sample(const Data& data) {
+  bool moved = !haveStored || fabs(data.temperature - lastStored.temperature) >= acquisition.temperatureDeadband ||
+               fabs(data.pressure - lastStored.pressure) >= acquisition.pressureDeadband ||
+               data.capturedAt - lastStored.capturedAt >= acquisition.heartbeat;
+  if (!moved) {
+    ++metrics.samplesHeld;
+    return;
+  }
+  lastStored = data;
+  haveStored = true;
+  ++metrics.samplesStored;
+  push_reservoir(data);
+}
+
+// Periods follow the clock once NTP answered, so a minute is the server's minute.
+uint32_t period_of(uint32_t capturedAt) {
+  return (uint32_t)((bootEpoch + capturedAt) / acquisition.aggregateSeconds);
+}
+
+// With aggregateSeconds each period's samples are averaged, the mean goes
+// on stamped with their mean capture time when the next period starts.
+void store_sample(const Data& data) {
+  if (acquisition.aggregateSeconds == 0) {
+    offer_sample(data);
+    return;
+  }
+  uint32_t id = period_of(data.capturedAt);
+  if (period.count > 0 && id != period.id) {
+    Data mean;
+    mean.capturedAt = (uint32_t)(period.time / period.count + 0.5);
+    mean.temperature = period.temperature / period.count;
+    mean.pressure = period.pressure / period.count;
+    offer_sample(mean);
+    period.count = 0;
+  }
+  if (period.count == 0) {
+    period.id = id;
+    period.time = period.temperature = period.pressure = 0;
+  }
+  ++period.count;
+  period.time += data.capturedAt;
+  period.temperature += data.temperature;
+  period.pressure += data.pressure;
+}
+
+void take_sample() {
+  Data data;
+  data.capturedAt = uptime_seconds();
+  ++metrics.samplesTaken;
+  LCD.clear();
+
+  double temperatures[acquisitionMax];
+  double pressures[acquisitionMax];
+  int count = read_sensor(temperatures, pressures);
+  if (count == 0) {
+    // nothing to show or store, the next period tries again
+    LCD.print("N/A C, N/A mb");
+    return;
+  }
+  data.temperature = filter(temperatures, count);
+  data.pressure = filter(pressures, count);
+
+  double fahrenheit = (9.0 / 5.0) * data.temperature + 32.0;
+  Serial.print("temperature: ");
+  Serial.print(data.temperature, 2);
+  Serial.print(" deg C, ");
+  Serial.print(fahrenheit, 2);
+  Serial.println(" deg F");
+  double inHg = data.pressure * 0.0295333727;
+  Serial.print("absolute pressure: ");
+  Serial.print(data.pressure, 2);
+  Serial.print(" mb, ");
+  Serial.print(inHg, 2);
+  Serial.println(" inHg");
+
+  LCD.print(data.temperature, 2);
+  LCD.print("C,");
+  LCD.print(data.pressure, 2);
+  LCD.print("mb");
+
+  // the window model gets every sample, whatever is stored
+  window_push(&windowModel, data.capturedAt, data.temperature, data.pressure);
+  LCD.setCursor(0, 1);
+  if (openWindow(data.temperature, data.pressure)) {
+    LCD.print("Window Opened");
+  } else {
+    LCD.print("Window Closed");
+  }
+
+  // what is stored goes through the reservoir, the network task sends it in order
+  store_sample(data);
+}
+
+// One pass of the network task, the only consumer of the reservoir.
+bool network_step() {
+  drop_expired(); // offline as well, that is when samples get old
+  wifi_step();
+  if (!online) return true;
+  anchor_clock();
+  return reservoir.empty() || dump_reservoir();
+}
+
+// Control port
+// The monitor keeps one connection open and sends framed commands,
+// "CMD <seq> SET_OVERRIDE_OPEN", answered with "ACK <seq> OPEN" once the
+// override is in effect. A new connection gets "STATE <override>" and
+// "PING" gets "PONG". "STATS" gets "STATS " and the line firmware_stats()
+// makes. Bare command lines, as command.sh sends them, still work.
+// A newer client replaces the current one, so a monitor whose old
+// connection died without a FIN isn't locked out until it times out.
+WiFiClient controlClient;
+String controlLine;
+const unsigned int controlLineMax = 64;
+const unsigned long controlIdleTimeout = 60000; // the monitor pings every 15s
+unsigned long controlHeardAt = 0;
+
+const char* override_name(OverrideState state) {
+  switch (state) {
+  case ON_OPEN: return "OPEN";
+  case ON_CLOSE: return "CLOSE";
+  default: return "OFF";
+  }
+}
+
+// replies are a line of a few bytes, they fit the socket buffer and never wait
+void reply(const char* kind, const char* seq, const char* state) {
+  char line[48];
+  int length = seq ? snprintf(line, sizeof(line), "%s %s %s\r\n", kind, seq, state)
+                   : snprintf(line, sizeof(line), "%s %s\r\n", kind, state);
+  controlClient.write((const uint8_t*)line, length);
+}
+
+bool apply_command(const String& command) {
+  if (command.startsWith("SET_OVERRIDE_OFF")) {
+    override = OFF;
+  } else if (command.startsWith("SET_OVERRIDE_OPEN")) {
+    override = ON_OPEN;
+  } else if (command.startsWith("SET_OVERRIDE_CLOSE")) {
+    override = ON_CLOSE;
+  } else {
+    return false;
+  }
+  Serial.print("Override set to ");
+  Serial.println(override_name(override));
+  return true;
+}
+
+void handle_command(const String& request) {
+  if (request.startsWith("CMD ")) {
+    int space = request.indexOf(' ', 4);
+    if (space < 0) return;
+    String seq = request.substring(4, space);
+    if (apply_command(request.substring(space + 1))) {
+      reply("ACK", seq.c_str(), override_name(override));
+    }
+  } else if (request == "PING") {
+    controlClient.write((const uint8_t*)"PONG\r\n", 6);
+  } else if (request == "STATS") {
+    // a few hundred bytes, still well inside the socket buffer
+    char line[320] = "STATS ";
+    int length = 6 + firmware_stats(line + 6, sizeof(line) - 8);
+    if (length > (int)sizeof(line) - 3) length = sizeof(line) - 3;
+    line[length++] = '\r';
+    line[length++] = '\n';
+    controlClient.write((const uint8_t*)line, length);
+  } else {
+    apply_command(request);
+  }
+}
+
+// Handles whatever bytes already arrived and returns, so a client that
+// stays connected costs nothing.
+void control_step() {
+  WiFiClient incoming = server.available();
+  if (incoming) {
+    if (controlClient) {
+      controlClient.stop();
+      Serial.println("Client replaced");
+    }
+    controlClient = incoming;
+    controlClient.setNoDelay(true);
+    controlLine = "";
+    controlHeardAt = millis();
+    Serial.println("Client Connected");
+    reply("STATE", NULL, override_name(override));
+  }
+  if (controlClient && (!controlClient.connected() || millis() - controlHeardAt > controlIdleTimeout)) {
+    controlClient.stop();
+    controlLine = "";
+    Serial.println("Client disconnected");
+  }
+  while (controlClient && controlClient.available()) {
+    char c = controlClient.read();
+    controlHeardAt = millis();
+    if (c == '\r' || c == '\n') {
+      if (controlLine.length() > 0) {
+        handle_command(controlLine);
+      }
+      controlLine = "";
+    } else if (controlLine.length() < controlLineMax) {
+      controlLine += c;
+    }
+  }
+}
+
+int firmware_stats(char* out, size_t size) {
+  return format_metrics(out, size, metrics, uptime_seconds(), reservoir.size(), reservoir.capacity(),
+                        reservoir.droppedCount(), ESP.getFreeHeap(), ESP.getMinFreeHeap());
+}
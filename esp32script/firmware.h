@@ -0,0 +1,103 @@
+#ifndef FIRMWARE_H
+#define FIRMWARE_H
+
+// The board's logic without the board: sampling, the reservoir, wifi
+// reconnects, uploads, the window decision and the control port.
+//
+// esp32script.ino only sets the hardware up and runs these from its tasks.
+// The same code builds on Linux against the stand-ins in host/, where the
+// harness drives it on a simulated clock, see host/harness.cpp.
+
+#include <Arduino.h>
+#include <SFE_BMP180.h>
+#include <LiquidCrystal.h>
+#include <WiFi.h>
+#include <WiFiServer.h>
+#include <time.h>
+#include "Reservoir.h"
+#include "Sample.h"
+// an hour at samplePeriod, the window model needs no more, see firmware.cpp
+#define ROLLING_CAPACITY 720
+#include "RollingStats.h"
+#include "Metrics.h"
+#include "Filter.h"
+
+extern SFE_BMP180 sensor;
+extern LiquidCrystal LCD;
+
+extern const int wifiSets;
+extern const char* ssid[];
+extern const char* password[];
+extern const char* serverUrl;
+extern const char* ntpServer;
+extern WiFiServer server;
+extern volatile bool online;
+
+extern const char* deviceHeader;
+extern char deviceId[13];
+
+// Timing, all in ms
+extern const uint32_t samplePeriod;
+extern const unsigned long connectTimeout; // per SSID
+extern const unsigned long reconnectInterval;
+extern const unsigned long uploadRetryInterval;
+extern const unsigned long networkPeriod;
+
+extern time_t bootEpoch;
+
+enum OverrideState {
+  OFF,
+  ON_OPEN,
+  ON_CLOSE
+};
+
+extern volatile OverrideState override;
+
+struct Data {
+  double temperature;
+  double pressure;
+  uint32_t capturedAt; // seconds since boot when the sample was taken
+};
+
+// How a sample is made and which ones are stored, see take_sample()
+enum FilterMode {
+  FILTER_MEDIAN,
+  FILTER_TRIMMED_MEAN
+};
+
+const int acquisitionMax = 16; // conversions per sample
+
+struct Acquisition {
+  int oversample; // conversions of each sensor per sample, 1 to acquisitionMax
+  FilterMode filter;
+  int trim; // conversions the trimmed mean drops at each end
+  uint32_t aggregateSeconds; // one mean per period is stored, 0 for every sample
+  double temperatureDeadband; // C, a smaller change isn't stored
+  double pressureDeadband; // mb
+  uint32_t heartbeat; // s, the longest a value goes without being stored
+};
+
+extern Acquisition acquisition;
+
+extern Reservoir<Sample> reservoir;
+extern const int dataMax;
+extern window_model windowModel;
+extern FirmwareMetrics metrics;
+
+// allocates the reservoir and clears the window model, false if the heap is too small
+bool firmware_begin();
+uint32_t uptime_seconds();
+bool openWindow(double temperature, double pressure);
+
+// one sample: read the sensor, update the LCD and the window model, store
+// it if it moved past the deadband
+void take_sample();
+// one pass of the network task: wifi, clock sync, upload what is stored,
+// returns false if an upload failed and the next pass should wait
+bool network_step();
+// serves the control port, never waits on the socket
+void control_step();
+// the metrics as the STATS line, returns its length like snprintf
+int firmware_stats(char* out, size_t size);
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Just enough of the Arduino core and FreeRTOS for firmware.cpp to build on
+// Linux. Time is the simulated clock in host.h, nothing here sleeps.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+class String {
+public:
+  String() {}
+  String(const char* c) : s(c ? c : "") {}
+  String(const std::string& c) : s(c) {}
+  String(int value) : s(std::to_string(value)) {}
+  String(unsigned value) : s(std::to_string(value)) {}
+  String(long value) : s(std::to_string(value)) {}
+  String(unsigned long value) : s(std::to_string(value)) {}
+
+  const char* c_str() const { return s.c_str(); }
+  unsigned length() const { return s.size(); }
+  bool startsWith(const char* prefix) const { return s.compare(0, strlen(prefix), prefix) == 0; }
+  bool operator==(const char* other) const { return s == other; }
+  int indexOf(char c, unsigned from = 0) const {
+    size_t at = s.find(c, from);
+    return at == std::string::npos ? -1 : (int)at;
+  }
+  String substring(unsigned from) const { return String(s.substr(from)); }
+  String substring(unsigned from, unsigned to) const { return String(s.substr(from, to - from)); }
+  String operator+(const String& other) const { return String(s + other.s); }
+  String& operator+=(const String& other) { s += other.s; return *this; }
+  String& operator+=(const char* other) { s += other; return *this; }
+  String& operator+=(char c) { s += c; return *this; }
+
+  std::string s;
+};
+
+class IPAddress {
+public:
+  String toString() const { return String("127.0.0.1"); }
+};
+
+// print() formats like the Arduino core, write() decides where it goes
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(const uint8_t* data, size_t length) = 0;
+  size_t write(uint8_t c) { return write(&c, 1); }
+
+  size_t print(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+  size_t print(const String& text) { return print(text.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(const IPAddress& address) { return print(address.toString()); }
+  size_t print(int value) { return print((long)value); }
+  size_t print(unsigned value) { return print((unsigned long)value); }
+  size_t print(long value) { return format("%ld", value); }
+  size_t print(unsigned long value) { return format("%lu", value); }
+  size_t print(double value, int digits = 2) { return format("%.*f", digits, value); }
+
+  template <typename T> size_t println(T value) { return print(value) + print("\r\n"); }
+  size_t println(double value, int digits) { return print(value, digits) + print("\r\n"); }
+  size_t println() { return print("\r\n"); }
+
+private:
+  template <typename... Args> size_t format(const char* pattern, Args... args) {
+    char text[64];
+    int length = snprintf(text, sizeof(text), pattern, args...);
+    return write((const uint8_t*)text, length < (int)sizeof(text) ? length : sizeof(text) - 1);
+  }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+};
+
+// prints to stdout with -v, the firmware is chatty
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long) {}
+  size_t write(const uint8_t* data, size_t length) override;
+};
+extern HardwareSerial Serial;
+
+// the ESP32 core's heap numbers, a host build has no heap to run out of
+class EspClass {
+public:
+  uint32_t getFreeHeap();
+  uint32_t getMinFreeHeap();
+};
+extern EspClass ESP;
+
+unsigned long millis();
+void delay(unsigned long ms);
+char* dtostrf(double value, signed char width, unsigned char precision, char* out);
+
+// NTP, time() answers with the simulated epoch once configTime() was called
+void configTime(long gmtOffset, int daylightOffset, const char* server);
+time_t host_time(time_t* out);
+#define time(out) host_time(out)
+
+// FreeRTOS, one tick per ms. A delay moves the simulated clock, and runs
+// whatever the harness scheduled in between, like a higher priority task.
+typedef uint32_t TickType_t;
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+TickType_t xTaskGetTickCount();
+void vTaskDelay(TickType_t ticks);
+void vTaskDelayUntil(TickType_t* previous, TickType_t period);
+
+#endif
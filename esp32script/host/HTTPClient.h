@@ -0,0 +1,31 @@
+#ifndef HOST_HTTPCLIENT_H
+#define HOST_HTTPCLIENT_H
+
+#include "Arduino.h"
+#include <string>
+
+// HTTP/1.1 over a real socket to host.server, keeping the connection when
+// setReuse(true) and the server allows it. Returns the status code, or a
+// negative code like the ESP32 one when the request fails.
+class HTTPClient {
+public:
+  ~HTTPClient() { end(); }
+  void setReuse(bool reuse) { keepAlive = reuse; }
+  bool begin(const String& url);
+  void addHeader(const char* name, const String& value);
+  int POST(const uint8_t* body, size_t length);
+  int POST(const String& body) { return POST((const uint8_t*)body.c_str(), body.length()); }
+  String getString() { return String(response); }
+  void end();
+
+private:
+  int exchange(const uint8_t* body, size_t length);
+
+  bool keepAlive = false;
+  int fd = -1;
+  std::string path;
+  std::string headers;
+  std::string response;
+};
+
+#endif
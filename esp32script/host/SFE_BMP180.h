@@ -0,0 +1,16 @@
+#ifndef HOST_SFE_BMP180_H
+#define HOST_SFE_BMP180_H
+
+// Replays host.temperature and host.pressure, one pair per sample, with
+// the host's noise on each conversion. The conversion times are the real
+// sensor's, the firmware waits them out on the simulated clock.
+class SFE_BMP180 {
+public:
+  char begin() { return 1; }
+  char startTemperature() { return 5; }
+  char getTemperature(double& temperature);
+  char startPressure(char oversampling) { return 3 + 3 * (1 << oversampling); }
+  char getPressure(double& pressure, double& temperature);
+};
+
+#endif
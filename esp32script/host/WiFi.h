@@ -0,0 +1,34 @@
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+#include "Arduino.h"
+
+enum {
+  WL_IDLE_STATUS = 0,
+  WL_CONNECTED = 3,
+  WL_DISCONNECTED = 6
+};
+enum { WIFI_STA = 1 };
+
+// Associates host.connectMs after begin(), unless an outage is on, and
+// drops the connection when one starts.
+class WiFiClass {
+public:
+  void mode(int) {}
+  int begin(const char* ssid, const char* password);
+  void disconnect();
+  int status();
+  IPAddress localIP() { return IPAddress(); }
+  String macAddress() { return String("02:00:00:00:00:01"); }
+  void macAddress(uint8_t* mac) {
+    static const uint8_t address[6] = { 2, 0, 0, 0, 0, 1 };
+    memcpy(mac, address, 6);
+  }
+
+private:
+  bool joining = false;
+  uint64_t joinedAtUs = 0;
+};
+extern WiFiClass WiFi;
+
+#endif
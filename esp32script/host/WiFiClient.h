@@ -0,0 +1,16 @@
+#ifndef HOST_WIFICLIENT_H
+#define HOST_WIFICLIENT_H
+
+#include "Arduino.h"
+
+// no one connects to the control port in a host build
+class WiFiClient : public Stream {
+public:
+  operator bool() const { return false; }
+  bool connected() { return false; }
+  void stop() {}
+  void setNoDelay(bool) {}
+  size_t write(const uint8_t* data, size_t length) override { return length; }
+};
+
+#endif
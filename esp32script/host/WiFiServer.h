@@ -0,0 +1,13 @@
+#ifndef HOST_WIFISERVER_H
+#define HOST_WIFISERVER_H
+
+#include "WiFiClient.h"
+
+class WiFiServer {
+public:
+  WiFiServer(int port) {}
+  void begin() {}
+  WiFiClient available() { return WiFiClient(); }
+};
+
+#endif
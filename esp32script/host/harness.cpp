@@ -0,0 +1,274 @@
+// Runs the firmware against a real server on a simulated clock.
+//
+//   harness [-f data.txt] [-a address:port] [-n samples] [-o start:length]...
+//           [-l latency_ms] [-t fail_ms] [-d device] [-v]
+//           [-s oversample] [-m] [-g seconds] [-e C:mb:heartbeat] [-j C:mb[:spikes]]
+//
+// Takes n samples, replaying temperatures and pressures from the file, while
+// the network side uploads them to the server, ingest or server.py. -o takes
+// wifi away for length seconds, start seconds after boot, and can be given
+// more than once. -l adds latency to every request, -t is how long a request
+// during an outage takes to fail. Once the samples are taken the network
+// side gets up to an hour to empty the reservoir.
+//
+// The rest set the acquisition up, see firmware.cpp: -s conversions per
+// sample, -m the median instead of the trimmed mean, -g one mean per that
+// many seconds, -e the deadbands and the heartbeat, -e 0:0:0 stores every
+// sample. -j puts noise with those deviations on every conversion, and
+// glitches on that fraction of them.
+//
+// Reports what arrived, what was lost, how long each outage took to drain
+// and how fast, so a change to the upload path can be measured against the
+// last one. Then how far what the server got is from the replayed readings,
+// and how often the window decision on it differs from the one on them.
+// The last line is the firmware's own STATS line.
+
+#include "../firmware.h"
+#include "host.h"
+
+#include <getopt.h>
+#include <vector>
+
+static uint64_t nextSampleUs;
+static bool sampling = true;
+static bool inSampling = false;
+
+// The sampling task runs next to the network task on the board. Here it
+// runs whenever the network side moved the clock past a due sample, at the
+// time the sample was due.
+static void run_sampling(uint64_t fromUs, uint64_t toUs) {
+  if (inSampling) return;
+  inSampling = true;
+  while (sampling && nextSampleUs <= toUs) {
+    uint64_t resume = host.nowUs;
+    host.nowUs = nextSampleUs;
+    host.nextReading = metrics.samplesTaken;
+    take_sample();
+    nextSampleUs += (uint64_t)samplePeriod * 1000;
+    if (host.nowUs < resume) host.nowUs = resume;
+  }
+  inSampling = false;
+}
+
+static time_t parse_time(const char* line) {
+  struct tm t;
+  memset(&t, 0, sizeof(t));
+  if (sscanf(line, "%d-%d-%d %d:%d:%d", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec) != 6) {
+    return 0;
+  }
+  t.tm_year -= 1900;
+  t.tm_mon -= 1;
+  t.tm_isdst = -1;
+  return mktime(&t);
+}
+
+// up to count readings from a data.txt, the epoch is the first row's time
+static size_t load_readings(const char* path, size_t count, double* temperature, double* pressure, time_t* epoch) {
+  FILE* file = fopen(path, "r");
+  if (!file) return 0;
+  char line[256];
+  size_t n = 0;
+  while (n < count && fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "%*s %*s %lf %lf", &temperature[n], &pressure[n]) == 2) {
+      if (n == 0) *epoch = parse_time(line);
+      ++n;
+    }
+  }
+  fclose(file);
+  return n;
+}
+
+struct Delivered {
+  uint32_t capturedAt;
+  double temperature;
+  double pressure;
+};
+
+static std::vector<Delivered> delivered;
+static const size_t batchHeader = 14; // see pack_batch()
+
+// what the server answered 200 to, a batch or a text post, see send_data()
+static void record_delivered(const uint8_t* body, size_t length) {
+  if (length >= batchHeader && body[0] == 'W' && body[1] == 'B') {
+    uint16_t count = body[4] | body[5] << 8;
+    uint32_t sentAt = body[10] | body[11] << 8 | body[12] << 16 | (uint32_t)body[13] << 24;
+    const Sample* samples = (const Sample*)(body + batchHeader);
+    for (uint16_t i = 0; i < count; ++i) {
+      delivered.push_back({ sample_time(samples[i], sentAt), sample_temperature(samples[i]),
+                            sample_pressure(samples[i]) });
+    }
+  } else {
+    std::string text((const char*)body, length);
+    Delivered d;
+    unsigned long epoch;
+    int fields = sscanf(text.c_str(), "%lf %lf %lu", &d.temperature, &d.pressure, &epoch);
+    if (fields < 2) return;
+    d.capturedAt = fields == 3 ? epoch - bootEpoch : uptime_seconds();
+    delivered.push_back(d);
+  }
+}
+
+// The window decision on what the server got against the one on the
+// replayed readings, at every sample. The server's side gets each delivered
+// sample once its time has come and decides on the newest, like the monitor.
+static void compare_decisions(size_t taken, const double* temperature, const double* pressure, size_t readings) {
+  static window_model truth, served;
+  window_init(&truth);
+  window_init(&served);
+  size_t next = 0;
+  uint64_t compared = 0, differ = 0;
+  double temperatureOff = 0, pressureOff = 0;
+  for (size_t i = 0; i < taken; ++i) {
+    uint32_t at = (uint32_t)((uint64_t)i * samplePeriod / 1000);
+    double t = temperature[i % readings];
+    double p = pressure[i % readings];
+    window_push(&truth, at, t, p);
+    while (next < delivered.size() && delivered[next].capturedAt <= at) {
+      window_push(&served, delivered[next].capturedAt, delivered[next].temperature, delivered[next].pressure);
+      ++next;
+    }
+    if (next == 0) continue;
+    const Delivered& last = delivered[next - 1];
+    ++compared;
+    differ += window_should_open(&truth, t, p) != window_should_open(&served, last.temperature, last.pressure);
+    if (fabs(last.temperature - t) > temperatureOff) temperatureOff = fabs(last.temperature - t);
+    if (fabs(last.pressure - p) > pressureOff) pressureOff = fabs(last.pressure - p);
+  }
+  printf("server's view: within %.2fC and %.2fmb of the readings, window decision differs on %llu of %llu "
+         "samples (%.2f%%)\n", temperatureOff, pressureOff, (unsigned long long)differ,
+         (unsigned long long)compared, compared ? 100.0 * differ / compared : 0);
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "usage: %s [-f data.txt] [-a address:port] [-n samples] [-o start:length]... "
+          "[-l latency_ms] [-t fail_ms] [-d device] [-v] "
+          "[-s oversample] [-m] [-g seconds] [-e C:mb:heartbeat] [-j C:mb[:spikes]]\n", name);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  const char* path = "../../data.txt";
+  const char* address = "127.0.0.1:8000";
+  const char* device = "harness";
+  size_t count = 24 * 3600 / 5; // a day
+  host.connectMs = 1500;
+  host.failMs = 5000;
+  int option;
+  while ((option = getopt(argc, argv, "f:a:n:o:l:t:d:vs:mg:e:j:")) != -1) {
+    switch (option) {
+    case 'f': path = optarg; break;
+    case 'a': address = optarg; break;
+    case 'n': count = strtoul(optarg, NULL, 10); break;
+    case 'o': {
+      double start, length;
+      if (host.outageCount == HOST_MAX_OUTAGES || sscanf(optarg, "%lf:%lf", &start, &length) != 2) usage(argv[0]);
+      host.outages[host.outageCount].startUs = (uint64_t)(start * 1e6);
+      host.outages[host.outageCount].endUs = (uint64_t)((start + length) * 1e6);
+      ++host.outageCount;
+    } break;
+    case 'l': host.latencyMs = atof(optarg); break;
+    case 't': host.failMs = atof(optarg); break;
+    case 'd': device = optarg; break;
+    case 'v': host.verbose = true; break;
+    case 's':
+      acquisition.oversample = atoi(optarg);
+      if (acquisition.oversample < 1 || acquisition.oversample > acquisitionMax) usage(argv[0]);
+      break;
+    case 'm': acquisition.filter = FILTER_MEDIAN; break;
+    case 'g': acquisition.aggregateSeconds = strtoul(optarg, NULL, 10); break;
+    case 'e': {
+      unsigned heartbeat;
+      if (sscanf(optarg, "%lf:%lf:%u", &acquisition.temperatureDeadband, &acquisition.pressureDeadband,
+                 &heartbeat) != 3) {
+        usage(argv[0]);
+      }
+      acquisition.heartbeat = heartbeat;
+    } break;
+    case 'j':
+      if (sscanf(optarg, "%lf:%lf:%lf", &host.temperatureNoise, &host.pressureNoise, &host.spikeRate) < 2) {
+        usage(argv[0]);
+      }
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if (count == 0) usage(argv[0]);
+
+  double* temperature = (double*)malloc(count * sizeof(double));
+  double* pressure = (double*)malloc(count * sizeof(double));
+  if (!temperature || !pressure) abort();
+  host.readings = load_readings(path, count, temperature, pressure, &host.epoch);
+  if (host.readings == 0) {
+    fprintf(stderr, "No readings in %s\n", path);
+    return 1;
+  }
+  if (host.epoch == 0) host.epoch = (time)(NULL); // the real one, not the macro
+  host.temperature = temperature;
+  host.pressure = pressure;
+
+  static char url[256];
+  snprintf(url, sizeof(url), "http://%s", address);
+  serverUrl = url;
+  snprintf(deviceId, sizeof(deviceId), "%s", device);
+  if (!firmware_begin()) {
+    fprintf(stderr, "Can't allocate the reservoir\n");
+    return 1;
+  }
+  host.advanced = run_sampling;
+  host.acked = record_delivered;
+
+  // the network task, until the samples are taken and sent or an hour later
+  struct timespec wallStart, wallEnd;
+  clock_gettime(CLOCK_MONOTONIC, &wallStart);
+  uint64_t drained[HOST_MAX_OUTAGES] = { 0 };
+  uint64_t giveUpUs = 0;
+  for (;;) {
+    if (!network_step()) vTaskDelay(pdMS_TO_TICKS(uploadRetryInterval));
+    vTaskDelay(pdMS_TO_TICKS(networkPeriod));
+    if (reservoir.empty()) {
+      for (int i = 0; i < host.outageCount; ++i) {
+        if (!drained[i] && host.nowUs >= host.outages[i].endUs) drained[i] = host.nowUs;
+      }
+    }
+    if (sampling && metrics.samplesTaken >= count) {
+      sampling = false;
+      giveUpUs = host.nowUs + 3600ULL * 1000000;
+    }
+    if (!sampling && (reservoir.empty() || host.nowUs >= giveUpUs)) break;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+  double wall = (wallEnd.tv_sec - wallStart.tv_sec) + (wallEnd.tv_nsec - wallStart.tv_nsec) / 1e9;
+
+  uint64_t taken = metrics.samplesTaken;
+  uint64_t stored = reservoir.size();
+  uint64_t lost = metrics.samplesStored - host.samplesAcked - stored;
+  printf("samples: %llu taken, %llu stored (%llu held back), %llu delivered, %llu lost "
+         "(%u dropped from a full reservoir, %u expired), %llu still stored\n",
+         (unsigned long long)taken, (unsigned long long)metrics.samplesStored,
+         (unsigned long long)metrics.samplesHeld, (unsigned long long)host.samplesAcked, (unsigned long long)lost,
+         reservoir.droppedCount(), metrics.samplesExpired, (unsigned long long)stored);
+  printf("requests: %llu sent, %llu failed, %.1f kB\n", (unsigned long long)host.requests,
+         (unsigned long long)host.failedRequests, host.bytesSent / 1e3);
+  for (int i = 0; i < host.outageCount; ++i) {
+    const HostOutage* outage = &host.outages[i];
+    printf("outage at %.0fs for %.0fs: ", outage->startUs / 1e6, (outage->endUs - outage->startUs) / 1e6);
+    if (drained[i]) {
+      printf("drained %.1fs after it ended\n", (drained[i] - outage->endUs) / 1e6);
+    } else {
+      printf("never drained\n");
+    }
+  }
+  printf("simulated %.0fs in %.2fs (%.0fx), %.3fs of it in requests: %.0f samples/s through the server\n",
+         host.nowUs / 1e6, wall, host.nowUs / 1e6 / wall, host.requestWallMs / 1000,
+         host.requestWallMs > 0 ? host.samplesAcked / (host.requestWallMs / 1000) : 0);
+  printf("request latency ms: p50 %.1f  p90 %.1f  p99 %.1f\n", host_latency_ms(0.5), host_latency_ms(0.9),
+         host_latency_ms(0.99));
+  compare_decisions(taken, temperature, pressure, host.readings);
+  // what the board would answer STATS with, in simulated time
+  char stats[320];
+  firmware_stats(stats, sizeof(stats));
+  printf("firmware: %s\n", stats);
+  free(temperature);
+  free(pressure);
+  return lost > 0 || stored > 0;
+}
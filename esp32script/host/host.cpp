@@ -0,0 +1,315 @@
+// The stand-ins' side of a host build: the simulated clock, the replayed
+// sensor, wifi with outages, and an HTTP client over real sockets.
+
+#include "host.h"
+#include "Arduino.h"
+#include "HTTPClient.h"
+#include "SFE_BMP180.h"
+#include "WiFi.h"
+#include "esp_timer.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+HostWorld host;
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+// negative codes of the ESP32 HTTPClient
+const int httpConnectionRefused = -1;
+const int httpConnectionLost = -5;
+
+static double wall_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+bool host_offline(uint64_t atUs) {
+  for (int i = 0; i < host.outageCount; ++i) {
+    if (atUs >= host.outages[i].startUs && atUs < host.outages[i].endUs) return true;
+  }
+  return false;
+}
+
+void host_advance_us(uint64_t us) {
+  uint64_t from = host.nowUs;
+  host.nowUs += us;
+  if (host.advanced) host.advanced(from, host.nowUs);
+}
+
+double host_latency_ms(double q) {
+  uint64_t total = 0;
+  for (int i = 0; i < HOST_LATENCY_BUCKETS; ++i) total += host.latency[i];
+  if (total == 0) return 0;
+  uint64_t rank = (uint64_t)(q * (total - 1));
+  uint64_t seen = 0;
+  for (int i = 0; i < HOST_LATENCY_BUCKETS; ++i) {
+    seen += host.latency[i];
+    if (seen > rank) return i / 10.0;
+  }
+  return (HOST_LATENCY_BUCKETS - 1) / 10.0;
+}
+
+// Arduino core and FreeRTOS
+
+size_t HardwareSerial::write(const uint8_t* data, size_t length) {
+  if (host.verbose) fwrite(data, 1, length, stdout);
+  return length;
+}
+
+// about what an ESP32 has free once wifi is up
+uint32_t EspClass::getFreeHeap() {
+  return 160 * 1024;
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+  return 160 * 1024;
+}
+
+unsigned long millis() {
+  return host.nowUs / 1000;
+}
+
+void delay(unsigned long ms) {
+  host_advance_us((uint64_t)ms * 1000);
+}
+
+char* dtostrf(double value, signed char width, unsigned char precision, char* out) {
+  sprintf(out, "%*.*f", width, precision, value);
+  return out;
+}
+
+int64_t esp_timer_get_time() {
+  return host.nowUs;
+}
+
+void configTime(long gmtOffset, int daylightOffset, const char* server) {
+  host.ntpConfigured = true;
+}
+
+// like the board, seconds since boot from 1970 until NTP answered
+time_t host_time(time_t* out) {
+  time_t now = (host.ntpConfigured ? host.epoch : 0) + host.nowUs / 1000000;
+  if (out) *out = now;
+  return now;
+}
+
+TickType_t xTaskGetTickCount() {
+  return host.nowUs / 1000;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  host_advance_us((uint64_t)ticks * 1000);
+}
+
+void vTaskDelayUntil(TickType_t* previous, TickType_t period) {
+  *previous += period;
+  TickType_t now = xTaskGetTickCount();
+  if ((int32_t)(*previous - now) > 0) vTaskDelay(*previous - now);
+}
+
+// sensor
+
+// xorshift64, the same noise every run
+static double uniform() {
+  static uint64_t state = 0x9E3779B97F4A7C15ULL;
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// about normal with deviation sd, plus now and then a glitch spike away
+static double noise(double sd, double spike) {
+  double sum = 0;
+  for (int i = 0; i < 12; ++i) sum += uniform();
+  double value = (sum - 6) * sd;
+  if (host.spikeRate > 0 && uniform() < host.spikeRate) value += uniform() < 0.5 ? -spike : spike;
+  return value;
+}
+
+char SFE_BMP180::getTemperature(double& temperature) {
+  if (host.readings == 0) return 0;
+  temperature = host.temperature[host.nextReading % host.readings] + noise(host.temperatureNoise, 2);
+  return 1;
+}
+
+char SFE_BMP180::getPressure(double& pressure, double& temperature) {
+  if (host.readings == 0) return 0;
+  pressure = host.pressure[host.nextReading % host.readings] + noise(host.pressureNoise, 5);
+  ++host.sensorReads;
+  return 1;
+}
+
+// wifi
+
+int WiFiClass::begin(const char* ssid, const char* password) {
+  joining = true;
+  joinedAtUs = host.nowUs + (uint64_t)(host.connectMs * 1000);
+  return status();
+}
+
+void WiFiClass::disconnect() {
+  joining = false;
+}
+
+int WiFiClass::status() {
+  if (host_offline(host.nowUs)) {
+    joining = false; // the access point is gone, begin() has to be called again
+    return WL_DISCONNECTED;
+  }
+  return joining && host.nowUs >= joinedAtUs ? WL_CONNECTED : WL_DISCONNECTED;
+}
+
+// HTTP
+
+static int connect_to(const std::string& address, const std::string& port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* found;
+  if (getaddrinfo(address.c_str(), port.c_str(), &hints, &found) != 0) return -1;
+  int fd = -1;
+  for (struct addrinfo* a = found; a && fd < 0; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(found);
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static std::string serverAddress;
+static std::string serverPort;
+
+bool HTTPClient::begin(const String& url) {
+  // http://address[:port][/path]
+  std::string rest = url.s.compare(0, 7, "http://") == 0 ? url.s.substr(7) : url.s;
+  size_t slash = rest.find('/');
+  std::string authority = rest.substr(0, slash);
+  path = slash == std::string::npos ? "/" : rest.substr(slash);
+  size_t colon = authority.rfind(':');
+  std::string address = authority.substr(0, colon);
+  std::string port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+  if (address != serverAddress || port != serverPort) {
+    end();
+    serverAddress = address;
+    serverPort = port;
+  }
+  headers.clear();
+  return true;
+}
+
+void HTTPClient::addHeader(const char* name, const String& value) {
+  headers += name;
+  headers += ": ";
+  headers += value.s;
+  headers += "\r\n";
+}
+
+void HTTPClient::end() {
+  if (fd >= 0) close(fd);
+  fd = -1;
+}
+
+static bool send_all(int fd, const char* data, size_t length) {
+  while (length > 0) {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+// one request and its response, the status code or a negative one
+int HTTPClient::exchange(const uint8_t* body, size_t length) {
+  if (fd < 0) {
+    fd = connect_to(serverAddress, serverPort);
+    if (fd < 0) return httpConnectionRefused;
+  }
+  std::string request = "POST " + path + " HTTP/1.1\r\nHost: " + serverAddress + "\r\n" + headers +
+                        "Content-Length: " + std::to_string(length) + "\r\n" +
+                        (keepAlive ? "" : "Connection: close\r\n") + "\r\n";
+  request.append((const char*)body, length);
+  if (!send_all(fd, request.data(), request.size())) return httpConnectionLost;
+  host.bytesSent += request.size();
+
+  std::string reply;
+  size_t headerEnd;
+  char buffer[4096];
+  while ((headerEnd = reply.find("\r\n\r\n")) == std::string::npos) {
+    ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return httpConnectionLost;
+    reply.append(buffer, got);
+  }
+  int code = 0;
+  if (sscanf(reply.c_str(), "HTTP/%*d.%*d %d", &code) != 1) return httpConnectionLost;
+  std::string head = reply.substr(0, headerEnd);
+  for (char& c : head) c = tolower(c);
+  bool closes = !keepAlive || reply.compare(0, 8, "HTTP/1.0") == 0 || head.find("connection: close") != std::string::npos;
+  size_t lengthAt = head.find("content-length:");
+  long contentLength = lengthAt == std::string::npos ? -1 : atol(head.c_str() + lengthAt + 15);
+  response = reply.substr(headerEnd + 4);
+  // without a length the body runs to the end of the connection
+  while (contentLength < 0 || (long)response.size() < contentLength) {
+    ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) {
+      if (contentLength < 0) break;
+      return httpConnectionLost;
+    }
+    response.append(buffer, got);
+  }
+  if (closes || contentLength < 0) end();
+  return code;
+}
+
+int HTTPClient::POST(const uint8_t* body, size_t length) {
+  ++host.requests;
+  response.clear();
+  if (WiFi.status() != WL_CONNECTED) {
+    // nothing answers, the request times out
+    end();
+    ++host.failedRequests;
+    host_advance_us((uint64_t)(host.failMs * 1000));
+    return httpConnectionRefused;
+  }
+  double start = wall_ms();
+  bool reused = fd >= 0;
+  int code = exchange(body, length);
+  if (code < 0 && reused) {
+    // the server closed a kept connection in the meantime
+    end();
+    code = exchange(body, length);
+  }
+  double ms = wall_ms() - start;
+  host.requestWallMs += ms;
+  int bucket = (int)(ms * 10);
+  ++host.latency[bucket < HOST_LATENCY_BUCKETS ? bucket : HOST_LATENCY_BUCKETS - 1];
+  if (code == 200) {
+    if (host.acked) host.acked(body, length);
+    // a batch says how many samples it holds, see pack_batch()
+    host.samplesAcked += length >= 6 && body[0] == 'W' && body[1] == 'B' ? body[4] | body[5] << 8 : 1;
+  } else {
+    end();
+    ++host.failedRequests;
+  }
+  host_advance_us((uint64_t)((ms + host.latencyMs) * 1000));
+  return code;
+}
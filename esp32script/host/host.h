@@ -0,0 +1,75 @@
+#ifndef HOST_H
+#define HOST_H
+
+// The world the firmware sees in a host build, set up and read by the
+// harness.
+//
+// Time is simulated. It only moves when the firmware waits (vTaskDelay,
+// a sensor conversion) or talks to the server, where it moves by the wall
+// time the request took plus the injected latency. So a day of sampling
+// replays in seconds, while uploads still cost what the real server makes
+// them cost.
+//
+// The sensor reads temperatures and pressures from a list, the harness
+// moves to the next pair for each sample, every conversion of it reads the
+// same pair plus noise. Wifi is up except during outages. An HTTP request during an
+// outage fails after failMs, like a connection that times out.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HOST_MAX_OUTAGES 64
+#define HOST_LATENCY_BUCKETS 4096 // 0.1ms each
+
+struct HostOutage {
+  uint64_t startUs;
+  uint64_t endUs;
+};
+
+struct HostWorld {
+  uint64_t nowUs;
+  bool verbose; // Serial goes to stdout
+  // called whenever the clock moved, with the time before and after;
+  // runs the sampling task, the firmware may wait inside it
+  void (*advanced)(uint64_t fromUs, uint64_t toUs);
+
+  // sensor replay
+  const double* temperature;
+  const double* pressure;
+  size_t readings;
+  size_t nextReading; // for the sample being taken
+  uint64_t sensorReads; // conversions
+  double temperatureNoise; // C, standard deviation per conversion
+  double pressureNoise; // mb
+  double spikeRate; // conversions that glitch 2C or 5mb off
+
+  // network
+  time_t epoch; // what NTP says at time 0
+  bool ntpConfigured;
+  HostOutage outages[HOST_MAX_OUTAGES];
+  int outageCount;
+  double connectMs; // wifi association
+  double latencyMs; // added to every request
+  double failMs; // a request during an outage
+
+  // what the server saw
+  // called with every body answered 200
+  void (*acked)(const uint8_t* body, size_t length);
+  uint64_t requests;
+  uint64_t failedRequests;
+  uint64_t samplesAcked; // in batches or text posts answered 200
+  uint64_t bytesSent;
+  double requestWallMs;
+  uint32_t latency[HOST_LATENCY_BUCKETS]; // per request, wall time
+};
+
+extern HostWorld host;
+
+bool host_offline(uint64_t atUs);
+// moves the clock forward, running host.advanced in between
+void host_advance_us(uint64_t us);
+// the wall latency quantile q of the requests so far, in ms
+double host_latency_ms(double q);
+
+#endif
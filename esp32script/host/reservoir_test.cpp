@@ -0,0 +1,145 @@
+// Tests for Reservoir.h, on the desktop.
+//
+//   reservoir_test [iterations]
+//
+// Wrap-around: a small reservoir filled and drained over and over, so its
+// slots go round millions of times, everything comes out once and in
+// order. Full: pushes past the capacity drop the oldest, count them, and
+// leave the newest in order. Threads: one thread pushes while another
+// peeks and consumes, first with the producer waiting whenever it is full,
+// where every item has to arrive exactly once and in order, then with the
+// producer never waiting, where what arrives has to be in order, untorn,
+// and what doesn't has to be counted as dropped.
+//
+// Prints a line per test, exits with 1 on the first failure.
+
+#include "../Reservoir.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+// Sample sized, with every byte derived from the sequence number, so a copy
+// torn by the producer shows
+struct Item {
+  uint32_t sequence;
+  uint16_t check;
+};
+
+static Item make_item(uint32_t sequence) {
+  Item item;
+  item.sequence = sequence;
+  item.check = (uint16_t)(sequence * 2654435761u >> 16);
+  return item;
+}
+
+static bool intact(const Item& item) {
+  return item.check == make_item(item.sequence).check;
+}
+
+static void fail(const char* test, const char* what, unsigned long long a, unsigned long long b) {
+  printf("FAIL %s: %s (%llu, %llu)\n", test, what, a, b);
+  exit(1);
+}
+
+static void wrap_around(uint32_t iterations) {
+  Reservoir<Item> reservoir;
+  if (!reservoir.begin(7)) fail("wrap", "no memory", 0, 0);
+  uint32_t pushed = 0;
+  uint32_t popped = 0;
+  // fill to a varying depth, drain a varying amount, so head and tail meet
+  // every slot at every depth
+  for (uint32_t round = 0; popped < iterations; ++round) {
+    uint32_t fill = round % 8;
+    for (uint32_t i = 0; i < fill && reservoir.size() < reservoir.capacity(); ++i) {
+      if (!reservoir.push(make_item(pushed++))) fail("wrap", "push dropped below capacity", pushed, 0);
+    }
+    uint32_t drain = (round * 3) % 8;
+    Item item;
+    for (uint32_t i = 0; i < drain && reservoir.pop(item); ++i) {
+      if (item.sequence != popped || !intact(item)) fail("wrap", "out of order", item.sequence, popped);
+      ++popped;
+    }
+    if (reservoir.size() != pushed - popped) fail("wrap", "size", reservoir.size(), pushed - popped);
+  }
+  if (reservoir.droppedCount() != 0) fail("wrap", "dropped", reservoir.droppedCount(), 0);
+  printf("wrap: %u pushed and popped in order through 7 slots\n", popped);
+}
+
+static void full(uint32_t iterations) {
+  const uint32_t capacity = 100;
+  Reservoir<Item> reservoir;
+  if (!reservoir.begin(capacity)) fail("full", "no memory", 0, 0);
+  uint32_t pushed = 0;
+  while (pushed < iterations) {
+    bool kept = reservoir.push(make_item(pushed));
+    ++pushed;
+    if (kept != (pushed <= capacity)) fail("full", "push result", pushed, kept);
+  }
+  if (reservoir.size() != capacity) fail("full", "size", reservoir.size(), capacity);
+  if (reservoir.droppedCount() != pushed - capacity) fail("full", "dropped", reservoir.droppedCount(), pushed - capacity);
+  // the newest capacity, oldest first, across a peek that wraps the slots
+  Item items[capacity];
+  uint32_t count = reservoir.peek(items, capacity);
+  if (count != capacity) fail("full", "peek", count, capacity);
+  for (uint32_t i = 0; i < count; ++i) {
+    if (items[i].sequence != pushed - capacity + i || !intact(items[i])) {
+      fail("full", "not the newest in order", items[i].sequence, pushed - capacity + i);
+    }
+  }
+  reservoir.consume(count);
+  if (!reservoir.empty()) fail("full", "not empty after consume", reservoir.size(), 0);
+  printf("full: %u pushed into %u slots, %u dropped, the newest kept in order\n", pushed, capacity,
+         reservoir.droppedCount());
+}
+
+// wait: the producer yields while the reservoir is full, so nothing may be lost
+static void threads(uint32_t iterations, bool wait) {
+  const char* test = wait ? "threads" : "threads, overflowing";
+  Reservoir<Item> reservoir;
+  if (!reservoir.begin(1024)) fail(test, "no memory", 0, 0);
+  std::thread producer([&]() {
+    for (uint32_t i = 0; i < iterations; ++i) {
+      while (wait && reservoir.size() >= reservoir.capacity()) std::this_thread::yield();
+      reservoir.push(make_item(i));
+    }
+  });
+  // the network side: peek a batch, "send" it, consume it
+  Item batch[256];
+  uint64_t received = 0;
+  uint64_t next = 0; // lowest sequence that may come next
+  for (;;) {
+    uint32_t count = reservoir.peek(batch, 256);
+    for (uint32_t i = 0; i < count; ++i) {
+      if (!intact(batch[i])) fail(test, "torn item", batch[i].sequence, i);
+      if (batch[i].sequence < next) fail(test, "out of order", batch[i].sequence, next);
+      if (wait && batch[i].sequence != next) fail(test, "lost", next, batch[i].sequence);
+      next = batch[i].sequence + 1;
+    }
+    reservoir.consume(count);
+    received += count;
+    if (next == iterations) break;
+    if (count == 0) std::this_thread::yield();
+  }
+  producer.join();
+  // an item peeked and then dropped by the producer before it was consumed
+  // arrives and is counted as dropped, so arrived and dropped can overlap
+  if (received + reservoir.droppedCount() < iterations) {
+    fail(test, "lost without being counted", received, reservoir.droppedCount());
+  }
+  if (wait && (received != iterations || reservoir.droppedCount() != 0)) {
+    fail(test, "lost or dropped", received, reservoir.droppedCount());
+  }
+  printf("%s: %u pushed, %llu arrived in order, %u dropped\n", test, iterations, (unsigned long long)received,
+         reservoir.droppedCount());
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+  wrap_around(iterations);
+  full(iterations);
+  threads(iterations, true);
+  threads(iterations, false);
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,328 @@
+#include "aggregate.h"
+#include "datafile.h"
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* one thread's share of the file */
+typedef struct {
+    int period;
+    /* text */
+    const char* begin;
+    const char* end;
+    const char* map; /* for offsets in messages */
+    /* wdb */
+    const WdbFile* wdb;
+    uint64_t firstRow;
+    uint64_t endRow;
+    /* results */
+    Bucket* buckets;
+    size_t count;
+    size_t cap;
+    uint64_t rows;
+    uint64_t badLines;
+    int64_t first; /* first and last sample of the range */
+    int64_t last;
+} Part;
+
+/* the local hour or day holding timestamp */
+static void
+BucketBounds(int period, int64_t timestamp, int64_t* start, int64_t* end) {
+    time_t t = (time_t)timestamp;
+    struct tm local;
+    localtime_r(&t, &local);
+    local.tm_min = 0;
+    local.tm_sec = 0;
+    if (period == AGGREGATE_DAY) {
+	local.tm_hour = 0;
+    }
+    local.tm_isdst = -1;
+    struct tm next = local;
+    *start = (int64_t)mktime(&local);
+    if (period == AGGREGATE_DAY) {
+	next.tm_mday += 1;
+    } else {
+	next.tm_hour += 1;
+    }
+    next.tm_isdst = -1;
+    *end = (int64_t)mktime(&next);
+}
+
+static Bucket*
+NewBucket(Bucket** buckets, size_t* count, size_t* cap) {
+    if (*count == *cap) {
+	size_t newCap = *cap ? *cap * 2 : 256;
+	Bucket* grown = realloc(*buckets, newCap * sizeof(Bucket));
+	if (!grown) {
+	    abort();
+	}
+	*buckets = grown;
+	*cap = newCap;
+    }
+    Bucket* bucket = &(*buckets)[(*count)++];
+    memset(bucket, 0, sizeof(*bucket));
+    bucket->temperature = EmptySummary();
+    bucket->pressure = EmptySummary();
+    return bucket;
+}
+
+static inline void
+AddValue(Summary* s, double shift, double value) {
+    double d = value - shift;
+    if (value < s->min) s->min = value;
+    if (value > s->max) s->max = value;
+    s->sum += d;
+    s->sumsq += d * d;
+    ++s->count;
+}
+
+static void
+AddRow(Part* part, int64_t timestamp, double temperature, double pressure) {
+    Bucket* bucket = part->count ? &part->buckets[part->count - 1] : NULL;
+    if (!bucket || timestamp < bucket->start || timestamp >= bucket->end) {
+	/* localtime only when the hour changes, not per row */
+	bucket = NewBucket(&part->buckets, &part->count, &part->cap);
+	BucketBounds(part->period, timestamp, &bucket->start, &bucket->end);
+	bucket->first = timestamp;
+	bucket->temperatureShift = temperature;
+	bucket->pressureShift = pressure;
+    }
+    if (part->rows == 0) {
+	part->first = timestamp;
+    } else if (timestamp - part->last > AGGREGATE_GAP_SECONDS) {
+	++bucket->gaps;
+	if (timestamp - part->last > bucket->longestGap) bucket->longestGap = timestamp - part->last;
+    }
+    part->last = timestamp;
+    bucket->last = timestamp;
+    AddValue(&bucket->temperature, bucket->temperatureShift, temperature);
+    AddValue(&bucket->pressure, bucket->pressureShift, pressure);
+    ++part->rows;
+}
+
+static void*
+AggregateText(void* user) {
+    Part* part = user;
+    const char* line = part->begin;
+    while (line < part->end) {
+	const char* newline = memchr(line, '\n', part->end - line);
+	const char* lineEnd = newline ? newline : part->end;
+	if (lineEnd > line) {
+	    int64_t timestamp;
+	    double temperature, pressure;
+	    if (ParseDataLine(line, lineEnd - line, &timestamp, &temperature, &pressure)) {
+		AddRow(part, timestamp, temperature, pressure);
+	    } else {
+		++part->badLines;
+		fprintf(stderr, "Skipping malformed line at byte %lld\n", (long long)(line - part->map));
+	    }
+	}
+	line = lineEnd + 1;
+    }
+    return NULL;
+}
+
+static void*
+AggregateWdb(void* user) {
+    Part* part = user;
+    const WdbFile* wdb = part->wdb;
+    for (uint64_t row = part->firstRow; row < part->endRow; ) {
+	uint64_t block = row / wdb->blockRows;
+	uint64_t blockEnd = (block + 1) * wdb->blockRows;
+	if (blockEnd > part->endRow) blockEnd = part->endRow;
+	const int64_t* timestamp = WdbTimestamps(wdb, block);
+	const double* temperature = WdbTemperatures(wdb, block);
+	const double* pressure = WdbPressures(wdb, block);
+	for (; row < blockEnd; ++row) {
+	    size_t i = row % wdb->blockRows;
+	    AddRow(part, timestamp[i], temperature[i], pressure[i]);
+	}
+    }
+    return NULL;
+}
+
+/* moves other's sums onto s's shift, then merges */
+static void
+MergeShifted(Summary* s, double shift, const Summary* other, double otherShift) {
+    Summary moved = *other;
+    double d = otherShift - shift;
+    moved.sum = other->sum + other->count * d;
+    moved.sumsq = other->sumsq + 2 * d * other->sum + other->count * d * d;
+    MergeSummary(s, &moved);
+}
+
+/* appends the parts' buckets in file order, joining the ones cut in two */
+static void
+MergeParts(Aggregate* aggregate, Part* parts, int count) {
+    int64_t last = 0;
+    int haveLast = 0;
+    for (int p = 0; p < count; ++p) {
+	Part* part = &parts[p];
+	aggregate->rows += part->rows;
+	aggregate->badLines += part->badLines;
+	for (size_t b = 0; b < part->count; ++b) {
+	    const Bucket* bucket = &part->buckets[b];
+	    Bucket* into = aggregate->count ? &aggregate->buckets[aggregate->count - 1] : NULL;
+	    if (!into || into->start != bucket->start) {
+		into = NewBucket(&aggregate->buckets, &aggregate->count, &aggregate->cap);
+		*into = *bucket;
+	    } else {
+		MergeShifted(&into->temperature, into->temperatureShift, &bucket->temperature, bucket->temperatureShift);
+		MergeShifted(&into->pressure, into->pressureShift, &bucket->pressure, bucket->pressureShift);
+		into->last = bucket->last;
+		into->gaps += bucket->gaps;
+		if (bucket->longestGap > into->longestGap) into->longestGap = bucket->longestGap;
+	    }
+	    if (b == 0 && haveLast && part->first - last > AGGREGATE_GAP_SECONDS) {
+		/* the gap between this range and the one before, no thread saw it */
+		++into->gaps;
+		if (part->first - last > into->longestGap) into->longestGap = part->first - last;
+	    }
+	}
+	if (part->rows > 0) {
+	    last = part->last;
+	    haveLast = 1;
+	}
+    }
+}
+
+static int
+ThreadCount(int threads) {
+    if (threads <= 0) {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cores > 0 ? (int)cores : 1;
+    }
+    return threads > AGGREGATE_MAX_THREADS ? AGGREGATE_MAX_THREADS : threads;
+}
+
+static void
+RunParts(Part* parts, int count, void* (*work)(void*)) {
+    pthread_t thread[AGGREGATE_MAX_THREADS];
+    int started[AGGREGATE_MAX_THREADS];
+    for (int i = 1; i < count; ++i) {
+	started[i] = pthread_create(&thread[i], NULL, work, &parts[i]) == 0;
+	if (!started[i]) work(&parts[i]);
+    }
+    work(&parts[0]); /* this thread does a share too */
+    for (int i = 1; i < count; ++i) {
+	if (started[i]) pthread_join(thread[i], NULL);
+    }
+}
+
+int
+AggregateFile(Aggregate* aggregate, const char* path, int period, int threads) {
+    memset(aggregate, 0, sizeof(*aggregate));
+    aggregate->period = period;
+    threads = ThreadCount(threads);
+    aggregate->threads = threads;
+    Part parts[AGGREGATE_MAX_THREADS];
+    memset(parts, 0, sizeof(parts));
+    for (int i = 0; i < threads; ++i) {
+	parts[i].period = period;
+    }
+
+    WdbFile wdb;
+    if (WdbOpen(&wdb, path) == 0) {
+	aggregate->bytes = wdb.mapSize;
+	for (int i = 0; i < threads; ++i) {
+	    parts[i].wdb = &wdb;
+	    parts[i].firstRow = wdb.rowCount * i / threads;
+	    parts[i].endRow = wdb.rowCount * (i + 1) / threads;
+	}
+	RunParts(parts, threads, AggregateWdb);
+	WdbClose(&wdb);
+    } else {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+	    return -1;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+	    close(fd);
+	    return -1;
+	}
+	size_t size = info.st_size;
+	aggregate->bytes = size;
+	if (size == 0) {
+	    close(fd);
+	    return 0;
+	}
+	const char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+	    return -1;
+	}
+	madvise((void*)map, size, MADV_SEQUENTIAL);
+	/* cut at whole lines, a range may end up empty */
+	const char* cut[AGGREGATE_MAX_THREADS + 1];
+	cut[0] = map;
+	cut[threads] = map + size;
+	for (int i = 1; i < threads; ++i) {
+	    const char* at = map + size * i / threads;
+	    if (at < cut[i - 1]) at = cut[i - 1];
+	    const char* newline = at > map ? memchr(at - 1, '\n', map + size - (at - 1)) : NULL;
+	    cut[i] = at == map ? map : newline ? newline + 1 : map + size;
+	}
+	for (int i = 0; i < threads; ++i) {
+	    parts[i].map = map;
+	    parts[i].begin = cut[i];
+	    parts[i].end = cut[i + 1];
+	}
+	RunParts(parts, threads, AggregateText);
+	munmap((void*)map, size);
+    }
+
+    MergeParts(aggregate, parts, threads);
+    for (int i = 0; i < threads; ++i) {
+	free(parts[i].buckets);
+    }
+    return 0;
+}
+
+static void
+WriteChannel(FILE* out, const Summary* s, double shift) {
+    double mean = s->sum / s->count;
+    double variance = s->sumsq / s->count - mean * mean;
+    fprintf(out, ",%.2f,%.2f,%.3f,%.3f", s->min, s->max, shift + mean, variance > 0 ? sqrt(variance) : 0);
+}
+
+void
+AggregateWriteCsv(const Aggregate* aggregate, FILE* out) {
+    fprintf(out, "start,samples,gaps,longest_gap,"
+	    "temperature_min,temperature_max,temperature_mean,temperature_std,"
+	    "pressure_min,pressure_max,pressure_mean,pressure_std\n");
+    char start[20];
+    for (size_t b = 0; b < aggregate->count; ++b) {
+	const Bucket* bucket = &aggregate->buckets[b];
+	if (b > 0) {
+	    /* hours or days nothing was recorded in */
+	    int64_t empty = aggregate->buckets[b - 1].end;
+	    while (empty < bucket->start) {
+		int64_t emptyStart, emptyEnd;
+		BucketBounds(aggregate->period, empty, &emptyStart, &emptyEnd);
+		FormatTimestamp(emptyStart, start);
+		fprintf(out, "%s,0,,,,,,,,,,\n", start);
+		empty = emptyEnd;
+	    }
+	}
+	FormatTimestamp(bucket->start, start);
+	fprintf(out, "%s,%zu,%llu,%lld", start, bucket->temperature.count,
+		(unsigned long long)bucket->gaps, (long long)bucket->longestGap);
+	WriteChannel(out, &bucket->temperature, bucket->temperatureShift);
+	WriteChannel(out, &bucket->pressure, bucket->pressureShift);
+	fputc('\n', out);
+    }
+}
+
+void
+AggregateFree(Aggregate* aggregate) {
+    free(aggregate->buckets);
+    memset(aggregate, 0, sizeof(*aggregate));
+}
@@ -0,0 +1,61 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "kernels.h"
+
+/* Per-hour or per-day statistics of a whole data file, for the headless mode.
+ *
+ * A text file is mapped and cut into one byte range per thread, each cut
+ * moved past the next newline. Every thread parses its own range into its
+ * own buckets, and the partial buckets are merged in file order, so a
+ * bucket that straddles two ranges comes out as if one thread had read it.
+ * A .wdb file is cut into row ranges the same way.
+ *
+ * Buckets start on local hours or local midnights, like the times in
+ * data.txt. Rows are expected in time order, as the server writes them.
+ */
+enum {
+    AGGREGATE_HOUR,
+    AGGREGATE_DAY
+};
+
+/* a longer interval between two samples counts as a gap, a board that
+ * only sends what changed stays quiet for up to its heartbeat */
+#define AGGREGATE_GAP_SECONDS 300
+#define AGGREGATE_MAX_THREADS 64
+
+typedef struct {
+    int64_t start; /* local hour or midnight */
+    int64_t end;
+    int64_t first; /* first and last sample */
+    int64_t last;
+    uint64_t gaps; /* gaps ending in this bucket */
+    int64_t longestGap;
+    /* sums are of value - shift, shift is a value of the bucket */
+    double temperatureShift;
+    double pressureShift;
+    Summary temperature;
+    Summary pressure;
+} Bucket;
+
+typedef struct {
+    int period;
+    Bucket* buckets;
+    size_t count;
+    size_t cap;
+    uint64_t rows;
+    uint64_t badLines;
+    uint64_t bytes; /* of the file */
+    int threads;
+} Aggregate;
+
+/* returns 0 on success, -1 if the file can't be read. threads 0 means one per core */
+int AggregateFile(Aggregate* aggregate, const char* path, int period, int threads);
+/* one line per bucket from the first to the last, empty ones included */
+void AggregateWriteCsv(const Aggregate* aggregate, FILE* out);
+void AggregateFree(Aggregate* aggregate);
+
+#endif
@@ -0,0 +1,480 @@
+/* Checks and timings for the monitor's in-memory data structures
+ *
+ * bench stress [rows]    fill a store far past any old capacity boundary, check every value
+ * bench kernels [count]  ns/sample of every min/max/sum/sumsq kernel the CPU runs
+ * bench lookup [count]   time to find a timestamp in a history of count samples
+ * bench stats [rows]     MB/s of the headless hourly statistics, one thread and all of them
+ * bench parse [lines]    GB/s of the data.txt parser, next to the old fscanf one
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "store.h"
+#include "kernels.h"
+#include "samples.h"
+#include "aggregate.h"
+#include "datafile.h"
+#include <unistd.h>
+
+/* same layout as the monitor's rows */
+typedef struct {
+    int64_t timestamp;
+    double temperature;
+    double pressure;
+} Row;
+
+static double
+Now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* values that can be recomputed from the index alone */
+static void
+MakeRow(uint64_t i, Row* row) {
+    row->timestamp = 1697202449 + 5 * (int64_t)i;
+    row->temperature = (double)(i % 4000) / 100.0 - 10.0;
+    row->pressure = 950.0 + (double)(i * 7919 % 10000) / 100.0;
+}
+
+/* appends rows in uneven chunks the way the follower hands them out */
+static uint64_t
+Fill(Store* store, uint64_t first, uint64_t rows) {
+    uint64_t i = first;
+    uint64_t end = first + rows;
+    uint64_t chunk = 1;
+    while (i < end) {
+	uint64_t count = chunk;
+	if (count > end - i) count = end - i;
+	Row* items = StoreGrow(store, count);
+	if (!items) {
+	    break;
+	}
+	for (uint64_t k = 0; k < count; ++k) {
+	    MakeRow(i + k, &items[k]);
+	}
+	i += count;
+	chunk = chunk * 3 % 4099 + 1;
+    }
+    return i - first;
+}
+
+static uint64_t
+Check(const Store* store) {
+    uint64_t bad = 0;
+    for (uint64_t i = 0; i < store->count; ++i) {
+	Row expected;
+	MakeRow(i, &expected);
+	const Row* row = StoreAt(store, i);
+	if (memcmp(row, &expected, sizeof(Row)) != 0) {
+	    if (bad < 10) {
+		printf("row %llu is wrong\n", (unsigned long long)i);
+	    }
+	    ++bad;
+	}
+    }
+    return bad;
+}
+
+static int
+Stress(uint64_t rows) {
+    Store store;
+    if (StoreInit(&store, sizeof(Row), rows * 2) != 0) {
+	printf("Can't reserve %llu rows\n", (unsigned long long)rows * 2);
+	return 1;
+    }
+    unsigned char* base = store.base;
+    int failed = 0;
+
+    double start = Now();
+    uint64_t filled = Fill(&store, 0, rows);
+    double seconds = Now() - start;
+    printf("Appended %llu rows in %.3fs, %.1fM rows/s, %zuMB committed\n", (unsigned long long)filled,
+	   seconds, filled / seconds / 1e6, store.committed / (1024 * 1024));
+    if (filled != rows || store.count != rows) {
+	printf("FAIL: store took %llu of %llu rows\n", (unsigned long long)filled, (unsigned long long)rows);
+	failed = 1;
+    }
+
+    start = Now();
+    uint64_t bad = Check(&store);
+    printf("Checked %zu rows in %.3fs\n", store.count, Now() - start);
+    if (bad) {
+	printf("FAIL: %llu rows changed\n", (unsigned long long)bad);
+	failed = 1;
+    }
+    if (store.base != base) {
+	printf("FAIL: the store moved\n");
+	failed = 1;
+    }
+
+    /* the reservation is a hard limit, growing past it fails without touching anything */
+    uint64_t over = Fill(&store, store.count, store.reserved / sizeof(Row));
+    while (StoreGrow(&store, 1) != NULL) {
+	++over;
+    }
+    if (store.count != store.reserved / sizeof(Row) || StoreGrow(&store, 1) != NULL) {
+	printf("FAIL: the store stopped at %zu of %zu rows\n", store.count, store.reserved / sizeof(Row));
+	failed = 1;
+    }
+    printf("Filled the reservation with %llu more rows\n", (unsigned long long)over);
+
+    /* a reset like the monitor does when the file is replaced */
+    StoreClear(&store);
+    if (store.count != 0 || Fill(&store, 0, rows / 2) != rows / 2 || Check(&store) != 0) {
+	printf("FAIL: refill after clear\n");
+	failed = 1;
+    }
+
+    StoreFree(&store);
+    printf(failed ? "FAILED\n" : "OK\n");
+    return failed;
+}
+
+/* best of a few runs, in ns per sample */
+#define KERNEL_RUNS 5
+
+static double
+NsPerSample(double seconds, size_t count) {
+    return seconds * 1e9 / count;
+}
+
+static int
+BenchKernels(size_t count) {
+    double* values = malloc(count * sizeof(double));
+    if (!values) {
+	printf("Can't allocate %zu samples\n", count);
+	return 1;
+    }
+    /* pressures around 1013 mb with a little noise, the hard case for a sum of squares */
+    uint64_t seed = 1;
+    for (size_t i = 0; i < count; ++i) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	values[i] = 1013.25 + 5.0 * sin(i / 1e5) + (double)(seed >> 40) / (1 << 24) - 0.5;
+    }
+    double shift = values[0];
+
+    /* reference variance, two passes in long double */
+    long double mean = 0;
+    for (size_t i = 0; i < count; ++i) mean += values[i];
+    mean /= count;
+    long double m2 = 0;
+    for (size_t i = 0; i < count; ++i) m2 += (values[i] - mean) * (values[i] - mean);
+    double variance = (double)(m2 / count);
+
+    /* what the monitor used to get from a plain unshifted single pass */
+    double naiveSum = 0, naiveSumsq = 0;
+    for (size_t i = 0; i < count; ++i) {
+	naiveSum += values[i];
+	naiveSumsq += values[i] * values[i];
+    }
+    double naiveMean = naiveSum / count;
+    printf("%zu samples, variance %.9f, plain single pass off by %.3g\n", count, variance,
+	   fabs(naiveSumsq / count - naiveMean * naiveMean - variance));
+    printf("%-8s %10s %10s %10s %10s %12s\n", "kernels", "minmax", "sum", "sumsq", "summarize", "var error");
+
+    int failed = 0;
+    Summary expected = EmptySummary();
+    KernelSummarize(&scalarKernels, values, count, shift, &expected);
+    const Kernels* const* available = KernelsAvailable();
+    for (int k = 0; available[k]; ++k) {
+	const Kernels* kernels = available[k];
+	double best[4] = { INFINITY, INFINITY, INFINITY, INFINITY };
+	double min = 0, max = 0, sum = 0, sumsq = 0;
+	Summary s;
+	for (int run = 0; run < KERNEL_RUNS; ++run) {
+	    double start = Now();
+	    kernels->minMax(values, count, &min, &max);
+	    double t1 = Now();
+	    sum = KernelSum(kernels, values, count, shift);
+	    double t2 = Now();
+	    sumsq = KernelSumSquares(kernels, values, count, shift);
+	    double t3 = Now();
+	    s = EmptySummary();
+	    KernelSummarize(kernels, values, count, shift, &s);
+	    double t4 = Now();
+	    double times[4] = { t1 - start, t2 - t1, t3 - t2, t4 - t3 };
+	    for (int i = 0; i < 4; ++i) {
+		if (times[i] < best[i]) best[i] = times[i];
+	    }
+	}
+	double m = s.sum / s.count;
+	double error = fabs(s.sumsq / s.count - m * m - variance);
+	printf("%-8s %10.3f %10.3f %10.3f %10.3f %12.3g\n", kernels->name, NsPerSample(best[0], count),
+	       NsPerSample(best[1], count), NsPerSample(best[2], count), NsPerSample(best[3], count), error);
+
+	/* every variant has to agree with the scalar one */
+	double tolerance = 1e-9 * (fabs(expected.sumsq) + 1);
+	if (min != expected.min || max != expected.max || s.min != expected.min || s.max != expected.max ||
+	    s.count != count || fabs(sum - expected.sum) > tolerance || fabs(s.sum - expected.sum) > tolerance ||
+	    fabs(sumsq - expected.sumsq) > tolerance || fabs(s.sumsq - expected.sumsq) > tolerance) {
+	    printf("FAIL: %s disagrees with scalar\n", kernels->name);
+	    failed = 1;
+	}
+    }
+    printf("best: %s\n", KernelsBest()->name);
+    free(values);
+    return failed;
+}
+
+#define LOOKUPS (1024 * 1024)
+
+static int
+BenchLookup(size_t count) {
+    Samples samples;
+    if (SamplesInit(&samples, count) != 0) {
+	printf("Can't reserve %zu samples\n", count);
+	return 1;
+    }
+    /* a sample every 5 seconds, with an outage of up to a day now and then */
+    enum { CHUNK = 4096 };
+    static int64_t t[CHUNK];
+    static double temp[CHUNK], press[CHUNK];
+    int64_t time = 1697155200;
+    uint64_t seed = 1;
+    double start = Now();
+    for (size_t done = 0; done < count; ) {
+	size_t n = count - done < CHUNK ? count - done : CHUNK;
+	for (size_t i = 0; i < n; ++i) {
+	    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	    time += (seed >> 44) == 0 ? (int64_t)(seed >> 40) % 86400 : 5;
+	    t[i] = time;
+	    temp[i] = 20.0;
+	    press[i] = 1013.25;
+	}
+	if (SamplesAppend(&samples, t, temp, press, n) != n) {
+	    printf("Can't append past %zu samples\n", done);
+	    SamplesFree(&samples);
+	    return 1;
+	}
+	done += n;
+    }
+    printf("%zu samples over %.1f days, appended in %.2fs\n", count,
+	   (samples.timestamp[count - 1] - samples.timestamp[0]) / 86400.0, Now() - start);
+
+    /* random times over the whole history, outages included */
+    int64_t first = samples.timestamp[0];
+    int64_t span = samples.timestamp[count - 1] - first + 1;
+    int64_t* wanted = malloc(LOOKUPS * sizeof(int64_t));
+    size_t* found = malloc(LOOKUPS * sizeof(size_t));
+    for (int i = 0; i < LOOKUPS; ++i) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	wanted[i] = first + (int64_t)((seed >> 11) % (uint64_t)span);
+    }
+    start = Now();
+    for (int i = 0; i < LOOKUPS; ++i) {
+	found[i] = SamplesFind(&samples, wanted[i]);
+    }
+    double seconds = Now() - start;
+
+    int failed = 0;
+    for (int i = 0; i < LOOKUPS; ++i) {
+	size_t row = found[i];
+	if ((row < count && samples.timestamp[row] < wanted[i]) ||
+	    (row > 0 && samples.timestamp[row - 1] >= wanted[i])) {
+	    printf("FAIL: lookup of %lld gave row %zu\n", (long long)wanted[i], row);
+	    failed = 1;
+	    break;
+	}
+    }
+    printf("%d lookups, %.3f us each\n", LOOKUPS, seconds * 1e6 / LOOKUPS);
+    free(wanted);
+    free(found);
+    SamplesFree(&samples);
+    return failed;
+}
+
+static int
+SameBuckets(const Aggregate* a, const Aggregate* b) {
+    if (a->count != b->count || a->rows != b->rows) return 0;
+    for (size_t i = 0; i < a->count; ++i) {
+	const Bucket* x = &a->buckets[i];
+	const Bucket* y = &b->buckets[i];
+	double xMean = x->temperatureShift + x->temperature.sum / x->temperature.count;
+	double yMean = y->temperatureShift + y->temperature.sum / y->temperature.count;
+	if (x->start != y->start || x->temperature.count != y->temperature.count || x->gaps != y->gaps ||
+	    x->temperature.min != y->temperature.min || x->pressure.max != y->pressure.max ||
+	    fabs(xMean - yMean) > 1e-9) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static int
+BenchStats(size_t rows) {
+    /* a data.txt look-alike, a row every 5 seconds with an outage now and then */
+    char path[] = "/tmp/benchXXXXXX";
+    int fd = mkstemp(path);
+    FILE* file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file) {
+	printf("Can't create a file in /tmp\n");
+	return 1;
+    }
+    int64_t time = 1697155200;
+    uint64_t seed = 1;
+    for (size_t i = 0; i < rows; ++i) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	time += (seed >> 50) == 0 ? 3 * 3600 : 5;
+	char stamp[20];
+	FormatTimestamp(time, stamp);
+	fprintf(file, "%s %.2f %.2f\n", stamp, 20 + 5 * sin(i / 1e4), 1013.25 + (double)(seed >> 40) / (1 << 24));
+    }
+    fclose(file);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    /* at least 4, so the cutting and merging is checked on small machines too */
+    int threadCounts[2] = { 1, cores > 4 ? (int)cores : 4 };
+    Aggregate results[2];
+    int failed = 0;
+    for (int t = 0; t < 2; ++t) {
+	double best = INFINITY;
+	for (int run = 0; run < 3; ++run) {
+	    if (run > 0) AggregateFree(&results[t]);
+	    double start = Now();
+	    if (AggregateFile(&results[t], path, AGGREGATE_HOUR, threadCounts[t]) != 0) {
+		printf("Can't read %s\n", path);
+		unlink(path);
+		return 1;
+	    }
+	    double seconds = Now() - start;
+	    if (seconds < best) best = seconds;
+	}
+	printf("%2d threads: %zu rows, %zu hours, %.1f MB in %.3fs, %.0f MB/s, %.1f M rows/s\n",
+	       results[t].threads, (size_t)results[t].rows, results[t].count, results[t].bytes / 1e6,
+	       best, results[t].bytes / 1e6 / best, results[t].rows / 1e6 / best);
+    }
+    if (results[0].rows != rows || !SameBuckets(&results[0], &results[1])) {
+	printf("FAIL: threads disagree, or rows went missing\n");
+	failed = 1;
+    }
+    AggregateFree(&results[0]);
+    AggregateFree(&results[1]);
+    unlink(path);
+    return failed;
+}
+
+/* how data.txt used to be read */
+static int
+ScanfDataLine(FILE* file, int64_t* timestamp, double* temperature, double* pressure) {
+    char date[11];
+    char time[9];
+    if (fscanf(file, "%10s %8s %lf %lf", date, time, temperature, pressure) != 4) {
+	return 0;
+    }
+    int year, month, day;
+    int hour, minute, second;
+    if (sscanf(date, "%d-%d-%d", &year, &month, &day) != 3 ||
+	sscanf(time, "%d:%d:%d", &hour, &minute, &second) != 3) {
+	return 0;
+    }
+    *timestamp = LocalTimestamp(year, month, day, hour, minute, second);
+    return 1;
+}
+
+#define PARSE_BUFFER_LINES (1000 * 1000)
+
+static int
+BenchParse(size_t lines) {
+    /* a buffer of data.txt lines, parsed over and over until lines are done */
+    size_t bufferLines = lines < PARSE_BUFFER_LINES ? lines : PARSE_BUFFER_LINES;
+    char* buffer = malloc(bufferLines * 40);
+    if (!buffer) {
+	printf("Can't allocate the buffer\n");
+	return 1;
+    }
+    size_t size = 0;
+    int64_t time = 1697155200;
+    uint64_t seed = 1;
+    for (size_t i = 0; i < bufferLines; ++i) {
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	time += 5;
+	char stamp[20];
+	FormatTimestamp(time, stamp);
+	size += sprintf(buffer + size, "%s %.2f %.2f\n", stamp, 20 + 5 * sin(i / 1e4) - (seed >> 63) * 30,
+			1013.25 + (double)(seed >> 40) / (1 << 24));
+    }
+
+    /* the whole buffer with both parsers, they have to agree */
+    double fastSum = 0;
+    int64_t fastTimes = 0;
+    size_t parsed = 0;
+    size_t passes = (lines + bufferLines - 1) / bufferLines;
+    double start = Now();
+    for (size_t pass = 0; pass < passes; ++pass) {
+	const char* line = buffer;
+	const char* end = buffer + size;
+	while (line < end) {
+	    const char* newline = memchr(line, '\n', end - line);
+	    int64_t timestamp;
+	    double temperature, pressure;
+	    if (ParseDataLine(line, newline - line, &timestamp, &temperature, &pressure)) {
+		++parsed;
+		if (pass == 0) {
+		    fastSum += temperature + pressure;
+		    fastTimes += timestamp;
+		}
+	    }
+	    line = newline + 1;
+	}
+    }
+    double fastSeconds = Now() - start;
+
+    FILE* file = fmemopen(buffer, size, "r");
+    double scanfSum = 0;
+    int64_t scanfTimes = 0;
+    size_t scanfParsed = 0;
+    int64_t timestamp;
+    double temperature, pressure;
+    start = Now();
+    while (ScanfDataLine(file, &timestamp, &temperature, &pressure)) {
+	scanfSum += temperature + pressure;
+	scanfTimes += timestamp;
+	++scanfParsed;
+    }
+    double scanfSeconds = Now() - start;
+    fclose(file);
+
+    double gigabytes = (double)size * passes / 1e9;
+    printf("%-8s %12s %10s %10s\n", "parser", "lines", "GB/s", "Mlines/s");
+    printf("%-8s %12zu %10.3f %10.1f\n", "fast", parsed, gigabytes / fastSeconds, parsed / fastSeconds / 1e6);
+    printf("%-8s %12zu %10.3f %10.1f\n", "fscanf", scanfParsed, size / scanfSeconds / 1e9,
+	   scanfParsed / scanfSeconds / 1e6);
+    printf("fast parser is %.1fx the fscanf one\n", (parsed / fastSeconds) / (scanfParsed / scanfSeconds));
+    free(buffer);
+    if (parsed != passes * bufferLines || scanfParsed != bufferLines ||
+	fastSum != scanfSum || fastTimes != scanfTimes) {
+	printf("FAIL: the parsers disagree\n");
+	return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[]) {
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "stress") == 0) {
+	return Stress(argc == 3 ? strtoull(argv[2], NULL, 10) : 20 * 1024 * 1024);
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "kernels") == 0) {
+	return BenchKernels(argc == 3 ? strtoull(argv[2], NULL, 10) : 16 * 1024 * 1024);
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "lookup") == 0) {
+	return BenchLookup(argc == 3 ? strtoull(argv[2], NULL, 10) : 100 * 1000 * 1000);
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "stats") == 0) {
+	return BenchStats(argc == 3 ? strtoull(argv[2], NULL, 10) : 10 * 1000 * 1000);
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "parse") == 0) {
+	return BenchParse(argc == 3 ? strtoull(argv[2], NULL, 10) : 100 * 1000 * 1000);
+    }
+    printf("usage: %s stress [rows]\n"
+	   "       %s kernels [count]\n"
+	   "       %s lookup [count]\n"
+	   "       %s stats [rows]\n"
+	   "       %s parse [lines]\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
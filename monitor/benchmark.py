@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+# Benchmark suite for the whole pipeline, writes a machine-readable report
+#
+# usage: python3 benchmark.py [-o report.json] [-b baseline.json] [-t tolerance] [--quick]
+#
+# Builds the tools with the flags make uses into a scratch directory and runs
+# the same synthetic workloads every time:
+#   bench      the monitor's kernels, lookups, hourly statistics, parser and store
+#   ingest     loadgen against ingest: text uploads, /batch uploads, 64 boards at once
+#   server.py  upload_bench.py's per-sample and batch uploads
+#   firmware   the host harness replaying a day with a half hour outage into ingest,
+#              storing every sample, then again with the default acquisition
+#
+# Every number goes into the report as {"name", "value", "unit", "better"},
+# along with the commit, compiler and CPU it was measured on. With -b the run
+# is compared against an earlier report, and the exit status is 1 if any
+# number got worse by more than the tolerance, 0.2 by default.
+#
+# The monitor itself needs a display, its frame phases are on the F1 overlay
+# and printed when it exits.
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+MONITOR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(MONITOR)
+FIRMWARE_HOST = os.path.join(ROOT, "esp32script", "host")
+
+BUILDS = {
+    "bench": ["gcc", "-Wall", "-O2", "-pthread", "bench.c", "samples.c", "store.c", "pyramid.c", "kernels.c",
+              "aggregate.c", "datafile.c", "-lm"],
+    "ingest": ["gcc", "-Wall", "-O2", "-pthread", "ingest.c", "datafile.c", "samples.c", "store.c", "pyramid.c",
+               "kernels.c", "rollup.c", "retention.c", "latency.c", "journal.c", "-lm"],
+    "loadgen": ["gcc", "-Wall", "-O2", "loadgen.c", "datafile.c", "-lm"],
+}
+HARNESS_BUILD = ["g++", "-Wall", "-O2", "-std=gnu++17", "-I.", "-I..", "harness.cpp", "host.cpp", "../firmware.cpp"]
+
+class Report:
+    def __init__(self):
+        self.results = []
+
+    def add(self, name, value, unit, better):
+        self.results.append({"name": name, "value": value, "unit": unit, "better": better})
+        print(f"  {name:32s} {value:14.3f} {unit}")
+
+def run(command, cwd=None, timeout=600):
+    done = subprocess.run(command, cwd=cwd, timeout=timeout, capture_output=True, text=True)
+    if done.returncode != 0:
+        sys.exit(f"{' '.join(command)} failed:\n{done.stdout}{done.stderr}")
+    return done.stdout
+
+def find(pattern, text, what):
+    match = re.search(pattern, text, re.MULTILINE)
+    if not match:
+        sys.exit(f"no {what} in:\n{text}")
+    return [float(group) for group in match.groups()]
+
+def find_line(pattern, text):
+    match = re.search(pattern, text, re.MULTILINE)
+    if not match:
+        sys.exit(f"no {pattern} in:\n{text}")
+    return match.group(1)
+
+def build(directory):
+    tools = {}
+    for name, command in BUILDS.items():
+        tools[name] = os.path.join(directory, name)
+        run(command[:1] + ["-o", tools[name]] + command[1:], cwd=MONITOR)
+    tools["harness"] = os.path.join(directory, "harness")
+    run(HARNESS_BUILD[:1] + ["-o", tools["harness"]] + HARNESS_BUILD[1:], cwd=FIRMWARE_HOST)
+    return tools
+
+def bench(report, tools, scale):
+    out = run([tools["bench"], "kernels", str(4 * 1024 * 1024 // scale)])
+    best = find_line(r"^best: (\S+)", out)
+    minmax, total, squares, summarize = find(rf"^{best}\s+(\S+)\s+(\S+)\s+(\S+)\s+(\S+)", out, "kernel timings")
+    report.add(f"bench.kernels.{best}.minmax", minmax, "ns/sample", "lower")
+    report.add(f"bench.kernels.{best}.summarize", summarize, "ns/sample", "lower")
+    out = run([tools["bench"], "lookup", str(20 * 1000 * 1000 // scale)])
+    report.add("bench.lookup", find(r"lookups, (\S+) us each", out, "lookup time")[0], "us", "lower")
+    out = run([tools["bench"], "stats", str(2 * 1000 * 1000 // scale)])
+    threads = re.findall(r"^\s*(\d+) threads: .* (\S+) MB/s", out, re.M)
+    if len(threads) != 2:
+        sys.exit(f"no statistics timings in:\n{out}")
+    report.add("bench.stats.1_thread", float(threads[0][1]), "MB/s", "higher")
+    report.add("bench.stats.all_threads", float(threads[1][1]), "MB/s", "higher")
+    out = run([tools["bench"], "parse", str(10 * 1000 * 1000 // scale)])
+    report.add("bench.parse", find(r"^fast\s+\d+\s+(\S+)", out, "parser speed")[0], "GB/s", "higher")
+    out = run([tools["bench"], "stress", str(8 * 1024 * 1024 // scale)])
+    report.add("bench.store.append", find(r"rows in \S+, (\S+)M rows/s", out, "append rate")[0], "M rows/s", "higher")
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+def start_ingest(tools, directory):
+    port = free_port()
+    process = subprocess.Popen([tools["ingest"], "-p", str(port), "-d", directory],
+                               stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return process, port
+        except OSError:
+            time.sleep(0.05)
+    process.kill()
+    sys.exit("ingest didn't start")
+
+def stop(process):
+    process.send_signal(signal.SIGINT)
+    process.wait(timeout=60)
+
+def loadgen(report, tools, port, name, arguments):
+    out = run([tools["loadgen"], "-p", str(port)] + arguments)
+    requests, samples = find(r"^(\S+) requests/s, (\S+) samples/s", out, "loadgen rates")
+    p50, p99 = find(r"latency ms: p50 (\S+)\s+p90 \S+\s+p99 (\S+)", out, "loadgen latency")
+    report.add(f"ingest.{name}.requests", requests, "requests/s", "higher")
+    report.add(f"ingest.{name}.samples", samples, "samples/s", "higher")
+    report.add(f"ingest.{name}.p50", p50, "ms", "lower")
+    report.add(f"ingest.{name}.p99", p99, "ms", "lower")
+
+def ingest(report, tools, scale):
+    with tempfile.TemporaryDirectory() as directory:
+        process, port = start_ingest(tools, directory)
+        try:
+            loadgen(report, tools, port, "text", ["-c", "16", "-n", str(40000 // scale)])
+            loadgen(report, tools, port, "batch", ["-c", "4", "-b", "256", "-n", str(4000 // scale)])
+            loadgen(report, tools, port, "devices", ["-c", "64", "-d", "64", "-n", str(40000 // scale)])
+            with urllib.request.urlopen(f"http://127.0.0.1:{port}/stats") as response:
+                stats = json.load(response)
+        finally:
+            stop(process)
+    report.add("ingest.write.p50", stats["write_ms"]["p50"], "ms", "lower")
+    report.add("ingest.write.p99", stats["write_ms"]["p99"], "ms", "lower")
+    report.add("ingest.fsync.p99", stats["fsync_ms"]["p99"], "ms", "lower")
+
+def server(report, scale):
+    out = run([sys.executable, os.path.join(ROOT, "upload_bench.py"), str(4000 // scale), "256"], cwd=ROOT)
+    report.add("server.per_sample", find(r"^per-sample .* (\S+) samples/s", out, "per-sample rate")[0],
+               "samples/s", "higher")
+    report.add("server.batch", find(r"^batch/\d+ .* (\S+) samples/s", out, "batch rate")[0], "samples/s", "higher")
+
+def firmware(report, tools, scale):
+    with tempfile.TemporaryDirectory() as directory:
+        process, port = start_ingest(tools, directory)
+        try:
+            out = run([tools["harness"], "-f", os.path.join(ROOT, "data.txt"), "-a", f"127.0.0.1:{port}",
+                       "-n", str(17280 // scale), "-o", f"{3600 // scale}:{1800 // scale}", "-e", "0:0:0"])
+            filtered = run([tools["harness"], "-f", os.path.join(ROOT, "data.txt"), "-a", f"127.0.0.1:{port}",
+                            "-n", str(17280 // scale), "-d", "filtered"])
+        finally:
+            stop(process)
+    report.add("firmware.throughput", find(r"(\S+) samples/s through the server", out, "throughput")[0],
+               "samples/s", "higher")
+    report.add("firmware.request.p99", find(r"request latency ms: .* p99 (\S+)", out, "latency")[0], "ms", "lower")
+    report.add("firmware.drain", find(r"drained (\S+)s after it ended", out, "drain time")[0], "s", "lower")
+    stats = dict(field.split("=", 1) for field in find_line(r"^firmware: (.*)$", out).split())
+    report.add("firmware.send_delay.p99", float(stats["delay_s"].split("/")[2]), "s", "lower")
+    report.add("firmware.depth_max", float(stats["depth_max"]), "samples", "lower")
+    taken, stored = find(r"^samples: (\S+) taken, (\S+) stored", filtered, "stored samples")
+    report.add("firmware.acquisition.stored", 100 * stored / taken, "%", "lower")
+    report.add("firmware.acquisition.window_differs", find(r"window decision differs .* \((\S+)%\)", filtered,
+                                                          "window decisions")[0], "%", "lower")
+
+def machine():
+    model = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as cpuinfo:
+            model = find_line(r"^model name\s*:\s*(.*)$", cpuinfo.read())
+    except OSError:
+        pass
+    commit = subprocess.run(["git", "describe", "--always", "--dirty"], cwd=ROOT, capture_output=True, text=True)
+    compiler = subprocess.run(["gcc", "--version"], capture_output=True, text=True)
+    return {
+        "commit": commit.stdout.strip(),
+        "compiler": compiler.stdout.splitlines()[0] if compiler.stdout else "",
+        "cpu": model,
+        "cpus": os.cpu_count(),
+        "kernel": platform.release(),
+        "python": platform.python_version(),
+    }
+
+# worse by more than tolerance, relative to the baseline
+def compare(results, baseline, tolerance):
+    old = {result["name"]: result for result in baseline["results"]}
+    regressed = 0
+    print(f"against {baseline['machine']['commit']} from {baseline['date']}:")
+    for result in results:
+        before = old.get(result["name"])
+        if not before or before["value"] == 0:
+            continue
+        change = (result["value"] - before["value"]) / before["value"]
+        worse = change < -tolerance if result["better"] == "higher" else change > tolerance
+        regressed += worse
+        print(f"  {result['name']:32s} {before['value']:14.3f} -> {result['value']:14.3f} {change:+7.1%}"
+              f"{'  REGRESSION' if worse else ''}")
+    return regressed
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the pipeline and write a JSON report")
+    parser.add_argument("-o", "--output", default="benchmark.json", help="report to write")
+    parser.add_argument("-b", "--baseline", help="earlier report to compare against")
+    parser.add_argument("-t", "--tolerance", type=float, default=0.2, help="allowed relative change")
+    parser.add_argument("--quick", action="store_true", help="a quarter of the work, for a quick check")
+    arguments = parser.parse_args()
+    scale = 4 if arguments.quick else 1
+
+    report = Report()
+    with tempfile.TemporaryDirectory() as directory:
+        print("building")
+        tools = build(directory)
+        print("bench")
+        bench(report, tools, scale)
+        print("ingest")
+        ingest(report, tools, scale)
+        print("server.py")
+        server(report, scale)
+        print("firmware")
+        firmware(report, tools, scale)
+
+    document = {
+        "version": 1,
+        "date": datetime.datetime.now(datetime.timezone.utc).isoformat(timespec="seconds"),
+        "quick": arguments.quick,
+        "machine": machine(),
+        "results": report.results,
+    }
+    with open(arguments.output, "w") as file:
+        json.dump(document, file, indent=1)
+        file.write("\n")
+    print(f"wrote {arguments.output}")
+
+    if arguments.baseline:
+        with open(arguments.baseline) as file:
+            baseline = json.load(file)
+        if baseline.get("quick") != arguments.quick:
+            print("the baseline was run with a different --quick, the numbers don't compare")
+        elif compare(report.results, baseline, arguments.tolerance):
+            return 1
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -5,7 +5,7 @@ ESP32_PORT=80  # Use the port you defined in your ESP32 Arduino code (e.g., 80)
 
 # Check if an argument is provided
 if [ -z "$1" ]; then
-    echo "Usage: $0 <0|1|2>"
+    echo "Usage: $0 <0|1|2|3>"
     exit 1
 fi
 
@@ -23,8 +23,12 @@ case $1 in
         COMMAND="SET_OVERRIDE_CLOSE"
 	echo "close"
         ;;
+    3)
+        COMMAND="STATS" # the board answers with its counters and histograms
+	echo "stats"
+        ;;
     *)
-        echo "Invalid input. Use 0, 1, or 2."
+        echo "Invalid input. Use 0, 1, 2 or 3."
         exit 1
         ;;
 esac
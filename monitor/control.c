@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include "control.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* commandNames[] = { "SET_OVERRIDE_OFF", "SET_OVERRIDE_OPEN", "SET_OVERRIDE_CLOSE" };
+static const char* stateNames[] = { "OFF", "OPEN", "CLOSE" };
+
+/* what the control thread knows about its connection */
+typedef struct {
+    int fd;
+    unsigned sentSeq;
+    double sentAt;
+    double heardAt; /* anything from the board */
+    double pingAt; /* 0 when no ping is out */
+    char line[128];
+    int lineLength;
+} Link;
+
+static double
+NowMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static void
+Notify(Control* control) {
+    if (control->changed) {
+	control->changed(control->user);
+    }
+}
+
+/* the pipe only has to be non-empty, a full one is as good */
+static void
+Wake(Control* control) {
+    char wake = 1;
+    ssize_t written = write(control->wake[1], &wake, 1);
+    (void)written;
+}
+
+static void
+DrainWake(Control* control) {
+    char buffer[64];
+    while (read(control->wake[0], buffer, sizeof(buffer)) > 0) {
+    }
+}
+
+/* a non-blocking connect, given up after CONTROL_CONNECT_MS */
+static int
+Connect(Control* control) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", control->port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses;
+    if (getaddrinfo(control->host, port, &hints, &addresses) != 0) {
+	return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* a = addresses; a && fd < 0; a = a->ai_next) {
+	fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+	if (fd < 0) {
+	    continue;
+	}
+	if (connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+	    struct pollfd p[2] = { { fd, POLLOUT, 0 }, { control->wake[0], POLLIN, 0 } };
+	    int error = 0;
+	    socklen_t length = sizeof(error);
+	    if (errno != EINPROGRESS || poll(p, 2, CONTROL_CONNECT_MS) <= 0 || !(p[0].revents & POLLOUT) ||
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+		close(fd);
+		fd = -1;
+	    }
+	}
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/* lines are a few dozen bytes, a short write means the board stopped reading */
+static int
+SendLine(Link* link, const char* line) {
+    size_t length = strlen(line);
+    return send(link->fd, line, length, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)length ? 0 : -1;
+}
+
+static int
+ParseState(const char* name) {
+    for (int s = 0; s < 3; ++s) {
+	if (strcmp(name, stateNames[s]) == 0) return s;
+    }
+    return CONTROL_UNKNOWN;
+}
+
+static void
+HandleLine(Control* control, Link* link, const char* line, double now) {
+    unsigned seq;
+    char state[16];
+    pthread_mutex_lock(&control->lock);
+    if (sscanf(line, "ACK %u %15s", &seq, state) == 2) {
+	control->status.board = ParseState(state);
+	if (seq == link->sentSeq) {
+	    control->ackedSeq = seq;
+	    control->status.lastReplyMs = now - link->sentAt;
+	}
+    } else if (sscanf(line, "STATE %15s", state) == 1) {
+	control->status.board = ParseState(state);
+    }
+    control->status.pending = control->ackedSeq != control->wantedSeq;
+    pthread_mutex_unlock(&control->lock);
+}
+
+/* returns -1 once the connection is gone */
+static int
+ReadLines(Control* control, Link* link) {
+    char buffer[512];
+    ssize_t got = recv(link->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+	return -1;
+    }
+    double now = NowMs();
+    for (ssize_t i = 0; i < got; ++i) {
+	char c = buffer[i];
+	if (c == '\r' || c == '\n') {
+	    if (link->lineLength > 0) {
+		link->line[link->lineLength] = '\0';
+		HandleLine(control, link, link->line, now);
+		Notify(control);
+	    }
+	    link->lineLength = 0;
+	} else if (link->lineLength < (int)sizeof(link->line) - 1) {
+	    link->line[link->lineLength++] = c;
+	}
+    }
+    if (got > 0) {
+	link->heardAt = now;
+	link->pingAt = 0;
+    }
+    return 0;
+}
+
+static void
+Disconnect(Control* control, Link* link) {
+    close(link->fd);
+    link->fd = -1;
+    pthread_mutex_lock(&control->lock);
+    control->status.connected = 0;
+    control->status.board = CONTROL_UNKNOWN;
+    /* sent again on the next connection */
+    control->ackedSeq = 0;
+    control->status.pending = control->wantedSeq != 0;
+    pthread_mutex_unlock(&control->lock);
+    Notify(control);
+}
+
+static void*
+ControlThread(void* user) {
+    Control* control = user;
+    Link link = { .fd = -1 };
+    double retryMs = 500;
+    double retryAt = 0;
+    while (!control->quit) {
+	double now = NowMs();
+	if (link.fd < 0) {
+	    if (now < retryAt) {
+		struct pollfd p = { control->wake[0], POLLIN, 0 };
+		if (poll(&p, 1, (int)(retryAt - now) + 1) > 0) {
+		    /* a new override is worth a try right away */
+		    DrainWake(control);
+		    retryAt = 0;
+		}
+		continue;
+	    }
+	    link.fd = Connect(control);
+	    if (link.fd < 0) {
+		retryAt = NowMs() + retryMs;
+		retryMs = retryMs * 2 < CONTROL_RETRY_MAX_MS ? retryMs * 2 : CONTROL_RETRY_MAX_MS;
+		continue;
+	    }
+	    retryMs = 500;
+	    link.sentSeq = 0;
+	    link.heardAt = NowMs();
+	    link.pingAt = 0;
+	    link.lineLength = 0;
+	    pthread_mutex_lock(&control->lock);
+	    control->status.connected = 1;
+	    pthread_mutex_unlock(&control->lock);
+	    Notify(control);
+	    continue;
+	}
+
+	/* the wanted override, if the board hasn't got it yet */
+	pthread_mutex_lock(&control->lock);
+	unsigned wantedSeq = control->wantedSeq;
+	unsigned ackedSeq = control->ackedSeq;
+	int wanted = control->status.wanted;
+	pthread_mutex_unlock(&control->lock);
+	int failed = 0;
+	if (wantedSeq != 0 && wantedSeq != link.sentSeq) {
+	    char command[64];
+	    snprintf(command, sizeof(command), "CMD %u %s\r\n", wantedSeq, commandNames[wanted]);
+	    failed = SendLine(&link, command);
+	    link.sentSeq = wantedSeq;
+	    link.sentAt = now;
+	}
+	if (!failed && link.pingAt == 0 && now - link.heardAt >= CONTROL_PING_MS) {
+	    failed = SendLine(&link, "PING\r\n");
+	    link.pingAt = now;
+	}
+	/* an unanswered command or ping means the board or the path is gone */
+	if (failed || (link.pingAt != 0 && now - link.pingAt > CONTROL_REPLY_MS) ||
+	    (link.sentSeq != ackedSeq && link.sentSeq != 0 && now - link.sentAt > CONTROL_REPLY_MS)) {
+	    Disconnect(control, &link);
+	    retryAt = NowMs() + retryMs;
+	    continue;
+	}
+
+	double wakeAt = link.pingAt != 0 ? link.pingAt + CONTROL_REPLY_MS : link.heardAt + CONTROL_PING_MS;
+	if (link.sentSeq != ackedSeq && link.sentAt + CONTROL_REPLY_MS < wakeAt) {
+	    wakeAt = link.sentAt + CONTROL_REPLY_MS;
+	}
+	struct pollfd p[2] = { { link.fd, POLLIN, 0 }, { control->wake[0], POLLIN, 0 } };
+	int timeout = wakeAt > now ? (int)(wakeAt - now) + 1 : 0;
+	if (poll(p, 2, timeout) > 0) {
+	    if (p[1].revents) {
+		DrainWake(control);
+	    }
+	    if (p[0].revents && ReadLines(control, &link) != 0) {
+		Disconnect(control, &link);
+		retryAt = NowMs() + retryMs;
+	    }
+	}
+    }
+    if (link.fd >= 0) {
+	close(link.fd);
+    }
+    return NULL;
+}
+
+int
+ControlStart(Control* control, const char* host, int port, void (*changed)(void*), void* user) {
+    memset(control, 0, sizeof(*control));
+    snprintf(control->host, sizeof(control->host), "%s", host);
+    control->port = port;
+    control->changed = changed;
+    control->user = user;
+    control->status.wanted = CONTROL_OFF;
+    control->status.board = CONTROL_UNKNOWN;
+    if (pipe2(control->wake, O_NONBLOCK | O_CLOEXEC) != 0) {
+	return -1;
+    }
+    pthread_mutex_init(&control->lock, NULL);
+    if (pthread_create(&control->thread, NULL, ControlThread, control) != 0) {
+	pthread_mutex_destroy(&control->lock);
+	close(control->wake[0]);
+	close(control->wake[1]);
+	return -1;
+    }
+    return 0;
+}
+
+void
+ControlSet(Control* control, int override) {
+    pthread_mutex_lock(&control->lock);
+    control->status.wanted = override;
+    ++control->wantedSeq;
+    if (control->wantedSeq == 0) ++control->wantedSeq; /* 0 is never sent */
+    control->status.pending = 1;
+    pthread_mutex_unlock(&control->lock);
+    Wake(control);
+}
+
+ControlStatus
+ControlGetStatus(Control* control) {
+    pthread_mutex_lock(&control->lock);
+    ControlStatus status = control->status;
+    pthread_mutex_unlock(&control->lock);
+    return status;
+}
+
+void
+ControlStop(Control* control) {
+    control->quit = 1;
+    Wake(control);
+    pthread_join(control->thread, NULL);
+    pthread_mutex_destroy(&control->lock);
+    close(control->wake[0]);
+    close(control->wake[1]);
+}
@@ -0,0 +1,63 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* The override channel to the board.
+ *
+ * One TCP connection to the board's control port, kept open by a thread of
+ * its own, so the monitor never waits on the network. ControlSet only
+ * records the override wanted and wakes the thread. Only the latest one
+ * matters, so key presses in quick succession send one command.
+ *
+ * Commands are lines, "CMD <seq> SET_OVERRIDE_OPEN". The board answers
+ * "ACK <seq> OPEN" once the override is in effect, and "STATE OPEN" when
+ * a connection opens. A quiet connection is pinged, and one that doesn't
+ * answer in time is dropped and opened again. After a reconnect the wanted
+ * override is sent again, so it survives a reboot of the board.
+ */
+enum {
+    CONTROL_OFF,
+    CONTROL_OPEN,
+    CONTROL_CLOSE,
+    CONTROL_UNKNOWN /* the board hasn't said */
+};
+
+#define CONTROL_CONNECT_MS 2000
+#define CONTROL_PING_MS 15000
+#define CONTROL_REPLY_MS 3000
+#define CONTROL_RETRY_MAX_MS 30000
+
+typedef struct {
+    int connected;
+    int wanted; /* CONTROL_OFF until an override is set */
+    int board; /* what the board last said it does */
+    int pending; /* the wanted override isn't acknowledged yet */
+    double lastReplyMs; /* from command to acknowledgement */
+} ControlStatus;
+
+typedef struct {
+    char host[256];
+    int port;
+    /* called on the control thread when the status changed */
+    void (*changed)(void* user);
+    void* user;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int wake[2]; /* pipe, written to wake the thread */
+    volatile int quit;
+    /* under lock */
+    unsigned wantedSeq; /* bumped on every ControlSet */
+    unsigned ackedSeq;
+    ControlStatus status;
+} Control;
+
+/* returns 0 on success, -1 if the thread can't be started */
+int ControlStart(Control* control, const char* host, int port, void (*changed)(void*), void* user);
+/* never blocks on the network */
+void ControlSet(Control* control, int override);
+ControlStatus ControlGetStatus(Control* control);
+void ControlStop(Control* control);
+
+#endif
@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+# Crash test for the ingestion log of ingest and server.py, see journal.h
+#
+# usage: python3 crashtest.py [-k kills] [-b boards] [--only ingest|server]
+#
+# Boards upload anchored /batch uploads as fast as they are answered, every
+# sample with a timestamp no other sample has, and note the ones answered
+# with 200. The writer is killed with SIGKILL at random moments, and while
+# it is down garbage is appended to some logs and half a line to some
+# data.txt files, the way a torn write leaves them, then it is started
+# again. SIGKILL keeps what is in the page cache, the garbage stands in for
+# what a power cut would tear. The logs are checkpointed every
+# CHECKPOINT_SIZE rather than every 4 MB, so kills land in checkpoints too.
+#
+# At the end every answered sample has to be in data.txt and data.wdb
+# exactly once, both files have to hold the same samples and data.txt no
+# malformed line. The exit status is 1 if not.
+import argparse
+import calendar
+import http.client
+import itertools
+import os
+import random
+import re
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import benchmark
+
+SERVER = os.path.join(benchmark.ROOT, "server.py")
+CLOCK = 1700000000 # boot epoch of every batch, samples are seconds after it
+BATCH_SAMPLES = 50
+CHECKPOINT_SIZE = 64 * 1024 # instead of 4 MB, a checkpoint every few hundred ms
+LINE = re.compile(r"^(\d{4}-\d\d-\d\d \d\d:\d\d:\d\d) +-?\d+\.\d\d +\d+\.\d\d$")
+WDB_HEADER = struct.Struct('<4sIIIQ')
+WDB_HEADER_SIZE = 64
+
+def start(command, directory, port):
+    # UTC, so data.txt's times map back to the timestamps one to one
+    with open(os.path.join(directory, "writer.out"), "a") as log:
+        process = subprocess.Popen(command, cwd=directory, stdout=log, stderr=subprocess.STDOUT,
+                                   env=dict(os.environ, TZ="UTC", LOG_CHECKPOINT_SIZE=str(CHECKPOINT_SIZE)))
+    for _ in range(400):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return process
+        except OSError:
+            if process.poll() is not None:
+                with open(log.name) as out:
+                    sys.exit(f"{command[0]} exited:\n" + "".join(out.readlines()[-20:]))
+            time.sleep(0.05)
+    process.kill()
+    sys.exit(f"{command[0]} didn't start")
+
+class Board(threading.Thread):
+    def __init__(self, port, device, counter, stop):
+        super().__init__(daemon=True)
+        self.port = port
+        self.device = device
+        self.counter = counter
+        self.stop = stop
+        self.acked = []
+        self.refused = 0
+
+    def run(self):
+        connection = None
+        while not self.stop.is_set():
+            captured = [next(self.counter) for _ in range(BATCH_SAMPLES)]
+            body = struct.pack('<2sBBHI', b'WB', 2, 1, len(captured), CLOCK) + b''.join(
+                struct.pack('<Iff', at, 20 + at % 1000 / 100, 1000 + at % 500 / 10) for at in captured)
+            headers = {"Content-Type": "application/octet-stream"}
+            if self.device:
+                headers["X-Device-Id"] = self.device
+            try:
+                if connection is None:
+                    connection = http.client.HTTPConnection("127.0.0.1", self.port, timeout=10)
+                connection.request("POST", "/batch", body, headers)
+                response = connection.getresponse()
+                response.read()
+                if response.status == 200:
+                    self.acked.extend(CLOCK + at for at in captured)
+                else:
+                    self.refused += 1
+                if response.getheader("Connection", "").lower() == "close" or response.version < 11:
+                    connection.close()
+                    connection = None
+            except (OSError, http.client.HTTPException):
+                # the writer is down, these samples are lost, never answered
+                if connection:
+                    connection.close()
+                connection = None
+                time.sleep(0.02)
+
+def directories(scratch, boards):
+    return {board.device: os.path.join(scratch, "devices", board.device) if board.device else scratch
+            for board in boards}
+
+def tear(directory):
+    """what a crash halfway through a write leaves"""
+    torn = []
+    log = os.path.join(directory, "data.log")
+    if os.path.exists(log) and random.random() < 0.5:
+        with open(log, "ab") as file:
+            file.write(os.urandom(random.randint(1, 200)))
+        torn.append("log")
+    text = os.path.join(directory, "data.txt")
+    if os.path.exists(text) and random.random() < 0.5:
+        with open(text, "a") as file:
+            file.write("2024-01-01 12:3")
+        torn.append("data.txt")
+    return torn
+
+def text_times(path):
+    times, bad = [], 0
+    with open(path) as file:
+        for line in file:
+            match = LINE.match(line.rstrip("\n"))
+            if not match:
+                bad += 1
+                continue
+            times.append(calendar.timegm(time.strptime(match.group(1), "%Y-%m-%d %H:%M:%S")))
+    return times, bad
+
+def wdb_times(path):
+    with open(path, "rb") as file:
+        data = file.read()
+    magic, version, block_rows, _, rows = WDB_HEADER.unpack_from(data, 0)
+    if magic != b'WDB1' or version != 1:
+        return None
+    times = []
+    for block in range(0, -(-rows // block_rows)):
+        count = min(block_rows, rows - block * block_rows)
+        base = WDB_HEADER_SIZE + block * block_rows * 24
+        times.extend(struct.unpack_from(f'<{count}q', data, base))
+    return times
+
+def check(name, boards, scratch):
+    failures = []
+    for device, directory in directories(scratch, boards).items():
+        label = f"{name} {device or 'default'}"
+        acked = [at for board in boards if board.device == device for at in board.acked]
+        text, bad = text_times(os.path.join(directory, "data.txt"))
+        wdb = wdb_times(os.path.join(directory, "data.wdb"))
+        if bad:
+            failures.append(f"{label}: {bad} malformed lines in data.txt")
+        if wdb is None:
+            failures.append(f"{label}: data.wdb is not a version 1 file")
+            continue
+        for file, times in (("data.txt", text), ("data.wdb", wdb)):
+            duplicates = len(times) - len(set(times))
+            missing = set(acked) - set(times)
+            if duplicates:
+                failures.append(f"{label}: {duplicates} samples twice in {file}")
+            if missing:
+                failures.append(f"{label}: {len(missing)} of {len(acked)} answered samples missing from {file}, "
+                                f"the first at {min(missing)}")
+        if set(text) != set(wdb):
+            failures.append(f"{label}: data.txt has {len(set(text))} samples, data.wdb {len(set(wdb))}")
+        print(f"  {label}: {len(acked)} answered, {len(text)} in data.txt, {len(wdb)} in data.wdb")
+    return failures
+
+def crash(name, command, port, scratch, kills, board_count):
+    print(f"{name}: {kills} kills, {board_count} boards")
+    counter = itertools.count()
+    stop = threading.Event()
+    boards = [Board(port, f"crash{i}" if i else None, counter, stop) for i in range(board_count)]
+    process = start(command, scratch, port)
+    for board in boards:
+        board.start()
+    torn = 0
+    for kill in range(kills):
+        time.sleep(random.uniform(0.1, 1.0))
+        process.send_signal(signal.SIGKILL)
+        process.wait()
+        for directory in directories(scratch, boards).values():
+            torn += len(tear(directory))
+        process = start(command, scratch, port)
+    time.sleep(random.uniform(0.1, 1.0))
+    stop.set()
+    for board in boards:
+        board.join()
+    # a last crash with nothing in flight, and the recovery the files are checked after
+    process.send_signal(signal.SIGKILL)
+    process.wait()
+    for directory in directories(scratch, boards).values():
+        torn += len(tear(directory))
+    process = start(command, scratch, port)
+    process.send_signal(signal.SIGKILL)
+    process.wait()
+    with open(os.path.join(scratch, "writer.out")) as file:
+        recovered = sum(int(rows) for rows in re.findall(r"(\d+) rows recovered", file.read()))
+    print(f"  {torn} torn files, {recovered} rows recovered from the logs, "
+          f"{sum(board.refused for board in boards)} uploads refused")
+    return check(name, boards, scratch)
+
+def main():
+    parser = argparse.ArgumentParser(description="kills ingest and server.py while they take uploads")
+    parser.add_argument("-k", "--kills", type=int, default=20)
+    parser.add_argument("-b", "--boards", type=int, default=8)
+    parser.add_argument("--only", choices=("ingest", "server"))
+    parser.add_argument("--seed", type=int)
+    args = parser.parse_args()
+    random.seed(args.seed)
+    failures = []
+    with tempfile.TemporaryDirectory(prefix="crashtest-") as scratch:
+        os.mkdir(os.path.join(scratch, "bin"))
+        ingest = os.path.join(scratch, "bin", "ingest")
+        benchmark.run(benchmark.BUILDS["ingest"][:1] + ["-o", ingest, f"-DJOURNAL_CHECKPOINT_SIZE={CHECKPOINT_SIZE}"] +
+                      benchmark.BUILDS["ingest"][1:], cwd=benchmark.MONITOR)
+        for name, command in (("ingest", lambda port, directory: [ingest, "-p", str(port), "-d", directory]),
+                              ("server", lambda port, directory: [sys.executable, SERVER, str(port)])):
+            if args.only and args.only != name:
+                continue
+            directory = os.path.join(scratch, name)
+            os.mkdir(directory)
+            port = benchmark.free_port()
+            failures += crash(name, command(port, directory), port, directory, args.kills, args.boards)
+    for failure in failures:
+        print("FAIL", failure)
+    print("FAIL" if failures else "OK")
+    return 1 if failures else 0
+
+if __name__ == "__main__":
+    sys.exit(main())
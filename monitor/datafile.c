@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include "datafile.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t
+ReadRowCount(const unsigned char* header) {
+    uint64_t rowCount;
+    memcpy(&rowCount, header + WDB_ROW_COUNT_OFFSET, sizeof(rowCount));
+    return rowCount;
+}
+
+/* never trust the count past what is actually mapped */
+static void
+UpdateRowCount(WdbFile* file) {
+    uint64_t mappedBlocks = (file->mapSize - WDB_HEADER_SIZE) / ((uint64_t)file->blockRows * WDB_ROW_SIZE);
+    file->rowCount = ReadRowCount(file->map);
+    if (file->rowCount > mappedBlocks * file->blockRows) {
+	file->rowCount = mappedBlocks * file->blockRows;
+    }
+}
+
+int
+WdbOpen(WdbFile* file, const char* path) {
+    memset(file, 0, sizeof(*file));
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0) {
+	return -1;
+    }
+
+    struct stat info;
+    if (fstat(file->fd, &info) != 0 || info.st_size < WDB_HEADER_SIZE) {
+	close(file->fd);
+	return -1;
+    }
+
+    file->mapSize = info.st_size;
+    file->map = mmap(NULL, file->mapSize, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (file->map == MAP_FAILED) {
+	close(file->fd);
+	file->map = NULL;
+	return -1;
+    }
+
+    uint32_t version;
+    memcpy(&version, file->map + 4, sizeof(version));
+    memcpy(&file->blockRows, file->map + 8, sizeof(file->blockRows));
+    if (memcmp(file->map, WDB_MAGIC, 4) != 0 || version != WDB_VERSION || file->blockRows == 0) {
+	WdbClose(file);
+	return -1;
+    }
+
+    UpdateRowCount(file);
+    madvise(file->map, file->mapSize, MADV_SEQUENTIAL);
+    return 0;
+}
+
+int
+WdbRefresh(WdbFile* file) {
+    struct stat info;
+    if (fstat(file->fd, &info) != 0 || info.st_size < WDB_HEADER_SIZE) {
+	return -1;
+    }
+    if ((size_t)info.st_size != file->mapSize) {
+	unsigned char* map = mremap(file->map, file->mapSize, info.st_size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+	    return -1;
+	}
+	file->map = map;
+	file->mapSize = info.st_size;
+    }
+    UpdateRowCount(file);
+    return 0;
+}
+
+void
+WdbClose(WdbFile* file) {
+    if (file->map) {
+	munmap(file->map, file->mapSize);
+	file->map = NULL;
+    }
+    if (file->fd >= 0) {
+	close(file->fd);
+	file->fd = -1;
+    }
+}
+
+static int
+WriteAll(int fd, const void* buffer, size_t size, off_t offset) {
+    const unsigned char* p = buffer;
+    while (size > 0) {
+	ssize_t written = pwrite(fd, p, size, offset);
+	if (written <= 0) return -1;
+	p += written;
+	size -= written;
+	offset += written;
+    }
+    return 0;
+}
+
+static int
+ReadAll(int fd, void* buffer, size_t size, off_t offset) {
+    unsigned char* p = buffer;
+    while (size > 0) {
+	ssize_t got = pread(fd, p, size, offset);
+	if (got <= 0) return -1;
+	p += got;
+	size -= got;
+	offset += got;
+    }
+    return 0;
+}
+
+int
+WdbWriterOpen(WdbWriter* writer, const char* path) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (writer->fd < 0) {
+	return -1;
+    }
+
+    unsigned char header[WDB_HEADER_SIZE];
+    struct stat info;
+    if (fstat(writer->fd, &info) != 0) {
+	close(writer->fd);
+	return -1;
+    }
+    if (info.st_size == 0) {
+	uint32_t version = WDB_VERSION;
+	uint32_t blockRows = WDB_BLOCK_ROWS;
+	memset(header, 0, sizeof(header));
+	memcpy(header, WDB_MAGIC, 4);
+	memcpy(header + 4, &version, sizeof(version));
+	memcpy(header + 8, &blockRows, sizeof(blockRows));
+	if (WriteAll(writer->fd, header, sizeof(header), 0) != 0) {
+	    close(writer->fd);
+	    return -1;
+	}
+    } else if (ReadAll(writer->fd, header, sizeof(header), 0) != 0 || memcmp(header, WDB_MAGIC, 4) != 0) {
+	close(writer->fd);
+	return -1;
+    }
+    memcpy(&writer->blockRows, header + 8, sizeof(writer->blockRows));
+    writer->rowCount = ReadRowCount(header);
+    writer->flushedCount = writer->rowCount;
+
+    size_t blockSize = (size_t)writer->blockRows * WDB_ROW_SIZE;
+    writer->timestamp = calloc(1, blockSize);
+    if (!writer->timestamp) {
+	close(writer->fd);
+	return -1;
+    }
+    writer->temperature = (double*)(writer->timestamp + writer->blockRows);
+    writer->pressure = writer->temperature + writer->blockRows;
+
+    /* pick up the partially filled last block */
+    if (writer->rowCount % writer->blockRows != 0) {
+	uint64_t block = writer->rowCount / writer->blockRows;
+	ReadAll(writer->fd, writer->timestamp, blockSize, WdbBlockOffset(writer->blockRows, block));
+    }
+    return 0;
+}
+
+int
+WdbAppend(WdbWriter* writer, int64_t timestamp, double temperature, double pressure) {
+    uint32_t row = writer->rowCount % writer->blockRows;
+    writer->timestamp[row] = timestamp;
+    writer->temperature[row] = temperature;
+    writer->pressure[row] = pressure;
+    ++writer->rowCount;
+    if (row + 1 == writer->blockRows) {
+	return WdbFlush(writer);
+    }
+    return 0;
+}
+
+int
+WdbFlush(WdbWriter* writer) {
+    if (writer->rowCount == writer->flushedCount) {
+	return 0;
+    }
+    /* the block holding the last appended row */
+    uint64_t block = (writer->rowCount - 1) / writer->blockRows;
+    size_t blockSize = (size_t)writer->blockRows * WDB_ROW_SIZE;
+    if (WriteAll(writer->fd, writer->timestamp, blockSize, WdbBlockOffset(writer->blockRows, block)) != 0) {
+	return -1;
+    }
+    if (WriteAll(writer->fd, &writer->rowCount, sizeof(writer->rowCount), WDB_ROW_COUNT_OFFSET) != 0) {
+	return -1;
+    }
+    writer->flushedCount = writer->rowCount;
+    if (writer->rowCount % writer->blockRows == 0) {
+	memset(writer->timestamp, 0, blockSize);
+    }
+    return 0;
+}
+
+int
+WdbWriterTruncate(WdbWriter* writer, uint64_t rowCount) {
+    if (WdbFlush(writer) != 0) {
+	return -1;
+    }
+    if (rowCount >= writer->rowCount) {
+	return 0;
+    }
+    writer->rowCount = writer->flushedCount = rowCount;
+    if (WriteAll(writer->fd, &writer->rowCount, sizeof(writer->rowCount), WDB_ROW_COUNT_OFFSET) != 0) {
+	return -1;
+    }
+    /* whole blocks, up to the one the next row goes in */
+    uint64_t blocks = (rowCount + writer->blockRows - 1) / writer->blockRows;
+    if (ftruncate(writer->fd, WdbBlockOffset(writer->blockRows, blocks)) != 0) {
+	return -1;
+    }
+    size_t blockSize = (size_t)writer->blockRows * WDB_ROW_SIZE;
+    memset(writer->timestamp, 0, blockSize);
+    if (rowCount % writer->blockRows != 0) {
+	ReadAll(writer->fd, writer->timestamp, blockSize, WdbBlockOffset(writer->blockRows, rowCount / writer->blockRows));
+    }
+    return 0;
+}
+
+int
+WdbWriterClose(WdbWriter* writer) {
+    int result = WdbFlush(writer);
+    free(writer->timestamp);
+    writer->timestamp = NULL;
+    if (close(writer->fd) != 0) result = -1;
+    return result;
+}
+
+int64_t
+LocalTimestamp(int year, int month, int day, int hour, int minute, int second) {
+    /* mktime is slow, but rows come in order, so cache the start of the hour,
+     * one cache per thread for the parallel loaders */
+    static __thread int cachedYear = -1, cachedMonth, cachedDay, cachedHour;
+    static __thread int64_t cachedBase;
+    if (year != cachedYear || month != cachedMonth || day != cachedDay || hour != cachedHour) {
+	struct tm t;
+	memset(&t, 0, sizeof(t));
+	t.tm_year = year - 1900;
+	t.tm_mon = month - 1;
+	t.tm_mday = day;
+	t.tm_hour = hour;
+	t.tm_isdst = -1;
+	cachedBase = (int64_t)mktime(&t);
+	cachedYear = year;
+	cachedMonth = month;
+	cachedDay = day;
+	cachedHour = hour;
+    }
+    return cachedBase + 60 * minute + second;
+}
+
+/* two digits at p, -1 if they aren't */
+static inline int
+TwoDigits(const char* p) {
+    unsigned tens = (unsigned char)p[0] - '0';
+    unsigned ones = (unsigned char)p[1] - '0';
+    return tens < 10 && ones < 10 ? (int)(tens * 10 + ones) : -1;
+}
+
+static const double powersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+/* [-]digits[.digits] after any spaces, at most 15 digits so the integer is exact */
+static inline const char*
+ParseFixed(const char* p, const char* end, double* value) {
+    while (p < end && *p == ' ') ++p;
+    int negative = p < end && *p == '-';
+    if (negative) ++p;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int decimals = -1;
+    for (; p < end; ++p) {
+	unsigned digit = (unsigned char)*p - '0';
+	if (digit < 10) {
+	    mantissa = mantissa * 10 + digit;
+	    ++digits;
+	    if (decimals >= 0) ++decimals;
+	} else if (*p == '.' && decimals < 0) {
+	    decimals = 0;
+	} else {
+	    break;
+	}
+    }
+    if (digits == 0 || digits > 15) {
+	return NULL;
+    }
+    double v = (double)mantissa;
+    if (decimals > 0) v /= powersOfTen[decimals];
+    *value = negative ? -v : v;
+    return p;
+}
+
+int
+ParseDataLine(const char* line, size_t length, int64_t* timestamp, double* temperature, double* pressure) {
+    /* YYYY-MM-DD HH:MM:SS */
+    if (length < 20 || line[4] != '-' || line[7] != '-' || line[10] != ' ' ||
+	line[13] != ':' || line[16] != ':' || line[19] != ' ') {
+	return 0;
+    }
+    int century = TwoDigits(line);
+    int yearInCentury = TwoDigits(line + 2);
+    int month = TwoDigits(line + 5);
+    int day = TwoDigits(line + 8);
+    int hour = TwoDigits(line + 11);
+    int minute = TwoDigits(line + 14);
+    int second = TwoDigits(line + 17);
+    if (century < 0 || yearInCentury < 0 || month < 1 || month > 12 || day < 1 || day > 31 ||
+	hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 60) {
+	return 0;
+    }
+
+    const char* end = line + length;
+    const char* p = ParseFixed(line + 20, end, temperature);
+    if (!p || p == end || *p != ' ') {
+	return 0;
+    }
+    p = ParseFixed(p, end, pressure);
+    if (!p) {
+	return 0;
+    }
+    while (p < end && (*p == ' ' || *p == '\r')) ++p;
+    if (p != end) {
+	return 0;
+    }
+    *timestamp = LocalTimestamp(century * 100 + yearInCentury, month, day, hour, minute, second);
+    return 1;
+}
+
+int
+DataReaderOpen(DataReader* reader, FILE* file) {
+    memset(reader, 0, sizeof(*reader));
+    reader->file = file;
+    reader->buffer = malloc(DATA_READ_SIZE);
+    return reader->buffer ? 0 : -1;
+}
+
+int
+DataReaderNext(DataReader* reader, int64_t* timestamp, double* temperature, double* pressure) {
+    for (;;) {
+	char* line = reader->buffer + reader->start;
+	char* newline = memchr(line, '\n', reader->end - reader->start);
+	int last = 0;
+	if (!newline) {
+	    /* move the partial line to the front and read more behind it */
+	    size_t partial = reader->end - reader->start;
+	    memmove(reader->buffer, line, partial);
+	    reader->offset += reader->start;
+	    reader->start = 0;
+	    reader->end = partial;
+	    size_t got = fread(reader->buffer + partial, 1, DATA_READ_SIZE - partial, reader->file);
+	    reader->end += got;
+	    line = reader->buffer;
+	    newline = memchr(line + partial, '\n', got);
+	    if (!newline) {
+		if (reader->end == 0) {
+		    return 0;
+		}
+		if (reader->end < DATA_READ_SIZE && got > 0) {
+		    continue; /* a short read, not the end yet */
+		}
+		/* the last line has no newline, or a line fills the whole buffer */
+		newline = reader->buffer + reader->end;
+		last = 1;
+	    }
+	}
+	size_t length = newline - line;
+	uint64_t offset = reader->offset + reader->start;
+	reader->start = last ? reader->end : reader->start + length + 1;
+	if (length == 0) {
+	    continue;
+	}
+	if (ParseDataLine(line, length, timestamp, temperature, pressure)) {
+	    return 1;
+	}
+	++reader->badLines;
+	printf("Skipping malformed line at byte %llu\n", (unsigned long long)offset);
+    }
+}
+
+void
+DataReaderClose(DataReader* reader) {
+    free(reader->buffer);
+    memset(reader, 0, sizeof(*reader));
+}
+
+void
+FormatTimestamp(int64_t timestamp, char* buffer) {
+    time_t t = (time_t)timestamp;
+    struct tm local;
+    localtime_r(&t, &local);
+    strftime(buffer, 20, "%Y-%m-%d %H:%M:%S", &local);
+}
@@ -0,0 +1,121 @@
+#ifndef DATAFILE_H
+#define DATAFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Weather data binary file (.wdb), append only and columnar.
+ *
+ * [header, WDB_HEADER_SIZE bytes][block 0][block 1]...
+ *
+ * header, little endian:
+ *   char magic[4]     "WDB1"
+ *   uint32 version    WDB_VERSION
+ *   uint32 blockRows  rows per block
+ *   uint32 reserved
+ *   uint64 rowCount   rows written so far
+ *   rest is zero
+ *
+ * block: int64 timestamp[blockRows]    seconds since the epoch (UTC)
+ *        double temperature[blockRows] Celsius
+ *        double pressure[blockRows]    millibar
+ *
+ * Blocks are allocated whole, only the last one is partially filled. Writers
+ * fill in the rows first and bump rowCount last, so a reader never looks at
+ * a row that isn't completely written. server.py writes the same format.
+ */
+#define WDB_MAGIC "WDB1"
+#define WDB_VERSION 1
+#define WDB_HEADER_SIZE 64
+#define WDB_BLOCK_ROWS 4096
+#define WDB_ROW_SIZE (sizeof(int64_t) + 2 * sizeof(double))
+#define WDB_ROW_COUNT_OFFSET 16
+
+typedef struct {
+    int fd;
+    unsigned char* map;
+    size_t mapSize;
+    uint32_t blockRows;
+    uint64_t rowCount;
+} WdbFile;
+
+typedef struct {
+    int fd;
+    uint32_t blockRows;
+    uint64_t rowCount;
+    uint64_t flushedCount;
+    /* the block being filled, written out whole */
+    int64_t* timestamp;
+    double* temperature;
+    double* pressure;
+} WdbWriter;
+
+/* returns 0 on success, -1 if the file can't be opened or isn't a .wdb file */
+int WdbOpen(WdbFile* file, const char* path);
+/* picks up rows appended since, remapping when the file grew. -1 if the file went bad */
+int WdbRefresh(WdbFile* file);
+void WdbClose(WdbFile* file);
+
+static inline size_t
+WdbBlockOffset(uint32_t blockRows, uint64_t block) {
+    return WDB_HEADER_SIZE + block * blockRows * WDB_ROW_SIZE;
+}
+
+static inline const int64_t*
+WdbTimestamps(const WdbFile* file, uint64_t block) {
+    return (const int64_t*)(file->map + WdbBlockOffset(file->blockRows, block));
+}
+
+static inline const double*
+WdbTemperatures(const WdbFile* file, uint64_t block) {
+    return (const double*)(WdbTimestamps(file, block) + file->blockRows);
+}
+
+static inline const double*
+WdbPressures(const WdbFile* file, uint64_t block) {
+    return WdbTemperatures(file, block) + file->blockRows;
+}
+
+/* creates the file, or continues appending to an existing one */
+int WdbWriterOpen(WdbWriter* writer, const char* path);
+int WdbAppend(WdbWriter* writer, int64_t timestamp, double temperature, double pressure);
+/* writes the partial block and the row count, appended rows become visible */
+int WdbFlush(WdbWriter* writer);
+/* drops every row from rowCount on, nothing if there are no more than that.
+ * For recovery, see journal.h, a reader that is following the file starts over */
+int WdbWriterTruncate(WdbWriter* writer, uint64_t rowCount);
+int WdbWriterClose(WdbWriter* writer);
+
+/* data.txt lines, "YYYY-MM-DD HH:MM:SS TT.TT PPPP.PP", times are local.
+ *
+ * The date and time are decoded at fixed positions, the numbers as an
+ * integer and a count of decimals, divided once by a power of ten, which
+ * rounds the same as strtod. No locale, no copies, no allocation.
+ */
+#define DATA_READ_SIZE (1024 * 1024)
+
+/* one line out of a buffer, length without the newline, returns 1 if it parsed */
+int ParseDataLine(const char* line, size_t length, int64_t* timestamp, double* temperature, double* pressure);
+
+/* reads a text file a large buffer at a time */
+typedef struct {
+    FILE* file;
+    char* buffer;
+    size_t start; /* next line */
+    size_t end;   /* bytes in the buffer */
+    uint64_t offset; /* of buffer[0] in the file */
+    uint64_t badLines;
+} DataReader;
+
+/* returns 0 on success */
+int DataReaderOpen(DataReader* reader, FILE* file);
+/* the next row, malformed lines are skipped and reported with their byte offset.
+ * returns 0 at the end of the file */
+int DataReaderNext(DataReader* reader, int64_t* timestamp, double* temperature, double* pressure);
+void DataReaderClose(DataReader* reader);
+int64_t LocalTimestamp(int year, int month, int day, int hour, int minute, int second);
+/* "YYYY-MM-DD HH:MM:SS" in local time, buffer needs 20 bytes */
+void FormatTimestamp(int64_t timestamp, char* buffer);
+
+#endif
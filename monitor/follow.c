@@ -0,0 +1,385 @@
+#define _GNU_SOURCE
+#include "follow.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* remembers which follower a file watch belongs to */
+static void
+MapWatch(FollowGroup* group, int watch, Follower* follower) {
+    if (watch < 0) {
+	return;
+    }
+    if (watch >= group->watchCap) {
+	int cap = group->watchCap ? group->watchCap : 256;
+	while (cap <= watch) cap *= 2;
+	Follower** grown = realloc(group->byWatch, cap * sizeof(Follower*));
+	if (!grown) {
+	    abort();
+	}
+	memset(grown + group->watchCap, 0, (cap - group->watchCap) * sizeof(Follower*));
+	group->byWatch = grown;
+	group->watchCap = cap;
+    }
+    group->byWatch[watch] = follower;
+}
+
+static int
+OpenFile(Follower* follower) {
+    follower->fd = open(follower->path, O_RDONLY);
+    if (follower->fd < 0) {
+	return -1;
+    }
+    struct stat info;
+    fstat(follower->fd, &info);
+    follower->device = info.st_dev;
+    follower->inode = info.st_ino;
+    follower->offset = 0;
+    follower->rows = 0;
+    follower->binary = WdbOpen(&follower->wdb, follower->path) == 0;
+
+    if (follower->inotifyFd >= 0) {
+	if (follower->fileWatch >= 0) {
+	    inotify_rm_watch(follower->inotifyFd, follower->fileWatch);
+	}
+	follower->fileWatch = inotify_add_watch(follower->inotifyFd, follower->path,
+						IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	if (follower->group) {
+	    MapWatch(follower->group, follower->fileWatch, follower);
+	}
+    }
+    follower->changed = 1;
+    return 0;
+}
+
+static void
+CloseFile(Follower* follower) {
+    if (follower->binary) {
+	WdbClose(&follower->wdb);
+	follower->binary = 0;
+    }
+    if (follower->fd >= 0) {
+	close(follower->fd);
+	follower->fd = -1;
+    }
+}
+
+static int
+Open(Follower* follower, FollowGroup* group, const char* path) {
+    memset(follower, 0, sizeof(*follower));
+    follower->fd = -1;
+    follower->fileWatch = -1;
+    follower->dirWatch = -1;
+    snprintf(follower->path, sizeof(follower->path), "%s", path);
+
+    /* without inotify every poll looks at the file, which still works */
+    if (group) {
+	follower->group = group;
+	follower->inotifyFd = group->inotifyFd;
+    } else {
+	follower->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    if (follower->inotifyFd < 0) {
+	if (!group) printf("inotify unavailable, checking the file every frame\n");
+    } else {
+	/* the directory tells us when the path gets a new file */
+	char directory[sizeof(follower->path)];
+	snprintf(directory, sizeof(directory), "%s", path);
+	follower->dirWatch = inotify_add_watch(follower->inotifyFd, dirname(directory),
+					       IN_CREATE | IN_MOVED_TO);
+    }
+
+    if (group) {
+	if (group->count == group->cap) {
+	    group->cap = group->cap ? group->cap * 2 : 64;
+	    group->followers = realloc(group->followers, group->cap * sizeof(Follower*));
+	    if (!group->followers) {
+		abort();
+	    }
+	}
+	group->followers[group->count++] = follower;
+    }
+
+    follower->buffer = malloc(FOLLOW_READ_SIZE);
+    if (!follower->buffer || OpenFile(follower) != 0) {
+	FollowerClose(follower);
+	return -1;
+    }
+    return 0;
+}
+
+int
+FollowerOpen(Follower* follower, const char* path) {
+    return Open(follower, NULL, path);
+}
+
+int
+FollowerOpenIn(Follower* follower, FollowGroup* group, const char* path) {
+    return Open(follower, group, path);
+}
+
+void
+FollowerClose(Follower* follower) {
+    CloseFile(follower);
+    FollowGroup* group = follower->group;
+    if (group) {
+	/* the descriptor is the group's, only the watches go */
+	for (size_t i = 0; i < group->count; ++i) {
+	    if (group->followers[i] == follower) {
+		group->followers[i] = group->followers[--group->count];
+		break;
+	    }
+	}
+	if (follower->fileWatch >= 0 && follower->fileWatch < group->watchCap &&
+	    group->byWatch[follower->fileWatch] == follower) {
+	    group->byWatch[follower->fileWatch] = NULL;
+	}
+	if (group->inotifyFd >= 0) {
+	    if (follower->fileWatch >= 0) inotify_rm_watch(group->inotifyFd, follower->fileWatch);
+	    if (follower->dirWatch >= 0) inotify_rm_watch(group->inotifyFd, follower->dirWatch);
+	}
+	follower->group = NULL;
+    } else if (follower->inotifyFd >= 0) {
+	close(follower->inotifyFd);
+    }
+    follower->inotifyFd = -1;
+    free(follower->buffer);
+    follower->buffer = NULL;
+}
+
+/* drains pending events, only whether anything happened matters */
+static void
+ReadEvents(Follower* follower) {
+    if (follower->group && follower->inotifyFd >= 0) {
+	return; /* FollowGroupEvents marks it */
+    }
+    if (follower->inotifyFd < 0) {
+	follower->changed = 1;
+	return;
+    }
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(follower->inotifyFd, events, sizeof(events)) > 0) {
+	follower->changed = 1;
+    }
+}
+
+/* true if the path now names a different file than the one we have open */
+static int
+Replaced(Follower* follower) {
+    struct stat info;
+    if (stat(follower->path, &info) != 0) {
+	return 0; /* gone for now, keep the old one until a new one shows up */
+    }
+    return info.st_dev != follower->device || info.st_ino != follower->inode;
+}
+
+static int
+PollBinary(Follower* follower, FollowRows rows, void* user) {
+    if (WdbRefresh(&follower->wdb) != 0) {
+	return FOLLOW_ERROR;
+    }
+    WdbFile* wdb = &follower->wdb;
+    if (wdb->rowCount < follower->rows) {
+	follower->rows = 0;
+	follower->changed = 1;
+	return FOLLOW_RESET;
+    }
+    if (wdb->rowCount == follower->rows) {
+	return FOLLOW_IDLE;
+    }
+    /* hand out the mapped columns directly, one block at a time */
+    while (follower->rows < wdb->rowCount) {
+	uint64_t block = follower->rows / wdb->blockRows;
+	uint32_t first = follower->rows % wdb->blockRows;
+	uint64_t count = wdb->rowCount - follower->rows;
+	if (count > wdb->blockRows - first) count = wdb->blockRows - first;
+	rows(user, WdbTimestamps(wdb, block) + first, WdbTemperatures(wdb, block) + first,
+	     WdbPressures(wdb, block) + first, count);
+	follower->rows += count;
+    }
+    return FOLLOW_APPENDED;
+}
+
+static int
+PollText(Follower* follower, FollowRows rows, void* user) {
+    struct stat info;
+    if (fstat(follower->fd, &info) != 0) {
+	return FOLLOW_ERROR;
+    }
+    if (info.st_size < follower->offset) {
+	/* truncated, whatever we read before is gone */
+	follower->offset = 0;
+	follower->rows = 0;
+	follower->changed = 1;
+	return FOLLOW_RESET;
+    }
+
+    int64_t timestamp[FOLLOW_CHUNK_ROWS];
+    double temperature[FOLLOW_CHUNK_ROWS];
+    double pressure[FOLLOW_CHUNK_ROWS];
+    size_t count = 0;
+    uint64_t before = follower->rows;
+
+    for (;;) {
+	ssize_t got = pread(follower->fd, follower->buffer, FOLLOW_READ_SIZE, follower->offset);
+	if (got <= 0) {
+	    break;
+	}
+	char* line = follower->buffer;
+	char* end = follower->buffer + got;
+	char* newline;
+	while ((newline = memchr(line, '\n', end - line)) != NULL) {
+	    if (newline > line) {
+		if (ParseDataLine(line, newline - line, &timestamp[count], &temperature[count], &pressure[count])) {
+		    if (++count == FOLLOW_CHUNK_ROWS) {
+			rows(user, timestamp, temperature, pressure, count);
+			follower->rows += count;
+			count = 0;
+		    }
+		} else {
+		    ++follower->badLines;
+		    printf("Skipping malformed line at byte %lld\n",
+			   (long long)(follower->offset + (line - follower->buffer)));
+		}
+	    }
+	    line = newline + 1;
+	}
+	if (line == follower->buffer) {
+	    if (got < FOLLOW_READ_SIZE) {
+		break; /* a line that isn't finished yet */
+	    }
+	    /* no newline in a whole buffer, that is no data line */
+	    ++follower->badLines;
+	    line = end;
+	}
+	follower->offset += line - follower->buffer;
+	if (got < FOLLOW_READ_SIZE) {
+	    break;
+	}
+    }
+    if (count > 0) {
+	rows(user, timestamp, temperature, pressure, count);
+	follower->rows += count;
+    }
+    return follower->rows > before ? FOLLOW_APPENDED : FOLLOW_IDLE;
+}
+
+int
+FollowerPoll(Follower* follower, FollowRows rows, void* user) {
+    ReadEvents(follower);
+    if (!follower->changed) {
+	return FOLLOW_IDLE;
+    }
+    follower->changed = 0;
+
+    if (follower->fd < 0 || Replaced(follower)) {
+	CloseFile(follower);
+	if (OpenFile(follower) != 0) {
+	    return FOLLOW_IDLE; /* wait for the directory watch to see it */
+	}
+	return FOLLOW_RESET;
+    }
+    return follower->binary ? PollBinary(follower, rows, user) : PollText(follower, rows, user);
+}
+
+int
+FollowerWait(Follower* follower, int timeoutMs) {
+    if (follower->inotifyFd < 0) {
+	/* nothing to wait on, say it changed every so often */
+	poll(NULL, 0, timeoutMs);
+	return 1;
+    }
+    struct pollfd fd;
+    fd.fd = follower->inotifyFd;
+    fd.events = POLLIN;
+    return poll(&fd, 1, timeoutMs) > 0;
+}
+
+int
+FollowGroupInit(FollowGroup* group) {
+    memset(group, 0, sizeof(*group));
+    group->directoryWatch = -1;
+    group->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (group->inotifyFd < 0) {
+	printf("inotify unavailable, checking the files every frame\n");
+    }
+    return 0;
+}
+
+int
+FollowGroupWatchDirectory(FollowGroup* group, const char* directory) {
+    if (group->inotifyFd < 0) {
+	group->directoryChanged = 1; /* look every time instead */
+	return 0;
+    }
+    group->directoryWatch = inotify_add_watch(group->inotifyFd, directory, IN_CREATE | IN_MOVED_TO);
+    return group->directoryWatch >= 0 ? 0 : -1;
+}
+
+/* a directory watch may be shared by followers in the same directory,
+ * and they are rare, so the owners are looked for */
+static void
+MarkDirectory(FollowGroup* group, int watch) {
+    for (size_t i = 0; i < group->count; ++i) {
+	if (group->followers[i]->dirWatch == watch) {
+	    group->followers[i]->changed = 1;
+	}
+    }
+}
+
+int
+FollowGroupEvents(FollowGroup* group) {
+    if (group->inotifyFd < 0) {
+	return group->directoryChanged;
+    }
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t got;
+    while ((got = read(group->inotifyFd, events, sizeof(events))) > 0) {
+	for (char* at = events; at < events + got; ) {
+	    const struct inotify_event* event = (const struct inotify_event*)at;
+	    at += sizeof(struct inotify_event) + event->len;
+	    if (event->wd == group->directoryWatch) {
+		group->directoryChanged = 1;
+		MarkDirectory(group, event->wd);
+	    } else if (event->wd < group->watchCap && group->byWatch[event->wd] &&
+		       group->byWatch[event->wd]->fileWatch == event->wd) {
+		group->byWatch[event->wd]->changed = 1;
+	    } else {
+		MarkDirectory(group, event->wd);
+	    }
+	}
+    }
+    int changed = group->directoryChanged;
+    group->directoryChanged = 0;
+    return changed;
+}
+
+int
+FollowGroupWait(FollowGroup* group, int timeoutMs) {
+    if (group->inotifyFd < 0) {
+	poll(NULL, 0, timeoutMs);
+	return 1;
+    }
+    struct pollfd fd;
+    fd.fd = group->inotifyFd;
+    fd.events = POLLIN;
+    return poll(&fd, 1, timeoutMs) > 0;
+}
+
+void
+FollowGroupClose(FollowGroup* group) {
+    if (group->inotifyFd >= 0) {
+	close(group->inotifyFd);
+    }
+    free(group->followers);
+    free(group->byWatch);
+    memset(group, 0, sizeof(*group));
+    group->inotifyFd = -1;
+}
@@ -0,0 +1,94 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "datafile.h"
+
+/* Follows a data file as the server appends to it, either data.txt or a .wdb.
+ *
+ * The first poll reads the whole file, every later poll reads only what was
+ * appended since. inotify tells us when to look, so a poll with nothing new
+ * costs one non-blocking read() whatever the size of the history.
+ *
+ * A text file is tracked by byte offset. A line is only consumed once its
+ * newline is there, a half written line is picked up on the next poll.
+ * If the file shrinks or the path starts pointing at a different file, the
+ * poll returns FOLLOW_RESET; the caller drops its rows and polls again to
+ * read the new file from the start.
+ */
+enum {
+    FOLLOW_IDLE,
+    FOLLOW_APPENDED,
+    FOLLOW_RESET,
+    FOLLOW_ERROR
+};
+
+#define FOLLOW_CHUNK_ROWS 4096
+#define FOLLOW_READ_SIZE (256 * 1024)
+
+/* receives rows in file order, count at most FOLLOW_CHUNK_ROWS for text files */
+typedef void (*FollowRows)(void* user, const int64_t* timestamp, const double* temperature,
+			   const double* pressure, size_t count);
+
+struct FollowGroup;
+
+typedef struct {
+    char path[4096];
+    struct FollowGroup* group; /* NULL when the follower has its own inotify */
+    int binary;
+    int inotifyFd;
+    int fileWatch;
+    int dirWatch;
+    int changed; /* something happened since the last poll */
+    int fd;
+    dev_t device;
+    ino_t inode;
+    off_t offset; /* text: bytes consumed */
+    uint64_t rows; /* rows handed out from this file */
+    uint64_t badLines;
+    WdbFile wdb;
+    char* buffer;
+} Follower;
+
+/* returns 0 on success, -1 if the file can't be opened */
+int FollowerOpen(Follower* follower, const char* path);
+int FollowerPoll(Follower* follower, FollowRows rows, void* user);
+/* blocks until the file may have changed or timeoutMs passed, returns 1 if it may have.
+ * Only reads the inotify descriptor's state, so it can run on another thread than the polls */
+int FollowerWait(Follower* follower, int timeoutMs);
+void FollowerClose(Follower* follower);
+
+/* Followers sharing one inotify descriptor, for one file per device.
+ *
+ * One read() drains the events of every file in the group and marks the
+ * followers they are about, so polling a follower nothing happened to
+ * makes no system call, and one thread can wait for all of them. A
+ * directory can be watched as well, to hear about new devices.
+ */
+typedef struct FollowGroup {
+    int inotifyFd;
+    int directoryWatch;
+    int directoryChanged; /* something was created in the directory */
+    Follower** followers;
+    size_t count;
+    size_t cap;
+    Follower** byWatch; /* the follower of a file watch, by descriptor */
+    int watchCap;
+} FollowGroup;
+
+/* returns 0 on success. Without inotify the group still works, every poll looks at its file */
+int FollowGroupInit(FollowGroup* group);
+/* returns 0 on success, -1 if directory can't be watched */
+int FollowGroupWatchDirectory(FollowGroup* group, const char* directory);
+/* FollowerOpen for a follower in the group. The follower must not move until it is closed */
+int FollowerOpenIn(Follower* follower, FollowGroup* group, const char* path);
+/* marks the followers that have something to poll, returns 1 if the watched directory changed */
+int FollowGroupEvents(FollowGroup* group);
+/* FollowerWait for the whole group */
+int FollowGroupWait(FollowGroup* group, int timeoutMs);
+/* the followers must be closed first */
+void FollowGroupClose(FollowGroup* group);
+
+#endif
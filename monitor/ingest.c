@@ -0,0 +1,1607 @@
+/* Ingestion daemon, takes the same uploads as server.py
+ *
+ * ingest [-p port] [-s always|never|ms] [-k days] [-d directory]
+ *
+ * POST / with "TT.TT PPPP.PP [epoch]" and POST /batch with a binary batch
+ * (layouts in server.py) append rows to data.txt and data.wdb in directory,
+ * answered with 200 and a line of text, so boards don't notice the change.
+ * Uploads with an X-Device-Id header go to devices/<id>/data.txt and
+ * data.wdb instead, like server.py does. Each device's files are opened on
+ * its first upload and stay open.
+ *
+ * Viewing, for index.html in directory or anything else that speaks HTTP:
+ *
+ * GET /                    index.html, a dashboard over the three below
+ * GET /devices             every device with its rows and time span
+ * GET /range?device=&from=&to=&points=
+ *                          min, max and mean of both channels in points
+ *                          equal stretches of from..to (unix seconds)
+ * GET /stream?device=      an event stream of the device's rows as they
+ *                          are committed
+ * GET /stats               counters and write latencies since the start,
+ *                          and the rates of the last stats line, as JSON
+ *
+ * Every device's rows are kept in memory with their min/max pyramids
+ * (samples.h), loaded from data.wdb at start, so a range query costs the
+ * same for a year as for an hour and never touches the disk. A commit
+ * formats its new rows once and hands the same event to every viewer of
+ * the device. A viewer that can't keep up is dropped rather than buffered
+ * for without end.
+ *
+ * One thread and one epoll loop. Sockets are non-blocking and connections
+ * are kept alive. Requests read in the same round of the loop are committed
+ * together: their rows go out in one record to the data.log of each device
+ * that sent any, then in one write to its data.txt and data.wdb, then one
+ * fsync of each log if the policy asks for it, and only then are they
+ * answered. The busier it gets, the more requests share an fsync. If a log
+ * can't be written, the uploads that went to it get no answer and their
+ * connections are closed, so the boards send them again. The other
+ * devices' uploads are answered as usual.
+ *
+ * The log is what makes an answered upload survive a crash, data.txt and
+ * data.wdb are only synced at its checkpoints. A device's files are
+ * recovered from it when they are opened, see journal.h.
+ *
+ * -s always  fsync every commit before answering (default)
+ * -s never   leave it to the kernel and the checkpoints
+ * -s ms      answer right away, fsync at most every ms milliseconds
+ *
+ * Every COMPACT_INTERVAL a thread goes through the devices one at a time
+ * and rolls their rows up into minute, hour and day tiers, dropping raw
+ * rows older than -k days (30, -1 keeps them all) once they are rolled up,
+ * see retention.h. The loop only stops for the swap at the end, and the
+ * rows in memory are reloaded from what is left. /range answers from the
+ * tiers before the first raw row.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "datafile.h"
+#include "samples.h"
+#include "retention.h"
+#include "rollup.h"
+#include "latency.h"
+#include "journal.h"
+
+#define MAX_EVENTS 256
+#define MAX_HEADER 8192
+#define MAX_BODY (1024 * 1024)
+#define READ_SIZE (64 * 1024)
+#define STATS_INTERVAL 10.0 /* seconds */
+#define DEVICES_DIR "devices"
+#define DEVICE_ID_MAX 32 /* letters, digits, '-' and '_' */
+#define SERIES_MAX_ROWS (64 * 1024 * 1024) /* per device, address space only */
+#define RANGE_MAX_POINTS 4096
+#define STREAM_BACKLOG (1024 * 1024) /* a viewer this far behind is dropped */
+#define INDEX_FILE "index.html"
+#define COMPACT_INTERVAL 600.0 /* seconds between rounds over the devices */
+
+/* server.py's batch layouts */
+#define BATCH_ANCHORED 0x01
+#define BATCH_HEADER_SIZE 10  /* magic, version, flags, count (u16), clock (u32) */
+#define BATCH_SAMPLE_SIZE 12  /* captured_at (u32), temperature (f32), pressure (f32) */
+#define PACKED_HEADER_SIZE 14 /* magic, version, flags, count (u16), boot_epoch (u32), uptime (u32) */
+#define PACKED_SAMPLE_SIZE 6
+#define SAMPLE_TIME_RANGE (1 << 17)
+
+enum {
+    SYNC_ALWAYS = -1,
+    SYNC_NEVER = 0
+};
+
+typedef struct {
+    char* data;
+    size_t length;
+    size_t cap;
+} Buffer;
+
+typedef JournalRow Row;
+
+/* one device's files, device is "" for boards that send no ID */
+typedef struct Sink {
+    char device[DEVICE_ID_MAX + 1];
+    int textFd;
+    WdbWriter wdb;
+    Journal journal;
+    Buffer pending; /* Rows read this round */
+    int queued; /* on the round's list of sinks with rows */
+    int dirty; /* logged but not synced */
+    int failed; /* its log couldn't be written this round */
+    struct Sink* nextQueued;
+    /* all rows in memory, with the pyramids range queries are answered from */
+    Samples series;
+    size_t published; /* rows sent to the viewers */
+    struct Connection* viewers;
+    History history; /* the rollups, for the time before the first raw row */
+} Sink;
+
+typedef struct Connection {
+    int fd;
+    Buffer in;
+    Buffer out;  /* answers that can be sent */
+    Buffer held; /* answers waiting for the commit */
+    int waiting; /* on the ingest's waiting list */
+    int closeAfter; /* close once the answers are out */
+    int closed; /* the peer is gone, free after the commit */
+    int uploads; /* answered 200 this round, if the commit fails they aren't sent */
+    Sink* fed; /* the sink they went to, NULL if more than one */
+    struct Connection* nextWaiting;
+    Sink* stream; /* the sink an event stream follows */
+    struct Connection* nextViewer;
+} Connection;
+
+/* Retention runs on a thread of its own, one sink at a time. The thread
+ * only prepares, the loop finishes between two commits. */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int quit;
+    int64_t rawSeconds;
+    Sink* sink; /* being compacted, NULL when idle */
+    int prepared; /* the thread is done with it */
+    int failed;
+    char directory[sizeof(DEVICES_DIR) + DEVICE_ID_MAX + 1];
+    Compaction compaction;
+    size_t nextSlot; /* of the sinks, where the round goes on */
+    double due; /* when the next round starts */
+} Compactor;
+
+typedef struct {
+    int epollFd;
+    int listenFd;
+    int syncPolicy; /* SYNC_ALWAYS, SYNC_NEVER or milliseconds */
+    /* open addressing on the device ID, never more than half full */
+    Sink** sinks;
+    size_t sinkSlots;
+    size_t sinkCount;
+    Sink* queued;
+    Buffer lines;
+    Connection* waiting;
+    int failed; /* a log couldn't be written this round */
+    int dirty; /* some sink is written but not synced */
+    double lastSync;
+    /* since the last stats line */
+    double lastStats;
+    uint64_t requests;
+    uint64_t rows;
+    uint64_t commits;
+    uint64_t syncs;
+    Latency writeLatency; /* per commit, writing and syncing every sink in it */
+    Latency syncLatency; /* per fdatasync of a sink's log */
+    /* since the start, for /stats, the above are added in on every stats line */
+    double started;
+    uint64_t totalRequests;
+    uint64_t totalRows;
+    uint64_t totalCommits;
+    uint64_t totalSyncs;
+    Latency totalWriteLatency;
+    Latency totalSyncLatency;
+    double requestRate; /* of the last stats interval */
+    double rowRate;
+    int connections;
+    int viewers;
+    Compactor compactor;
+} Ingest;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void
+Stop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+static double
+Now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double
+WallClock(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+BufferAppend(Buffer* buffer, const void* data, size_t length) {
+    if (buffer->length + length > buffer->cap) {
+	size_t cap = buffer->cap ? buffer->cap : 4096;
+	while (cap < buffer->length + length) cap *= 2;
+	char* grown = realloc(buffer->data, cap);
+	if (!grown) {
+	    abort();
+	}
+	buffer->data = grown;
+	buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void
+BufferConsume(Buffer* buffer, size_t length) {
+    memmove(buffer->data, buffer->data + length, buffer->length - length);
+    buffer->length -= length;
+}
+
+static void
+BufferText(Buffer* buffer, const char* text) {
+    BufferAppend(buffer, text, strlen(text));
+}
+
+static void
+BufferFree(Buffer* buffer) {
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+static void
+AddRow(Sink* sink, double time, double temperature, double pressure) {
+    Row row = { (int64_t)floor(time), temperature, pressure };
+    BufferAppend(&sink->pending, &row, sizeof(row));
+}
+
+static int
+ValidDevice(const char* id, size_t length) {
+    if (length == 0 || length > DEVICE_ID_MAX) return 0;
+    for (size_t i = 0; i < length; ++i) {
+	char c = id[i];
+	if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_')) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static uint32_t
+HashDevice(const char* id, size_t length) {
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < length; ++i) {
+	hash = (hash ^ (unsigned char)id[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* the rows already in the binary file, for range queries over history */
+static void
+LoadSeries(Sink* sink, const char* path) {
+    WdbFile wdb;
+    if (WdbOpen(&wdb, path) != 0) {
+	return;
+    }
+    for (uint64_t block = 0; block * wdb.blockRows < wdb.rowCount; ++block) {
+	uint64_t rows = wdb.rowCount - block * wdb.blockRows;
+	if (rows > wdb.blockRows) rows = wdb.blockRows;
+	SamplesAppend(&sink->series, WdbTimestamps(&wdb, block), WdbTemperatures(&wdb, block),
+		      WdbPressures(&wdb, block), rows);
+    }
+    WdbClose(&wdb);
+    sink->published = sink->series.count;
+}
+
+/* directory needs sizeof(DEVICES_DIR) + DEVICE_ID_MAX + 1 bytes */
+static void
+SinkDirectory(const Sink* sink, char* directory) {
+    if (sink->device[0]) {
+	sprintf(directory, DEVICES_DIR "/%s", sink->device);
+    } else {
+	strcpy(directory, ".");
+    }
+}
+
+/* the log's rows, into the sink's pending ones */
+static void
+KeepRows(void* user, const JournalRow* rows, size_t count) {
+    BufferAppend(user, rows, count * sizeof(Row));
+}
+
+/* cuts data.txt and data.wdb back to the log's checkpoint, see journal.h */
+static int
+CutBack(Sink* sink) {
+    const JournalHeader* checkpoint = &sink->journal.checkpoint;
+    struct stat info;
+    if (!sink->journal.haveCheckpoint) {
+	return 0;
+    }
+    if (fstat(sink->textFd, &info) != 0 ||
+	((uint64_t)info.st_size > checkpoint->textSize && ftruncate(sink->textFd, checkpoint->textSize) != 0)) {
+	return -1;
+    }
+    return WdbWriterTruncate(&sink->wdb, checkpoint->rowCount);
+}
+
+static Sink*
+OpenSink(const char* id, size_t length) {
+    Sink* sink = calloc(1, sizeof(Sink));
+    if (!sink) {
+	abort();
+    }
+    memcpy(sink->device, id, length);
+    char directory[sizeof(DEVICES_DIR) + DEVICE_ID_MAX + 1];
+    SinkDirectory(sink, directory);
+    if (length > 0) {
+	mkdir(DEVICES_DIR, 0755);
+	mkdir(directory, 0755);
+    }
+    char path[sizeof(directory) + 16];
+    snprintf(path, sizeof(path), "%s/data.txt", directory);
+    sink->textFd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (sink->textFd < 0) {
+	perror(path);
+	free(sink);
+	return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/data.wdb", directory);
+    if (SamplesInit(&sink->series, SERIES_MAX_ROWS) != 0) {
+	fprintf(stderr, "Can't reserve memory for %s\n", path);
+	close(sink->textFd);
+	free(sink);
+	return NULL;
+    }
+    if (WdbWriterOpen(&sink->wdb, path) != 0) {
+	perror(path);
+	SamplesFree(&sink->series);
+	close(sink->textFd);
+	free(sink);
+	return NULL;
+    }
+    /* the files go back to the checkpoint before anything reads them, the
+     * log's rows are appended again by FindSink */
+    char logPath[sizeof(directory) + 16];
+    snprintf(logPath, sizeof(logPath), "%s/" JOURNAL_FILE, directory);
+    if (JournalOpen(&sink->journal, logPath, KeepRows, &sink->pending) != 0 || CutBack(sink) != 0) {
+	perror(logPath);
+	JournalClose(&sink->journal);
+	WdbWriterClose(&sink->wdb);
+	SamplesFree(&sink->series);
+	close(sink->textFd);
+	BufferFree(&sink->pending);
+	free(sink);
+	return NULL;
+    }
+    LoadSeries(sink, path);
+    HistoryOpen(&sink->history, path);
+    return sink;
+}
+
+static void
+CloseSink(Sink* sink) {
+    HistoryClose(&sink->history);
+    SamplesFree(&sink->series);
+    WdbWriterClose(&sink->wdb);
+    close(sink->textFd);
+    JournalClose(&sink->journal);
+    BufferFree(&sink->pending);
+    free(sink);
+}
+
+static void
+InsertSink(Sink** slots, size_t slotCount, Sink* sink) {
+    size_t i = HashDevice(sink->device, strlen(sink->device)) & (slotCount - 1);
+    while (slots[i]) i = (i + 1) & (slotCount - 1);
+    slots[i] = sink;
+}
+
+/* the device's sink if its files are open */
+static Sink*
+LookupSink(Ingest* ingest, const char* id, size_t length) {
+    size_t i = HashDevice(id, length) & (ingest->sinkSlots - 1);
+    for (Sink* sink; (sink = ingest->sinks[i]) != NULL; i = (i + 1) & (ingest->sinkSlots - 1)) {
+	if (strlen(sink->device) == length && memcmp(sink->device, id, length) == 0) {
+	    return sink;
+	}
+    }
+    return NULL;
+}
+
+/* writes the sink's rows this round to both of its files */
+static void
+WriteSink(Ingest* ingest, Sink* sink) {
+    size_t count = sink->pending.length / sizeof(Row);
+    const Row* rows = (const Row*)sink->pending.data;
+    ingest->lines.length = 0;
+    for (size_t i = 0; i < count; ++i) {
+	char stamp[20];
+	char line[64];
+	FormatTimestamp(rows[i].timestamp, stamp);
+	int length = snprintf(line, sizeof(line), "%s %5.2f %7.2f\n", stamp, rows[i].temperature, rows[i].pressure);
+	BufferAppend(&ingest->lines, line, length);
+	WdbAppend(&sink->wdb, rows[i].timestamp, rows[i].temperature, rows[i].pressure);
+    }
+    size_t written = 0;
+    while (written < ingest->lines.length) {
+	ssize_t n = write(sink->textFd, ingest->lines.data + written, ingest->lines.length - written);
+	if (n < 0 && errno == EINTR) continue;
+	if (n <= 0) {
+	    fprintf(stderr, "data.txt of %s: %s\n", sink->device[0] ? sink->device : "default", strerror(errno));
+	    break;
+	}
+	written += n;
+    }
+    if (WdbFlush(&sink->wdb) != 0) {
+	fprintf(stderr, "data.wdb of %s: %s\n", sink->device[0] ? sink->device : "default", strerror(errno));
+    }
+    /* and to the columns in memory */
+    for (size_t i = 0; i < count; ) {
+	int64_t timestamp[256];
+	double temperature[256], pressure[256];
+	size_t chunk = 0;
+	for (; chunk < 256 && i < count; ++chunk, ++i) {
+	    timestamp[chunk] = rows[i].timestamp;
+	    temperature[chunk] = rows[i].temperature;
+	    pressure[chunk] = rows[i].pressure;
+	}
+	SamplesAppend(&sink->series, timestamp, temperature, pressure, chunk);
+    }
+    sink->pending.length = 0;
+}
+
+/* Syncs data.txt and data.wdb and starts the log over, see journal.h.
+ * Returns 0 on success. */
+static int
+CheckpointSink(Sink* sink) {
+    struct stat info;
+    if (WdbFlush(&sink->wdb) != 0 || fdatasync(sink->textFd) != 0 || fdatasync(sink->wdb.fd) != 0 ||
+	fstat(sink->textFd, &info) != 0 || JournalCheckpoint(&sink->journal, info.st_size, sink->wdb.rowCount) != 0) {
+	fprintf(stderr, "Checkpoint of %s failed: %s\n", sink->device[0] ? sink->device : "default", strerror(errno));
+	return -1;
+    }
+    sink->dirty = 0;
+    return 0;
+}
+
+/* appends what the log had when the sink was opened, then checkpoints */
+static int
+RecoverSink(Ingest* ingest, Sink* sink) {
+    const Journal* journal = &sink->journal;
+    if (journal->recovered > 0 || journal->cut > 0) {
+	printf("%s: %llu rows recovered from the log, %llu bytes of torn tail dropped\n",
+	       sink->device[0] ? sink->device : "default", (unsigned long long)journal->recovered,
+	       (unsigned long long)journal->cut);
+	fflush(stdout);
+    }
+    if (sink->pending.length > 0) {
+	WriteSink(ingest, sink);
+    }
+    return CheckpointSink(sink);
+}
+
+/* the device's sink, opening its files the first time, NULL if they can't be */
+static Sink*
+FindSink(Ingest* ingest, const char* id, size_t length) {
+    Sink* sink = LookupSink(ingest, id, length);
+    if (sink) {
+	return sink;
+    }
+    sink = OpenSink(id, length);
+    if (!sink) {
+	return NULL;
+    }
+    if (RecoverSink(ingest, sink) != 0) {
+	CloseSink(sink);
+	return NULL;
+    }
+    if (2 * (ingest->sinkCount + 1) > ingest->sinkSlots) {
+	size_t slotCount = ingest->sinkSlots * 2;
+	Sink** slots = calloc(slotCount, sizeof(Sink*));
+	if (!slots) {
+	    abort();
+	}
+	for (size_t s = 0; s < ingest->sinkSlots; ++s) {
+	    if (ingest->sinks[s]) InsertSink(slots, slotCount, ingest->sinks[s]);
+	}
+	free(ingest->sinks);
+	ingest->sinks = slots;
+	ingest->sinkSlots = slotCount;
+    }
+    InsertSink(ingest->sinks, ingest->sinkSlots, sink);
+    ++ingest->sinkCount;
+    /* devices with history are opened at start */
+    if (length > 0 && sink->series.count == 0) {
+	printf("New device %s\n", sink->device);
+	fflush(stdout);
+    }
+    return sink;
+}
+
+static uint32_t
+U32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static float
+F32(const unsigned char* p) {
+    uint32_t bits = U32(p);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* "TT.TT PPPP.PP", new boards add the capture time as epoch seconds */
+static const char*
+DecodeText(Sink* sink, const char* body, size_t length, double arrival) {
+    char text[128];
+    if (length >= sizeof(text)) {
+	return "body too long";
+    }
+    memcpy(text, body, length);
+    text[length] = '\0';
+    double temperature, pressure;
+    long long captured;
+    char extra;
+    int fields = sscanf(text, "%lf %lf %lld %c", &temperature, &pressure, &captured, &extra);
+    if (fields == 2) {
+	AddRow(sink, arrival, temperature, pressure);
+    } else if (fields == 3) {
+	AddRow(sink, (double)captured, temperature, pressure);
+    } else {
+	return "expected temperature and pressure";
+    }
+    return NULL;
+}
+
+/* returns NULL or what is wrong with the batch */
+static const char*
+DecodeBatch(Sink* sink, const unsigned char* body, size_t length, double arrival) {
+    if (length >= 3 && body[0] == 'W' && body[1] == 'B' && body[2] == 3) {
+	if (length < PACKED_HEADER_SIZE) {
+	    return "batch too short";
+	}
+	int flags = body[3];
+	size_t count = body[4] | body[5] << 8;
+	uint32_t bootEpoch = U32(body + 6);
+	uint32_t uptime = U32(body + 10);
+	if (length != PACKED_HEADER_SIZE + count * PACKED_SAMPLE_SIZE) {
+	    return "batch length does not match count";
+	}
+	for (size_t i = 0; i < count; ++i) {
+	    const unsigned char* p = body + PACKED_HEADER_SIZE + i * PACKED_SAMPLE_SIZE;
+	    uint64_t bits = 0;
+	    for (int b = 0; b < PACKED_SAMPLE_SIZE; ++b) bits |= (uint64_t)p[b] << (8 * b);
+	    uint32_t capturedLow = bits & (SAMPLE_TIME_RANGE - 1);
+	    int centiDegrees = (bits >> 17) & 0x3FFF;
+	    if (centiDegrees & 0x2000) centiDegrees -= 0x4000;
+	    double pressure = ((bits >> 31) & 0x1FFFF) / 100.0;
+	    uint32_t age = (uptime - capturedLow) & (SAMPLE_TIME_RANGE - 1);
+	    double time = flags & BATCH_ANCHORED ? (double)bootEpoch + uptime - age : arrival - age;
+	    AddRow(sink, time, centiDegrees / 100.0, pressure);
+	}
+	return NULL;
+    }
+
+    if (length < BATCH_HEADER_SIZE) {
+	return "batch too short";
+    }
+    int version = body[2];
+    int flags = body[3];
+    size_t count = body[4] | body[5] << 8;
+    uint32_t clock = U32(body + 6);
+    if (body[0] != 'W' || body[1] != 'B' || (version != 1 && version != 2)) {
+	return "unknown batch format";
+    }
+    if (length != BATCH_HEADER_SIZE + count * BATCH_SAMPLE_SIZE) {
+	return "batch length does not match count";
+    }
+    for (size_t i = 0; i < count; ++i) {
+	const unsigned char* p = body + BATCH_HEADER_SIZE + i * BATCH_SAMPLE_SIZE;
+	uint32_t capturedAt = U32(p);
+	double time;
+	if (version == 1) {
+	    time = arrival - (uint32_t)(clock - capturedAt) / 1000.0; /* millis() wraps every 49 days */
+	} else if (flags & BATCH_ANCHORED) {
+	    time = (double)clock + capturedAt;
+	} else {
+	    time = arrival - ((double)clock - capturedAt);
+	}
+	AddRow(sink, time, F32(p + 4), F32(p + 8));
+    }
+    return NULL;
+}
+
+/* what is held goes out after the commit */
+static void
+Hold(Ingest* ingest, Connection* connection) {
+    if (!connection->waiting) {
+	connection->waiting = 1;
+	connection->nextWaiting = ingest->waiting;
+	ingest->waiting = connection;
+    }
+}
+
+static void
+Reply(Ingest* ingest, Connection* connection, int status, const char* reason, const char* type,
+      const char* body, size_t length) {
+    char head[256];
+    int headLength = snprintf(head, sizeof(head),
+			      "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s\r\n",
+			      status, reason, type, length, connection->closeAfter ? "Connection: close\r\n" : "");
+    BufferAppend(&connection->held, head, headLength);
+    BufferAppend(&connection->held, body, length);
+    Hold(ingest, connection);
+}
+
+static void
+Answer(Ingest* ingest, Connection* connection, int status, const char* reason, const char* text) {
+    Reply(ingest, connection, status, reason, "text/plain", text, strlen(text));
+}
+
+static void
+BufferPrintf(Buffer* buffer, const char* format, ...) {
+    char text[256];
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+    BufferAppend(buffer, text, length < (int)sizeof(text) ? (size_t)length : sizeof(text) - 1);
+}
+
+/* copies the value of name in the query string, 0 if it isn't there or doesn't fit */
+static int
+QueryValue(const char* query, const char* name, char* value, size_t size) {
+    size_t nameLength = strlen(name);
+    for (const char* field = query; *field; ) {
+	const char* end = strchr(field, '&');
+	if (!end) end = field + strlen(field);
+	if ((size_t)(end - field) > nameLength && field[nameLength] == '=' && strncmp(field, name, nameLength) == 0) {
+	    size_t length = end - field - nameLength - 1;
+	    if (length >= size) return 0;
+	    memcpy(value, field + nameLength + 1, length);
+	    value[length] = '\0';
+	    return 1;
+	}
+	field = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+static void
+ServeIndex(Ingest* ingest, Connection* connection) {
+    int fd = open(INDEX_FILE, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+	if (fd >= 0) close(fd);
+	Answer(ingest, connection, 404, "Not Found", "no " INDEX_FILE);
+	return;
+    }
+    Buffer page = { 0 };
+    char chunk[READ_SIZE];
+    ssize_t got;
+    while ((got = read(fd, chunk, sizeof(chunk))) > 0) {
+	BufferAppend(&page, chunk, got);
+    }
+    close(fd);
+    Reply(ingest, connection, 200, "OK", "text/html; charset=utf-8", page.data, page.length);
+    BufferFree(&page);
+}
+
+/* The first second of a sink's history, rolled up or raw, and one past
+ * the last. Returns 0 if it has none */
+static int
+SinkSpan(Sink* sink, int64_t* first, int64_t* end) {
+    const Samples* series = &sink->series;
+    HistoryRefresh(&sink->history);
+    *first = HistoryFirst(&sink->history);
+    *end = INT64_MIN;
+    for (int k = 0; k < ROLLUP_TIERS; ++k) {
+	const RollupFile* tier = &sink->history.tier[k];
+	if (sink->history.open[k] && tier->count > 0) {
+	    int64_t tierEnd = RollupBuckets(tier)[tier->count - 1].start + tier->period;
+	    if (tierEnd > *end) *end = tierEnd;
+	}
+    }
+    if (series->count > 0) {
+	if (series->timestamp[0] < *first) *first = series->timestamp[0];
+	*end = series->latest[series->timeIndex.count - 1] + 1;
+    }
+    return *end > *first;
+}
+
+/* GET /devices, every device with its raw rows and the time its history spans */
+static void
+ListDevices(Ingest* ingest, Connection* connection) {
+    Buffer json = { 0 };
+    BufferText(&json, "[");
+    int first = 1;
+    for (size_t s = 0; s < ingest->sinkSlots; ++s) {
+	Sink* sink = ingest->sinks[s];
+	if (!sink) continue;
+	BufferPrintf(&json, "%s{\"device\":\"%s\",\"rows\":%zu", first ? "" : ",", sink->device,
+		     sink->series.count);
+	int64_t start, end;
+	if (SinkSpan(sink, &start, &end)) {
+	    BufferPrintf(&json, ",\"first\":%lld,\"last\":%lld", (long long)start, (long long)end - 1);
+	}
+	BufferText(&json, "}");
+	first = 0;
+    }
+    BufferText(&json, "]");
+    Reply(ingest, connection, 200, "OK", "application/json", json.data, json.length);
+    BufferFree(&json);
+}
+
+static void
+AppendValues(Buffer* json, const char* name, const Summary* summaries, int points, int which,
+	     const Pyramid* pyramid) {
+    BufferPrintf(json, "\"%s\":[", name);
+    for (int i = 0; i < points; ++i) {
+	const Summary* s = &summaries[i];
+	const char* comma = i ? "," : "";
+	if (s->count == 0) {
+	    BufferPrintf(json, "%snull", comma);
+	} else {
+	    BufferPrintf(json, "%s%.2f", comma, which == 0 ? s->min : which == 1 ? s->max : SummaryMean(pyramid, *s));
+	}
+    }
+    BufferText(json, "]");
+}
+
+/* GET /range?device=&from=&to=&points=
+ * The time from..to cut into points equal stretches, with the rows, min,
+ * max and mean of both channels in each, null where there are no rows.
+ * Each stretch costs two time index lookups and two pyramid queries
+ * however many rows it covers, so months of history are as cheap as an
+ * hour, and every viewer reads the same pyramids. Stretches before the
+ * first raw row come from the coarsest rollup tier that fits, a few
+ * buckets each. */
+static void
+AnswerRange(Ingest* ingest, Connection* connection, Sink* sink, const char* query) {
+    const Samples* series = &sink->series;
+    int64_t from = 0;
+    int64_t to = 0;
+    int64_t first, end;
+    int any = SinkSpan(sink, &first, &end);
+    if (any) {
+	from = first;
+	to = end;
+    }
+    int points = 500;
+    char value[32];
+    if (QueryValue(query, "from", value, sizeof(value))) from = strtoll(value, NULL, 10);
+    if (QueryValue(query, "to", value, sizeof(value))) to = strtoll(value, NULL, 10);
+    if (QueryValue(query, "points", value, sizeof(value))) points = atoi(value);
+    if (points < 1) points = 1;
+    if (points > RANGE_MAX_POINTS) points = RANGE_MAX_POINTS;
+    if (to <= from) {
+	Answer(ingest, connection, 400, "Bad Request", "empty range");
+	return;
+    }
+
+    Summary* temperature = malloc(2 * points * sizeof(Summary));
+    if (!temperature) {
+	abort();
+    }
+    Summary* pressure = temperature + points;
+    Buffer json = { 0 };
+    BufferPrintf(&json, "{\"device\":\"%s\",\"from\":%lld,\"to\":%lld,\"points\":%d,\"count\":[",
+		 sink->device, (long long)from, (long long)to, points);
+    /* the raw rows take over on the minute of the first one */
+    int64_t rawStart = series->count > 0 ? series->timestamp[0] / 60 * 60 : INT64_MAX;
+    /* from and to are anything strtoll returns, so the stretches are cut in
+     * 128 bits and then clamped to the sink's span, where every lookup is
+     * in range, a stretch outside it stays empty */
+    __int128 span = (__int128)to - from;
+    int64_t step = span / points > INT64_MAX ? INT64_MAX : (int64_t)(span / points);
+    for (int i = 0; i < points; ++i) {
+	__int128 low128 = from + span * i / points;
+	__int128 high128 = from + span * (i + 1) / points;
+	temperature[i] = pressure[i] = EmptySummary();
+	if (!any || high128 <= first || low128 >= end) {
+	    BufferPrintf(&json, "%s0", i ? "," : "");
+	    continue;
+	}
+	int64_t start = low128 < first ? first : (int64_t)low128;
+	int64_t stop = high128 > end ? end : (int64_t)high128;
+	if (start < rawStart) {
+	    HistoryQuery(&sink->history, start, stop < rawStart ? stop : rawStart, step, series->temperatureLod.shift,
+			 series->pressureLod.shift, &temperature[i], &pressure[i]);
+	    start = rawStart;
+	}
+	size_t low = start < stop ? SamplesFind(series, start) : 0;
+	size_t high = start < stop ? SamplesFind(series, stop) : 0;
+	if (high > low) {
+	    Summary t = SamplesTemperature(series, low, high);
+	    Summary p = SamplesPressure(series, low, high);
+	    MergeSummary(&temperature[i], &t);
+	    MergeSummary(&pressure[i], &p);
+	}
+	BufferPrintf(&json, "%s%zu", i ? "," : "", temperature[i].count);
+    }
+    BufferText(&json, "],\"temperature\":{");
+    AppendValues(&json, "min", temperature, points, 0, &series->temperatureLod);
+    BufferText(&json, ",");
+    AppendValues(&json, "max", temperature, points, 1, &series->temperatureLod);
+    BufferText(&json, ",");
+    AppendValues(&json, "mean", temperature, points, 2, &series->temperatureLod);
+    BufferText(&json, "},\"pressure\":{");
+    AppendValues(&json, "min", pressure, points, 0, &series->pressureLod);
+    BufferText(&json, ",");
+    AppendValues(&json, "max", pressure, points, 1, &series->pressureLod);
+    BufferText(&json, ",");
+    AppendValues(&json, "mean", pressure, points, 2, &series->pressureLod);
+    BufferText(&json, "}}");
+    Reply(ingest, connection, 200, "OK", "application/json", json.data, json.length);
+    BufferFree(&json);
+    free(temperature);
+}
+
+/* GET /stream?device= stays open as an event stream, see Publish */
+static void
+StartStream(Ingest* ingest, Connection* connection, Sink* sink) {
+    const char* head = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n";
+    BufferAppend(&connection->held, head, strlen(head));
+    Hold(ingest, connection);
+    connection->stream = sink;
+    connection->nextViewer = sink->viewers;
+    sink->viewers = connection;
+    ++ingest->viewers;
+}
+
+static void
+AppendLatency(Buffer* json, const char* name, const Latency* interval, const Latency* total) {
+    Latency all = *total;
+    LatencyMerge(&all, interval);
+    BufferPrintf(json, ",\"%s\":{\"count\":%llu,\"mean\":%.4f,\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f}",
+		 name, (unsigned long long)all.count, LatencyMean(&all), LatencyQuantile(&all, 0.5),
+		 LatencyQuantile(&all, 0.9), LatencyQuantile(&all, 0.99), all.max);
+}
+
+/* GET /stats, latencies in ms */
+static void
+AnswerStats(Ingest* ingest, Connection* connection) {
+    Buffer json = { 0 };
+    BufferPrintf(&json, "{\"uptime\":%.1f,\"connections\":%d,\"viewers\":%d,\"devices\":%zu,"
+		 "\"requests\":%llu,\"rows\":%llu,\"commits\":%llu,\"fsyncs\":%llu,"
+		 "\"requests_per_second\":%.1f,\"rows_per_second\":%.1f",
+		 Now() - ingest->started, ingest->connections, ingest->viewers, ingest->sinkCount,
+		 (unsigned long long)(ingest->totalRequests + ingest->requests),
+		 (unsigned long long)(ingest->totalRows + ingest->rows),
+		 (unsigned long long)(ingest->totalCommits + ingest->commits),
+		 (unsigned long long)(ingest->totalSyncs + ingest->syncs), ingest->requestRate, ingest->rowRate);
+    AppendLatency(&json, "write_ms", &ingest->writeLatency, &ingest->totalWriteLatency);
+    AppendLatency(&json, "fsync_ms", &ingest->syncLatency, &ingest->totalSyncLatency);
+    BufferText(&json, "}");
+    Reply(ingest, connection, 200, "OK", "application/json", json.data, json.length);
+    BufferFree(&json);
+}
+
+static void
+HandleGet(Ingest* ingest, Connection* connection, char* path) {
+    char* query = strchr(path, '?');
+    if (query) {
+	*query++ = '\0';
+    } else {
+	query = path + strlen(path);
+    }
+    if (strcmp(path, "/") == 0 || strcmp(path, "/" INDEX_FILE) == 0) {
+	ServeIndex(ingest, connection);
+	return;
+    }
+    if (strcmp(path, "/devices") == 0) {
+	ListDevices(ingest, connection);
+	return;
+    }
+    if (strcmp(path, "/stats") == 0) {
+	AnswerStats(ingest, connection);
+	return;
+    }
+    if (strcmp(path, "/range") != 0 && strcmp(path, "/stream") != 0) {
+	Answer(ingest, connection, 404, "Not Found", "not found");
+	return;
+    }
+    /* no device is the boards without an ID */
+    char device[DEVICE_ID_MAX + 1] = "";
+    Sink* sink = NULL;
+    if (!QueryValue(query, "device", device, sizeof(device)) || device[0] == '\0' ||
+	ValidDevice(device, strlen(device))) {
+	sink = LookupSink(ingest, device, strlen(device));
+    }
+    if (!sink) {
+	Answer(ingest, connection, 404, "Not Found", "no such device");
+    } else if (strcmp(path, "/range") == 0) {
+	AnswerRange(ingest, connection, sink, query);
+    } else {
+	StartStream(ingest, connection, sink);
+    }
+}
+
+/* the value of header name in the header block, NULL if it isn't there */
+static const char*
+FindHeader(const char* headers, const char* end, const char* name, size_t* length) {
+    size_t nameLength = strlen(name);
+    const char* line = headers;
+    while (line < end) {
+	const char* lineEnd = memmem(line, end - line, "\r\n", 2);
+	if (!lineEnd) lineEnd = end;
+	if ((size_t)(lineEnd - line) > nameLength && line[nameLength] == ':' &&
+	    strncasecmp(line, name, nameLength) == 0) {
+	    const char* value = line + nameLength + 1;
+	    while (value < lineEnd && (*value == ' ' || *value == '\t')) ++value;
+	    *length = lineEnd - value;
+	    return value;
+	}
+	line = lineEnd + 2;
+    }
+    return NULL;
+}
+
+/* Handles every complete request in the input, returns -1 if the
+ * connection has to be dropped without an answer */
+static int
+HandleInput(Ingest* ingest, Connection* connection) {
+    while (!connection->closeAfter && !connection->stream) {
+	Buffer* in = &connection->in;
+	char* headerEnd = memmem(in->data, in->length, "\r\n\r\n", 4);
+	if (!headerEnd) {
+	    if (in->length > MAX_HEADER) {
+		connection->closeAfter = 1;
+		Answer(ingest, connection, 431, "Request Header Fields Too Large", "header too large");
+	    }
+	    return 0;
+	}
+	size_t headerLength = headerEnd + 4 - in->data;
+
+	/* request line */
+	char requestLine[128];
+	const char* lineEnd = memmem(in->data, headerLength, "\r\n", 2);
+	size_t lineLength = lineEnd - in->data < (long)sizeof(requestLine) ? (size_t)(lineEnd - in->data) : sizeof(requestLine) - 1;
+	memcpy(requestLine, in->data, lineLength);
+	requestLine[lineLength] = '\0';
+	char method[8];
+	char path[128];
+	int minor = 0;
+	if (sscanf(requestLine, "%7s %127s HTTP/1.%d", method, path, &minor) != 3) {
+	    connection->closeAfter = 1;
+	    Answer(ingest, connection, 400, "Bad Request", "bad request line");
+	    return 0;
+	}
+	const char* headers = lineEnd + 2;
+	size_t valueLength;
+	const char* value = FindHeader(headers, headerEnd, "Connection", &valueLength);
+	int keepAlive = minor >= 1;
+	if (value && valueLength == 5 && strncasecmp(value, "close", 5) == 0) keepAlive = 0;
+	if (value && valueLength == 10 && strncasecmp(value, "keep-alive", 10) == 0) keepAlive = 1;
+	size_t contentLength = 0;
+	value = FindHeader(headers, headerEnd, "Content-Length", &valueLength);
+	if (value) {
+	    contentLength = strtoull(value, NULL, 10);
+	} else if (FindHeader(headers, headerEnd, "Transfer-Encoding", &valueLength)) {
+	    connection->closeAfter = 1;
+	    Answer(ingest, connection, 411, "Length Required", "Content-Length required");
+	    return 0;
+	}
+	if (contentLength > MAX_BODY) {
+	    connection->closeAfter = 1;
+	    Answer(ingest, connection, 413, "Payload Too Large", "body too large");
+	    return 0;
+	}
+	if (in->length < headerLength + contentLength) {
+	    return 0; /* the rest of the body is on its way */
+	}
+
+	const char* body = in->data + headerLength;
+	connection->closeAfter = !keepAlive;
+	++ingest->requests;
+	/* boards without an ID go to the files in the directory itself */
+	size_t deviceLength = 0;
+	const char* device = FindHeader(headers, headerEnd, "X-Device-Id", &deviceLength);
+	Sink* sink = NULL;
+	if (strcmp(method, "GET") == 0) {
+	    HandleGet(ingest, connection, path);
+	} else if (strcmp(method, "POST") != 0) {
+	    Answer(ingest, connection, 501, "Not Implemented", "only GET and POST are supported");
+	} else if (device && !ValidDevice(device, deviceLength)) {
+	    Answer(ingest, connection, 400, "Bad Request", "bad device id");
+	} else if ((sink = FindSink(ingest, device ? device : "", deviceLength)) == NULL) {
+	    Answer(ingest, connection, 500, "Internal Server Error", "can't open the device's files");
+	} else {
+	    double arrival = WallClock();
+	    size_t before = sink->pending.length;
+	    const char* error = strcmp(path, "/batch") == 0 ?
+		DecodeBatch(sink, (const unsigned char*)body, contentLength, arrival) :
+		DecodeText(sink, body, contentLength, arrival);
+	    if (error) {
+		sink->pending.length = before; /* all of a batch or nothing */
+		fprintf(stderr, "Bad upload: %s\n", error);
+		Answer(ingest, connection, 400, "Bad Request", error);
+	    } else {
+		Answer(ingest, connection, 200, "OK", strcmp(path, "/batch") == 0 ?
+		       "Batch received and saved successfully" : "Data received and saved successfully");
+		connection->fed = connection->uploads++ == 0 || connection->fed == sink ? sink : NULL;
+		if (!sink->queued && sink->pending.length > 0) {
+		    sink->queued = 1;
+		    sink->nextQueued = ingest->queued;
+		    ingest->queued = sink;
+		}
+	    }
+	}
+	BufferConsume(in, headerLength + contentLength);
+    }
+    return 0;
+}
+
+static void
+CloseConnection(Ingest* ingest, Connection* connection) {
+    if (connection->stream) {
+	Connection** link = &connection->stream->viewers;
+	while (*link != connection) link = &(*link)->nextViewer;
+	*link = connection->nextViewer;
+	--ingest->viewers;
+    }
+    epoll_ctl(ingest->epollFd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    BufferFree(&connection->in);
+    BufferFree(&connection->out);
+    BufferFree(&connection->held);
+    free(connection);
+    --ingest->connections;
+}
+
+/* sends what the socket takes, returns -1 if the peer is gone */
+static int
+Flush(Ingest* ingest, Connection* connection) {
+    while (connection->out.length > 0) {
+	ssize_t sent = send(connection->fd, connection->out.data, connection->out.length, MSG_NOSIGNAL);
+	if (sent < 0) {
+	    if (errno == EINTR) continue;
+	    if (errno != EAGAIN) return -1;
+	    break;
+	}
+	BufferConsume(&connection->out, sent);
+    }
+    /* nothing more is read from a connection that is closing */
+    struct epoll_event event = { connection->closeAfter ? 0 : EPOLLIN | EPOLLRDHUP, { .ptr = connection } };
+    if (connection->out.length > 0) event.events |= EPOLLOUT;
+    epoll_ctl(ingest->epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+    return 0;
+}
+
+/* returns 0 once the sink's log is on disk */
+static int
+SyncSink(Ingest* ingest, Sink* sink) {
+    double start = Now();
+    int result = JournalSync(&sink->journal);
+    LatencyAdd(&ingest->syncLatency, (Now() - start) * 1000);
+    if (result == 0) {
+	sink->dirty = 0;
+    }
+    ++ingest->syncs;
+    return result;
+}
+
+/* every sink written since the last sync */
+static void
+Sync(Ingest* ingest) {
+    for (size_t s = 0; s < ingest->sinkSlots; ++s) {
+	if (ingest->sinks[s] && ingest->sinks[s]->dirty) SyncSink(ingest, ingest->sinks[s]);
+    }
+    ingest->dirty = 0;
+    ingest->lastSync = Now();
+}
+
+/* Sends the sink's new rows to everyone following it, formatted once as
+ * data: {"time":[...],"temperature":[...],"pressure":[...]}
+ * A viewer whose stream hasn't started yet gets it after its header. */
+static void
+Publish(Ingest* ingest, Sink* sink) {
+    const Samples* series = &sink->series;
+    if (!sink->viewers || sink->published == series->count) {
+	sink->published = series->count;
+	return;
+    }
+    Buffer* event = &ingest->lines;
+    event->length = 0;
+    BufferText(event, "data: {\"time\":[");
+    for (size_t i = sink->published; i < series->count; ++i) {
+	BufferPrintf(event, "%s%lld", i > sink->published ? "," : "", (long long)series->timestamp[i]);
+    }
+    BufferText(event, "],\"temperature\":[");
+    for (size_t i = sink->published; i < series->count; ++i) {
+	BufferPrintf(event, "%s%.2f", i > sink->published ? "," : "", series->temperature[i]);
+    }
+    BufferText(event, "],\"pressure\":[");
+    for (size_t i = sink->published; i < series->count; ++i) {
+	BufferPrintf(event, "%s%.2f", i > sink->published ? "," : "", series->pressure[i]);
+    }
+    BufferText(event, "]}\n\n");
+    sink->published = series->count;
+
+    Connection* viewer = sink->viewers;
+    while (viewer) {
+	Connection* next = viewer->nextViewer;
+	if (viewer->waiting) {
+	    BufferAppend(&viewer->held, event->data, event->length);
+	} else if (!viewer->closed) {
+	    BufferAppend(&viewer->out, event->data, event->length);
+	    if (Flush(ingest, viewer) != 0 || viewer->out.length > STREAM_BACKLOG) {
+		CloseConnection(ingest, viewer);
+	    }
+	}
+	viewer = next;
+    }
+}
+
+/* a comment line now and then, so proxies don't time the stream out */
+static void
+PingViewers(Ingest* ingest) {
+    for (size_t s = 0; s < ingest->sinkSlots; ++s) {
+	Sink* sink = ingest->sinks[s];
+	if (!sink) continue;
+	Connection* viewer = sink->viewers;
+	while (viewer) {
+	    Connection* next = viewer->nextViewer;
+	    if (!viewer->waiting && !viewer->closed) {
+		BufferText(&viewer->out, ":\n\n");
+		if (Flush(ingest, viewer) != 0) CloseConnection(ingest, viewer);
+	    }
+	    viewer = next;
+	}
+    }
+}
+
+/* writes the round's rows, syncs by policy, then answers */
+static void
+Commit(Ingest* ingest) {
+    /* the round's sinks stay queued until the answers, which look up
+     * whether the sink they fed failed */
+    Sink* queued = ingest->queued;
+    if (queued) {
+	Sink* sink = queued;
+	double writing = 0; /* the viewers' time isn't the writers' */
+	while (sink) {
+	    Sink* next = sink->nextQueued;
+	    double start = Now();
+	    size_t count = sink->pending.length / sizeof(Row);
+	    int logged = JournalAppend(&sink->journal, (const Row*)sink->pending.data, count) == 0;
+	    if (logged) {
+		sink->dirty = 1;
+	    }
+	    if (logged && ingest->syncPolicy == SYNC_ALWAYS) {
+		logged = SyncSink(ingest, sink) == 0;
+	    }
+	    if (!logged) {
+		fprintf(stderr, "data.log of %s: %s\n", sink->device[0] ? sink->device : "default", strerror(errno));
+		sink->pending.length = 0; /* the boards send them again */
+		sink->failed = 1;
+		ingest->failed = 1;
+	    } else {
+		WriteSink(ingest, sink);
+		ingest->rows += count;
+		if (sink->journal.size >= JOURNAL_CHECKPOINT_SIZE) {
+		    CheckpointSink(sink);
+		}
+	    }
+	    writing += Now() - start;
+	    Publish(ingest, sink);
+	    sink = next;
+	}
+	LatencyAdd(&ingest->writeLatency, writing * 1000);
+	++ingest->commits;
+	ingest->dirty = ingest->syncPolicy != SYNC_ALWAYS;
+    }
+    if (ingest->dirty && ingest->syncPolicy > 0 && (Now() - ingest->lastSync) * 1000 >= ingest->syncPolicy) {
+	Sync(ingest);
+    }
+
+    Connection* connection = ingest->waiting;
+    ingest->waiting = NULL;
+    while (connection) {
+	Connection* next = connection->nextWaiting;
+	connection->waiting = 0;
+	connection->nextWaiting = NULL;
+	/* one that fed several sinks is dropped if any failed, its answers
+	 * are in one buffer */
+	if (connection->uploads > 0 && (connection->fed ? connection->fed->failed : ingest->failed)) {
+	    connection->closed = 1; /* no answer rather than a wrong one */
+	} else {
+	    BufferAppend(&connection->out, connection->held.data, connection->held.length);
+	}
+	connection->held.length = 0;
+	connection->uploads = 0;
+	connection->fed = NULL;
+	if (connection->closed || Flush(ingest, connection) != 0 ||
+	    (connection->closeAfter && connection->out.length == 0)) {
+	    CloseConnection(ingest, connection);
+	}
+	connection = next;
+    }
+    ingest->queued = NULL;
+    while (queued) {
+	Sink* next = queued->nextQueued;
+	queued->queued = 0;
+	queued->failed = 0;
+	queued->nextQueued = NULL;
+	queued = next;
+    }
+    ingest->failed = 0;
+}
+
+static void
+Accept(Ingest* ingest) {
+    for (;;) {
+	int fd = accept4(ingest->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+	    if (errno == EINTR) continue;
+	    if (errno != EAGAIN) perror("accept");
+	    return;
+	}
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)); /* boards that vanish */
+	Connection* connection = calloc(1, sizeof(Connection));
+	if (!connection) {
+	    close(fd);
+	    continue;
+	}
+	connection->fd = fd;
+	struct epoll_event event = { EPOLLIN | EPOLLRDHUP, { .ptr = connection } };
+	if (epoll_ctl(ingest->epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+	    close(fd);
+	    free(connection);
+	    continue;
+	}
+	++ingest->connections;
+    }
+}
+
+static void
+Readable(Ingest* ingest, Connection* connection) {
+    char chunk[READ_SIZE];
+    for (;;) {
+	ssize_t got = recv(connection->fd, chunk, sizeof(chunk), 0);
+	if (got > 0) {
+	    /* a viewer has nothing more to say */
+	    if (!connection->closeAfter && !connection->stream) BufferAppend(&connection->in, chunk, got);
+	    if (connection->in.length > MAX_HEADER + MAX_BODY) break;
+	    continue;
+	}
+	if (got < 0 && errno == EINTR) continue;
+	if (got < 0 && errno == EAGAIN) break;
+	if (got == 0) {
+	    /* the client is done sending, it still gets its answers */
+	    HandleInput(ingest, connection);
+	    connection->closeAfter = 1;
+	    if (connection->waiting) {
+		Flush(ingest, connection); /* stop reading until the commit */
+	    } else if (connection->out.length == 0) {
+		CloseConnection(ingest, connection);
+	    }
+	    return;
+	}
+	connection->closed = 1;
+	if (!connection->waiting) CloseConnection(ingest, connection);
+	return;
+    }
+    HandleInput(ingest, connection);
+}
+
+static int
+Listen(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static void*
+CompactThread(void* user) {
+    Compactor* compactor = user;
+    pthread_mutex_lock(&compactor->lock);
+    for (;;) {
+	while (!compactor->quit && (!compactor->sink || compactor->prepared)) {
+	    pthread_cond_wait(&compactor->wake, &compactor->lock);
+	}
+	if (compactor->quit) {
+	    break;
+	}
+	pthread_mutex_unlock(&compactor->lock);
+	int result = CompactPrepare(&compactor->compaction, compactor->directory, compactor->rawSeconds);
+	pthread_mutex_lock(&compactor->lock);
+	compactor->failed = result != 0;
+	compactor->prepared = 1;
+    }
+    pthread_mutex_unlock(&compactor->lock);
+    return NULL;
+}
+
+static int
+StartCompactor(Compactor* compactor, int64_t rawSeconds) {
+    compactor->rawSeconds = rawSeconds;
+    compactor->due = Now() + 60; /* not in the way of the start */
+    pthread_mutex_init(&compactor->lock, NULL);
+    pthread_cond_init(&compactor->wake, NULL);
+    return pthread_create(&compactor->thread, NULL, CompactThread, compactor);
+}
+
+/* waits for a compaction under way, and leaves the files as they were */
+static void
+StopCompactor(Compactor* compactor) {
+    pthread_mutex_lock(&compactor->lock);
+    compactor->quit = 1;
+    pthread_cond_signal(&compactor->wake);
+    pthread_mutex_unlock(&compactor->lock);
+    pthread_join(compactor->thread, NULL);
+    if (compactor->sink && !compactor->failed) {
+	CompactAbandon(&compactor->compaction);
+    }
+}
+
+/* the files were replaced, the rows in memory go back to what is left */
+static void
+ReopenSink(Sink* sink) {
+    char directory[sizeof(DEVICES_DIR) + DEVICE_ID_MAX + 1];
+    char path[sizeof(directory) + 16];
+    SinkDirectory(sink, directory);
+    snprintf(path, sizeof(path), "%s/data.txt", directory);
+    close(sink->textFd);
+    sink->textFd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (sink->textFd < 0) {
+	perror(path);
+    }
+    snprintf(path, sizeof(path), "%s/data.wdb", directory);
+    WdbWriterClose(&sink->wdb);
+    if (WdbWriterOpen(&sink->wdb, path) != 0) {
+	perror(path);
+    }
+    SamplesClear(&sink->series);
+    LoadSeries(sink, path);
+}
+
+/* Finishes the sink the thread prepared, then hands it the next one.
+ * Runs between commits, when every row is written. */
+static void
+Compact(Ingest* ingest) {
+    Compactor* compactor = &ingest->compactor;
+    pthread_mutex_lock(&compactor->lock);
+    Sink* sink = compactor->sink;
+    int prepared = compactor->prepared;
+    pthread_mutex_unlock(&compactor->lock);
+    if (sink && !prepared) {
+	return;
+    }
+    if (sink) {
+	Compaction* compaction = &compactor->compaction;
+	const char* name = sink->device[0] ? sink->device : "default";
+	int rewrite = compaction->rewrite;
+	double start = Now();
+	/* the files are synced before they are replaced, and the log's
+	 * checkpoint moves on to the new ones after */
+	if (!compactor->failed && rewrite && CheckpointSink(sink) != 0) {
+	    CompactAbandon(compaction);
+	    compactor->failed = 1;
+	}
+	if (compactor->failed || CompactFinish(compaction) != 0) {
+	    fprintf(stderr, "Compacting %s failed\n", name);
+	} else if (rewrite || compaction->buckets[0] > 0) {
+	    if (rewrite) {
+		ReopenSink(sink);
+		CheckpointSink(sink);
+	    }
+	    printf("%s: %zu minutes rolled up, %llu raw rows dropped, %.1f ms in the loop\n", name,
+		   compaction->buckets[0], (unsigned long long)compaction->droppedRows, (Now() - start) * 1000);
+	}
+	compactor->sink = NULL;
+    }
+    if (Now() < compactor->due) {
+	return;
+    }
+    while (compactor->nextSlot < ingest->sinkSlots && !ingest->sinks[compactor->nextSlot]) {
+	++compactor->nextSlot;
+    }
+    if (compactor->nextSlot >= ingest->sinkSlots) {
+	compactor->nextSlot = 0;
+	compactor->due = Now() + COMPACT_INTERVAL;
+	return;
+    }
+    sink = ingest->sinks[compactor->nextSlot++];
+    pthread_mutex_lock(&compactor->lock);
+    SinkDirectory(sink, compactor->directory);
+    compactor->sink = sink;
+    compactor->prepared = 0;
+    pthread_cond_signal(&compactor->wake);
+    pthread_mutex_unlock(&compactor->lock);
+}
+
+static void
+PrintStats(Ingest* ingest) {
+    double now = Now();
+    double seconds = now - ingest->lastStats;
+    ingest->requestRate = ingest->requests / seconds;
+    ingest->rowRate = ingest->rows / seconds;
+    if (ingest->requests > 0) {
+	printf("%d connections, %d viewers, %zu devices, %.0f requests/s, %.0f rows/s, %.1f requests per commit, %llu fsyncs\n",
+	       ingest->connections, ingest->viewers, ingest->sinkCount, ingest->requestRate, ingest->rowRate,
+	       ingest->commits ? (double)ingest->requests / ingest->commits : 0.0,
+	       (unsigned long long)ingest->syncs);
+	printf("write ms p50 %.3f  p99 %.3f  max %.3f, fsync ms p50 %.3f  p99 %.3f\n",
+	       LatencyQuantile(&ingest->writeLatency, 0.5), LatencyQuantile(&ingest->writeLatency, 0.99),
+	       ingest->writeLatency.max, LatencyQuantile(&ingest->syncLatency, 0.5),
+	       LatencyQuantile(&ingest->syncLatency, 0.99));
+	fflush(stdout);
+    }
+    ingest->totalRequests += ingest->requests;
+    ingest->totalRows += ingest->rows;
+    ingest->totalCommits += ingest->commits;
+    ingest->totalSyncs += ingest->syncs;
+    LatencyMerge(&ingest->totalWriteLatency, &ingest->writeLatency);
+    LatencyMerge(&ingest->totalSyncLatency, &ingest->syncLatency);
+    ingest->requests = ingest->rows = ingest->commits = ingest->syncs = 0;
+    LatencyClear(&ingest->writeLatency);
+    LatencyClear(&ingest->syncLatency);
+    ingest->lastStats = now;
+}
+
+int
+main(int argc, char* argv[]) {
+    int port = 8000;
+    int syncPolicy = SYNC_ALWAYS;
+    int64_t rawDays = RETENTION_RAW_DAYS;
+    const char* directory = ".";
+    int option;
+    while ((option = getopt(argc, argv, "p:s:k:d:")) != -1) {
+	switch (option) {
+	case 'p': port = atoi(optarg); break;
+	case 's':
+	    if (strcmp(optarg, "always") == 0) syncPolicy = SYNC_ALWAYS;
+	    else if (strcmp(optarg, "never") == 0) syncPolicy = SYNC_NEVER;
+	    else syncPolicy = atoi(optarg) > 0 ? atoi(optarg) : SYNC_ALWAYS;
+	    break;
+	case 'k': rawDays = strtoll(optarg, NULL, 10); break;
+	case 'd': directory = optarg; break;
+	default:
+	    fprintf(stderr, "usage: %s [-p port] [-s always|never|ms] [-k days] [-d directory]\n", argv[0]);
+	    return 1;
+	}
+    }
+    if (chdir(directory) != 0) {
+	perror(directory);
+	return 1;
+    }
+
+    /* three files per device on top of the connections */
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+	files.rlim_cur = files.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    Ingest ingest;
+    memset(&ingest, 0, sizeof(ingest));
+    ingest.syncPolicy = syncPolicy;
+    ingest.sinkSlots = 64;
+    ingest.sinks = calloc(ingest.sinkSlots, sizeof(Sink*));
+    if (!ingest.sinks || !FindSink(&ingest, "", 0)) {
+	fprintf(stderr, "Can't open data.txt or data.wdb\n");
+	return 1;
+    }
+    /* every device with history, so it can be viewed before it uploads again */
+    DIR* devices = opendir(DEVICES_DIR);
+    if (devices) {
+	struct dirent* entry;
+	while ((entry = readdir(devices)) != NULL) {
+	    if (ValidDevice(entry->d_name, strlen(entry->d_name))) FindSink(&ingest, entry->d_name, strlen(entry->d_name));
+	}
+	closedir(devices);
+    }
+    size_t loaded = 0;
+    for (size_t s = 0; s < ingest.sinkSlots; ++s) {
+	if (ingest.sinks[s]) loaded += ingest.sinks[s]->series.count;
+    }
+    printf("%zu devices, %zu rows in memory\n", ingest.sinkCount, loaded);
+    ingest.listenFd = Listen(port);
+    if (ingest.listenFd < 0) {
+	perror("listen");
+	return 1;
+    }
+    ingest.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listenEvent = { EPOLLIN, { .ptr = NULL } };
+    epoll_ctl(ingest.epollFd, EPOLL_CTL_ADD, ingest.listenFd, &listenEvent);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = Stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Ingest is running on port %d, fsync %s\n", port,
+	   syncPolicy == SYNC_ALWAYS ? "on every commit" : syncPolicy == SYNC_NEVER ? "never" : "on a timer");
+    fflush(stdout);
+    ingest.started = ingest.lastSync = ingest.lastStats = Now();
+    if (StartCompactor(&ingest.compactor, rawDays < 0 ? -1 : rawDays * 86400) != 0) {
+	fprintf(stderr, "Can't start the compaction thread, nothing is rolled up\n");
+	return 1;
+    }
+    struct epoll_event events[MAX_EVENTS];
+    while (!stopping) {
+	/* wake up for the next timed fsync or stats line */
+	double due = ingest.lastStats + STATS_INTERVAL;
+	if (ingest.dirty && ingest.syncPolicy > 0 && ingest.lastSync + ingest.syncPolicy / 1000.0 < due) {
+	    due = ingest.lastSync + ingest.syncPolicy / 1000.0;
+	}
+	if (ingest.compactor.sink && due > Now() + 1) {
+	    due = Now() + 1; /* look for the compaction to finish */
+	}
+	int timeout = (int)ceil((due - Now()) * 1000);
+	int count = epoll_wait(ingest.epollFd, events, MAX_EVENTS, timeout > 0 ? timeout : 0);
+	if (count < 0 && errno != EINTR) {
+	    perror("epoll_wait");
+	    break;
+	}
+	for (int i = 0; i < count; ++i) {
+	    Connection* connection = events[i].data.ptr;
+	    if (!connection) {
+		Accept(&ingest);
+		continue;
+	    }
+	    if (connection->closed) {
+		continue;
+	    }
+	    if (events[i].events & EPOLLOUT) {
+		if (Flush(&ingest, connection) != 0) {
+		    connection->closed = 1;
+		} else if (connection->closeAfter && connection->out.length == 0 && !connection->waiting) {
+		    CloseConnection(&ingest, connection);
+		    continue;
+		}
+	    }
+	    if (!connection->closed && events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+		Readable(&ingest, connection);
+	    } else if (connection->closed && !connection->waiting) {
+		CloseConnection(&ingest, connection);
+	    }
+	}
+	Commit(&ingest);
+	Compact(&ingest);
+	if (Now() - ingest.lastStats >= STATS_INTERVAL) {
+	    PrintStats(&ingest);
+	    PingViewers(&ingest);
+	}
+    }
+
+    Commit(&ingest);
+    if (ingest.dirty) Sync(&ingest);
+    StopCompactor(&ingest.compactor);
+    for (size_t s = 0; s < ingest.sinkSlots; ++s) {
+	if (ingest.sinks[s]) {
+	    CheckpointSink(ingest.sinks[s]);
+	    CloseSink(ingest.sinks[s]);
+	}
+    }
+    free(ingest.sinks);
+    printf("Stopped\n");
+    return 0;
+}
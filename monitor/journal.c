@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include "journal.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_SIZE (JOURNAL_RECORD_HEADER + JOURNAL_RECORD_ROWS * sizeof(JournalRow))
+
+/* the reflected CRC-32 of zlib and Python's zlib.crc32 */
+uint32_t
+JournalCrc(uint32_t crc, const void* data, size_t length) {
+    static uint32_t table[256];
+    if (!table[1]) {
+	for (uint32_t i = 0; i < 256; ++i) {
+	    uint32_t c = i;
+	    for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+	    table[i] = c;
+	}
+    }
+    const unsigned char* p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t
+RecordCrc(uint64_t generation, const void* rows, size_t length) {
+    return JournalCrc(JournalCrc(0, &generation, sizeof(generation)), rows, length);
+}
+
+static int
+WriteAll(int fd, const void* buffer, size_t size, off_t offset) {
+    const unsigned char* p = buffer;
+    while (size > 0) {
+	ssize_t written = pwrite(fd, p, size, offset);
+	if (written <= 0) return -1;
+	p += written;
+	size -= written;
+	offset += written;
+    }
+    return 0;
+}
+
+/* -1 at the end of the file as well */
+static int
+ReadAll(int fd, void* buffer, size_t size, off_t offset) {
+    unsigned char* p = buffer;
+    while (size > 0) {
+	ssize_t got = pread(fd, p, size, offset);
+	if (got <= 0) return -1;
+	p += got;
+	size -= got;
+	offset += got;
+    }
+    return 0;
+}
+
+/* returns 0 if the header is there and intact */
+static int
+ReadHeader(int fd, JournalHeader* checkpoint) {
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    if (ReadAll(fd, header, sizeof(header), 0) != 0) {
+	return -1;
+    }
+    uint32_t version, crc;
+    memcpy(&version, header + 4, sizeof(version));
+    memcpy(&crc, header + 32, sizeof(crc));
+    if (memcmp(header, JOURNAL_MAGIC, 4) != 0 || version != JOURNAL_VERSION || JournalCrc(0, header, 32) != crc) {
+	return -1;
+    }
+    memcpy(&checkpoint->generation, header + 8, sizeof(uint64_t));
+    memcpy(&checkpoint->textSize, header + 16, sizeof(uint64_t));
+    memcpy(&checkpoint->rowCount, header + 24, sizeof(uint64_t));
+    return 0;
+}
+
+/* Hands out the intact records from offset on, returns the offset after
+ * the last one. rows counts what was handed out. */
+static uint64_t
+ReadRecords(int fd, uint64_t generation, uint64_t offset, unsigned char* record, JournalRows rows, void* user,
+	    uint64_t* count) {
+    for (;;) {
+	uint32_t head[2];
+	if (ReadAll(fd, head, sizeof(head), offset) != 0 || head[0] == 0 || head[0] > JOURNAL_RECORD_ROWS) {
+	    break;
+	}
+	size_t length = head[0] * sizeof(JournalRow);
+	if (ReadAll(fd, record, length, offset + JOURNAL_RECORD_HEADER) != 0 ||
+	    RecordCrc(generation, record, length) != head[1]) {
+	    break;
+	}
+	if (rows) rows(user, (const JournalRow*)record, head[0]);
+	*count += head[0];
+	offset += JOURNAL_RECORD_HEADER + length;
+    }
+    return offset;
+}
+
+/* so a new log is still there after a power cut */
+static void
+SyncDirectory(const char* path) {
+    char directory[PATH_MAX];
+    const char* slash = strrchr(path, '/');
+    if (!slash) {
+	strcpy(directory, ".");
+    } else {
+	size_t length = slash - path < PATH_MAX ? (size_t)(slash - path) : PATH_MAX - 1;
+	memcpy(directory, path, length);
+	directory[length] = '\0';
+	if (length == 0) strcpy(directory, "/");
+    }
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+	fsync(fd);
+	close(fd);
+    }
+}
+
+int
+JournalOpen(Journal* journal, const char* path, JournalRows replay, void* user) {
+    memset(journal, 0, sizeof(*journal));
+    journal->record = malloc(RECORD_SIZE);
+    journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat info;
+    if (!journal->record || journal->fd < 0 || fstat(journal->fd, &info) != 0) {
+	JournalClose(journal);
+	return -1;
+    }
+    if (info.st_size == 0) {
+	SyncDirectory(path);
+	return 0;
+    }
+    if (ReadHeader(journal->fd, &journal->checkpoint) != 0) {
+	/* a checkpoint caught halfway, see the top of journal.h. What is
+	 * left of the records goes, so the generations can start over */
+	memset(&journal->checkpoint, 0, sizeof(journal->checkpoint));
+	journal->cut = info.st_size;
+	if (ftruncate(journal->fd, 0) != 0 || fdatasync(journal->fd) != 0) {
+	    JournalClose(journal);
+	    return -1;
+	}
+	return 0;
+    }
+    journal->haveCheckpoint = 1;
+    journal->size = ReadRecords(journal->fd, journal->checkpoint.generation, JOURNAL_HEADER_SIZE, journal->record,
+				replay, user, &journal->recovered);
+    journal->cut = info.st_size - journal->size;
+    if (journal->cut > 0 && ftruncate(journal->fd, journal->size) != 0) {
+	JournalClose(journal);
+	return -1;
+    }
+    return 0;
+}
+
+int
+JournalAppend(Journal* journal, const JournalRow* rows, size_t count) {
+    while (count > 0) {
+	uint32_t n = count < JOURNAL_RECORD_ROWS ? count : JOURNAL_RECORD_ROWS;
+	size_t length = n * sizeof(JournalRow);
+	uint32_t crc = RecordCrc(journal->checkpoint.generation, rows, length);
+	memcpy(journal->record, &n, sizeof(n));
+	memcpy(journal->record + 4, &crc, sizeof(crc));
+	memcpy(journal->record + JOURNAL_RECORD_HEADER, rows, length);
+	/* a failed write leaves a torn record, the next one goes over it */
+	if (WriteAll(journal->fd, journal->record, JOURNAL_RECORD_HEADER + length, journal->size) != 0) {
+	    return -1;
+	}
+	journal->size += JOURNAL_RECORD_HEADER + length;
+	rows += n;
+	count -= n;
+    }
+    return 0;
+}
+
+int
+JournalSync(Journal* journal) {
+    return fdatasync(journal->fd);
+}
+
+/* The header goes first and is synced before the records are cut off. A
+ * crash in between leaves records of the old generation behind, which fail
+ * their CRC against the new one. */
+int
+JournalCheckpoint(Journal* journal, uint64_t textSize, uint64_t rowCount) {
+    JournalHeader checkpoint = { journal->checkpoint.generation + 1, textSize, rowCount };
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    uint32_t version = JOURNAL_VERSION;
+    memset(header, 0, sizeof(header));
+    memcpy(header, JOURNAL_MAGIC, 4);
+    memcpy(header + 4, &version, sizeof(version));
+    memcpy(header + 8, &checkpoint.generation, sizeof(uint64_t));
+    memcpy(header + 16, &checkpoint.textSize, sizeof(uint64_t));
+    memcpy(header + 24, &checkpoint.rowCount, sizeof(uint64_t));
+    uint32_t crc = JournalCrc(0, header, 32);
+    memcpy(header + 32, &crc, sizeof(crc));
+    if (WriteAll(journal->fd, header, sizeof(header), 0) != 0 || fdatasync(journal->fd) != 0 ||
+	ftruncate(journal->fd, JOURNAL_HEADER_SIZE) != 0) {
+	return -1;
+    }
+    journal->checkpoint = checkpoint;
+    journal->haveCheckpoint = 1;
+    journal->size = JOURNAL_HEADER_SIZE;
+    return 0;
+}
+
+void
+JournalClose(Journal* journal) {
+    if (journal->fd >= 0) {
+	close(journal->fd);
+	journal->fd = -1;
+    }
+    free(journal->record);
+    journal->record = NULL;
+}
+
+int
+JournalReaderOpen(JournalReader* reader, const char* path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader->fd < 0) {
+	return -1;
+    }
+    reader->record = malloc(RECORD_SIZE);
+    if (!reader->record) {
+	JournalReaderClose(reader);
+	return -1;
+    }
+    reader->offset = JOURNAL_HEADER_SIZE;
+    return 0;
+}
+
+int
+JournalReaderPoll(JournalReader* reader, JournalRows rows, void* user) {
+    JournalHeader checkpoint;
+    if (ReadHeader(reader->fd, &checkpoint) != 0) {
+	return JOURNAL_IDLE; /* not written yet, or a checkpoint in progress */
+    }
+    if (!reader->haveGeneration) {
+	reader->generation = checkpoint.generation;
+	reader->haveGeneration = 1;
+    } else if (checkpoint.generation != reader->generation) {
+	reader->generation = checkpoint.generation;
+	reader->offset = JOURNAL_HEADER_SIZE;
+	reader->rows = 0;
+	return JOURNAL_RESET;
+    }
+    uint64_t before = reader->rows;
+    reader->offset = ReadRecords(reader->fd, reader->generation, reader->offset, reader->record, rows, user,
+				 &reader->rows);
+    return reader->rows > before ? JOURNAL_APPENDED : JOURNAL_IDLE;
+}
+
+void
+JournalReaderClose(JournalReader* reader) {
+    if (reader->fd >= 0) {
+	close(reader->fd);
+	reader->fd = -1;
+    }
+    free(reader->record);
+    reader->record = NULL;
+}
@@ -0,0 +1,123 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ingestion log, data.log next to data.txt and data.wdb, written ahead of
+ * them.
+ *
+ * [header, JOURNAL_HEADER_SIZE bytes][record][record]...
+ *
+ * header, little endian:
+ *   char magic[4]        "WJL1"
+ *   uint32 version       JOURNAL_VERSION
+ *   uint64 generation    one more at every checkpoint
+ *   uint64 textSize      bytes of data.txt at the checkpoint
+ *   uint64 rowCount      rows of data.wdb at the checkpoint
+ *   uint32 crc           CRC-32 of the 32 bytes before it
+ *   rest is zero
+ *
+ * record: uint32 count   rows, 1 to JOURNAL_RECORD_ROWS
+ *         uint32 crc     CRC-32 of the generation (8 bytes) and the rows
+ *         count rows     int64 timestamp, double temperature, double pressure
+ *
+ * An upload's rows go into the log first and are answered once the log is
+ * synced. data.txt and data.wdb are written right after without a sync of
+ * their own. Once the log is JOURNAL_CHECKPOINT_SIZE, and before anything
+ * replaces the files, the writer syncs the two files and checkpoints: the
+ * header gets the next generation and the files' sizes, is synced, and the
+ * records are cut off. A checkpoint costs three syncs, every upload in
+ * between costs one for all three files.
+ *
+ * Recovery cuts data.txt and data.wdb back to the checkpoint, torn lines
+ * and half written blocks with them, then appends the log's rows again.
+ * The log is read up to the first record that is short or fails its CRC:
+ * a write the crash cut short, or a record of the generation before that
+ * the checkpoint didn't get to cut off. A header that fails its CRC is a
+ * checkpoint caught halfway, the files were synced, there is nothing to do.
+ * A file smaller than the checkpoint was replaced, by compaction, and is
+ * left alone. server.py writes the same format.
+ *
+ * Readers can follow the log while it is written: a record is only handed
+ * out once it is complete and its CRC matches, see JournalReaderPoll.
+ */
+#define JOURNAL_FILE "data.log"
+#define JOURNAL_MAGIC "WJL1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 64
+#define JOURNAL_RECORD_HEADER 8
+#define JOURNAL_RECORD_ROWS 4096
+/* crashtest.py builds with less, so crashes land in checkpoints as well */
+#ifndef JOURNAL_CHECKPOINT_SIZE
+#define JOURNAL_CHECKPOINT_SIZE (4 * 1024 * 1024)
+#endif
+
+enum {
+    JOURNAL_IDLE,
+    JOURNAL_APPENDED,
+    JOURNAL_RESET
+};
+
+typedef struct {
+    int64_t timestamp;
+    double temperature;
+    double pressure;
+} JournalRow;
+
+typedef struct {
+    uint64_t generation;
+    uint64_t textSize;
+    uint64_t rowCount;
+} JournalHeader;
+
+typedef struct {
+    int fd;
+    JournalHeader checkpoint;
+    int haveCheckpoint; /* the header was intact when the log was opened */
+    uint64_t size; /* bytes, the header included */
+    uint64_t recovered; /* rows found in the log when it was opened */
+    uint64_t cut; /* bytes of torn tail cut off then */
+    unsigned char* record; /* one record being written */
+} Journal;
+
+typedef void (*JournalRows)(void* user, const JournalRow* rows, size_t count);
+
+/* Opens the log at path, creating it if there is none, and hands the rows
+ * of every intact record to replay, in order. If journal->haveCheckpoint,
+ * the caller cuts its files back to journal->checkpoint and appends those
+ * rows again. Either way it syncs the files and calls JournalCheckpoint
+ * before appending anything. Returns 0 on success, -1 if the log can't be
+ * opened or written. */
+int JournalOpen(Journal* journal, const char* path, JournalRows replay, void* user);
+/* rows in one record, or as many as it takes. Returns 0 on success */
+int JournalAppend(Journal* journal, const JournalRow* rows, size_t count);
+/* returns 0 once everything appended is on disk */
+int JournalSync(Journal* journal);
+/* the files were synced at these sizes, the log starts the next generation.
+ * Returns 0 on success */
+int JournalCheckpoint(Journal* journal, uint64_t textSize, uint64_t rowCount);
+void JournalClose(Journal* journal);
+
+/* Follows a log, see the top. */
+typedef struct {
+    int fd;
+    uint64_t generation;
+    int haveGeneration;
+    uint64_t offset; /* of the next record */
+    uint64_t rows; /* handed out in this generation */
+    unsigned char* record;
+} JournalReader;
+
+/* returns 0 on success, -1 if the file can't be opened */
+int JournalReaderOpen(JournalReader* reader, const char* path);
+/* Hands out the rows of the records completed since the last poll.
+ * JOURNAL_RESET when the log was checkpointed in between: the rows it had
+ * are in data.txt and data.wdb now, records from here on are the next
+ * generation's, poll again to read them. */
+int JournalReaderPoll(JournalReader* reader, JournalRows rows, void* user);
+void JournalReaderClose(JournalReader* reader);
+
+uint32_t JournalCrc(uint32_t crc, const void* data, size_t length);
+
+#endif
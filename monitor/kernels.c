@@ -0,0 +1,375 @@
+#include "kernels.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+Summary
+EmptySummary(void) {
+    Summary s;
+    s.min = INFINITY;
+    s.max = -INFINITY;
+    s.sum = 0;
+    s.sumsq = 0;
+    s.count = 0;
+    return s;
+}
+
+void
+MergeSummary(Summary* s, const Summary* other) {
+    if (other->min < s->min) s->min = other->min;
+    if (other->max > s->max) s->max = other->max;
+    s->sum += other->sum;
+    s->sumsq += other->sumsq;
+    s->count += other->count;
+}
+
+/* scalar */
+
+static void
+ScalarMinMax(const double* values, size_t count, double* min, double* max) {
+    double low = INFINITY;
+    double high = -INFINITY;
+    for (size_t i = 0; i < count; ++i) {
+	if (values[i] < low) low = values[i];
+	if (values[i] > high) high = values[i];
+    }
+    *min = low;
+    *max = high;
+}
+
+static double
+ScalarSum(const double* values, size_t count, double shift) {
+    double sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+	sum += values[i] - shift;
+    }
+    return sum;
+}
+
+static double
+ScalarSumSquares(const double* values, size_t count, double shift) {
+    double sumsq = 0;
+    for (size_t i = 0; i < count; ++i) {
+	double d = values[i] - shift;
+	sumsq += d * d;
+    }
+    return sumsq;
+}
+
+static void
+ScalarSummarize(const double* values, size_t count, double shift, Summary* out) {
+    Summary s = EmptySummary();
+    for (size_t i = 0; i < count; ++i) {
+	double d = values[i] - shift;
+	if (values[i] < s.min) s.min = values[i];
+	if (values[i] > s.max) s.max = values[i];
+	s.sum += d;
+	s.sumsq += d * d;
+    }
+    s.count = count;
+    MergeSummary(out, &s);
+}
+
+const Kernels scalarKernels = {
+    "scalar", ScalarMinMax, ScalarSum, ScalarSumSquares, ScalarSummarize
+};
+
+#ifdef KERNELS_X86
+
+/* SSE2, two lanes, two accumulators each so the adds don't wait on each other */
+
+static double
+Sse2Total(__m128d v) {
+    double lanes[2];
+    _mm_storeu_pd(lanes, v);
+    return lanes[0] + lanes[1];
+}
+
+static void
+Sse2MinMax(const double* values, size_t count, double* min, double* max) {
+    __m128d low0 = _mm_set1_pd(INFINITY), low1 = low0;
+    __m128d high0 = _mm_set1_pd(-INFINITY), high1 = high0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128d a = _mm_loadu_pd(values + i);
+	__m128d b = _mm_loadu_pd(values + i + 2);
+	low0 = _mm_min_pd(low0, a);
+	low1 = _mm_min_pd(low1, b);
+	high0 = _mm_max_pd(high0, a);
+	high1 = _mm_max_pd(high1, b);
+    }
+    double lows[2], highs[2];
+    _mm_storeu_pd(lows, _mm_min_pd(low0, low1));
+    _mm_storeu_pd(highs, _mm_max_pd(high0, high1));
+    double low = lows[0] < lows[1] ? lows[0] : lows[1];
+    double high = highs[0] > highs[1] ? highs[0] : highs[1];
+    for (; i < count; ++i) {
+	if (values[i] < low) low = values[i];
+	if (values[i] > high) high = values[i];
+    }
+    *min = low;
+    *max = high;
+}
+
+static double
+Sse2Sum(const double* values, size_t count, double shift) {
+    __m128d s = _mm_set1_pd(shift);
+    __m128d sum0 = _mm_setzero_pd(), sum1 = sum0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+	sum0 = _mm_add_pd(sum0, _mm_sub_pd(_mm_loadu_pd(values + i), s));
+	sum1 = _mm_add_pd(sum1, _mm_sub_pd(_mm_loadu_pd(values + i + 2), s));
+    }
+    double sum = Sse2Total(_mm_add_pd(sum0, sum1));
+    for (; i < count; ++i) {
+	sum += values[i] - shift;
+    }
+    return sum;
+}
+
+static double
+Sse2SumSquares(const double* values, size_t count, double shift) {
+    __m128d s = _mm_set1_pd(shift);
+    __m128d sum0 = _mm_setzero_pd(), sum1 = sum0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128d a = _mm_sub_pd(_mm_loadu_pd(values + i), s);
+	__m128d b = _mm_sub_pd(_mm_loadu_pd(values + i + 2), s);
+	sum0 = _mm_add_pd(sum0, _mm_mul_pd(a, a));
+	sum1 = _mm_add_pd(sum1, _mm_mul_pd(b, b));
+    }
+    double sumsq = Sse2Total(_mm_add_pd(sum0, sum1));
+    for (; i < count; ++i) {
+	double d = values[i] - shift;
+	sumsq += d * d;
+    }
+    return sumsq;
+}
+
+static void
+Sse2Summarize(const double* values, size_t count, double shift, Summary* out) {
+    __m128d s = _mm_set1_pd(shift);
+    __m128d low = _mm_set1_pd(INFINITY);
+    __m128d high = _mm_set1_pd(-INFINITY);
+    __m128d sum0 = _mm_setzero_pd(), sum1 = sum0;
+    __m128d sumsq0 = _mm_setzero_pd(), sumsq1 = sumsq0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+	__m128d a = _mm_loadu_pd(values + i);
+	__m128d b = _mm_loadu_pd(values + i + 2);
+	low = _mm_min_pd(low, _mm_min_pd(a, b));
+	high = _mm_max_pd(high, _mm_max_pd(a, b));
+	a = _mm_sub_pd(a, s);
+	b = _mm_sub_pd(b, s);
+	sum0 = _mm_add_pd(sum0, a);
+	sum1 = _mm_add_pd(sum1, b);
+	sumsq0 = _mm_add_pd(sumsq0, _mm_mul_pd(a, a));
+	sumsq1 = _mm_add_pd(sumsq1, _mm_mul_pd(b, b));
+    }
+    Summary r;
+    double lows[2], highs[2];
+    _mm_storeu_pd(lows, low);
+    _mm_storeu_pd(highs, high);
+    r.min = lows[0] < lows[1] ? lows[0] : lows[1];
+    r.max = highs[0] > highs[1] ? highs[0] : highs[1];
+    r.sum = Sse2Total(_mm_add_pd(sum0, sum1));
+    r.sumsq = Sse2Total(_mm_add_pd(sumsq0, sumsq1));
+    r.count = 0;
+    MergeSummary(out, &r);
+    ScalarSummarize(values + i, count - i, shift, out);
+    out->count += i;
+}
+
+const Kernels sse2Kernels = {
+    "sse2", Sse2MinMax, Sse2Sum, Sse2SumSquares, Sse2Summarize
+};
+
+/* AVX2, four lanes, two accumulators each. Compiled for AVX2 and FMA here
+ * only, the rest of the program runs on any x86-64 */
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static double
+Avx2Total(__m256d v) {
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return Sse2Total(half);
+}
+
+AVX2 static void
+Avx2MinMax(const double* values, size_t count, double* min, double* max) {
+    __m256d low0 = _mm256_set1_pd(INFINITY), low1 = low0;
+    __m256d high0 = _mm256_set1_pd(-INFINITY), high1 = high0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+	__m256d a = _mm256_loadu_pd(values + i);
+	__m256d b = _mm256_loadu_pd(values + i + 4);
+	low0 = _mm256_min_pd(low0, a);
+	low1 = _mm256_min_pd(low1, b);
+	high0 = _mm256_max_pd(high0, a);
+	high1 = _mm256_max_pd(high1, b);
+    }
+    double lows[4], highs[4];
+    _mm256_storeu_pd(lows, _mm256_min_pd(low0, low1));
+    _mm256_storeu_pd(highs, _mm256_max_pd(high0, high1));
+    double low = lows[0], high = highs[0];
+    for (int k = 1; k < 4; ++k) {
+	if (lows[k] < low) low = lows[k];
+	if (highs[k] > high) high = highs[k];
+    }
+    for (; i < count; ++i) {
+	if (values[i] < low) low = values[i];
+	if (values[i] > high) high = values[i];
+    }
+    *min = low;
+    *max = high;
+}
+
+AVX2 static double
+Avx2Sum(const double* values, size_t count, double shift) {
+    __m256d s = _mm256_set1_pd(shift);
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = sum0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+	sum0 = _mm256_add_pd(sum0, _mm256_sub_pd(_mm256_loadu_pd(values + i), s));
+	sum1 = _mm256_add_pd(sum1, _mm256_sub_pd(_mm256_loadu_pd(values + i + 4), s));
+    }
+    double sum = Avx2Total(_mm256_add_pd(sum0, sum1));
+    for (; i < count; ++i) {
+	sum += values[i] - shift;
+    }
+    return sum;
+}
+
+AVX2 static double
+Avx2SumSquares(const double* values, size_t count, double shift) {
+    __m256d s = _mm256_set1_pd(shift);
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = sum0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+	__m256d a = _mm256_sub_pd(_mm256_loadu_pd(values + i), s);
+	__m256d b = _mm256_sub_pd(_mm256_loadu_pd(values + i + 4), s);
+	sum0 = _mm256_fmadd_pd(a, a, sum0);
+	sum1 = _mm256_fmadd_pd(b, b, sum1);
+    }
+    double sumsq = Avx2Total(_mm256_add_pd(sum0, sum1));
+    for (; i < count; ++i) {
+	double d = values[i] - shift;
+	sumsq += d * d;
+    }
+    return sumsq;
+}
+
+AVX2 static void
+Avx2Summarize(const double* values, size_t count, double shift, Summary* out) {
+    __m256d s = _mm256_set1_pd(shift);
+    __m256d low = _mm256_set1_pd(INFINITY);
+    __m256d high = _mm256_set1_pd(-INFINITY);
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = sum0;
+    __m256d sumsq0 = _mm256_setzero_pd(), sumsq1 = sumsq0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+	__m256d a = _mm256_loadu_pd(values + i);
+	__m256d b = _mm256_loadu_pd(values + i + 4);
+	low = _mm256_min_pd(low, _mm256_min_pd(a, b));
+	high = _mm256_max_pd(high, _mm256_max_pd(a, b));
+	a = _mm256_sub_pd(a, s);
+	b = _mm256_sub_pd(b, s);
+	sum0 = _mm256_add_pd(sum0, a);
+	sum1 = _mm256_add_pd(sum1, b);
+	sumsq0 = _mm256_fmadd_pd(a, a, sumsq0);
+	sumsq1 = _mm256_fmadd_pd(b, b, sumsq1);
+    }
+    Summary r;
+    double lows[4], highs[4];
+    _mm256_storeu_pd(lows, low);
+    _mm256_storeu_pd(highs, high);
+    r.min = lows[0];
+    r.max = highs[0];
+    for (int k = 1; k < 4; ++k) {
+	if (lows[k] < r.min) r.min = lows[k];
+	if (highs[k] > r.max) r.max = highs[k];
+    }
+    r.sum = Avx2Total(_mm256_add_pd(sum0, sum1));
+    r.sumsq = Avx2Total(_mm256_add_pd(sumsq0, sumsq1));
+    r.count = 0;
+    MergeSummary(out, &r);
+    ScalarSummarize(values + i, count - i, shift, out);
+    out->count += i;
+}
+
+const Kernels avx2Kernels = {
+    "avx2", Avx2MinMax, Avx2Sum, Avx2SumSquares, Avx2Summarize
+};
+
+#endif
+
+const Kernels* const*
+KernelsAvailable(void) {
+    static const Kernels* available[4];
+    if (!available[0]) {
+	int n = 0;
+	available[n++] = &scalarKernels;
+#ifdef KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) available[n++] = &sse2Kernels;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) available[n++] = &avx2Kernels;
+#endif
+	available[n] = NULL;
+    }
+    return available;
+}
+
+const Kernels*
+KernelsBest(void) {
+    static const Kernels* best;
+    if (!best) {
+	const Kernels* const* available = KernelsAvailable();
+	for (int i = 0; available[i]; ++i) {
+	    best = available[i];
+	}
+    }
+    return best;
+}
+
+/* split at a multiple of KERNEL_BLOCK, so blocks line up however the column is cut */
+static size_t
+Half(size_t count) {
+    return (count / KERNEL_BLOCK + 1) / 2 * KERNEL_BLOCK;
+}
+
+double
+KernelSum(const Kernels* kernels, const double* values, size_t count, double shift) {
+    if (count <= KERNEL_BLOCK) {
+	return kernels->sum(values, count, shift);
+    }
+    size_t half = Half(count);
+    return KernelSum(kernels, values, half, shift) + KernelSum(kernels, values + half, count - half, shift);
+}
+
+double
+KernelSumSquares(const Kernels* kernels, const double* values, size_t count, double shift) {
+    if (count <= KERNEL_BLOCK) {
+	return kernels->sumSquares(values, count, shift);
+    }
+    size_t half = Half(count);
+    return KernelSumSquares(kernels, values, half, shift) +
+	KernelSumSquares(kernels, values + half, count - half, shift);
+}
+
+void
+KernelSummarize(const Kernels* kernels, const double* values, size_t count, double shift, Summary* out) {
+    if (count <= KERNEL_BLOCK) {
+	kernels->summarize(values, count, shift, out);
+	return;
+    }
+    size_t half = Half(count);
+    Summary s = EmptySummary();
+    KernelSummarize(kernels, values, half, shift, &s);
+    Summary right = EmptySummary();
+    KernelSummarize(kernels, values + half, count - half, shift, &right);
+    MergeSummary(&s, &right);
+    MergeSummary(out, &s);
+}
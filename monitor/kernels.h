@@ -0,0 +1,62 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+
+/* Reductions over a column of doubles.
+ *
+ * There is a scalar version of every kernel, and SSE2 and AVX2 versions on
+ * x86. KernelsBest() picks the widest one the CPU runs. Sums are of
+ * value - shift, shift being a value close to the data (the first sample),
+ * so the sum of squares doesn't lose the variance to cancellation. Long
+ * columns are summed pairwise, KERNEL_BLOCK values at a time, which keeps
+ * the rounding error growing with log n instead of n.
+ */
+#define KERNEL_BLOCK 1024
+
+typedef struct {
+    double min;
+    double max;
+    double sum;   /* of value - shift */
+    double sumsq; /* of (value - shift)^2 */
+    size_t count;
+} Summary;
+
+typedef struct {
+    const char* name;
+    void (*minMax)(const double* values, size_t count, double* min, double* max);
+    /* up to KERNEL_BLOCK values, Kernel* below split longer columns */
+    double (*sum)(const double* values, size_t count, double shift);
+    double (*sumSquares)(const double* values, size_t count, double shift);
+    /* all of the above in one pass, merged into out */
+    void (*summarize)(const double* values, size_t count, double shift, Summary* out);
+} Kernels;
+
+extern const Kernels scalarKernels;
+#if defined(__x86_64__) || defined(__i386__)
+extern const Kernels sse2Kernels;
+extern const Kernels avx2Kernels;
+#endif
+
+/* the widest kernels the CPU supports, decided once */
+const Kernels* KernelsBest(void);
+/* every variant this CPU runs, NULL terminated, for benchmarks */
+const Kernels* const* KernelsAvailable(void);
+
+Summary EmptySummary(void);
+void MergeSummary(Summary* s, const Summary* other);
+
+/* pairwise over columns of any length */
+double KernelSum(const Kernels* kernels, const double* values, size_t count, double shift);
+double KernelSumSquares(const Kernels* kernels, const double* values, size_t count, double shift);
+void KernelSummarize(const Kernels* kernels, const double* values, size_t count, double shift, Summary* out);
+
+/* with the best kernels */
+static inline Summary
+Summarize(const double* values, size_t count, double shift) {
+    Summary s = EmptySummary();
+    KernelSummarize(KernelsBest(), values, count, shift, &s);
+    return s;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#include "latency.h"
+
+#include <math.h>
+#include <string.h>
+
+void
+LatencyClear(Latency* latency) {
+    memset(latency, 0, sizeof(*latency));
+}
+
+/* bucket 0 is everything under 1 us */
+static int
+Bucket(double ms) {
+    double us = ms * 1000;
+    if (!(us >= 1)) return 0;
+    int bucket = 1 + (int)(log2(us) * LATENCY_STEPS);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/* the top of a bucket, in ms */
+static double
+BucketTop(int bucket) {
+    return exp2((double)bucket / LATENCY_STEPS) / 1000;
+}
+
+void
+LatencyAdd(Latency* latency, double ms) {
+    ++latency->bucket[Bucket(ms)];
+    ++latency->count;
+    latency->sum += ms;
+    if (ms > latency->max) latency->max = ms;
+}
+
+void
+LatencyMerge(Latency* latency, const Latency* other) {
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+	latency->bucket[i] += other->bucket[i];
+    }
+    latency->count += other->count;
+    latency->sum += other->sum;
+    if (other->max > latency->max) latency->max = other->max;
+}
+
+double
+LatencyQuantile(const Latency* latency, double q) {
+    if (latency->count == 0) {
+	return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (latency->count - 1));
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+	seen += latency->bucket[i];
+	if (seen > rank) {
+	    double top = BucketTop(i);
+	    return top < latency->max ? top : latency->max;
+	}
+    }
+    return latency->max;
+}
@@ -0,0 +1,36 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+
+/* Histogram of durations, for the stats lines of ingest, /stats and the
+ * monitor's frame overlay.
+ *
+ * Buckets are a quarter of a power of two wide, from 1 us up to about an
+ * hour, so recording is a log2 and an increment whatever the value, the
+ * whole thing is a fixed 1 kB, and a quantile is within 19% of the real
+ * one. Durations are in milliseconds.
+ */
+#define LATENCY_BUCKETS 128
+#define LATENCY_STEPS 4 /* buckets per power of two */
+
+typedef struct {
+    uint64_t count;
+    double sum;
+    double max;
+    uint64_t bucket[LATENCY_BUCKETS];
+} Latency;
+
+void LatencyClear(Latency* latency);
+void LatencyAdd(Latency* latency, double ms);
+/* adds what other recorded */
+void LatencyMerge(Latency* latency, const Latency* other);
+/* the q-th quantile, 0 without any, never above the max */
+double LatencyQuantile(const Latency* latency, double q);
+
+static inline double
+LatencyMean(const Latency* latency) {
+    return latency->count ? latency->sum / latency->count : 0;
+}
+
+#endif
@@ -0,0 +1,393 @@
+/* Load generator for the ingestion server (ingest or server.py)
+ *
+ * loadgen [-a address] [-p port] [-c connections] [-n requests] [-b samples]
+ *         [-d devices] [-f file]
+ *
+ * Opens connections kept alive, each with one request in flight, like as
+ * many boards posting as fast as they get answers. Requests are the text
+ * upload send_data() makes, or with -b, /batch uploads of that many packed
+ * samples. Prints requests/s and the latency percentiles.
+ *
+ * With -d the uploads come from that many simulated boards, sim0000 and
+ * up, each with its own X-Device-Id. Connection i posts as devices i,
+ * i + c, i + 2c, ... in turn, so -c equal to -d gives every board a
+ * connection of its own. With -f every board replays the rows of a
+ * data.txt, with their timestamps, each starting at a different place in
+ * the file and wrapping around at the end.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "datafile.h"
+
+#define MAX_CONNECTIONS 4096
+#define MAX_DEVICES 100000
+#define RESPONSE_MAX 4096
+#define REQUEST_HEAD_MAX 256
+#define PACKED_HEADER_SIZE 14
+#define PACKED_SAMPLE_SIZE 6
+#define SAMPLE_TIME_RANGE (1 << 17)
+
+typedef struct {
+    int fd;
+    int device; /* posting as, -1 without -d */
+    char* request;
+    size_t requestLength;
+    int samples; /* in the request */
+    size_t sent;   /* of the request */
+    char response[RESPONSE_MAX];
+    size_t received;
+    double started; /* of the request in flight */
+} Client;
+
+/* the rows of the file given with -f */
+typedef struct {
+    size_t count;
+    int64_t* timestamp;
+    double* temperature;
+    double* pressure;
+} Replay;
+
+static double
+Now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int
+CompareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+PutU32(unsigned char* out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out[i] = value >> (8 * i);
+}
+
+static void
+PutSample(unsigned char* out, uint32_t capturedAt, double temperature, double pressure) {
+    uint64_t bits = (uint64_t)(capturedAt & (SAMPLE_TIME_RANGE - 1)) |
+	(uint64_t)(lround(temperature * 100) & 0x3FFF) << 17 | (uint64_t)(lround(pressure * 100) & 0x1FFFF) << 31;
+    for (int b = 0; b < PACKED_SAMPLE_SIZE; ++b) out[b] = bits >> (8 * b);
+}
+
+/* a /batch body in the version 3 packed format, see esp32script/Sample.h */
+static size_t
+MakeBatch(unsigned char* body, int count) {
+    unsigned char header[PACKED_HEADER_SIZE] = { 'W', 'B', 3, 0, count & 0xFF, count >> 8 };
+    PutU32(header + 10, count * 5);
+    memcpy(body, header, sizeof(header));
+    for (int i = 0; i < count; ++i) {
+	PutSample(body + PACKED_HEADER_SIZE + i * PACKED_SAMPLE_SIZE, i * 5, 24.50 + i % 7 / 100.0, 1023.98 + i % 5 / 100.0);
+    }
+    return PACKED_HEADER_SIZE + count * PACKED_SAMPLE_SIZE;
+}
+
+/* up to count replayed rows from *at on, anchored to the first one's time like a synced board */
+static size_t
+MakeReplayBatch(unsigned char* body, int count, const Replay* replay, size_t* at) {
+    int64_t boot = replay->timestamp[*at];
+    int taken = 0;
+    while (taken < count) {
+	size_t row = *at;
+	int64_t age = replay->timestamp[row] - boot;
+	if (age < 0 || age >= SAMPLE_TIME_RANGE) {
+	    break; /* a board would have sent these long ago */
+	}
+	PutSample(body + PACKED_HEADER_SIZE + taken * PACKED_SAMPLE_SIZE, (uint32_t)age,
+		  replay->temperature[row], replay->pressure[row]);
+	++taken;
+	if (++*at == replay->count) {
+	    *at = 0;
+	    break;
+	}
+    }
+    unsigned char header[PACKED_HEADER_SIZE] = { 'W', 'B', 3, 0x01, taken & 0xFF, taken >> 8 };
+    PutU32(header + 6, (uint32_t)boot);
+    PutU32(header + 10, (uint32_t)(replay->timestamp[(*at ? *at : replay->count) - 1] - boot));
+    memcpy(body, header, sizeof(header));
+    return PACKED_HEADER_SIZE + taken * PACKED_SAMPLE_SIZE;
+}
+
+static int
+LoadReplay(Replay* replay, const char* path) {
+    FILE* file = fopen(path, "r");
+    DataReader reader;
+    if (!file || DataReaderOpen(&reader, file) != 0) {
+	return -1;
+    }
+    size_t cap = 0;
+    memset(replay, 0, sizeof(*replay));
+    int64_t timestamp;
+    double temperature, pressure;
+    while (DataReaderNext(&reader, &timestamp, &temperature, &pressure)) {
+	if (replay->count == cap) {
+	    cap = cap ? cap * 2 : 65536;
+	    replay->timestamp = realloc(replay->timestamp, cap * sizeof(int64_t));
+	    replay->temperature = realloc(replay->temperature, cap * sizeof(double));
+	    replay->pressure = realloc(replay->pressure, cap * sizeof(double));
+	    if (!replay->timestamp || !replay->temperature || !replay->pressure) {
+		abort();
+	    }
+	}
+	replay->timestamp[replay->count] = timestamp;
+	replay->temperature[replay->count] = temperature;
+	replay->pressure[replay->count] = pressure;
+	++replay->count;
+    }
+    DataReaderClose(&reader);
+    fclose(file);
+    return replay->count > 0 ? 0 : -1;
+}
+
+static int
+Connect(struct sockaddr_in* address) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)address, sizeof(*address)) != 0) {
+	close(fd);
+	return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* length of a complete response in the buffer, 0 if it isn't complete yet */
+static size_t
+ResponseLength(const char* response, size_t received) {
+    const char* headerEnd = memmem(response, received, "\r\n\r\n", 4);
+    if (!headerEnd) return 0;
+    size_t headerLength = headerEnd + 4 - response;
+    size_t contentLength = 0;
+    const char* value = memmem(response, headerLength, "Content-Length:", 15);
+    if (value) contentLength = strtoul(value + 15, NULL, 10);
+    return received >= headerLength + contentLength ? headerLength + contentLength : 0;
+}
+
+/* what every request is made of */
+typedef struct {
+    const char* host;
+    int port;
+    int batch;
+    int devices;
+    const Replay* replay; /* NULL without -f */
+    size_t* position;     /* per device, the next row it replays */
+    unsigned char* body;  /* the same every time without -f */
+    size_t bodyLength;
+} Workload;
+
+static size_t
+RequestMax(const Workload* load) {
+    return REQUEST_HEAD_MAX + (load->batch ? PACKED_HEADER_SIZE + load->batch * PACKED_SAMPLE_SIZE : 64);
+}
+
+/* the client's next request, as its current device */
+static void
+MakeRequest(const Workload* load, Client* client) {
+    static unsigned char replayBody[PACKED_HEADER_SIZE + 65535 * PACKED_SAMPLE_SIZE];
+    const unsigned char* body = load->body;
+    size_t bodyLength = load->bodyLength;
+    client->samples = load->batch ? load->batch : 1;
+    if (load->replay) {
+	size_t* at = &load->position[client->device >= 0 ? client->device : 0];
+	const Replay* replay = load->replay;
+	body = replayBody;
+	if (load->batch) {
+	    bodyLength = MakeReplayBatch(replayBody, load->batch, replay, at);
+	    client->samples = (bodyLength - PACKED_HEADER_SIZE) / PACKED_SAMPLE_SIZE;
+	} else {
+	    bodyLength = sprintf((char*)replayBody, "%.2f %.2f %lld", replay->temperature[*at],
+				 replay->pressure[*at], (long long)replay->timestamp[*at]);
+	    *at = (*at + 1) % replay->count;
+	}
+    }
+    char device[48] = "";
+    if (client->device >= 0) {
+	snprintf(device, sizeof(device), "X-Device-Id: sim%04d\r\n", client->device);
+    }
+    client->requestLength = sprintf(client->request, "POST %s HTTP/1.1\r\nHost: %s:%d\r\n%sContent-Type: %s\r\n"
+				    "Content-Length: %zu\r\n\r\n", load->batch ? "/batch" : "/", load->host, load->port,
+				    device, load->batch ? "application/octet-stream" : "application/x-www-form-urlencoded",
+				    bodyLength);
+    memcpy(client->request + client->requestLength, body, bodyLength);
+    client->requestLength += bodyLength;
+}
+
+int
+main(int argc, char* argv[]) {
+    const char* host = "127.0.0.1";
+    int port = 8000;
+    int connections = 64;
+    long total = 100000;
+    int batch = 0;
+    int devices = 0;
+    const char* replayFile = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "a:p:c:n:b:d:f:")) != -1) {
+	switch (option) {
+	case 'a': host = optarg; break;
+	case 'p': port = atoi(optarg); break;
+	case 'c': connections = atoi(optarg); break;
+	case 'n': total = atol(optarg); break;
+	case 'b': batch = atoi(optarg); break;
+	case 'd': devices = atoi(optarg); break;
+	case 'f': replayFile = optarg; break;
+	default:
+	    fprintf(stderr, "usage: %s [-a address] [-p port] [-c connections] [-n requests] [-b samples] "
+		    "[-d devices] [-f file]\n", argv[0]);
+	    return 1;
+	}
+    }
+    if (connections < 1 || connections > MAX_CONNECTIONS || total < 1 || batch < 0 || batch > 65535 ||
+	devices < 0 || devices > MAX_DEVICES) {
+	fprintf(stderr, "bad arguments\n");
+	return 1;
+    }
+    if (connections > total) connections = total;
+
+    Replay replay;
+    static unsigned char body[PACKED_HEADER_SIZE + 65535 * PACKED_SAMPLE_SIZE];
+    Workload load = { host, port, batch, devices, NULL, NULL, body, 0 };
+    if (replayFile) {
+	if (LoadReplay(&replay, replayFile) != 0) {
+	    fprintf(stderr, "No rows in %s\n", replayFile);
+	    return 1;
+	}
+	load.replay = &replay;
+	/* every board starts somewhere else in the file */
+	int boards = devices ? devices : 1;
+	load.position = malloc(boards * sizeof(size_t));
+	for (int d = 0; d < boards; ++d) {
+	    load.position[d] = replay.count * d / boards;
+	}
+	printf("Replaying %zu rows of %s\n", replay.count, replayFile);
+    } else {
+	load.bodyLength = batch ? MakeBatch(body, batch) : (size_t)sprintf((char*)body, "24.50 1023.98");
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+	fprintf(stderr, "%s is not an IPv4 address\n", host);
+	return 1;
+    }
+
+    int epollFd = epoll_create1(0);
+    Client* clients = calloc(connections, sizeof(Client));
+    double* latencies = malloc(total * sizeof(double));
+    long started = 0, done = 0, errors = 0;
+    double samples = 0;
+    double start = Now();
+    for (int i = 0; i < connections; ++i) {
+	clients[i].fd = Connect(&address);
+	if (clients[i].fd < 0) {
+	    perror("connect");
+	    return 1;
+	}
+	clients[i].device = devices ? i % devices : -1;
+	clients[i].request = malloc(RequestMax(&load));
+	MakeRequest(&load, &clients[i]);
+	struct epoll_event event = { EPOLLOUT, { .ptr = &clients[i] } };
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, clients[i].fd, &event);
+	clients[i].started = Now();
+	++started;
+    }
+    struct epoll_event events[256];
+    while (done < total) {
+	int count = epoll_wait(epollFd, events, 256, 10000);
+	if (count <= 0) {
+	    fprintf(stderr, "no answer for 10 s, giving up after %ld requests\n", done);
+	    break;
+	}
+	for (int e = 0; e < count; ++e) {
+	    Client* client = events[e].data.ptr;
+	    if (client->sent < client->requestLength) {
+		ssize_t n = send(client->fd, client->request + client->sent, client->requestLength - client->sent,
+				 MSG_NOSIGNAL);
+		if (n < 0 && errno != EAGAIN) {
+		    perror("send");
+		    return 1;
+		}
+		if (n > 0) client->sent += n;
+		if (client->sent == client->requestLength) {
+		    struct epoll_event event = { EPOLLIN, { .ptr = client } };
+		    epoll_ctl(epollFd, EPOLL_CTL_MOD, client->fd, &event);
+		}
+		continue;
+	    }
+	    ssize_t n = recv(client->fd, client->response + client->received, RESPONSE_MAX - client->received, 0);
+	    if (n < 0 && errno == EAGAIN) continue;
+	    if (n <= 0) {
+		fprintf(stderr, "connection closed by the server\n");
+		return 1;
+	    }
+	    client->received += n;
+	    size_t length = ResponseLength(client->response, client->received);
+	    if (length == 0) continue;
+	    latencies[done++] = Now() - client->started;
+	    samples += client->samples;
+	    if (strncmp(client->response, "HTTP/1.1 200", 12) != 0 && strncmp(client->response, "HTTP/1.0 200", 12) != 0) {
+		++errors;
+	    }
+	    if (memmem(client->response, length, "Connection: close", 17) || started >= total) {
+		/* server.py answers once per connection */
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+		close(client->fd);
+		if (started >= total) continue;
+		client->fd = Connect(&address);
+		if (client->fd < 0) {
+		    perror("connect");
+		    return 1;
+		}
+		struct epoll_event event = { EPOLLOUT, { .ptr = client } };
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, client->fd, &event);
+	    } else {
+		struct epoll_event event = { EPOLLOUT, { .ptr = client } };
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, client->fd, &event);
+	    }
+	    if (devices) client->device = (client->device + connections) % devices;
+	    MakeRequest(&load, client);
+	    client->sent = 0;
+	    client->received = 0;
+	    client->started = Now();
+	    ++started;
+	}
+    }
+    double seconds = Now() - start;
+
+    if (done == 0) {
+	return 1;
+    }
+    qsort(latencies, done, sizeof(double), CompareDoubles);
+    printf("%ld requests over %d connections", done, connections);
+    if (devices) printf(" from %d devices", devices);
+    printf(" in %.2fs, %ld failed\n", seconds, errors);
+    printf("%.0f requests/s, %.0f samples/s\n", done / seconds, samples / seconds);
+    printf("latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", latencies[done / 2] * 1000,
+	   latencies[done * 9 / 10] * 1000, latencies[done * 99 / 100] * 1000, latencies[done - 1] * 1000);
+    free(latencies);
+    for (int i = 0; i < connections; ++i) {
+	free(clients[i].request);
+    }
+    free(clients);
+    return errors > 0 || done < total;
+}
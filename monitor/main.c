@@ -4,9 +4,22 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <stdio.h>
-#include <time.h>
+#include <string.h>
 #include <math.h>
+#include <dirent.h>
+#include <stdlib.h>
 #include <sys/stat.h>
+#include "datafile.h"
+#include "follow.h"
+#include "samples.h"
+#include "render.h"
+#include "aggregate.h"
+#include "control.h"
+#include "rollup.h"
+#include "latency.h"
+/* an hour of rows a second apart */
+#define ROLLING_CAPACITY 4096
+#include "../esp32script/RollingStats.h"
 
 #define bool int
 #define true 1
@@ -16,6 +29,8 @@
 #define KILO (1024)
 #define MEGA (1024 * KILO)
 #define GIGA (1024 * MEGA)
+#define MAX_SAMPLES (1024 * MEGA) /* address space only, 24GB of it */
+#define DEVICE_SAMPLES (64 * MEGA) /* per device, 1.5GB of address space each */
 
 #define SCREEN_WIDTH (1080)
 #define SCREEN_HEIGHT (720)
@@ -33,15 +48,6 @@ typedef struct {
     int b;
 } Color;
 
-typedef struct {
-    char date[11];
-    char time[9];
-    int days;
-    int seconds;
-    double temperature;
-    double pressure;
-} Data;
-
 Color
 RGB(int r, int g, int b) {
     Color color;
@@ -51,8 +57,151 @@ RGB(int r, int g, int b) {
     return color;
 }
 
+typedef struct {
+    Samples* samples;
+    int* dataIndex;
+    window_model* windowModel;
+} DataTarget;
+
+/* FollowRows callback, appends new rows to the sample columns and feeds
+ * them to the window decision, the same one the board makes */
+void
+AppendRows(void* user, const int64_t* timestamp, const double* temperature, const double* pressure, size_t count) {
+    DataTarget* target = user;
+    size_t taken = SamplesAppend(target->samples, timestamp, temperature, pressure, count);
+    if (taken < count) {
+	printf("No room for %zu more rows, dropping them\n", count - taken);
+    }
+    *target->dataIndex = target->samples->count;
+    for (size_t i = 0; i < taken; ++i) {
+	window_push(target->windowModel, (uint32_t)timestamp[i], temperature[i], pressure[i]);
+    }
+}
+
+/* One board's data: the server's own data file, where boards without an
+ * ID go, or the one in devices/<id>/. Each has its own columns and window
+ * model. All of them take their rows as they come in, inotify says which,
+ * but only the ones on screen are drawn. Only the raw rows the server
+ * keeps are loaded, the time before them is read from the rollup tiers
+ * next to the file, which stay mapped, see rollup.h. */
+#define DEVICES_DIR "../devices"
+/* the board's control port, overrides go there */
+#define BOARD_HOST "192.168.130.249"
+#define BOARD_PORT 80
+#define MAX_STREAMS 1024
+#define OVERLAY_MAX 8 /* streams drawn over each other */
+
+typedef struct {
+    char name[64]; /* the device ID, or the path of the server's own file */
+    Follower follower;
+    Samples samples;
+    History history;
+    window_model windowModel;
+    int dataIndex;
+    DataTarget target;
+} Stream;
+
+/* returns NULL if the file can't be opened or the memory reserved */
+Stream*
+OpenStream(FollowGroup* group, const char* name, const char* path, size_t maxSamples) {
+    Stream* stream = calloc(1, sizeof(Stream));
+    if (!stream) {
+	return NULL;
+    }
+    snprintf(stream->name, sizeof(stream->name), "%s", name);
+    if (SamplesInit(&stream->samples, maxSamples) != 0) {
+	free(stream);
+	return NULL;
+    }
+    if (FollowerOpenIn(&stream->follower, group, path) != 0) {
+	SamplesFree(&stream->samples);
+	free(stream);
+	return NULL;
+    }
+    HistoryOpen(&stream->history, path);
+    window_init(&stream->windowModel);
+    stream->target.samples = &stream->samples;
+    stream->target.dataIndex = &stream->dataIndex;
+    stream->target.windowModel = &stream->windowModel;
+    return stream;
+}
+
+void
+CloseStream(Stream* stream) {
+    FollowerClose(&stream->follower);
+    HistoryClose(&stream->history);
+    SamplesFree(&stream->samples);
+    free(stream);
+}
+
+/* the first second of a stream with rows, rolled up or raw, and one past the last */
+double
+FirstTime(const Stream* stream) {
+    return (double)min(HistoryFirst(&stream->history), stream->samples.timestamp[0]);
+}
+
+double
+EndTime(const Stream* stream) {
+    return stream->samples.timestamp[stream->dataIndex - 1] + 1;
+}
+
+int
+CompareStreamNames(const void* a, const void* b) {
+    return strcmp((*(Stream* const*)a)->name, (*(Stream* const*)b)->name);
+}
+
+/* Opens a stream for every device directory that has none yet, the binary
+ * file if there is one. Device streams are kept in name order after the
+ * first stream. Returns true if a directory had no file in it yet, the
+ * server creates it just before, so it is worth looking again shortly. */
+bool
+AddDeviceStreams(FollowGroup* group, Stream** streams, int* streamCount, int firstDevice) {
+    DIR* dir = opendir(DEVICES_DIR);
+    if (!dir) {
+	return false;
+    }
+    bool incomplete = false;
+    int before = *streamCount;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && *streamCount < MAX_STREAMS) {
+	if (entry->d_name[0] == '.') {
+	    continue;
+	}
+	bool known = false;
+	for (int s = firstDevice; s < *streamCount && !known; ++s) {
+	    known = strcmp(streams[s]->name, entry->d_name) == 0;
+	}
+	char path[4096];
+	struct stat info;
+	snprintf(path, sizeof(path), DEVICES_DIR "/%s", entry->d_name);
+	if (known || stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+	    continue;
+	}
+	snprintf(path, sizeof(path), DEVICES_DIR "/%s/data.wdb", entry->d_name);
+	if (stat(path, &info) != 0) {
+	    snprintf(path, sizeof(path), DEVICES_DIR "/%s/data.txt", entry->d_name);
+	    if (stat(path, &info) != 0) {
+		incomplete = true;
+		continue;
+	    }
+	}
+	Stream* stream = OpenStream(group, entry->d_name, path, DEVICE_SAMPLES);
+	if (stream) {
+	    streams[(*streamCount)++] = stream;
+	} else {
+	    printf("Can't open %s\n", path);
+	}
+    }
+    closedir(dir);
+    if (*streamCount > before) {
+	qsort(streams + firstDevice, *streamCount - firstDevice, sizeof(Stream*), CompareStreamNames);
+    }
+    return incomplete;
+}
+
+
 void
-ExitSequence(SDL_Window* window, SDL_Renderer* renderer, Data* data) {
+ExitSequence(SDL_Window* window, SDL_Renderer* renderer, Stream** streams, int streamCount) {
     printf("Exit...");
    
     IMG_Quit();
@@ -66,9 +215,8 @@ ExitSequence(SDL_Window* window, SDL_Renderer* renderer, Data* data) {
 	renderer = NULL;
     }
 
-    if (data) {
-	free(data);
-	data = NULL;
+    for (int s = 0; s < streamCount; ++s) {
+	CloseStream(streams[s]);
     }
     
     SDL_Quit();
@@ -77,73 +225,369 @@ ExitSequence(SDL_Window* window, SDL_Renderer* renderer, Data* data) {
     exit(1);
 }
 
-void
-BlitChar(SDL_Renderer* renderer, SDL_Texture *atlas, char c, int x, int y, int charWidth) {
-    SDL_Rect dest;
-    dest.x = x;
-    dest.y = y;
-    dest.w = charWidth;
-    SDL_QueryTexture(atlas, NULL, NULL, NULL, &dest.h);
-    
-    SDL_Rect src;
-    src.x = ((int)c - 32) * charWidth; /* the first 32 ascii codes aren't on the atlas */
-    src.y = 0;
-    src.w = (int)charWidth;
-    src.h = 31;
-    SDL_RenderCopy(renderer, atlas, &src, &dest);
+void SDL_SetRenderDrawColorRGB(SDL_Renderer* renderer, Color color) {
+    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, 255);
 }
 
-void
-BlitChars(SDL_Renderer* renderer, SDL_Texture* atlas, char* s, int count, int x, int y, int charWidth) {
-    for (int i = 0; i < count; ++i) {
-	BlitChar(renderer, atlas, s[i], x, y, charWidth);
-	x += charWidth;
-    }
+double LinearMap(double value, double fromLow, double fromHigh, double toLow, double toHigh) {
+    return (value - fromLow) / (fromHigh - fromLow) * (toHigh - toLow) + toLow;
 }
 
+/* Layout and looks of one graph. Each graph is drawn into a screen sized
+ * texture of its own and only the part inside area is shown. It is drawn
+ * again only when what it shows changed, an idle frame just copies it. */
+typedef struct {
+    const char* title;
+    SDL_Rect area; /* screen region owned by the graph */
+    int x;	   /* graph box */
+    int x2;	   /* where samples end */
+    Color background;
+    Color lineColor;
+    Color dataColor;
+    const float* levels; /* grid spacings, coarse to fine */
+    int levelCount;
+    bool labelsRight; /* min/max labels right of the box, else left */
+    int labelChars;
+    bool pressure; /* the channel shown, else temperature */
+    SDL_Texture* panel;
+    /* what the panel holds */
+    bool valid;
+    double start;
+    double end;
+    float shift;
+    unsigned generation;
+} Graph;
+
+/* Where a frame's time goes: reading new rows (since the last frame),
+ * the statistics and window decision, drawing the graphs, text, and the
+ * present, which waits for the GPU. Plot is what is left of the drawing
+ * once the statistics and text are taken out. */
+enum {
+    PHASE_INGEST,
+    PHASE_STATS,
+    PHASE_PLOT,
+    PHASE_TEXT,
+    PHASE_PRESENT,
+    PHASE_COUNT
+};
+
+const char* phaseNames[PHASE_COUNT] = { "ingest", "stats", "plot", "text", "present" };
+
+typedef struct {
+    double ms[PHASE_COUNT]; /* of the last frame */
+    Latency latency[PHASE_COUNT]; /* of every frame, printed at exit */
+} FrameTimes;
 
-void DataExpand(Data *data, int* dataCap) {
-    Data* new = (Data*)malloc((*dataCap + MEGA) * sizeof(Data));
-    memccpy(new, data, *dataCap, sizeof(Data));
-    free(data);
-    data = new;
-    *dataCap += MEGA;
-    printf("Data expanded to %dMB\n", *dataCap/MEGA);
+/* what other streams are drawn in, the selected one gets the graph's own color */
+const Color overlayColors[OVERLAY_MAX - 1] = {
+    { 255, 196, 61 }, { 97, 200, 255 }, { 255, 120, 80 }, { 180, 140, 255 },
+    { 120, 255, 120 }, { 255, 140, 220 }, { 200, 200, 200 }
+};
+
+const Pyramid*
+ChannelLod(const Samples* samples, bool pressure) {
+    return pressure ? &samples->pressureLod : &samples->temperatureLod;
 }
 
-void SDL_SetRenderDrawColorRGB(SDL_Renderer* renderer, Color color) {
-    SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, 255);
+const double*
+ChannelValues(const Samples* samples, bool pressure) {
+    return pressure ? samples->pressure : samples->temperature;
 }
 
-double LinearMap(double value, double fromLow, double fromHigh, double toLow, double toHigh) {
-    return (value - fromLow) / (fromHigh - fromLow) * (toHigh - toLow) + toLow;
+Uint64
+NowTicks(void) {
+    return SDL_GetPerformanceCounter();
+}
+
+double
+MillisecondsSince(Uint64 ticks) {
+    return 1000.0 * (double)(SDL_GetPerformanceCounter() - ticks) / (double)SDL_GetPerformanceFrequency();
+}
+
+/* where the raw rows take over from the rollups, on the minute of the first one */
+int64_t
+RawStart(const Stream* stream) {
+    return stream->dataIndex > 0 ? stream->samples.timestamp[0] / 60 * 60 : INT64_MAX;
+}
+
+/* One channel over [from, to): the pyramid of the raw rows from where they
+ * start, before that the coarsest rollup tier with buckets no longer than
+ * step. The sums are relative to the pyramid's shift either way. */
+Summary
+StreamSummary(const Stream* stream, bool pressure, int64_t from, int64_t to, int64_t step) {
+    const Samples* samples = &stream->samples;
+    int64_t rawStart = RawStart(stream);
+    Summary s = EmptySummary();
+    if (from < rawStart) {
+	Summary temperature, pressures;
+	HistoryQuery(&stream->history, from, min(to, rawStart), step, samples->temperatureLod.shift,
+		     samples->pressureLod.shift, &temperature, &pressures);
+	s = pressure ? pressures : temperature;
+	from = rawStart;
+    }
+    if (from < to) {
+	Summary raw = PyramidQuery(ChannelLod(samples, pressure), ChannelValues(samples, pressure),
+				   SamplesFind(samples, from), SamplesFind(samples, to));
+	MergeSummary(&s, &raw);
+    }
+    return s;
+}
+
+/* shown[0] is the selected stream, its statistics and min/max are the ones
+ * labelled. The others are drawn under it, and the axes fit all of them.
+ * Returns the milliseconds spent on the statistics. */
+double
+DrawGraph(SDL_Renderer* renderer, TextCache* text, const Font* font, const Font* smallFont,
+	  RectBatch* rects, PointBatch* dots, Graph* graph, Stream* const* shown, int shownCount,
+	  double start, double end, float shift) {
+    const Color backgroundColor = RGB(54,51,95);
+    const Color graphFrameColor = RGB(255,255,255);
+    const Color dottedLineColor = RGB(255,255,255);
+    int graphY = 50;
+    int graphW = 400;
+    int graphH = 300;
+    int graphY2 = graphY + graphH;
+
+    SDL_SetRenderTarget(renderer, graph->panel);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColorRGB(renderer, backgroundColor);
+    SDL_RenderClear(renderer);
+
+    /* the rows from start to end, timestamps are whole seconds */
+    size_t low[OVERLAY_MAX];
+    size_t high[OVERLAY_MAX];
+    int64_t from = (int64_t)ceil(start);
+    int64_t to = (int64_t)ceil(end);
+    int64_t step = max(1, (to - from) / (graph->x2 - graph->x)); /* a pixel column */
+
+    /* find max and min */
+    /* min/max/sum come from the pyramid and the rollups, a frame costs the
+     * same however much is visible */
+    Uint64 statsStart = NowTicks();
+    Summary own = EmptySummary();
+    Summary range = EmptySummary(); /* only min, max and count, the sums have different shifts */
+    for (int s = 0; s < shownCount; ++s) {
+	const Samples* samples = &shown[s]->samples;
+	low[s] = SamplesFind(samples, from);
+	high[s] = SamplesFind(samples, to);
+	Summary r = StreamSummary(shown[s], graph->pressure, from, to, step);
+	if (s == 0) own = r;
+	range.min = min(range.min, r.min);
+	range.max = max(range.max, r.max);
+	range.count += r.count;
+    }
+    double statsMs = MillisecondsSince(statsStart);
+    float displayRangeLow = (range.max - range.min) * -0.2 + range.min;
+    float displayRangeHigh = range.max + (range.max - range.min) * 0.2;
+
+    /* graph title */
+    DrawText(text, font, graph->title, graph->x, graphY - CHAR_HEIGHT);
+
+    /* graph background */
+    SDL_SetRenderDrawColorRGB(renderer, graph->background);
+    RectBatchAdd(rects, graph->x, graphY, graphW, graphH);
+    RectBatchFill(renderer, rects);
+
+    if (range.count == 0) {
+	DrawText(text, font, "No data", graph->x + CHAR_WIDTH, graphY + CHAR_HEIGHT);
+	displayRangeLow = displayRangeHigh = 0;
+    }
+
+    /* Horizontal whole number lines */
+    float displayDiff = (displayRangeHigh - displayRangeLow) / 5.0f;
+    float definitionLevel = graph->levels[0];
+    for (int i = 0; i < graph->levelCount; ++i) {
+	if (displayDiff <= graph->levels[i]) {
+	    definitionLevel = graph->levels[i];
+	} else {
+	    break;
+	}
+    }
+    float lineValue = 0;
+    while (lineValue < displayRangeLow) {
+	lineValue += definitionLevel;
+    }
+    while (lineValue < displayRangeHigh) {
+	int y = (int)(LinearMap(lineValue, displayRangeLow, displayRangeHigh, graphY2, graphY));
+	RectBatchAdd(rects, graph->x, y, graphW + 1, 1);
+	char num[7];
+	snprintf(num, sizeof(num), "%.2f", lineValue);
+	DrawText(text, smallFont, num, graph->x + SMALL_CHAR_WIDTH, y);
+	lineValue += definitionLevel;
+    }
+    SDL_SetRenderDrawColorRGB(renderer, graph->lineColor);
+    RectBatchFill(renderer, rects);
+
+    /* Data points */
+    /* Samples are placed by time, so an outage shows as a gap. A few raw
+     * ones are drawn one by one. Past that, or before the raw rows, every
+     * pixel column gets one vertical line from the min to the max of its
+     * slice of time. The selected stream goes last, on top. */
+    bool drewMin = false;
+    bool drewMax = false;
+    int labelX = graph->labelsRight ? graph->x + graphW + CHAR_WIDTH/2 : graph->x - 4.5 * CHAR_WIDTH;
+    int lineEnd = graph->labelsRight ? graph->x + graphW + CHAR_WIDTH/2 : graph->x - CHAR_WIDTH/2;
+    for (int s = shownCount - 1; s >= 0; --s) {
+	const Samples* samples = &shown[s]->samples;
+	const Pyramid* lod = ChannelLod(samples, graph->pressure);
+	const double* values = ChannelValues(samples, graph->pressure);
+	int visibleCount = high[s] - low[s];
+	bool drawRect = visibleCount < 1000 && from >= RawStart(shown[s]);
+	int columns = drawRect ? visibleCount : graph->x2 - graph->x;
+	size_t row = low[s];
+	int64_t columnStart = from;
+	for (int c = 0; c < columns; ++c) {
+	    Summary column;
+	    int x;
+	    if (drawRect) {
+		column = PyramidQuery(lod, values, row, row + 1);
+		x = (int)LinearMap(samples->timestamp[row++], start, end, graph->x, graph->x2);
+	    } else {
+		int64_t columnEnd = c + 1 < columns ? (int64_t)ceil(LinearMap(c + 1, 0, columns, start, end)) : to;
+		column = StreamSummary(shown[s], graph->pressure, columnStart, columnEnd, step);
+		columnStart = columnEnd;
+		x = graph->x + c;
+		if (column.count == 0) {
+		    continue; /* nothing was recorded in this slice */
+		}
+	    }
+	    int yMin = ((int)LinearMap(column.min, displayRangeLow, displayRangeHigh, graphY2, graphY));
+	    int yMax = ((int)LinearMap(column.max, displayRangeLow, displayRangeHigh, graphY2, graphY));
+	    if (drawRect) {
+		RectBatchAdd(rects, x, yMin, 2, 2);
+	    } else {
+		RectBatchAdd(rects, x, yMax, 1, yMin - yMax + 1);
+	    }
+	    for (int m = 0; m < 2 && s == 0; ++m) {
+		double value = m ? column.max : column.min;
+		int y = m ? yMax : yMin;
+		if ((value == own.min && !drewMin) || (value == own.max && !drewMax)) {
+		    /* horizontal dotted line */
+		    char label[8];
+		    snprintf(label, graph->labelChars + 1, "%.2f", value);
+		    DrawText(text, font, label, labelX, y - CHAR_HEIGHT/2);
+		    PointBatchDottedLine(dots, x, y, lineEnd, y, shift);
+		}
+		if (value == own.min) drewMin = true;
+		if (value == own.max) drewMax = true;
+	    }
+	}
+	SDL_SetRenderDrawColorRGB(renderer, s ? overlayColors[(s - 1) % (OVERLAY_MAX - 1)] : graph->dataColor);
+	RectBatchFill(renderer, rects);
+    }
+    SDL_SetRenderDrawColorRGB(renderer, dottedLineColor);
+    PointBatchDraw(renderer, dots);
+
+    char textBuffer[51];
+    sprintf(textBuffer, "Average: %.2f", own.count ? SummaryMean(ChannelLod(&shown[0]->samples, graph->pressure), own) : 0);
+    DrawText(text, font, textBuffer, graph->x, graphY2 + 2 * CHAR_HEIGHT);
+    sprintf(textBuffer, "St Deviation: %.2f", SummaryStd(own));
+    DrawText(text, font, textBuffer, graph->x, graphY2 + 3 * CHAR_HEIGHT);
+
+    /* frame */
+    SDL_SetRenderDrawColorRGB(renderer, graphFrameColor);
+    RectBatchAdd(rects, graph->x, graphY, graphW, graphH);
+    RectBatchOutline(renderer, rects);
+
+    SDL_SetRenderTarget(renderer, NULL);
+    graph->valid = true;
+    graph->start = start;
+    graph->end = end;
+    graph->shift = shift;
+    return statsMs;
+}
+
+/* Wakes the main loop when a data file changes. inotify can't be waited
+ * on through SDL, so a thread waits on it and pushes an event. */
+typedef struct {
+    FollowGroup* group;
+    Uint32 eventType;
+    SDL_sem* polled; /* the main thread read the file since the event */
+    volatile int quit;
+} FileWaker;
+
+int
+WatchFile(void* user) {
+    FileWaker* waker = user;
+    while (!waker->quit) {
+	if (FollowGroupWait(waker->group, 500)) {
+	    SDL_Event event;
+	    memset(&event, 0, sizeof(event));
+	    event.type = waker->eventType;
+	    SDL_PushEvent(&event);
+	    /* the descriptor stays readable until the main thread drains it */
+	    while (!waker->quit && SDL_SemWaitTimeout(waker->polled, 500) != 0) {
+	    }
+	}
+    }
+    return 0;
 }
 
+/* Control callback, on the control thread. The status is read when the
+ * frame is drawn, the event only wakes the loop. */
 void
-DrawDottedLine(SDL_Renderer* renderer, int x1, int y1, int x2, int y2, float shift) {
-    float dx = (float)(x2 - x1);
-    float dy = (float)(y2 - y1);
-    float length = sqrt(dx*dx + dy*dy);
-    float segmentLength = 3.0f;
-    int segmentCount = (int)(length / segmentLength);
-    float dxs = dx / segmentCount;
-    float dys = dy / segmentCount;
-    shift = shift - floorf(shift);
-    int x = x1 + shift * 2 * dxs;
-    int y = y1 + shift * 2 * dys;
-    if (shift > 0.5f) {
-	SDL_RenderDrawLine(renderer, x1, y1, x - shift*dxs, y - shift*dys);
-    }
-    for (int i = 0; i < segmentCount - 2; i += 2) {
-	SDL_RenderDrawLine(renderer, x, y, x + dxs, y + dys);
-	x += dxs * 2;
-	y += dys * 2;
-    }
-    SDL_RenderDrawLine(renderer, x, y, x1 + segmentCount * dxs, y2 + segmentCount * dys);
+ControlChanged(void* user) {
+    SDL_Event event;
+    memset(&event, 0, sizeof(event));
+    event.type = *(Uint32*)user;
+    SDL_PushEvent(&event);
+}
+
+/* What the view can be zoomed to, in seconds */
+#define HOUR 3600.0
+#define DAY (24 * HOUR)
+#define MIN_SPAN (10 * 60.0)
+
+/* moves a tenth of the way to target, and snaps once the rest is too small to see */
+double
+CatchUp(double value, double target, double span) {
+    double rest = target - value;
+    return fabs(rest) < span / 1000 ? target : value + rest / 10;
+}
+
+/* the binary file if the server writes one */
+const char*
+DefaultDataFile(void) {
+    struct stat file_info;
+    if (stat("../data.wdb", &file_info) == 0) return "../data.wdb";
+    return "../data.txt";
+}
+
+/* Headless mode: exe --stats hour|day [file]
+ * Hourly or daily statistics of the whole file as CSV on stdout, without
+ * opening a window or touching SDL. */
+int
+WriteStats(const char* periodName, const char* filename) {
+    int period;
+    if (strcmp(periodName, "hour") == 0) {
+	period = AGGREGATE_HOUR;
+    } else if (strcmp(periodName, "day") == 0) {
+	period = AGGREGATE_DAY;
+    } else {
+	fprintf(stderr, "usage: exe --stats hour|day [file]\n");
+	return 1;
+    }
+    Uint64 start = SDL_GetPerformanceCounter();
+    Aggregate aggregate;
+    if (AggregateFile(&aggregate, filename, period, 0) != 0) {
+	fprintf(stderr, "Can't read %s\n", filename);
+	return 1;
+    }
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    AggregateWriteCsv(&aggregate, stdout);
+    fprintf(stderr, "%s: %llu rows, %llu malformed, %.1f MB in %.3fs on %d threads\n", filename,
+	    (unsigned long long)aggregate.rows, (unsigned long long)aggregate.badLines,
+	    aggregate.bytes / 1e6, seconds, aggregate.threads);
+    AggregateFree(&aggregate);
+    return 0;
 }
 
 int
 main(int argc, char* argv[]) {
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--stats") == 0) {
+	return WriteStats(argv[2], argc == 4 ? argv[3] : DefaultDataFile());
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
 	printf("Init SDL failed\n");
 	return 0;
@@ -157,141 +601,251 @@ main(int argc, char* argv[]) {
 
     if (!window) {
 	printf("create window failed");
-	ExitSequence(window, NULL, NULL);
+	ExitSequence(window, NULL, NULL, 0);
     }
 
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
 
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1,
-						SDL_RENDERER_ACCELERATED);
+						SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
     if (!renderer) {
 	printf("create renderer failed");
-	ExitSequence(window, renderer, NULL);
+	ExitSequence(window, renderer, NULL, 0);
     }
 
     /* Init IMG */
     if (IMG_Init(IMG_INIT_PNG) < 0) {
 	printf("IMG_Init failed\n");
-	ExitSequence(window, renderer, NULL);
+	ExitSequence(window, renderer, NULL, 0);
     }
     
     /* load font atlas png */
-    SDL_Texture* fontAtlas;
-    char* fontFile = "font.png";
-    printf("Loading %s\n", fontFile);
-    fontAtlas = IMG_LoadTexture(renderer, fontFile);
-    if (!fontAtlas) {
-	printf("Failed to load %s\n", fontFile);
-    }
-    
-    SDL_Texture* smallFontAtlas;
-    char* smallFontFile = "smallfont.png";
-    printf("Loading %s\n", smallFontFile);
-    smallFontAtlas = IMG_LoadTexture(renderer, smallFontFile);
-    if (!smallFontAtlas) {
-	printf("Failed to load %s\n", smallFontFile);
-    }
+    Font font;
+    FontLoad(&font, renderer, "font.png", CHAR_WIDTH);
+    Font smallFont;
+    FontLoad(&smallFont, renderer, "smallfont.png", SMALL_CHAR_WIDTH);
+
+    /* rendered strings, and batches reused every frame */
+    TextCache text;
+    TextCacheInit(&text, renderer);
+    RectBatch rects = { 0 };
+    PointBatch dots = { 0 };
+    bool showStats = false;
+    RenderStats lastStats = { 0 };
+    double lastFrameMs = 0;
+    int lastDirtyGraphs = 0;
+    static FrameTimes frameTimes;
+    double ingestMs = 0; /* reading rows since the last frame */
 
     printf("Init Successful\n");
 
-    Data* data = (Data*)malloc(MEGA * sizeof(Data));
-    struct stat file_info;
-    int dataCap = MEGA;
-    int dataIndex = 0;
-    int visibleIndexLow = 0;
-    int visibleIndexHigh = dataIndex;
-    int targetVisibleIndexLow = visibleIndexLow;
-    int targetVisibleIndexHigh = visibleIndexHigh;
+    /* The view is a range of time, seconds since the epoch. It moves
+     * towards the target a bit every frame. */
+    double viewStart = 0;
+    double viewEnd = 0;
+    double targetStart = 0;
+    double targetEnd = 0;
+    char dateEntry[11]; /* YYYY-MM-DD typed after [g] */
+    int dateLength = -1; /* -1 when not typing one */
     
-    /* read data file */
-    char* filename = "../data.txt";
+    /* read the data files, the binary ones if the server writes them: the
+     * server's own file and one per device, or just the file asked for */
+    static Stream* streams[MAX_STREAMS];
+    int streamCount = 0;
+    int firstDevice = 0; /* where the device streams start */
+    FollowGroup group;
+    FollowGroupInit(&group);
+    const char* filename = DefaultDataFile();
     if (argc == 2) filename = argv[1];
-    FILE* file = fopen(filename, "r");
-    printf("Opening file %s\n", filename);
-    if (file == NULL) {
-	printf("Can't open file\n");
-	ExitSequence(window, renderer, data);
-    } else {
-	// Load data file
-	if (stat(filename, &file_info) != 0) {
-	    printf("Failed to retrieve file edit time\n");
-	} else {
-	    printf("File size: %lld bytes\n", (long long)file_info.st_size);	    
-	    Data inData;
-	    while (fscanf(file, "%s %s %lf %lf", inData.date, inData.time, &inData.temperature, &inData.pressure) == 4) {
-		if (dataIndex == dataCap) {
-		    DataExpand(data, &dataCap);
-		}
-		int year, month, day;
-		int hour, minute, second;
-		sscanf(inData.date, "%d-%d-%d", &year, &month, &day);
-		inData.days = 365*year + 30*month + day;
-		sscanf(inData.time, "%d-%d-%d", &hour, &minute, &second);
-		inData.seconds = 3600*hour + 60*minute + second;
-		data[dataIndex] = inData;
-		++dataIndex;
-		++targetVisibleIndexHigh;
-	    }
+    struct stat fileInfo;
+    if (argc == 2 || stat(filename, &fileInfo) == 0) {
+	printf("Opening file %s\n", filename);
+	/* columns never move once they are in, the pointers stay valid as they grow */
+	streams[0] = OpenStream(&group, filename, filename, MAX_SAMPLES);
+	if (!streams[0]) {
+	    printf("Can't open file\n");
+	    ExitSequence(window, renderer, NULL, 0);
 	}
-
-	fclose(file);
-	printf("Read %d rows from file\n", dataIndex);
+	streamCount = firstDevice = 1;
+    }
+    bool devicesPending = false; /* a device directory without a file yet */
+    Uint64 devicesChecked = 0;
+    if (argc != 2) {
+	FollowGroupWatchDirectory(&group, DEVICES_DIR);
+	devicesPending = AddDeviceStreams(&group, streams, &streamCount, firstDevice);
+	devicesChecked = NowTicks();
+    }
+    if (streamCount == 0) {
+	printf("Can't open %s and there are no devices in %s\n", filename, DEVICES_DIR);
+	ExitSequence(window, renderer, NULL, 0);
+    }
+    for (int s = 0; s < streamCount; ++s) {
+	Stream* stream = streams[s];
+	FollowerPoll(&stream->follower, AppendRows, &stream->target);
+	/* binary columns are mapped straight from the file, nothing to parse */
+	printf("Read %d rows from %s%s\n", stream->dataIndex, stream->follower.path,
+	       stream->follower.binary ? ", binary" : "");
+    }
+    int selected = 0; /* the stream the window state and statistics are about */
+    bool overlay = false; /* draw the next few streams along with it */
+    Stream* current = streams[selected];
+    if (current->dataIndex > 0) {
+	/* all of it */
+	viewStart = targetStart = FirstTime(current);
+	viewEnd = targetEnd = EndTime(current);
     }
 
     /* main loop */
+    /* Frames are only drawn when something changed: input, new rows, or the
+     * view still moving towards its target. In between the loop sleeps in
+     * SDL_WaitEventTimeout, so an idle monitor uses no CPU. */
     bool running = true;
     int targetFPS = 30;
     float64 frameTimeBudget = 1000.0/(float64)(targetFPS); // in ms
-    clock_t lastTick = clock();
-    float64 frameTime = 0;
+    Uint64 lastFrame = NowTicks();
     float delta = (float)frameTimeBudget/1000.0f;
-    Uint32 sleepTime;
     bool windowOpen = false;
-    bool forcing = false;
-
-    char *openCommand = "./command.sh 1";
-    char *closeCommand = "./command.sh 2";
-    char *releaseCommand = "./command.sh 0";
+    bool redraw = true;
+    unsigned generation = 0; /* bumped when rows on screen are replaced or added, or others are shown */
+    float shift = 0;
 
     const Color backgroundColor = RGB(54,51,95);
-    const Color graphFrameColor = RGB(255,255,255);
     const Color tempDataColor = RGB(219,217,247);
     const Color pressLineColor = RGB(80,220,162);
-    const Color dottedLineColor = RGB(255,255,255);
     const Color tempDefinitionLineColor = RGB(82,11,16);
     const Color pressDefinitionLineColor = RGB(21,53,18);
     const Color tempGraphBG = RGB(166,33,88);
     const Color pressGraphBG = RGB(77,90,54);
 
+    int graphW = 400;
+    int graphY2 = 50 + 300;
+    int tempGraphX = 100;
+    int pressGraphX = SCREEN_WIDTH - 100 - graphW;
+    const float tempDefinitionLevels[6] = { 5,2,1,0.5,0.2,0.1};
+    const float pressDefinitionLevels[8] = { 20.0f, 10.0f, 5,2,1,0.5,0.2,0.1 };
+    Graph graphs[2] = {
+	{ "Temperature (Celsius)", { 0, 0, SCREEN_WIDTH/2, graphY2 + 4 * CHAR_HEIGHT },
+	  tempGraphX, tempGraphX + graphW * 0.85f, tempGraphBG, tempDefinitionLineColor, tempDataColor,
+	  tempDefinitionLevels, 6, false, 4, false },
+	{ "Atomospheric Pressure (Millibar)", { SCREEN_WIDTH/2, 0, SCREEN_WIDTH/2, graphY2 + 4 * CHAR_HEIGHT },
+	  pressGraphX, pressGraphX + graphW * 0.85f, pressGraphBG, pressDefinitionLineColor, pressLineColor,
+	  pressDefinitionLevels, 8, true, 6, true },
+    };
+    for (int g = 0; g < 2; ++g) {
+	graphs[g].panel = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+					    SCREEN_WIDTH, SCREEN_HEIGHT);
+	if (!graphs[g].panel) {
+	    printf("Can't create a render target: %s\n", SDL_GetError());
+	    ExitSequence(window, renderer, streams, streamCount);
+	}
+    }
+
+    FileWaker waker = { &group, SDL_RegisterEvents(1), SDL_CreateSemaphore(0), 0 };
+    SDL_Thread* wakerThread = SDL_CreateThread(WatchFile, "watch file", &waker);
+    /* overrides are sent from a thread of its own, a key press never waits on the network */
+    Uint32 controlEvent = SDL_RegisterEvents(1);
+    Control control;
+    bool controlStarted = ControlStart(&control, BOARD_HOST, BOARD_PORT, ControlChanged, &controlEvent) == 0;
+    if (!controlStarted) {
+	printf("Can't start the control thread, overrides won't be sent\n");
+    }
+
+    bool fileChanged = false; /* the waker is waiting for us to read the file */
     bool ctrl = false;
     while (running) {
-	/* event handling */
+	/* sleep until something happens, or the next frame if the view is moving */
+	bool animating = viewStart != targetStart || viewEnd != targetEnd;
+	int timeout = -1;
+	if (animating || redraw) {
+	    timeout = max(0, (int)ceil(frameTimeBudget - MillisecondsSince(lastFrame)));
+	}
 	SDL_Event event;
-	while (SDL_PollEvent(&event) != 0) {
+	int got = SDL_WaitEventTimeout(&event, timeout);
+	/* event handling */
+	while (got) {
+	    if (event.type == waker.eventType) {
+		fileChanged = true;
+	    } else if (event.type == controlEvent) {
+		redraw = true;
+	    }
 	    switch (event.type) {
 	    case SDL_QUIT: { running = false; } break;
+	    case SDL_RENDER_TARGETS_RESET: {
+		TextCacheClear(&text);
+		graphs[0].valid = graphs[1].valid = false;
+		redraw = true;
+	    } break;
+	    case SDL_WINDOWEVENT: { redraw = true; } break;
 	    case SDL_KEYDOWN: {
-		switch (event.key.keysym.sym) {
+		redraw = true;
+		SDL_Keycode key = event.key.keysym.sym;
+		if (dateLength >= 0) {
+		    /* typing a date, the day is shown once it's entered */
+		    if (((key >= SDLK_0 && key <= SDLK_9) || key == SDLK_MINUS) && dateLength < 10) {
+			dateEntry[dateLength++] = (char)key;
+			dateEntry[dateLength] = '\0';
+		    } else if (key == SDLK_BACKSPACE && dateLength > 0) {
+			dateEntry[--dateLength] = '\0';
+		    } else if (key == SDLK_RETURN || key == SDLK_ESCAPE) {
+			int year, month, day;
+			if (key == SDLK_RETURN && sscanf(dateEntry, "%d-%d-%d", &year, &month, &day) == 3) {
+			    targetStart = (double)LocalTimestamp(year, month, day, 0, 0, 0);
+			    targetEnd = targetStart + DAY;
+			}
+			dateLength = -1;
+		    }
+		    break;
+		}
+		double span = targetEnd - targetStart;
+		double presets[5] = { 0, HOUR, DAY, 7 * DAY, 30 * DAY };
+		switch (key) {
 		case SDLK_ESCAPE: { running = false; } break;
-		case SDLK_LCTRL: case SDLK_RCTRL: { ctrl = true; } break;
-		case SDLK_o: {
-		    windowOpen = true;
-		    forcing = true;
-		    int ret = system(openCommand);
-		    printf("open command sent\n");
+		case SDLK_1: case SDLK_2: case SDLK_3: case SDLK_4: {
+		    /* the last hour/day/week/month of the view */
+		    if (current->dataIndex > 0) targetStart = targetEnd - presets[key - SDLK_0];
 		} break;
-		    
-		case SDLK_c: {
-		    windowOpen = false;
-		    forcing = false;
-		    int ret = system(closeCommand);
-		    printf("close command sent\n");
+		case SDLK_0: {
+		    if (current->dataIndex > 0) {
+			targetStart = FirstTime(current);
+			targetEnd = EndTime(current);
+		    }
 		} break;
-		}
-
-		case SDLK_r: {
-		    forcing = false;
+		case SDLK_LEFT: { targetStart -= span / 4; targetEnd -= span / 4; } break;
+		case SDLK_RIGHT: { targetStart += span / 4; targetEnd += span / 4; } break;
+		case SDLK_END: {
+		    if (current->dataIndex > 0) {
+			targetEnd = EndTime(current);
+			targetStart = targetEnd - span;
+		    }
+		} break;
+		case SDLK_LEFTBRACKET: case SDLK_RIGHTBRACKET: {
+		    /* the same stretch of time on another device, or its newest
+		     * data if the view was following the newest */
+		    bool following = current->dataIndex > 0 && targetEnd == EndTime(current);
+		    selected = (selected + (key == SDLK_RIGHTBRACKET ? 1 : streamCount - 1)) % streamCount;
+		    current = streams[selected];
+		    if (current->dataIndex > 0 && (following || targetEnd <= targetStart)) {
+			targetEnd = EndTime(current);
+			targetStart = span > 0 ? targetEnd - span : FirstTime(current);
+		    }
+		    ++generation;
 		} break;
+		case SDLK_v: {
+		    overlay = !overlay;
+		    ++generation;
+		} break;
+		case SDLK_g: {
+		    dateLength = 0;
+		    dateEntry[0] = '\0';
+		} break;
+		case SDLK_F1: { showStats = !showStats; } break;
+		case SDLK_LCTRL: case SDLK_RCTRL: { ctrl = true; } break;
+		case SDLK_o: case SDLK_c: case SDLK_r: {
+		    if (controlStarted) {
+			ControlSet(&control, key == SDLK_o ? CONTROL_OPEN : key == SDLK_c ? CONTROL_CLOSE : CONTROL_OFF);
+		    }
+		} break;
+		}
 	    } break;
 	    case SDL_KEYUP: {
 		switch (event.key.keysym.sym) {
@@ -299,327 +853,288 @@ main(int argc, char* argv[]) {
 		}
 	    } break;
 	    case SDL_MOUSEWHEEL: {
-		int step = (targetVisibleIndexHigh - targetVisibleIndexLow) / 20;
+		if (current->dataIndex == 0) break;
+		double step = (targetEnd - targetStart) / 20;
+		double first = FirstTime(current);
+		double last = EndTime(current);
 		if (ctrl) {
-		    targetVisibleIndexHigh -= event.wheel.y * step;
-		    targetVisibleIndexHigh = max(targetVisibleIndexLow + 200, min(dataIndex, targetVisibleIndexHigh));
+		    targetEnd -= event.wheel.y * step;
+		    targetEnd = max(targetStart + MIN_SPAN, min(last, targetEnd));
 		} else {
-		    targetVisibleIndexLow -= event.wheel.y * step ;
-		    targetVisibleIndexLow = max(0, min((targetVisibleIndexHigh - 200), targetVisibleIndexLow));
+		    targetStart -= event.wheel.y * step ;
+		    targetStart = max(first, min((targetEnd - MIN_SPAN), targetStart));
 		}
 	    } break;
 	    }
+	    got = SDL_PollEvent(&event);
 	}
 
-	float catchUpSpeedLow = (float)(targetVisibleIndexLow - visibleIndexLow) / 10.0f;
-	visibleIndexLow += catchUpSpeedLow;
-	visibleIndexLow = max(0, min(dataIndex, visibleIndexLow));
-	
-	float catchUpSpeedHigh = (float)(targetVisibleIndexHigh - visibleIndexHigh) / 10.0f;
-	visibleIndexHigh += catchUpSpeedHigh;
-	visibleIndexHigh = max(0, min(dataIndex, visibleIndexHigh));
-
-	/* check if file updated */
-	struct stat new_info;
-	if (stat(filename, &new_info) != 0) {
-	    printf("Failed to retrieve file edit time\n");
-	} else if (file_info.st_size != new_info.st_size) {
-	    printf("File size went from %ld to %ld, reading new entries\n", file_info.st_size, new_info.st_size);
-	    file_info = new_info;
-	    
-	    FILE* file = fopen(filename, "r");
-	    if (file == NULL) {
-		printf("Can't open file\n");
-	    } else {
-		// Load data file
-		int row = 0;
-		char buffer[50];
-		while (row < dataIndex && fgets(buffer, sizeof(buffer), file) != NULL) {
-		    ++row;
-		}
-		Data inData;
-		int newRows = 0;
-		while (fscanf(file, "%s %s %lf %lf", inData.date, inData.time, &inData.temperature, &inData.pressure) == 4) {
-		    if (dataIndex == dataCap) {
-			DataExpand(data, &dataCap);
-		    }
-		    data[dataIndex] = inData;
-		    ++dataIndex;
-		    ++newRows;
-		}
-		fclose(file);
-		printf("Read %d new rows from file\n", newRows);
+	/* wall time since the last frame, what the animation moves by */
+	double sinceLastFrame = MillisecondsSince(lastFrame);
+	if (animating || redraw) {
+	    if (sinceLastFrame < frameTimeBudget) {
+		continue; /* woken early, the frame isn't due yet */
 	    }
-	}	
-	SDL_SetRenderDrawColorRGB(renderer,backgroundColor);
-	SDL_RenderClear(renderer);
-
-	/* find max and min */
-	double tempMin = 10000;
-	double tempMax = -10000;
-	double pressMin = 1000000;
-	double pressMax = 0;
+	    delta = (float)min(sinceLastFrame, 2 * frameTimeBudget) / 1000.0f;
+	}
 
-	for (int i = visibleIndexLow; i < visibleIndexHigh; ++i) {
-	    Data item = data[i];
-	    tempMin = min(tempMin, item.temperature);
-	    tempMax = max(tempMax, item.temperature);
-	    pressMin = min(pressMin, item.pressure);
-	    pressMax = max(pressMax, item.pressure);
+	/* the view moves a tenth of the way each frame */
+	double targetSpan = targetEnd - targetStart;
+	viewStart = CatchUp(viewStart, targetStart, targetSpan);
+	viewEnd = CatchUp(viewEnd, targetEnd, targetSpan);
+	if (animating) {
+	    /* the dotted lines march while the view moves */
+	    shift += delta * 3;
 	}
-	
-	/* draw stuff */
-	/* prepare some numbers */
-	int graphY = 50;
-	int graphW = 400;
-	int graphH = 300;
-	int graphY2 = graphY + graphH;
-
-	int tempGraphX = 100;
-	int tempGraphX2 = tempGraphX + graphW * 0.85f;
-	float tempDisplayRangeLow = (tempMax - tempMin) * -0.2 + tempMin;
-	float tempDisplayRangeHigh = tempMax + (tempMax - tempMin) * 0.2;
-	
-	int pressGraphX = SCREEN_WIDTH - 100 - graphW;
-	int pressGraphX2 = pressGraphX + graphW * 0.85f;
-	float pressDisplayRangeLow = (pressMax - pressMin) * -0.2 + pressMin;
-	float pressDisplayRangeHigh = pressMax + (pressMax - pressMin) * 0.2;
-
-	/* graph titles */
-	BlitChars(renderer, fontAtlas, "Temperature (Celsius)", 22, tempGraphX, graphY - CHAR_HEIGHT, CHAR_WIDTH);
-	BlitChars(renderer, fontAtlas, "Atomospheric Pressure (Millibar)", 33, pressGraphX, graphY - CHAR_HEIGHT, CHAR_WIDTH);
 
-	/* time range */
-	char timeRangeBuffer[51];
-	Data firstItem = data[targetVisibleIndexLow];
-	Data lastItem = data[targetVisibleIndexHigh - 1];
-	sprintf(timeRangeBuffer, "[%s %s] to [%s %s]", firstItem.date, firstItem.time, lastItem.date, lastItem.time);
-	BlitChars(renderer, fontAtlas, timeRangeBuffer, 50, tempGraphX + 10*CHAR_WIDTH, graphY2 + CHAR_HEIGHT/2, CHAR_WIDTH);
-	
-	/* graph background */
-	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-	SDL_Rect tempRect;
-	tempRect.x = tempGraphX;
-	tempRect.y = graphY;
-	tempRect.w = graphW;
-	tempRect.h = graphH;
-	SDL_SetRenderDrawColorRGB(renderer, tempGraphBG);
-	SDL_RenderFillRect(renderer, &tempRect);
-
-	SDL_Rect pressRect;
-	pressRect.x = pressGraphX;
-	pressRect.y = graphY;
-	pressRect.w = graphW;
-	pressRect.h = graphH;
-	SDL_SetRenderDrawColorRGB(renderer, pressGraphBG);
-	SDL_RenderFillRect(renderer, &pressRect);
-	
-	/* Temperature */
-	/* Horizontal whole number lines */
-	float tempDefinitionLevels[6] = { 5,2,1,0.5,0.2,0.1};
-	float tempDisplayDiff = (tempDisplayRangeHigh - tempDisplayRangeLow) / 5.0f;
-	float tempDefinitionLevel = tempDefinitionLevels[0];
-	for (int i = 0; i < 6; ++i) {
-	    if (tempDisplayDiff < tempDefinitionLevels[i]) {
-		tempDefinitionLevel = tempDefinitionLevels[i];
-	    } else {
-		break;
+	/* new devices, inotify sees their directories appear */
+	if (FollowGroupEvents(&group) ||
+	    (devicesPending && MillisecondsSince(devicesChecked) > 1000)) {
+	    devicesPending = AddDeviceStreams(&group, streams, &streamCount, firstDevice);
+	    devicesChecked = NowTicks();
+	    /* the list is kept sorted, the selected stream may have moved */
+	    for (int s = 0; s < streamCount; ++s) {
+		if (streams[s] == current) selected = s;
 	    }
+	    redraw = true;
 	}
-	float lineValue = 0;
-	while (lineValue < tempDisplayRangeLow) {
-	    lineValue += tempDefinitionLevel;
-	}
-	SDL_SetRenderDrawColorRGB(renderer, tempDefinitionLineColor);
-	while (lineValue < tempDisplayRangeHigh) {
-	    int y = (int)(LinearMap(lineValue, tempDisplayRangeLow, tempDisplayRangeHigh, graphY2, graphY));
-	    SDL_RenderDrawLine(renderer, tempGraphX, y, tempGraphX + graphW, y);
-	    char num[6];
-	    sprintf(num, "%.2f", lineValue);
-	    BlitChars(renderer, smallFontAtlas, num,6,tempGraphX + SMALL_CHAR_WIDTH, y, SMALL_CHAR_WIDTH);
-	    lineValue += tempDefinitionLevel;
-	}
-
-	/* Pressure */
-	/* Horizontal whole number lines */
-	float pressDefinitionLevels[8] = { 20.0f, 10.0f, 5,2,1,0.5,0.2,0.1 };
-	float pressDisplayDiff = (pressDisplayRangeHigh - pressDisplayRangeLow) / 5.0f;
-	float pressDefinitionLevel = pressDefinitionLevels[0];
-	for (int i = 0; i < 8; ++i) {
-	    if (pressDisplayDiff <= pressDefinitionLevels[i]) {
-		pressDefinitionLevel = pressDefinitionLevels[i];
-	    } else {
-		break;
-	    }
+
+	/* pick up appended rows. Only the streams inotify marked are looked
+	 * at, a stream nothing happened to costs no system call */
+	int shownCount = 0;
+	Stream* shown[OVERLAY_MAX];
+	for (int s = 0; s < (overlay ? min(streamCount, OVERLAY_MAX) : 1); ++s) {
+	    shown[shownCount++] = streams[(selected + s) % streamCount];
 	}
-	lineValue = 0;
-	while (lineValue < pressDisplayRangeLow) {
-	    lineValue += pressDefinitionLevel;
-	}
-	SDL_SetRenderDrawColorRGB(renderer, pressDefinitionLineColor);
-	while (lineValue < pressDisplayRangeHigh) {
-	    int y = (int)(LinearMap(lineValue, pressDisplayRangeLow, pressDisplayRangeHigh, graphY2, graphY));
-	    SDL_RenderDrawLine(renderer, pressGraphX, y, pressGraphX + graphW, y);
-	    char num[6];
-	    sprintf(num, "%.2f", lineValue);
-	    BlitChars(renderer, smallFontAtlas, num, 6, pressGraphX+SMALL_CHAR_WIDTH, y, SMALL_CHAR_WIDTH);
-	    lineValue += pressDefinitionLevel;
-	}
-	
-	
-	/* Data points */
-	/* Temperature */
-	bool drewMin = false;
-	bool drewMax = false;
-	double tempSum = 0;
-	static float shift = 0;
-	shift += delta * 3;
-	SDL_SetRenderDrawColorRGB(renderer, tempDataColor);
-	bool drawRect = visibleIndexHigh - visibleIndexLow < 1000;
-	for (int i = visibleIndexLow; i < visibleIndexHigh; ++i) {
-	    Data item = data[i];
-	    tempSum += item.temperature;
-	    int x = ((int)LinearMap(i, visibleIndexLow, visibleIndexHigh, tempGraphX, tempGraphX2));
-	    int y = ((int)LinearMap(item.temperature, tempDisplayRangeLow, tempDisplayRangeHigh, graphY2, graphY));
-	    if (drawRect) {
-		SDL_Rect rect;
-		rect.x = x;
-		rect.y = y;
-		rect.w = 2;
-		rect.h = 2;
-		SDL_RenderDrawRect(renderer, &rect);
-	    } else {
-		SDL_RenderDrawPoint(renderer, x, y);
+	Uint64 ingestStart = NowTicks();
+	for (int s = 0; s < streamCount; ++s) {
+	    Stream* stream = streams[s];
+	    int oldIndex = stream->dataIndex;
+	    double oldLast = oldIndex > 0 ? EndTime(stream) : 0;
+	    int followStatus = FollowerPoll(&stream->follower, AppendRows, &stream->target);
+	    if (followStatus == FOLLOW_IDLE || followStatus == FOLLOW_ERROR) {
+		continue;
 	    }
-	    if ((item.temperature == tempMin && !drewMin) || (item.temperature == tempMax && !drewMax)) {
-		/* horizontal dotted line */
-		char s[6];
-		sprintf(s, "%.2f", item.temperature);
-		BlitChars(renderer, fontAtlas, s,4, tempGraphX - 4.5 * CHAR_WIDTH, y - CHAR_HEIGHT/2, CHAR_WIDTH);
-		SDL_SetRenderDrawColorRGB(renderer, dottedLineColor);
-		DrawDottedLine(renderer, tempGraphX - CHAR_WIDTH/2, y, x, y, shift);
-		SDL_SetRenderDrawColorRGB(renderer, tempDataColor);
+	    bool onScreen = false;
+	    for (int i = 0; i < shownCount; ++i) {
+		if (shown[i] == stream) onScreen = true;
 	    }
-	    if (item.temperature == tempMin) drewMin = true;
-	    if (item.temperature == tempMax) drewMax = true;
-	}
-	double tempAverage = tempSum / (visibleIndexHigh - visibleIndexLow);
-	char* emptyTextBuffer = "                                                  ";
-	char textBuffer[51];
-	sprintf(textBuffer, "%s", emptyTextBuffer);
-	sprintf(textBuffer, "Average: %.2f", tempAverage);
-	BlitChars(renderer, fontAtlas, textBuffer, 50, tempGraphX, graphY2 + 2 * CHAR_HEIGHT, CHAR_WIDTH);
-	double stdSum = 0;
-	for (int i = visibleIndexLow; i < visibleIndexHigh; ++i) {
-	    double diff = data[i].temperature - tempAverage;
-	    stdSum += diff * diff;
-	}
-	double tempStd = sqrt(stdSum / (visibleIndexHigh - visibleIndexLow));
-	sprintf(textBuffer, "%s", emptyTextBuffer);
-	sprintf(textBuffer, "St Deviation: %.2f", tempStd); 
-	BlitChars(renderer, fontAtlas, textBuffer, 50, tempGraphX, graphY2 + 3 * CHAR_HEIGHT, CHAR_WIDTH);
-	
-	/* Pressure */
-	drewMin = false;
-	drewMax = false;
-	double pressSum = 0;
-	SDL_SetRenderDrawColorRGB(renderer, pressLineColor);
-	for (int i = visibleIndexLow; i < visibleIndexHigh; ++i) {
-	    Data item = data[i];
-	    pressSum += item.pressure;
-	    int x = ((int)LinearMap(i, visibleIndexLow, visibleIndexHigh, pressGraphX, pressGraphX2));
-	    int y = ((int)LinearMap(item.pressure, pressDisplayRangeLow, pressDisplayRangeHigh, graphY2, graphY));
-	    if (drawRect) {
-		SDL_Rect rect;
-		rect.x = x;
-		rect.y = y;
-		rect.w = 2;
-		rect.h = 2;
-		SDL_RenderDrawRect(renderer, &rect);
-	    } else {
-		SDL_RenderDrawPoint(renderer, x, y);
+	    if (onScreen) {
+		++generation;
+		redraw = true;
+	    }
+	    /* the server rolls up before it drops raw rows */
+	    HistoryRefresh(&stream->history);
+	    if (followStatus == FOLLOW_RESET) {
+		/* compacted most of the time, the view stays where it was */
+		printf("%s was truncated or replaced, reloading\n", stream->follower.path);
+		stream->dataIndex = 0;
+		SamplesClear(&stream->samples);
+		window_init(&stream->windowModel);
+		followStatus = FollowerPoll(&stream->follower, AppendRows, &stream->target);
+		if (followStatus == FOLLOW_APPENDED) {
+		    printf("Read %d rows from %s\n", stream->dataIndex, stream->name);
+		}
+	    } else if (followStatus == FOLLOW_APPENDED) {
+		printf("Read %d new rows from %s\n", stream->dataIndex - oldIndex, stream->name);
+	    }
+	    if (followStatus != FOLLOW_APPENDED || stream != current) {
+		continue;
 	    }
-	    SDL_RenderDrawPoint(renderer, x, y);
-	    if ((item.pressure == pressMin && !drewMin) || (item.pressure == pressMax && !drewMax)) {
-		/* horizontal dotted line */
-		char s[6];
-		sprintf(s, "%.2f", item.pressure);
-		BlitChars(renderer, fontAtlas, s,6, pressGraphX + graphW + CHAR_WIDTH/2, y - CHAR_HEIGHT/2, CHAR_WIDTH);
-		SDL_SetRenderDrawColorRGB(renderer, dottedLineColor);
-		DrawDottedLine(renderer, x, y, pressGraphX + graphW + CHAR_WIDTH/2, y, shift);
-		SDL_SetRenderDrawColorRGB(renderer, pressLineColor);
+	    double last = EndTime(stream);
+	    if (oldIndex == 0) {
+		viewStart = targetStart = FirstTime(stream);
+		viewEnd = targetEnd = last;
+	    } else if (targetEnd == oldLast) {
+		/* the view was showing the newest data, keep it that way, and
+		 * keep its length unless it showed everything */
+		if (targetStart != FirstTime(stream)) {
+		    viewStart += last - targetEnd;
+		    targetStart += last - targetEnd;
+		}
+		viewEnd = targetEnd = last;
+	    }
+	    redraw = true; /* the window state looks at the newest rows */
+	}
+	ingestMs += MillisecondsSince(ingestStart);
+	if (fileChanged) {
+	    SDL_SemPost(waker.polled);
+	    fileChanged = false;
+	}
+
+	/* a graph is drawn again only if what it shows changed */
+	int dirtyGraphs = 0;
+	for (int g = 0; g < 2; ++g) {
+	    Graph* graph = &graphs[g];
+	    if (!graph->valid || graph->start != viewStart || graph->end != viewEnd ||
+		graph->shift != shift || graph->generation != generation) {
+		graph->valid = false;
+		graph->generation = generation;
+		++dirtyGraphs;
+	    }
+	}
+	if (!redraw && dirtyGraphs == 0) {
+	    continue;
+	}
+	redraw = false;
+
+	Uint64 frameStart = NowTicks();
+	lastFrame = frameStart;
+	memset(&renderStats, 0, sizeof(renderStats));
+	TextCacheFrame(&text);
+	if (current->dataIndex == 0 || viewEnd <= viewStart) {
+	    /* nothing to draw until the file has rows */
+	    SDL_SetRenderDrawColorRGB(renderer,backgroundColor);
+	    SDL_RenderClear(renderer);
+	    SDL_RenderPresent(renderer);
+	    continue;
+	}
+
+	/* draw stuff */
+	/* Everything goes through batches, one SDL call per color, and text
+	 * comes out of the cache, so the number of draw calls doesn't depend
+	 * on how many samples are visible. */
+	double statsMs = 0;
+	for (int g = 0; g < 2; ++g) {
+	    if (!graphs[g].valid) {
+		statsMs += DrawGraph(renderer, &text, &font, &smallFont, &rects, &dots, &graphs[g],
+				     shown, shownCount, viewStart, viewEnd, shift);
 	    }
-	    if (item.pressure == pressMin) drewMin = true;
-	    if (item.pressure == pressMax) drewMax = true;
-	}
-	
-	double pressAverage = pressSum / (visibleIndexHigh - visibleIndexLow);
-	sprintf(textBuffer, "%s", emptyTextBuffer);
-	sprintf(textBuffer, "Average: %.2f", pressAverage);
-	BlitChars(renderer, fontAtlas, textBuffer, 50, pressGraphX, graphY2+ 2 * CHAR_HEIGHT, CHAR_WIDTH);
-	double pressStdSum = 0;
-	for (int i = visibleIndexLow; i < visibleIndexHigh; ++i) {
-	    double diff = data[i].pressure - pressAverage;
-	    pressStdSum += diff * diff;
-	}
-	double pressStd = sqrt(pressStdSum / (visibleIndexHigh - visibleIndexLow));
-	sprintf(textBuffer, "%s", emptyTextBuffer);
-	sprintf(textBuffer, "St Deviation: %.2f", pressStd); 
-	BlitChars(renderer, fontAtlas, textBuffer, 50, pressGraphX, graphY2 + 3 * CHAR_HEIGHT, CHAR_WIDTH);
-
-
-	/* frame */
-	SDL_SetRenderDrawColorRGB(renderer,graphFrameColor);
-	SDL_RenderDrawRect(renderer, &tempRect);
-	SDL_SetRenderDrawColorRGB(renderer,graphFrameColor);
-	SDL_RenderDrawRect(renderer, &pressRect);
+	}
+	SDL_SetRenderDrawColorRGB(renderer,backgroundColor);
+	SDL_RenderClear(renderer);
+	for (int g = 0; g < 2; ++g) {
+	    SDL_RenderCopy(renderer, graphs[g].panel, &graphs[g].area, &graphs[g].area);
+	    ++renderStats.drawCalls;
+	}
+
+	/* time range */
+	char timeRangeBuffer[51];
+	char firstTime[20];
+	char lastTime[20];
+	FormatTimestamp((int64_t)targetStart, firstTime);
+	FormatTimestamp((int64_t)targetEnd - 1, lastTime);
+	sprintf(timeRangeBuffer, "[%s] to [%s]", firstTime, lastTime);
+	DrawText(&text, &font, timeRangeBuffer, tempGraphX + 10*CHAR_WIDTH, graphY2 + CHAR_HEIGHT/2);
 
 	/* window state */
-	tempSum = 0;
-	pressAverage = 0;
-	int low = max(0, dataIndex - 10000);
-	int high = dataIndex;
-	int diff = high - low;
-	for (int i = low; i < high; ++i) {
-	    tempSum += data[i].temperature;
-	    pressAverage += data[i].pressure;
-	}
-	tempAverage = tempSum/diff;
-	pressAverage = pressSum/diff;
-	Data current = data[dataIndex - 1];
-	windowOpen = ((current.pressure < 1000 ||
-	     current.pressure - pressAverage < 10) &&
-		      current.temperature - tempAverage < 0.5);
+	/* against the last hour, kept up to date as rows come in */
+	Uint64 windowStart = NowTicks();
+	windowOpen = window_should_open(&current->windowModel, current->samples.temperature[current->dataIndex - 1],
+					current->samples.pressure[current->dataIndex - 1]);
+	statsMs += MillisecondsSince(windowStart);
+	/* an override wins, like on the board */
+	ControlStatus controlStatus = { 0 };
+	if (controlStarted) controlStatus = ControlGetStatus(&control);
+	if (controlStatus.wanted != CONTROL_OFF) {
+	    windowOpen = controlStatus.wanted == CONTROL_OPEN;
+	}
 	if (windowOpen) {
-	    BlitChars(renderer, fontAtlas, "Window is   Open.",17, tempGraphX, SCREEN_HEIGHT - 2 * CHAR_HEIGHT, CHAR_WIDTH);
+	    DrawText(&text, &font, "Window is   Open.", tempGraphX, SCREEN_HEIGHT - 2 * CHAR_HEIGHT);
 	} else {
-	    BlitChars(renderer, fontAtlas, "Window is   Open.",17, tempGraphX, SCREEN_HEIGHT - 2 * CHAR_HEIGHT, CHAR_WIDTH);
+	    DrawText(&text, &font, "Window is Closed.", tempGraphX, SCREEN_HEIGHT - 2 * CHAR_HEIGHT);
+	}
+
+	/* sending until the board acknowledged it */
+	const char* controlText = NULL;
+	if (!controlStatus.connected) {
+	    controlText = controlStatus.wanted != CONTROL_OFF ? "[forcing, board offline]" : "[board offline]";
+	} else if (controlStatus.pending) {
+	    controlText = "[sending]";
+	} else if (controlStatus.wanted != CONTROL_OFF) {
+	    controlText = "[forcing]";
+	}
+	if (controlText) {
+	    DrawText(&text, &font, controlText, tempGraphX + 17*CHAR_WIDTH, SCREEN_HEIGHT - 2 * CHAR_HEIGHT);
 	}
 
-	if (forcing) {
-	    BlitChars(renderer, fontAtlas, "[forcing]", 9, tempGraphX + 17*CHAR_WIDTH, SCREEN_HEIGHT - 2 * CHAR_HEIGHT, CHAR_WIDTH);
+	DrawText(&text, &font, "[o/c] to force open/close. [r] to cancel force.", tempGraphX, SCREEN_HEIGHT - CHAR_HEIGHT);
+
+	/* devices, with a key to the colors when more than one is drawn */
+	if (streamCount > 1) {
+	    char device[TEXT_MAX * 2];
+	    snprintf(device, sizeof(device), "Device %.24s (%d/%d) [[/]] [v] overlay",
+		     current->name, selected + 1, streamCount);
+	    DrawText(&text, &font, device, tempGraphX, graphY2 + 4.5 * CHAR_HEIGHT);
+	    for (int s = 1; s < shownCount; ++s) {
+		int x = tempGraphX + (s - 1) / 4 * 20 * SMALL_CHAR_WIDTH;
+		int y = graphY2 + 6 * CHAR_HEIGHT + (s - 1) % 4 * SMALL_CHAR_HEIGHT;
+		SDL_SetRenderDrawColorRGB(renderer, overlayColors[s - 1]);
+		RectBatchAdd(&rects, x, y + 3, 8, 8);
+		RectBatchFill(renderer, &rects);
+		DrawText(&text, &smallFont, shown[s]->name, x + 2 * SMALL_CHAR_WIDTH, y);
+	    }
+	}
+	if (dateLength >= 0) {
+	    char prompt[32];
+	    snprintf(prompt, sizeof(prompt), "Go to date: %s_", dateEntry);
+	    DrawText(&text, &font, prompt, tempGraphX, SCREEN_HEIGHT - 4 * CHAR_HEIGHT);
+	} else {
+	    DrawText(&text, &font, "[1-4] hour/day/week/month [0] all [g] go to date [end] now",
+		     tempGraphX, SCREEN_HEIGHT - 4 * CHAR_HEIGHT);
 	}
 
-	BlitChars(renderer, fontAtlas, "[o/c] to force open/close. [r] to cancel force.", 47, tempGraphX, SCREEN_HEIGHT - CHAR_HEIGHT, CHAR_WIDTH);
+	/* frame time overlay, numbers are from the frame before */
+	if (showStats) {
+	    char stats[TEXT_MAX];
+	    snprintf(stats, sizeof(stats), "frame %.2fms  %d draw calls  %d graphs  %d texts %d rebuilt",
+		     lastFrameMs, lastStats.drawCalls, lastDirtyGraphs, lastStats.textDraws, lastStats.textRebuilds);
+	    DrawText(&text, &smallFont, stats, 4, 4);
+	    const double* ms = frameTimes.ms;
+	    snprintf(stats, sizeof(stats), "ingest %.2f stats %.2f plot %.2f text %.2f present %.2f",
+		     ms[PHASE_INGEST], ms[PHASE_STATS], ms[PHASE_PLOT], ms[PHASE_TEXT], ms[PHASE_PRESENT]);
+	    DrawText(&text, &smallFont, stats, 4, 4 + SMALL_CHAR_HEIGHT);
+	}
+	double drawMs = MillisecondsSince(frameStart);
+	Uint64 presentStart = NowTicks();
         SDL_RenderPresent(renderer);
+	lastStats = renderStats;
+	lastDirtyGraphs = dirtyGraphs;
 
-	/* Timing and sleeping */
-	/* Time is divided into three parts: */
-	/* process time, sleep time, misc undil process */
-	/* we start timing right after sleep, stop at the end of process time, their sum is true frame time */
-	/* frame time budget minus that is how much we should sleep */
-	frameTime = 1000.0 * (double)(clock() - lastTick) / (double)(CLOCKS_PER_SEC);
-	if (frameTime > frameTimeBudget) {
-	    printf("WARNING: Missed frame, frame time was %.3fms\n", frameTime);
-	    delta = (float)frameTime/1000.0f;
-	} else {
-	    sleepTime = (Uint32)(frameTimeBudget - frameTime);
-	    SDL_Delay(sleepTime);
-	    delta = frameTimeBudget/1000.0f;
+	/* Timing */
+	/* wall time from the start of drawing to the present, the wait above
+	 * sleeps off whatever is left of the frame budget */
+	lastFrameMs = MillisecondsSince(frameStart);
+	frameTimes.ms[PHASE_INGEST] = ingestMs;
+	frameTimes.ms[PHASE_STATS] = statsMs;
+	frameTimes.ms[PHASE_TEXT] = renderStats.textMs;
+	frameTimes.ms[PHASE_PLOT] = max(0, drawMs - statsMs - renderStats.textMs);
+	frameTimes.ms[PHASE_PRESENT] = MillisecondsSince(presentStart);
+	for (int p = 0; p < PHASE_COUNT; ++p) {
+	    LatencyAdd(&frameTimes.latency[p], frameTimes.ms[p]);
+	}
+	ingestMs = 0;
+	if (lastFrameMs > frameTimeBudget) {
+	    printf("WARNING: Missed frame, frame time was %.3fms (stats %.3f plot %.3f text %.3f present %.3f)\n",
+		   lastFrameMs, statsMs, frameTimes.ms[PHASE_PLOT], renderStats.textMs, frameTimes.ms[PHASE_PRESENT]);
 	}
-	lastTick = clock();
     }
 
-    ExitSequence(window, renderer, data);
+    if (frameTimes.latency[0].count > 0) {
+	printf("%llu frames, ms p50/p99/max:", (unsigned long long)frameTimes.latency[0].count);
+	for (int p = 0; p < PHASE_COUNT; ++p) {
+	    const Latency* latency = &frameTimes.latency[p];
+	    printf(" %s %.3f/%.3f/%.3f", phaseNames[p], LatencyQuantile(latency, 0.5),
+		   LatencyQuantile(latency, 0.99), latency->max);
+	}
+	printf("\n");
+    }
+
+    if (controlStarted) {
+	ControlStop(&control);
+    }
+    waker.quit = 1;
+    SDL_WaitThread(wakerThread, NULL);
+    SDL_DestroySemaphore(waker.polled);
+    for (int g = 0; g < 2; ++g) {
+	SDL_DestroyTexture(graphs[g].panel);
+    }
+    TextCacheClear(&text);
+    RectBatchFree(&rects);
+    PointBatchFree(&dots);
+    FontFree(&font);
+    FontFree(&smallFont);
+    ExitSequence(window, renderer, streams, streamCount);
+    FollowGroupClose(&group);
     return 0;
 }
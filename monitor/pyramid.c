@@ -0,0 +1,103 @@
+#include "pyramid.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void
+PyramidInit(Pyramid* pyramid) {
+    memset(pyramid, 0, sizeof(*pyramid));
+}
+
+void
+PyramidClear(Pyramid* pyramid) {
+    pyramid->count = 0;
+    pyramid->levels = 0;
+}
+
+void
+PyramidFree(Pyramid* pyramid) {
+    for (int i = 0; i < PYRAMID_MAX_LEVELS; ++i) {
+	free(pyramid->level[i]);
+    }
+    PyramidInit(pyramid);
+}
+
+/* adds the summary of count samples from index on, all inside one level 0 node */
+static void
+AddToLevels(Pyramid* pyramid, const Summary* s, size_t index) {
+    for (int k = 0; k < PYRAMID_MAX_LEVELS; ++k) {
+	size_t node = index >> (PYRAMID_BASE_BITS + k);
+	if (node >= pyramid->levelCap[k]) {
+	    size_t cap = pyramid->levelCap[k] ? pyramid->levelCap[k] * 2 : 64;
+	    Summary* grown = realloc(pyramid->level[k], cap * sizeof(Summary));
+	    if (!grown) {
+		abort();
+	    }
+	    pyramid->level[k] = grown;
+	    pyramid->levelCap[k] = cap;
+	}
+	/* the first sample of a node starts it, a new level starts from the node below */
+	if ((index & ((1UL << (PYRAMID_BASE_BITS + k)) - 1)) == 0) {
+	    pyramid->level[k][node] = EmptySummary();
+	} else if (k >= pyramid->levels) {
+	    pyramid->level[k][0] = pyramid->level[k - 1][0];
+	}
+	if (k >= pyramid->levels) {
+	    pyramid->levels = k + 1;
+	}
+	MergeSummary(&pyramid->level[k][node], s);
+	if (node == 0) {
+	    break; /* levels above would only repeat this node */
+	}
+    }
+}
+
+void
+PyramidAppend(Pyramid* pyramid, const double* values, size_t count) {
+    if (pyramid->count == 0 && count > 0) {
+	pyramid->shift = values[0];
+    }
+    while (count > 0) {
+	/* up to the end of the current level 0 node */
+	size_t n = PYRAMID_BASE - (pyramid->count & (PYRAMID_BASE - 1));
+	if (n > count) n = count;
+	Summary s = Summarize(values, n, pyramid->shift);
+	AddToLevels(pyramid, &s, pyramid->count);
+	pyramid->count += n;
+	values += n;
+	count -= n;
+    }
+}
+
+Summary
+PyramidQuery(const Pyramid* pyramid, const double* values, size_t low, size_t high) {
+    Summary result = EmptySummary();
+    if (high > pyramid->count) high = pyramid->count;
+    if (low >= high) {
+	return result;
+    }
+
+    /* nodes fully inside the range, the last node may be partial if the range runs to the end */
+    size_t first = (low + PYRAMID_BASE - 1) >> PYRAMID_BASE_BITS;
+    size_t last = high == pyramid->count ? (high + PYRAMID_BASE - 1) >> PYRAMID_BASE_BITS
+	: high >> PYRAMID_BASE_BITS;
+    if (first >= last) {
+	KernelSummarize(KernelsBest(), values + low, high - low, pyramid->shift, &result);
+	return result;
+    }
+    size_t head = first << PYRAMID_BASE_BITS;
+    size_t tail = last << PYRAMID_BASE_BITS;
+    KernelSummarize(KernelsBest(), values + low, head - low, pyramid->shift, &result);
+    if (tail < high) {
+	KernelSummarize(KernelsBest(), values + tail, high - tail, pyramid->shift, &result);
+    }
+
+    /* bottom up, take the odd nodes at the edges and move a level up */
+    for (int k = 0; first < last && k < pyramid->levels; ++k) {
+	if (first & 1) MergeSummary(&result, &pyramid->level[k][first++]);
+	if (last & 1) MergeSummary(&result, &pyramid->level[k][--last]);
+	first >>= 1;
+	last >>= 1;
+    }
+    return result;
+}
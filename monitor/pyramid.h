@@ -0,0 +1,53 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <stddef.h>
+#include <math.h>
+#include "kernels.h"
+
+/* Min/max/sum pyramid over one channel of samples.
+ *
+ * Level 0 summarizes blocks of PYRAMID_BASE samples, every level above
+ * summarizes pairs of nodes of the level below. Appending a sample updates
+ * one node per level. A range query takes at most 2 * PYRAMID_BASE raw
+ * samples at the ends and two nodes per level in between, so it is
+ * O(log n) however long the range is.
+ *
+ * The pyramid keeps no raw samples, queries read the ends from the caller's
+ * column. Whole blocks are summarized with the SIMD kernels. Sums are kept
+ * relative to the first sample, so the variance of a million pressures
+ * around 1000 mb doesn't cancel away.
+ */
+#define PYRAMID_BASE_BITS 6
+#define PYRAMID_BASE (1 << PYRAMID_BASE_BITS)
+#define PYRAMID_MAX_LEVELS 48
+
+typedef struct {
+    double shift;
+    size_t count; /* samples appended */
+    int levels;
+    Summary* level[PYRAMID_MAX_LEVELS];
+    size_t levelCap[PYRAMID_MAX_LEVELS];
+} Pyramid;
+
+void PyramidInit(Pyramid* pyramid);
+void PyramidClear(Pyramid* pyramid);
+void PyramidFree(Pyramid* pyramid);
+void PyramidAppend(Pyramid* pyramid, const double* values, size_t count);
+
+/* summary of samples [low, high), values is the column the pyramid was built from */
+Summary PyramidQuery(const Pyramid* pyramid, const double* values, size_t low, size_t high);
+
+static inline double
+SummaryMean(const Pyramid* pyramid, Summary s) {
+    return pyramid->shift + s.sum / s.count;
+}
+
+static inline double
+SummaryStd(Summary s) {
+    double mean = s.sum / s.count;
+    double variance = s.sumsq / s.count - mean * mean;
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include "render.h"
+
+#include <SDL2/SDL_image.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+RenderStats renderStats;
+
+int
+FontLoad(Font* font, SDL_Renderer* renderer, const char* file, int charWidth) {
+    memset(font, 0, sizeof(*font));
+    printf("Loading %s\n", file);
+    font->atlas = IMG_LoadTexture(renderer, file);
+    if (!font->atlas) {
+	printf("Failed to load %s\n", file);
+	return -1;
+    }
+    /* once, not per character */
+    SDL_QueryTexture(font->atlas, NULL, NULL, NULL, &font->charHeight);
+    font->charWidth = charWidth;
+    return 0;
+}
+
+void
+FontFree(Font* font) {
+    if (font->atlas) {
+	SDL_DestroyTexture(font->atlas);
+    }
+    memset(font, 0, sizeof(*font));
+}
+
+void
+TextCacheInit(TextCache* cache, SDL_Renderer* renderer) {
+    memset(cache, 0, sizeof(*cache));
+    cache->renderer = renderer;
+}
+
+void
+TextCacheClear(TextCache* cache) {
+    for (int i = 0; i < TEXT_CACHE_SIZE; ++i) {
+	if (cache->entries[i].texture) {
+	    SDL_DestroyTexture(cache->entries[i].texture);
+	}
+	memset(&cache->entries[i], 0, sizeof(cache->entries[i]));
+    }
+}
+
+void
+TextCacheFrame(TextCache* cache) {
+    ++cache->frame;
+}
+
+/* blits the glyphs of s into a texture of its own */
+static int
+Build(TextCache* cache, CachedText* entry, const Font* font, const char* s) {
+    SDL_Renderer* renderer = cache->renderer;
+    int count = strlen(s);
+    if (count >= TEXT_MAX) count = TEXT_MAX - 1;
+    memcpy(entry->text, s, count);
+    entry->text[count] = '\0';
+    entry->font = font;
+    entry->w = count * font->charWidth;
+    entry->h = font->charHeight;
+    entry->texture = NULL;
+    if (count == 0 || !font->atlas) {
+	return 0;
+    }
+    entry->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+				       entry->w, entry->h);
+    if (!entry->texture) {
+	return -1;
+    }
+    SDL_SetTextureBlendMode(entry->texture, SDL_BLENDMODE_BLEND);
+    /* text is drawn into panels as well, whatever was being drawn to goes on after */
+    SDL_Texture* target = SDL_GetRenderTarget(renderer);
+    Uint8 r, g, b, a;
+    SDL_GetRenderDrawColor(renderer, &r, &g, &b, &a);
+    SDL_SetRenderTarget(renderer, entry->texture);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderClear(renderer);
+    for (int i = 0; i < count; ++i) {
+	SDL_Rect src;
+	src.x = ((int)entry->text[i] - 32) * font->charWidth; /* the first 32 ascii codes aren't on the atlas */
+	src.y = 0;
+	src.w = font->charWidth;
+	src.h = font->charHeight;
+	SDL_Rect dest = src;
+	dest.x = i * font->charWidth;
+	SDL_RenderCopy(renderer, font->atlas, &src, &dest);
+	++renderStats.drawCalls;
+    }
+    SDL_SetRenderTarget(renderer, target);
+    SDL_SetRenderDrawColor(renderer, r, g, b, a);
+    ++renderStats.textRebuilds;
+    return 0;
+}
+
+int
+DrawText(TextCache* cache, const Font* font, const char* s, int x, int y) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    CachedText* entry = NULL;
+    CachedText* oldest = &cache->entries[0];
+    for (int i = 0; i < TEXT_CACHE_SIZE; ++i) {
+	CachedText* e = &cache->entries[i];
+	if (e->font == font && strncmp(e->text, s, TEXT_MAX - 1) == 0) {
+	    entry = e;
+	    break;
+	}
+	if (e->lastUsed < oldest->lastUsed) {
+	    oldest = e;
+	}
+    }
+    if (!entry) {
+	entry = oldest;
+	if (entry->texture) {
+	    SDL_DestroyTexture(entry->texture);
+	}
+	if (Build(cache, entry, font, s) != 0) {
+	    memset(entry, 0, sizeof(*entry));
+	    return 0;
+	}
+    }
+    entry->lastUsed = cache->frame;
+    if (entry->texture) {
+	SDL_Rect dest = { x, y, entry->w, entry->h };
+	SDL_RenderCopy(cache->renderer, entry->texture, NULL, &dest);
+	++renderStats.drawCalls;
+	++renderStats.textDraws;
+    }
+    renderStats.textMs += 1000.0 * (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    return entry->w;
+}
+
+static void*
+Grow(void* items, int* cap, size_t itemSize) {
+    int newCap = *cap ? *cap * 2 : 256;
+    void* grown = realloc(items, newCap * itemSize);
+    if (!grown) {
+	abort();
+    }
+    *cap = newCap;
+    return grown;
+}
+
+void
+RectBatchAdd(RectBatch* batch, int x, int y, int w, int h) {
+    if (batch->count == batch->cap) {
+	batch->rects = Grow(batch->rects, &batch->cap, sizeof(SDL_Rect));
+    }
+    SDL_Rect* rect = &batch->rects[batch->count++];
+    rect->x = x;
+    rect->y = y;
+    rect->w = w;
+    rect->h = h;
+}
+
+void
+RectBatchFill(SDL_Renderer* renderer, RectBatch* batch) {
+    if (batch->count > 0) {
+	SDL_RenderFillRects(renderer, batch->rects, batch->count);
+	++renderStats.drawCalls;
+    }
+    batch->count = 0;
+}
+
+void
+RectBatchOutline(SDL_Renderer* renderer, RectBatch* batch) {
+    if (batch->count > 0) {
+	SDL_RenderDrawRects(renderer, batch->rects, batch->count);
+	++renderStats.drawCalls;
+    }
+    batch->count = 0;
+}
+
+void
+RectBatchFree(RectBatch* batch) {
+    free(batch->rects);
+    memset(batch, 0, sizeof(*batch));
+}
+
+void
+PointBatchAdd(PointBatch* batch, int x, int y) {
+    if (batch->count == batch->cap) {
+	batch->points = Grow(batch->points, &batch->cap, sizeof(SDL_Point));
+    }
+    batch->points[batch->count].x = x;
+    batch->points[batch->count].y = y;
+    ++batch->count;
+}
+
+void
+PointBatchDraw(SDL_Renderer* renderer, PointBatch* batch) {
+    if (batch->count > 0) {
+	SDL_RenderDrawPoints(renderer, batch->points, batch->count);
+	++renderStats.drawCalls;
+    }
+    batch->count = 0;
+}
+
+void
+PointBatchDottedLine(PointBatch* batch, int x1, int y1, int x2, int y2, float shift) {
+    int dx = x2 - x1;
+    int dy = y2 - y1;
+    int steps = abs(dx) > abs(dy) ? abs(dx) : abs(dy);
+    /* 3 pixels on, 3 off, one whole period per unit of shift */
+    float offset = (shift - floorf(shift)) * 6.0f;
+    for (int i = 0; i <= steps; ++i) {
+	float phase = fmodf((float)i - offset + 6.0f, 6.0f);
+	if (phase < 3.0f) {
+	    int x = steps ? x1 + dx * i / steps : x1;
+	    int y = steps ? y1 + dy * i / steps : y1;
+	    PointBatchAdd(batch, x, y);
+	}
+    }
+}
+
+void
+PointBatchFree(PointBatch* batch) {
+    free(batch->points);
+    memset(batch, 0, sizeof(*batch));
+}
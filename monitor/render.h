@@ -0,0 +1,86 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#define SDL_DISABLE_IMMINTRIN_H
+#include <SDL2/SDL.h>
+
+/* Batched drawing and cached text for the monitor.
+ *
+ * Text is drawn from a fixed width atlas, the glyphs of ' ' to '~' side by
+ * side. A string is blitted into a texture of its own the first time it is
+ * drawn and reused from then on, so a label that doesn't change costs one
+ * SDL_RenderCopy however long it is. Unused strings are dropped oldest first
+ * once the cache is full.
+ *
+ * Rects and points are collected in a batch and submitted with one call.
+ * Every SDL draw call made through here is counted in renderStats for the
+ * frame overlay.
+ */
+#define TEXT_CACHE_SIZE 256
+#define TEXT_MAX 64
+
+typedef struct {
+    SDL_Texture* atlas;
+    int charWidth;
+    int charHeight;
+} Font;
+
+typedef struct {
+    const Font* font;
+    char text[TEXT_MAX];
+    SDL_Texture* texture;
+    int w;
+    int h;
+    Uint64 lastUsed; /* frame number */
+} CachedText;
+
+typedef struct {
+    SDL_Renderer* renderer;
+    CachedText entries[TEXT_CACHE_SIZE];
+    Uint64 frame;
+} TextCache;
+
+typedef struct {
+    SDL_Rect* rects;
+    int count;
+    int cap;
+} RectBatch;
+
+typedef struct {
+    SDL_Point* points;
+    int count;
+    int cap;
+} PointBatch;
+
+typedef struct {
+    int drawCalls;
+    int textDraws;
+    int textRebuilds;
+    double textMs; /* in DrawText, finding, building and copying */
+} RenderStats;
+
+extern RenderStats renderStats;
+
+/* returns 0 on success, the width of a glyph is given, the height is the atlas' */
+int FontLoad(Font* font, SDL_Renderer* renderer, const char* file, int charWidth);
+void FontFree(Font* font);
+
+void TextCacheInit(TextCache* cache, SDL_Renderer* renderer);
+/* drops every cached string, also needed when the renderer loses its targets */
+void TextCacheClear(TextCache* cache);
+/* call once per frame, before drawing */
+void TextCacheFrame(TextCache* cache);
+/* draws s at x, y, returns its width in pixels */
+int DrawText(TextCache* cache, const Font* font, const char* s, int x, int y);
+
+void RectBatchAdd(RectBatch* batch, int x, int y, int w, int h);
+void RectBatchFill(SDL_Renderer* renderer, RectBatch* batch);
+void RectBatchOutline(SDL_Renderer* renderer, RectBatch* batch);
+void RectBatchFree(RectBatch* batch);
+void PointBatchAdd(PointBatch* batch, int x, int y);
+void PointBatchDraw(SDL_Renderer* renderer, PointBatch* batch);
+/* dashes of 3 pixels, the pattern moves along with shift */
+void PointBatchDottedLine(PointBatch* batch, int x1, int y1, int x2, int y2, float shift);
+void PointBatchFree(PointBatch* batch);
+
+#endif
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include "retention.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* minutes a row may be behind the newest one and still go into its minute
+ * in the same pass, the rest of the pass keeps them in a ring */
+#define MINUTE_RING 1440
+/* buckets written to a tier at a time */
+#define ROLLUP_CHUNK 65536
+#define COPY_SIZE (256 * 1024)
+
+typedef struct {
+    RollupBucket* items;
+    size_t count;
+    size_t cap;
+} BucketList;
+
+static void
+BucketPush(BucketList* list, const RollupBucket* bucket) {
+    if (list->count == list->cap) {
+	list->cap = list->cap ? list->cap * 2 : 1024;
+	list->items = realloc(list->items, list->cap * sizeof(RollupBucket));
+	if (!list->items) {
+	    abort();
+	}
+    }
+    list->items[list->count++] = *bucket;
+}
+
+static void
+DirectoryPath(char* out, size_t size, const char* directory, const char* name) {
+    snprintf(out, size, "%s/%s", directory, name);
+}
+
+/* the tier's header, as if empty when there is no file yet */
+static int64_t
+TierComplete(const char* directory, int tier, uint64_t* count) {
+    char path[4096 + 32];
+    RollupPath(path, sizeof(path), directory, tier);
+    RollupFile file;
+    *count = 0;
+    if (RollupOpen(&file, path) != 0) {
+	return 0;
+    }
+    int64_t complete = file.complete;
+    *count = file.count;
+    RollupClose(&file);
+    return complete;
+}
+
+/* Raw rows into the minute tier, those from its complete time up to limit.
+ * Rows come in append order, close to time order. Open minutes are kept in
+ * a ring, and written once a row a ring's length later shows up. */
+typedef struct {
+    RollupBucket ring[MINUTE_RING];
+    int64_t base; /* the oldest minute the ring can hold, -1 before the first row */
+    size_t pending; /* minutes in the ring with rows */
+    BucketList out;
+    char path[4096 + 32];
+    int failed;
+    size_t written;
+} MinuteRoller;
+
+static void
+WriteMinutes(MinuteRoller* roller, int64_t complete) {
+    if (!roller->failed && RollupAppend(roller->path, rollupPeriods[0], roller->out.items,
+				     roller->out.count, complete) != 0) {
+	roller->failed = 1;
+    }
+    roller->written += roller->out.count;
+    roller->out.count = 0;
+}
+
+/* moves minutes before upto out of the ring */
+static void
+ShiftMinutes(MinuteRoller* roller, int64_t upto) {
+    for (int64_t minute = roller->base; minute < upto && roller->pending > 0; ++minute) {
+	RollupBucket* bucket = &roller->ring[minute % MINUTE_RING];
+	if (bucket->count > 0) {
+	    BucketPush(&roller->out, bucket);
+	    memset(bucket, 0, sizeof(*bucket));
+	    --roller->pending;
+	}
+    }
+    roller->base = upto;
+    if (roller->out.count >= ROLLUP_CHUNK) {
+	WriteMinutes(roller, upto * 60);
+    }
+}
+
+static int
+RollMinutes(Compaction* compaction, int64_t newest) {
+    uint64_t count;
+    int64_t complete = TierComplete(compaction->directory, 0, &count);
+    int64_t limit = (newest - ROLLUP_GRACE) / 60 * 60;
+    compaction->complete = complete;
+    if (limit <= complete) {
+	return 0;
+    }
+    MinuteRoller* roller = calloc(1, sizeof(MinuteRoller));
+    if (!roller) {
+	abort();
+    }
+    RollupPath(roller->path, sizeof(roller->path), compaction->directory, 0);
+    roller->base = complete > 0 ? complete / 60 : -1;
+
+    const WdbFile* wdb = &compaction->wdb;
+    for (uint64_t row = 0; row < wdb->rowCount; ) {
+	uint64_t block = row / wdb->blockRows;
+	uint64_t end = (block + 1) * wdb->blockRows < wdb->rowCount ? (block + 1) * wdb->blockRows : wdb->rowCount;
+	const int64_t* timestamp = WdbTimestamps(wdb, block);
+	const double* temperature = WdbTemperatures(wdb, block);
+	const double* pressure = WdbPressures(wdb, block);
+	for (; row < end; ++row) {
+	    uint32_t i = row % wdb->blockRows;
+	    if (timestamp[i] < complete || timestamp[i] >= limit) {
+		continue;
+	    }
+	    int64_t minute = timestamp[i] / 60;
+	    if (roller->base < 0) {
+		roller->base = minute;
+	    }
+	    if (minute < roller->base) {
+		++compaction->lateRows;
+		continue;
+	    }
+	    if (minute >= roller->base + MINUTE_RING) {
+		ShiftMinutes(roller, minute - MINUTE_RING + 1);
+	    }
+	    RollupBucket* bucket = &roller->ring[minute % MINUTE_RING];
+	    if (bucket->count == 0) {
+		bucket->start = minute * 60;
+		++roller->pending;
+	    }
+	    RollupAdd(bucket, temperature[i], pressure[i]);
+	}
+    }
+    ShiftMinutes(roller, limit / 60);
+    WriteMinutes(roller, limit);
+    int failed = roller->failed;
+    compaction->buckets[0] = roller->written;
+    compaction->complete = failed ? complete : limit;
+    free(roller->out.items);
+    free(roller);
+    return failed ? -1 : 0;
+}
+
+/* tier from the one below, as far as that one is complete */
+static int
+RollTier(Compaction* compaction, int tier) {
+    char below[4096 + 32];
+    char path[4096 + 32];
+    RollupPath(below, sizeof(below), compaction->directory, tier - 1);
+    RollupPath(path, sizeof(path), compaction->directory, tier);
+    uint64_t count;
+    int64_t complete = TierComplete(compaction->directory, tier, &count);
+    int64_t period = rollupPeriods[tier];
+    RollupFile source;
+    if (RollupOpen(&source, below) != 0) {
+	return 0;
+    }
+    int64_t limit = source.complete / period * period;
+    if (limit <= complete) {
+	RollupClose(&source);
+	return 0;
+    }
+    BucketList out = { 0 };
+    RollupBucket bucket = { 0 };
+    const RollupBucket* buckets = RollupBuckets(&source);
+    for (size_t i = RollupFind(&source, complete); i < source.count && buckets[i].start < limit; ++i) {
+	int64_t start = buckets[i].start / period * period;
+	if (bucket.count > 0 && start != bucket.start) {
+	    BucketPush(&out, &bucket);
+	    memset(&bucket, 0, sizeof(bucket));
+	}
+	bucket.start = start;
+	RollupMerge(&bucket, &buckets[i]);
+    }
+    if (bucket.count > 0) {
+	BucketPush(&out, &bucket);
+    }
+    RollupClose(&source);
+    int result = RollupAppend(path, period, out.items, out.count, limit);
+    compaction->buckets[tier] = out.count;
+    free(out.items);
+    return result;
+}
+
+static int
+CopyRange(int from, int to, off_t start, off_t end) {
+    char* buffer = malloc(COPY_SIZE);
+    if (!buffer) {
+	abort();
+    }
+    int result = 0;
+    while (start < end && result == 0) {
+	size_t want = end - start < COPY_SIZE ? end - start : COPY_SIZE;
+	ssize_t got = pread(from, buffer, want, start);
+	if (got <= 0 || write(to, buffer, got) != got) {
+	    result = -1;
+	}
+	start += got > 0 ? got : 0;
+    }
+    free(buffer);
+    return result;
+}
+
+/* the offset of the first line at or after cutoff, and where the last whole line ends */
+static void
+FindTextCut(int fd, off_t size, int64_t cutoff, off_t* cut, off_t* end) {
+    char* buffer = malloc(COPY_SIZE);
+    if (!buffer) {
+	abort();
+    }
+    *cut = -1;
+    *end = 0;
+    off_t offset = 0;
+    while (offset < size) {
+	size_t want = size - offset < COPY_SIZE ? size - offset : COPY_SIZE;
+	ssize_t got = pread(fd, buffer, want, offset);
+	if (got <= 0) {
+	    break;
+	}
+	char* line = buffer;
+	char* newline;
+	while ((newline = memchr(line, '\n', buffer + got - line)) != NULL) {
+	    int64_t timestamp;
+	    double temperature, pressure;
+	    if (*cut < 0 && ParseDataLine(line, newline - line, &timestamp, &temperature, &pressure) &&
+		timestamp >= cutoff) {
+		*cut = offset + (line - buffer);
+	    }
+	    line = newline + 1;
+	}
+	if (line == buffer) {
+	    break; /* a line longer than the buffer, nothing sensible to cut at */
+	}
+	offset += line - buffer;
+	*end = offset;
+    }
+    if (*cut < 0) {
+	*cut = *end;
+    }
+    free(buffer);
+}
+
+/* copies of the raw files without the rows before cutoff */
+static int
+CopyRaw(Compaction* compaction, int64_t cutoff) {
+    const WdbFile* wdb = &compaction->wdb;
+    uint64_t cut = 0;
+    while (cut < wdb->rowCount && WdbTimestamps(wdb, cut / wdb->blockRows)[cut % wdb->blockRows] < cutoff) {
+	++cut;
+    }
+    if (cut < RETENTION_MIN_DROP) {
+	return 0;
+    }
+    char path[sizeof(compaction->directory) + 32];
+    DirectoryPath(path, sizeof(path), compaction->directory, "data.wdb.compact");
+    unlink(path);
+    if (WdbWriterOpen(&compaction->wdbCopy, path) != 0) {
+	return -1;
+    }
+    for (uint64_t row = cut; row < wdb->rowCount; ++row) {
+	uint64_t block = row / wdb->blockRows;
+	uint32_t i = row % wdb->blockRows;
+	if (WdbAppend(&compaction->wdbCopy, WdbTimestamps(wdb, block)[i], WdbTemperatures(wdb, block)[i],
+		      WdbPressures(wdb, block)[i]) != 0) {
+	    WdbWriterClose(&compaction->wdbCopy);
+	    unlink(path);
+	    return -1;
+	}
+    }
+    compaction->droppedRows = cut;
+    compaction->rewrite = 1;
+
+    /* data.txt has the same rows, cut at the same time */
+    DirectoryPath(path, sizeof(path), compaction->directory, "data.txt");
+    compaction->textFd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (compaction->textFd < 0 || fstat(compaction->textFd, &info) != 0) {
+	return 0;
+    }
+    off_t textCut;
+    FindTextCut(compaction->textFd, info.st_size, cutoff, &textCut, &compaction->textEnd);
+    DirectoryPath(path, sizeof(path), compaction->directory, "data.txt.compact");
+    compaction->textCopyFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (compaction->textCopyFd < 0 ||
+	CopyRange(compaction->textFd, compaction->textCopyFd, textCut, compaction->textEnd) != 0) {
+	return -1;
+    }
+    compaction->droppedBytes = textCut;
+    return 0;
+}
+
+int
+CompactPrepare(Compaction* compaction, const char* directory, int64_t rawSeconds) {
+    memset(compaction, 0, sizeof(*compaction));
+    compaction->textFd = -1;
+    compaction->textCopyFd = -1;
+    snprintf(compaction->directory, sizeof(compaction->directory), "%s", directory);
+    compaction->rawSeconds = rawSeconds;
+    char path[sizeof(compaction->directory) + 32];
+    DirectoryPath(path, sizeof(path), directory, "data.wdb");
+    if (WdbOpen(&compaction->wdb, path) != 0) {
+	return 0; /* nothing to roll up */
+    }
+    compaction->haveWdb = 1;
+    const WdbFile* wdb = &compaction->wdb;
+    compaction->rows = wdb->rowCount;
+    if (wdb->rowCount == 0) {
+	return 0;
+    }
+
+    int64_t newest = INT64_MIN;
+    for (uint64_t block = 0; block * wdb->blockRows < wdb->rowCount; ++block) {
+	uint64_t rows = wdb->rowCount - block * wdb->blockRows;
+	if (rows > wdb->blockRows) rows = wdb->blockRows;
+	const int64_t* timestamp = WdbTimestamps(wdb, block);
+	for (uint64_t i = 0; i < rows; ++i) {
+	    if (timestamp[i] > newest) newest = timestamp[i];
+	}
+    }
+    if (RollMinutes(compaction, newest) != 0) {
+	CompactAbandon(compaction);
+	return -1;
+    }
+    for (int tier = 1; tier < ROLLUP_TIERS; ++tier) {
+	if (RollTier(compaction, tier) != 0) {
+	    CompactAbandon(compaction);
+	    return -1;
+	}
+    }
+    if (rawSeconds < 0) {
+	return 0;
+    }
+    /* raw rows go only once they are rolled up */
+    int64_t cutoff = newest - rawSeconds;
+    if (cutoff > compaction->complete) cutoff = compaction->complete;
+    cutoff = cutoff / 60 * 60;
+    if (CopyRaw(compaction, cutoff) != 0) {
+	CompactAbandon(compaction);
+	return -1;
+    }
+    return 0;
+}
+
+static int
+Replace(const char* directory, const char* copy, const char* name) {
+    char from[4096 + 32];
+    char to[4096 + 32];
+    DirectoryPath(from, sizeof(from), directory, copy);
+    DirectoryPath(to, sizeof(to), directory, name);
+    return rename(from, to);
+}
+
+int
+CompactFinish(Compaction* compaction) {
+    int result = 0;
+    if (compaction->rewrite) {
+	/* whatever was appended since the snapshot */
+	WdbFile* wdb = &compaction->wdb;
+	uint64_t snapshot = wdb->rowCount;
+	if (WdbRefresh(wdb) != 0) {
+	    result = -1;
+	}
+	for (uint64_t row = snapshot; row < wdb->rowCount && result == 0; ++row) {
+	    uint64_t block = row / wdb->blockRows;
+	    uint32_t i = row % wdb->blockRows;
+	    result = WdbAppend(&compaction->wdbCopy, WdbTimestamps(wdb, block)[i], WdbTemperatures(wdb, block)[i],
+			       WdbPressures(wdb, block)[i]);
+	}
+	if (result == 0 && (WdbFlush(&compaction->wdbCopy) != 0 || fdatasync(compaction->wdbCopy.fd) != 0)) {
+	    result = -1;
+	}
+	if (compaction->textCopyFd >= 0 && result == 0) {
+	    struct stat info;
+	    if (fstat(compaction->textFd, &info) != 0 ||
+		CopyRange(compaction->textFd, compaction->textCopyFd, compaction->textEnd, info.st_size) != 0 ||
+		fdatasync(compaction->textCopyFd) != 0) {
+		result = -1;
+	    }
+	}
+	if (result != 0) {
+	    CompactAbandon(compaction);
+	    return -1;
+	}
+	WdbWriterClose(&compaction->wdbCopy);
+	if (Replace(compaction->directory, "data.wdb.compact", "data.wdb") != 0) {
+	    result = -1;
+	}
+	if (compaction->textCopyFd >= 0) {
+	    close(compaction->textCopyFd);
+	    compaction->textCopyFd = -1;
+	    if (result == 0 && Replace(compaction->directory, "data.txt.compact", "data.txt") != 0) {
+		result = -1;
+	    }
+	}
+	compaction->rewrite = 0;
+    }
+    if (compaction->textFd >= 0) {
+	close(compaction->textFd);
+	compaction->textFd = -1;
+    }
+    if (compaction->haveWdb) {
+	WdbClose(&compaction->wdb);
+	compaction->haveWdb = 0;
+    }
+    return result;
+}
+
+void
+CompactAbandon(Compaction* compaction) {
+    char path[sizeof(compaction->directory) + 32];
+    if (compaction->rewrite) {
+	WdbWriterClose(&compaction->wdbCopy);
+	DirectoryPath(path, sizeof(path), compaction->directory, "data.wdb.compact");
+	unlink(path);
+	compaction->rewrite = 0;
+    }
+    if (compaction->textCopyFd >= 0) {
+	close(compaction->textCopyFd);
+	compaction->textCopyFd = -1;
+	DirectoryPath(path, sizeof(path), compaction->directory, "data.txt.compact");
+	unlink(path);
+    }
+    if (compaction->textFd >= 0) {
+	close(compaction->textFd);
+	compaction->textFd = -1;
+    }
+    if (compaction->haveWdb) {
+	WdbClose(&compaction->wdb);
+	compaction->haveWdb = 0;
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "datafile.h"
+#include "rollup.h"
+
+/* Retention for one data directory, the one with data.txt and data.wdb.
+ *
+ * The raw rows are rolled up into minutes, minutes into hours and hours
+ * into days (rollup.h), and raw rows older than the raw window are cut off
+ * the front of both files once they are in the minute tier. So the raw
+ * files, and whatever loads them, stay the size of the window, while the
+ * tiers keep every year at 80 bytes a minute, an hour or a day.
+ *
+ * A minute is rolled up once the newest row is ROLLUP_GRACE past its end.
+ * A row that shows up after that, more than ROLLUP_GRACE out of order,
+ * stays raw only.
+ *
+ * Compaction is split so the writer never waits for it:
+ *
+ * CompactPrepare does the work, on any thread, while the writer keeps
+ * appending. It reads a snapshot of data.wdb, appends to the tiers, and if
+ * enough raw rows are old enough, copies the ones that stay into
+ * data.wdb.compact and data.txt.compact.
+ *
+ * CompactFinish runs where the files are written, between two appends. It
+ * copies what was appended since the snapshot, syncs the copies and renames
+ * them over the originals, which the writer then opens again. It costs
+ * the rows appended in between. Readers see the rename like any replaced
+ * file, see follow.h.
+ */
+#define RETENTION_RAW_DAYS 30
+#define ROLLUP_GRACE 300 /* seconds */
+/* fewer old rows than this aren't worth a rewrite */
+#define RETENTION_MIN_DROP WDB_BLOCK_ROWS
+
+typedef struct {
+    char directory[4096];
+    int64_t rawSeconds; /* negative keeps every raw row */
+    /* CompactPrepare's snapshot and copies */
+    WdbFile wdb;
+    int haveWdb;
+    int rewrite; /* the copies are there, CompactFinish swaps them in */
+    WdbWriter wdbCopy;
+    int textFd;
+    int textCopyFd;
+    off_t textEnd; /* bytes of data.txt copied */
+    /* what was done */
+    uint64_t rows; /* raw rows in the snapshot */
+    uint64_t droppedRows;
+    off_t droppedBytes;
+    uint64_t lateRows; /* too late for their minute */
+    size_t buckets[ROLLUP_TIERS]; /* appended to each tier */
+    int64_t complete; /* of the minute tier */
+} Compaction;
+
+/* returns 0 on success, then CompactFinish or CompactAbandon has to follow.
+ * -1 if a file couldn't be written, nothing is replaced then */
+int CompactPrepare(Compaction* compaction, const char* directory, int64_t rawSeconds);
+/* returns 0 on success, the files were replaced if compaction->rewrite */
+int CompactFinish(Compaction* compaction);
+/* drops the copies instead, when the writer went away in between */
+void CompactAbandon(Compaction* compaction);
+
+#endif
@@ -0,0 +1,276 @@
+#define _GNU_SOURCE
+#include "rollup.h"
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint32_t rollupPeriods[ROLLUP_TIERS] = { 60, 3600, 86400 };
+
+void
+RollupPath(char* out, size_t size, const char* directory, int tier) {
+    snprintf(out, size, "%s/rollup.%u.wru", directory, rollupPeriods[tier]);
+}
+
+/* never trust the count past what is actually mapped */
+static void
+ReadHeader(RollupFile* file) {
+    uint64_t mapped = (file->mapSize - ROLLUP_HEADER_SIZE) / sizeof(RollupBucket);
+    memcpy(&file->count, file->map + ROLLUP_COUNT_OFFSET, sizeof(file->count));
+    memcpy(&file->complete, file->map + ROLLUP_COMPLETE_OFFSET, sizeof(file->complete));
+    if (file->count > mapped) {
+	file->count = mapped;
+    }
+}
+
+int
+RollupOpen(RollupFile* file, const char* path) {
+    memset(file, 0, sizeof(*file));
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+	return -1;
+    }
+    struct stat info;
+    if (fstat(file->fd, &info) != 0 || info.st_size < ROLLUP_HEADER_SIZE) {
+	close(file->fd);
+	return -1;
+    }
+    file->mapSize = info.st_size;
+    file->map = mmap(NULL, file->mapSize, PROT_READ, MAP_SHARED, file->fd, 0);
+    if (file->map == MAP_FAILED) {
+	close(file->fd);
+	file->map = NULL;
+	return -1;
+    }
+    uint32_t version;
+    memcpy(&version, file->map + 4, sizeof(version));
+    memcpy(&file->period, file->map + 8, sizeof(file->period));
+    if (memcmp(file->map, ROLLUP_MAGIC, 4) != 0 || version != ROLLUP_VERSION || file->period == 0) {
+	RollupClose(file);
+	return -1;
+    }
+    ReadHeader(file);
+    return 0;
+}
+
+int
+RollupRefresh(RollupFile* file) {
+    struct stat info;
+    if (fstat(file->fd, &info) != 0 || info.st_size < ROLLUP_HEADER_SIZE) {
+	return -1;
+    }
+    if ((size_t)info.st_size != file->mapSize) {
+	unsigned char* map = mremap(file->map, file->mapSize, info.st_size, MREMAP_MAYMOVE);
+	if (map == MAP_FAILED) {
+	    return -1;
+	}
+	file->map = map;
+	file->mapSize = info.st_size;
+    }
+    ReadHeader(file);
+    return 0;
+}
+
+void
+RollupClose(RollupFile* file) {
+    if (file->map) {
+	munmap(file->map, file->mapSize);
+	file->map = NULL;
+    }
+    if (file->fd >= 0) {
+	close(file->fd);
+	file->fd = -1;
+    }
+}
+
+size_t
+RollupFind(const RollupFile* file, int64_t time) {
+    const RollupBucket* buckets = RollupBuckets(file);
+    size_t low = 0;
+    size_t high = file->count;
+    while (low < high) {
+	size_t middle = low + (high - low) / 2;
+	if (buckets[middle].start < time) {
+	    low = middle + 1;
+	} else {
+	    high = middle;
+	}
+    }
+    return low;
+}
+
+static int
+WriteAll(int fd, const void* buffer, size_t size, off_t offset) {
+    const unsigned char* p = buffer;
+    while (size > 0) {
+	ssize_t written = pwrite(fd, p, size, offset);
+	if (written <= 0) return -1;
+	p += written;
+	size -= written;
+	offset += written;
+    }
+    return 0;
+}
+
+int
+RollupAppend(const char* path, uint32_t period, const RollupBucket* buckets, size_t count, int64_t complete) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+	return -1;
+    }
+    unsigned char header[ROLLUP_HEADER_SIZE];
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+	close(fd);
+	return -1;
+    }
+    if (info.st_size < ROLLUP_HEADER_SIZE) {
+	uint32_t version = ROLLUP_VERSION;
+	memset(header, 0, sizeof(header));
+	memcpy(header, ROLLUP_MAGIC, 4);
+	memcpy(header + 4, &version, sizeof(version));
+	memcpy(header + 8, &period, sizeof(period));
+    } else if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, ROLLUP_MAGIC, 4) != 0 ||
+	       memcmp(header + 8, &period, sizeof(period)) != 0) {
+	close(fd);
+	return -1;
+    }
+    uint64_t written;
+    memcpy(&written, header + ROLLUP_COUNT_OFFSET, sizeof(written));
+    /* the rows these come from may go once this returns, so they are on disk first */
+    if (WriteAll(fd, buckets, count * sizeof(RollupBucket), ROLLUP_HEADER_SIZE + written * sizeof(RollupBucket)) != 0) {
+	close(fd);
+	return -1;
+    }
+    written += count;
+    memcpy(header + ROLLUP_COUNT_OFFSET, &written, sizeof(written));
+    memcpy(header + ROLLUP_COMPLETE_OFFSET, &complete, sizeof(complete));
+    if (fdatasync(fd) != 0 || WriteAll(fd, header, sizeof(header), 0) != 0 || fdatasync(fd) != 0) {
+	close(fd);
+	return -1;
+    }
+    return close(fd);
+}
+
+/* Chan et al., the variance of the union from both means and variances */
+static void
+MergeChannel(RollupChannel* channel, uint32_t count, const RollupChannel* other, uint32_t otherCount) {
+    if (count == 0) {
+	*channel = *other;
+	return;
+    }
+    double total = (double)count + otherCount;
+    double delta = other->mean - channel->mean;
+    double squares = channel->variance * count + other->variance * otherCount +
+		     delta * delta * count * otherCount / total;
+    channel->mean += delta * otherCount / total;
+    channel->variance = squares / total;
+    if (other->min < channel->min) channel->min = other->min;
+    if (other->max > channel->max) channel->max = other->max;
+}
+
+void
+RollupMerge(RollupBucket* bucket, const RollupBucket* other) {
+    if (other->count == 0) {
+	return;
+    }
+    MergeChannel(&bucket->temperature, bucket->count, &other->temperature, other->count);
+    MergeChannel(&bucket->pressure, bucket->count, &other->pressure, other->count);
+    bucket->count += other->count;
+}
+
+void
+RollupAdd(RollupBucket* bucket, double temperature, double pressure) {
+    RollupBucket one = { bucket->start, 1, 0, { temperature, temperature, temperature, 0 },
+			 { pressure, pressure, pressure, 0 } };
+    RollupMerge(bucket, &one);
+}
+
+Summary
+RollupSummary(const RollupChannel* channel, uint32_t count, double shift) {
+    Summary s;
+    double mean = channel->mean - shift;
+    s.min = channel->min;
+    s.max = channel->max;
+    s.sum = count * mean;
+    s.sumsq = count * (channel->variance + mean * mean);
+    s.count = count;
+    return s;
+}
+
+void
+HistoryOpen(History* history, const char* path) {
+    memset(history, 0, sizeof(*history));
+    char copy[sizeof(history->directory)];
+    snprintf(copy, sizeof(copy), "%s", path);
+    snprintf(history->directory, sizeof(history->directory), "%s", dirname(copy));
+    HistoryRefresh(history);
+}
+
+void
+HistoryRefresh(History* history) {
+    for (int k = 0; k < ROLLUP_TIERS; ++k) {
+	if (history->open[k]) {
+	    if (RollupRefresh(&history->tier[k]) == 0) continue;
+	    RollupClose(&history->tier[k]);
+	    history->open[k] = 0;
+	}
+	char path[sizeof(history->directory) + 32];
+	RollupPath(path, sizeof(path), history->directory, k);
+	history->open[k] = RollupOpen(&history->tier[k], path) == 0;
+    }
+}
+
+void
+HistoryClose(History* history) {
+    for (int k = 0; k < ROLLUP_TIERS; ++k) {
+	if (history->open[k]) RollupClose(&history->tier[k]);
+	history->open[k] = 0;
+    }
+}
+
+int64_t
+HistoryFirst(const History* history) {
+    int64_t first = INT64_MAX;
+    for (int k = 0; k < ROLLUP_TIERS; ++k) {
+	const RollupFile* tier = &history->tier[k];
+	if (history->open[k] && tier->count > 0 && RollupBuckets(tier)[0].start < first) {
+	    first = RollupBuckets(tier)[0].start;
+	}
+    }
+    return first;
+}
+
+size_t
+HistoryQuery(const History* history, int64_t from, int64_t to, int64_t step,
+	     double temperatureShift, double pressureShift, Summary* temperature, Summary* pressure) {
+    *temperature = EmptySummary();
+    *pressure = EmptySummary();
+    int coarsest = 0;
+    while (coarsest + 1 < ROLLUP_TIERS && rollupPeriods[coarsest + 1] <= step) {
+	++coarsest;
+    }
+    /* a coarser tier is never complete further than a finer one */
+    size_t read = 0;
+    int64_t at = from;
+    for (int k = coarsest; k >= 0 && at < to; --k) {
+	if (!history->open[k]) continue;
+	const RollupFile* tier = &history->tier[k];
+	int64_t upto = tier->complete < to ? tier->complete : to;
+	const RollupBucket* buckets = RollupBuckets(tier);
+	for (size_t i = RollupFind(tier, at); i < tier->count && buckets[i].start < upto; ++i) {
+	    Summary t = RollupSummary(&buckets[i].temperature, buckets[i].count, temperatureShift);
+	    Summary p = RollupSummary(&buckets[i].pressure, buckets[i].count, pressureShift);
+	    MergeSummary(temperature, &t);
+	    MergeSummary(pressure, &p);
+	    ++read;
+	}
+	if (upto > at) at = upto;
+    }
+    return read;
+}
@@ -0,0 +1,110 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "kernels.h"
+
+/* Rolled up history (.wru), one file per tier next to data.wdb:
+ * rollup.60.wru, rollup.3600.wru and rollup.86400.wru.
+ *
+ * [header, ROLLUP_HEADER_SIZE bytes][bucket 0][bucket 1]...
+ *
+ * header, little endian:
+ *   char magic[4]     "WRU1"
+ *   uint32 version    ROLLUP_VERSION
+ *   uint32 period     seconds per bucket
+ *   uint32 reserved
+ *   uint64 count      buckets written so far
+ *   int64 complete    every row before this time is in a bucket
+ *   rest is zero
+ *
+ * Buckets start on multiples of the period in UTC and are in time order,
+ * empty ones are left out. Like .wdb files the buckets are written first
+ * and the header last, so a reader never sees half a bucket. The tiers are
+ * written by retention.c, each from the one below: minutes from the raw
+ * rows, hours from minutes, days from hours.
+ */
+#define ROLLUP_MAGIC "WRU1"
+#define ROLLUP_VERSION 1
+#define ROLLUP_HEADER_SIZE 64
+#define ROLLUP_COUNT_OFFSET 16
+#define ROLLUP_COMPLETE_OFFSET 24
+#define ROLLUP_TIERS 3
+
+extern const uint32_t rollupPeriods[ROLLUP_TIERS];
+
+typedef struct {
+    double min;
+    double max;
+    double mean;
+    double variance; /* of the population */
+} RollupChannel;
+
+typedef struct {
+    int64_t start;
+    uint32_t count;
+    uint32_t reserved;
+    RollupChannel temperature;
+    RollupChannel pressure;
+} RollupBucket;
+
+typedef struct {
+    int fd;
+    unsigned char* map;
+    size_t mapSize;
+    uint32_t period;
+    uint64_t count;
+    int64_t complete;
+} RollupFile;
+
+/* "directory/rollup.<period>.wru", out needs room for the directory and 24 bytes */
+void RollupPath(char* out, size_t size, const char* directory, int tier);
+
+/* returns 0 on success, -1 if the file can't be opened or isn't a .wru file */
+int RollupOpen(RollupFile* file, const char* path);
+/* picks up buckets appended since, -1 if the file went bad */
+int RollupRefresh(RollupFile* file);
+void RollupClose(RollupFile* file);
+/* the first bucket starting at or after time, count if there is none */
+size_t RollupFind(const RollupFile* file, int64_t time);
+
+static inline const RollupBucket*
+RollupBuckets(const RollupFile* file) {
+    return (const RollupBucket*)(file->map + ROLLUP_HEADER_SIZE);
+}
+
+/* appends buckets and moves complete forward, creating the file with the
+ * tier's period if there is none. returns 0 on success */
+int RollupAppend(const char* path, uint32_t period, const RollupBucket* buckets, size_t count, int64_t complete);
+
+/* a bucket being filled, start and count 0 when empty */
+void RollupAdd(RollupBucket* bucket, double temperature, double pressure);
+void RollupMerge(RollupBucket* bucket, const RollupBucket* other);
+/* a channel as the sums the pyramids keep, relative to shift */
+Summary RollupSummary(const RollupChannel* channel, uint32_t count, double shift);
+
+/* All tiers of one data file, for readers. A tier that doesn't exist yet
+ * is looked for again on every refresh. */
+typedef struct {
+    char directory[4096];
+    RollupFile tier[ROLLUP_TIERS];
+    int open[ROLLUP_TIERS];
+} History;
+
+/* the tiers next to the data file at path, there may be none */
+void HistoryOpen(History* history, const char* path);
+void HistoryRefresh(History* history);
+void HistoryClose(History* history);
+/* the start of the first bucket, INT64_MAX without any */
+int64_t HistoryFirst(const History* history);
+
+/* Summaries of the buckets starting in [from, to), sums relative to the
+ * shifts. The coarsest tier with buckets no longer than step is used as
+ * far as it is complete, the finer ones after that, so a wide view costs
+ * a few buckets per pixel column whatever the span. Returns the number of
+ * buckets read. */
+size_t HistoryQuery(const History* history, int64_t from, int64_t to, int64_t step,
+		    double temperatureShift, double pressureShift, Summary* temperature, Summary* pressure);
+
+#endif
@@ -0,0 +1,102 @@
+#include "samples.h"
+
+#include <string.h>
+
+int
+SamplesInit(Samples* samples, size_t maxCount) {
+    memset(samples, 0, sizeof(*samples));
+    if (StoreInit(&samples->timestamps, sizeof(int64_t), maxCount) != 0 ||
+	StoreInit(&samples->temperatures, sizeof(double), maxCount) != 0 ||
+	StoreInit(&samples->pressures, sizeof(double), maxCount) != 0 ||
+	StoreInit(&samples->timeIndex, sizeof(int64_t), maxCount / SAMPLES_TIME_STRIDE + 1) != 0) {
+	SamplesFree(samples);
+	return -1;
+    }
+    samples->timestamp = (int64_t*)samples->timestamps.base;
+    samples->temperature = (double*)samples->temperatures.base;
+    samples->pressure = (double*)samples->pressures.base;
+    samples->latest = (int64_t*)samples->timeIndex.base;
+    PyramidInit(&samples->temperatureLod);
+    PyramidInit(&samples->pressureLod);
+    return 0;
+}
+
+size_t
+SamplesAppend(Samples* samples, const int64_t* timestamp, const double* temperature,
+	      const double* pressure, size_t count) {
+    /* the columns have the same capacity, they fill up together */
+    size_t room = samples->timestamps.reserved / sizeof(int64_t) - samples->count;
+    if (count > room) count = room;
+    if (count == 0) {
+	return 0;
+    }
+    int64_t* t = StoreGrow(&samples->timestamps, count);
+    double* temp = StoreGrow(&samples->temperatures, count);
+    double* press = StoreGrow(&samples->pressures, count);
+    size_t stretches = (samples->count + count + SAMPLES_TIME_STRIDE - 1) / SAMPLES_TIME_STRIDE;
+    size_t firstNew = samples->timeIndex.count;
+    if (!t || !temp || !press ||
+	(stretches > firstNew && !StoreGrow(&samples->timeIndex, stretches - firstNew))) {
+	return 0;
+    }
+    memcpy(t, timestamp, count * sizeof(int64_t));
+    memcpy(temp, temperature, count * sizeof(double));
+    memcpy(press, pressure, count * sizeof(double));
+    /* a new stretch starts from the latest time before it */
+    for (size_t i = 0; i < count; ++i) {
+	size_t stretch = (samples->count + i) / SAMPLES_TIME_STRIDE;
+	if ((samples->count + i) % SAMPLES_TIME_STRIDE == 0) {
+	    samples->latest[stretch] = stretch ? samples->latest[stretch - 1] : t[i];
+	}
+	if (t[i] > samples->latest[stretch]) samples->latest[stretch] = t[i];
+    }
+    PyramidAppend(&samples->temperatureLod, temp, count);
+    PyramidAppend(&samples->pressureLod, press, count);
+    samples->count += count;
+    return count;
+}
+
+void
+SamplesClear(Samples* samples) {
+    StoreClear(&samples->timestamps);
+    StoreClear(&samples->temperatures);
+    StoreClear(&samples->pressures);
+    StoreClear(&samples->timeIndex);
+    PyramidClear(&samples->temperatureLod);
+    PyramidClear(&samples->pressureLod);
+    samples->count = 0;
+}
+
+size_t
+SamplesFind(const Samples* samples, int64_t time) {
+    /* the first stretch that reaches time, every row before it is earlier */
+    size_t low = 0;
+    size_t high = samples->timeIndex.count;
+    while (low < high) {
+	size_t middle = low + (high - low) / 2;
+	if (samples->latest[middle] < time) {
+	    low = middle + 1;
+	} else {
+	    high = middle;
+	}
+    }
+    if (low == samples->timeIndex.count) {
+	return samples->count;
+    }
+    size_t row = low * SAMPLES_TIME_STRIDE;
+    while (row < samples->count && samples->timestamp[row] < time) {
+	++row;
+    }
+    return row;
+}
+
+void
+SamplesFree(Samples* samples) {
+    StoreFree(&samples->timestamps);
+    StoreFree(&samples->temperatures);
+    StoreFree(&samples->pressures);
+    StoreFree(&samples->timeIndex);
+    PyramidFree(&samples->temperatureLod);
+    PyramidFree(&samples->pressureLod);
+    memset(samples, 0, sizeof(*samples));
+}
@@ -0,0 +1,57 @@
+#ifndef SAMPLES_H
+#define SAMPLES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "store.h"
+#include "pyramid.h"
+
+/* The monitor's samples, one column per field.
+ *
+ * Each column is its own store, so a pass over temperatures reads nothing
+ * but temperatures and the kernels get contiguous doubles. Columns never
+ * move as they grow. Temperature and pressure each have a pyramid, kept up
+ * to date on append, for range statistics.
+ *
+ * Timestamps are seconds since the epoch. The time index holds, for every
+ * SAMPLES_TIME_STRIDE rows, the latest timestamp up to the end of that
+ * stretch. It is sorted even if the clock went backwards at some point, so
+ * SamplesFind is a binary search over it, small enough to stay in cache,
+ * and a scan of one stretch.
+ */
+#define SAMPLES_TIME_STRIDE 256
+typedef struct {
+    size_t count;
+    int64_t* timestamp;
+    double* temperature;
+    double* pressure;
+    Store timestamps;
+    Store temperatures;
+    Store pressures;
+    Store timeIndex;
+    int64_t* latest; /* the time index, one per stretch of rows */
+    Pyramid temperatureLod;
+    Pyramid pressureLod;
+} Samples;
+
+/* returns 0 on success, -1 if the address space can't be reserved */
+int SamplesInit(Samples* samples, size_t maxCount);
+/* returns the number of rows taken, fewer than count once the reservation is full */
+size_t SamplesAppend(Samples* samples, const int64_t* timestamp, const double* temperature,
+		     const double* pressure, size_t count);
+void SamplesClear(Samples* samples);
+/* the first row at or after time, count if there is none */
+size_t SamplesFind(const Samples* samples, int64_t time);
+void SamplesFree(Samples* samples);
+
+static inline Summary
+SamplesTemperature(const Samples* samples, size_t low, size_t high) {
+    return PyramidQuery(&samples->temperatureLod, samples->temperature, low, high);
+}
+
+static inline Summary
+SamplesPressure(const Samples* samples, size_t low, size_t high) {
+    return PyramidQuery(&samples->pressureLod, samples->pressure, low, high);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include "store.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int
+StoreInit(Store* store, size_t itemSize, size_t maxItems) {
+    memset(store, 0, sizeof(*store));
+    size_t page = sysconf(_SC_PAGESIZE);
+    store->itemSize = itemSize;
+    store->reserved = (itemSize * maxItems + page - 1) / page * page;
+    void* base = mmap(NULL, store->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+	store->reserved = 0;
+	return -1;
+    }
+    store->base = base;
+    return 0;
+}
+
+void*
+StoreGrow(Store* store, size_t count) {
+    size_t used = store->count * store->itemSize;
+    size_t needed = used + count * store->itemSize;
+    if (count > (store->reserved - used) / store->itemSize) {
+	return NULL;
+    }
+    if (needed > store->committed) {
+	/* commit in large steps, one mprotect per STORE_COMMIT_BYTES */
+	size_t committed = (needed + STORE_COMMIT_BYTES - 1) / STORE_COMMIT_BYTES * STORE_COMMIT_BYTES;
+	if (committed > store->reserved) committed = store->reserved;
+	if (mprotect(store->base + store->committed, committed - store->committed, PROT_READ | PROT_WRITE) != 0) {
+	    return NULL;
+	}
+	store->committed = committed;
+    }
+    store->count += count;
+    return store->base + used;
+}
+
+void
+StoreClear(Store* store) {
+    if (store->committed > 0) {
+	/* private anonymous pages read back as zero after this, the mapping stays */
+	madvise(store->base, store->committed, MADV_DONTNEED);
+    }
+    store->count = 0;
+}
+
+void
+StoreFree(Store* store) {
+    if (store->base) {
+	munmap(store->base, store->reserved);
+    }
+    memset(store, 0, sizeof(*store));
+}
@@ -0,0 +1,37 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+
+/* Growable array of fixed size items that never moves.
+ *
+ * The whole capacity is reserved as address space up front, with no access
+ * and no memory behind it. Growing commits the next pages in place, so
+ * existing items are never copied and pointers into the array stay valid
+ * for as long as the store lives. Reserving a few GB of address space costs
+ * nothing on a 64 bit system.
+ */
+#define STORE_COMMIT_BYTES (64 * 1024 * 1024)
+
+typedef struct {
+    unsigned char* base;
+    size_t itemSize;
+    size_t count;     /* items in use */
+    size_t committed; /* bytes that can be touched */
+    size_t reserved;  /* bytes of address space */
+} Store;
+
+/* returns 0 on success, -1 if the address space can't be reserved */
+int StoreInit(Store* store, size_t itemSize, size_t maxItems);
+/* makes room for count more items and returns the first, NULL when the reservation is full */
+void* StoreGrow(Store* store, size_t count);
+/* drops every item, the memory goes back to the system but the reservation stays */
+void StoreClear(Store* store);
+void StoreFree(Store* store);
+
+static inline void*
+StoreAt(const Store* store, size_t index) {
+    return store->base + index * store->itemSize;
+}
+
+#endif
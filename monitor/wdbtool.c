@@ -0,0 +1,264 @@
+/* Tools for .wdb files, see datafile.h for the format
+ *
+ * wdbtool convert data.txt data.wdb   append every row of a text file
+ * wdbtool dump data.wdb               print rows in the data.txt format
+ * wdbtool synth out.wdb rows          append rows of synthetic data, 5 s apart
+ * wdbtool bench data.wdb [data.txt]   time loading the binary file (and the text file)
+ * wdbtool compact directory [days]    roll up and keep days of raw rows (30, -1 for all),
+ *                                     while nothing writes there, ingest does it by itself
+ * wdbtool tiers directory             what the rollup tiers hold
+ * wdbtool log data.log                 print the rows in an ingestion log, see journal.h
+ * wdbtool follow data.log              and keep printing them as they are appended
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "datafile.h"
+#include "journal.h"
+#include "retention.h"
+#include "rollup.h"
+
+static double
+Now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int
+Convert(const char* from, const char* to) {
+    FILE* file = fopen(from, "r");
+    if (!file) {
+	printf("Can't open %s\n", from);
+	return 1;
+    }
+    WdbWriter writer;
+    if (WdbWriterOpen(&writer, to) != 0) {
+	printf("Can't open %s\n", to);
+	fclose(file);
+	return 1;
+    }
+    DataReader reader;
+    if (DataReaderOpen(&reader, file) != 0) {
+	printf("Out of memory\n");
+	fclose(file);
+	WdbWriterClose(&writer);
+	return 1;
+    }
+    int64_t timestamp;
+    double temperature, pressure;
+    uint64_t rows = 0;
+    while (DataReaderNext(&reader, &timestamp, &temperature, &pressure)) {
+	WdbAppend(&writer, timestamp, temperature, pressure);
+	++rows;
+    }
+    if (reader.badLines > 0) {
+	printf("Skipped %llu malformed lines\n", (unsigned long long)reader.badLines);
+    }
+    DataReaderClose(&reader);
+    fclose(file);
+    if (WdbWriterClose(&writer) != 0) {
+	printf("Write to %s failed\n", to);
+	return 1;
+    }
+    printf("Converted %llu rows\n", (unsigned long long)rows);
+    return 0;
+}
+
+static int
+Dump(const char* path) {
+    WdbFile wdb;
+    if (WdbOpen(&wdb, path) != 0) {
+	printf("Can't open %s\n", path);
+	return 1;
+    }
+    char stamp[20];
+    for (uint64_t row = 0; row < wdb.rowCount; ++row) {
+	uint64_t block = row / wdb.blockRows;
+	uint32_t i = row % wdb.blockRows;
+	FormatTimestamp(WdbTimestamps(&wdb, block)[i], stamp);
+	printf("%s %.2f %.2f\n", stamp, WdbTemperatures(&wdb, block)[i], WdbPressures(&wdb, block)[i]);
+    }
+    WdbClose(&wdb);
+    return 0;
+}
+
+static int
+Synth(const char* path, uint64_t rows) {
+    WdbWriter writer;
+    if (WdbWriterOpen(&writer, path) != 0) {
+	printf("Can't open %s\n", path);
+	return 1;
+    }
+    int64_t timestamp = 1697202449; /* first row of data.txt */
+    for (uint64_t row = 0; row < rows; ++row) {
+	double day = 2 * M_PI * (double)(row % 17280) / 17280.0;
+	double temperature = 22.0 + 4.0 * sin(day) + (double)(row % 7) * 0.01;
+	double pressure = 1015.0 + 8.0 * sin(day / 5.0) + (double)(row % 5) * 0.02;
+	if (WdbAppend(&writer, timestamp + 5 * row, temperature, pressure) != 0) {
+	    printf("Write to %s failed\n", path);
+	    return 1;
+	}
+    }
+    if (WdbWriterClose(&writer) != 0) {
+	printf("Write to %s failed\n", path);
+	return 1;
+    }
+    printf("Appended %llu rows\n", (unsigned long long)rows);
+    return 0;
+}
+
+static int
+Bench(const char* binaryPath, const char* textPath) {
+    double start = Now();
+    WdbFile wdb;
+    if (WdbOpen(&wdb, binaryPath) != 0) {
+	printf("Can't open %s\n", binaryPath);
+	return 1;
+    }
+    double opened = Now();
+    /* touch every value, like copying it into the monitor would */
+    double sum = 0;
+    int64_t last = 0;
+    uint64_t blocks = (wdb.rowCount + wdb.blockRows - 1) / wdb.blockRows;
+    for (uint64_t block = 0; block < blocks; ++block) {
+	uint64_t rows = wdb.rowCount - block * wdb.blockRows;
+	if (rows > wdb.blockRows) rows = wdb.blockRows;
+	const int64_t* timestamp = WdbTimestamps(&wdb, block);
+	const double* temperature = WdbTemperatures(&wdb, block);
+	const double* pressure = WdbPressures(&wdb, block);
+	for (uint64_t i = 0; i < rows; ++i) {
+	    sum += temperature[i] + pressure[i];
+	}
+	last = timestamp[rows - 1];
+    }
+    double read = Now();
+    printf("binary: %llu rows, open %.3f ms, read %.3f s, %.1f Mrows/s (checksum %.1f, last %lld)\n",
+	   (unsigned long long)wdb.rowCount, (opened - start) * 1000.0, read - opened,
+	   wdb.rowCount / (read - start) / 1e6, sum, (long long)last);
+    WdbClose(&wdb);
+
+    if (textPath) {
+	FILE* file = fopen(textPath, "r");
+	if (!file) {
+	    printf("Can't open %s\n", textPath);
+	    return 1;
+	}
+	start = Now();
+	DataReader reader;
+	if (DataReaderOpen(&reader, file) != 0) {
+	    fclose(file);
+	    return 1;
+	}
+	int64_t timestamp;
+	double temperature, pressure;
+	uint64_t rows = 0;
+	sum = 0;
+	while (DataReaderNext(&reader, &timestamp, &temperature, &pressure)) {
+	    sum += temperature + pressure;
+	    ++rows;
+	}
+	read = Now();
+	DataReaderClose(&reader);
+	fclose(file);
+	printf("text:   %llu rows, read %.3f s, %.1f Mrows/s (checksum %.1f)\n",
+	       (unsigned long long)rows, read - start, rows / (read - start) / 1e6, sum);
+    }
+    return 0;
+}
+
+static int
+Compact(const char* directory, int64_t days) {
+    double start = Now();
+    Compaction compaction;
+    if (CompactPrepare(&compaction, directory, days < 0 ? -1 : days * 86400) != 0 ||
+	CompactFinish(&compaction) != 0) {
+	printf("Compacting %s failed\n", directory);
+	return 1;
+    }
+    printf("%llu raw rows, %llu dropped (%.1f MB of text), %llu too late for their minute\n",
+	   (unsigned long long)compaction.rows, (unsigned long long)compaction.droppedRows,
+	   compaction.droppedBytes / 1e6, (unsigned long long)compaction.lateRows);
+    printf("%zu minutes, %zu hours, %zu days rolled up in %.3f s\n", compaction.buckets[0],
+	   compaction.buckets[1], compaction.buckets[2], Now() - start);
+    return 0;
+}
+
+static int
+Tiers(const char* directory) {
+    for (int k = 0; k < ROLLUP_TIERS; ++k) {
+	char path[4096];
+	RollupPath(path, sizeof(path), directory, k);
+	RollupFile tier;
+	if (RollupOpen(&tier, path) != 0) {
+	    printf("%s: none\n", path);
+	    continue;
+	}
+	char first[20] = "-";
+	char complete[20];
+	if (tier.count > 0) FormatTimestamp(RollupBuckets(&tier)[0].start, first);
+	FormatTimestamp(tier.complete, complete);
+	printf("%s: %llu buckets of %us, from %s, complete up to %s\n", path, (unsigned long long)tier.count,
+	       tier.period, first, complete);
+	RollupClose(&tier);
+    }
+    return 0;
+}
+
+static void
+PrintRows(void* user, const JournalRow* rows, size_t count) {
+    char stamp[20];
+    for (size_t i = 0; i < count; ++i) {
+	FormatTimestamp(rows[i].timestamp, stamp);
+	printf("%s %.2f %.2f\n", stamp, rows[i].temperature, rows[i].pressure);
+    }
+}
+
+/* what a viewer tailing the log would get */
+static int
+Log(const char* path, int follow) {
+    JournalReader reader;
+    if (JournalReaderOpen(&reader, path) != 0) {
+	printf("Can't open %s\n", path);
+	return 1;
+    }
+    for (;;) {
+	int result = JournalReaderPoll(&reader, PrintRows, NULL);
+	if (result == JOURNAL_RESET) {
+	    printf("-- checkpoint, generation %llu\n", (unsigned long long)reader.generation);
+	    continue;
+	}
+	if (!follow) break;
+	fflush(stdout);
+	if (result == JOURNAL_IDLE) usleep(100000);
+    }
+    printf("%llu rows of generation %llu\n", (unsigned long long)reader.rows, (unsigned long long)reader.generation);
+    JournalReaderClose(&reader);
+    return 0;
+}
+
+int
+main(int argc, char* argv[]) {
+    if (argc == 4 && strcmp(argv[1], "convert") == 0) return Convert(argv[2], argv[3]);
+    if (argc == 3 && strcmp(argv[1], "dump") == 0) return Dump(argv[2]);
+    if (argc == 4 && strcmp(argv[1], "synth") == 0) return Synth(argv[2], strtoull(argv[3], NULL, 10));
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "bench") == 0) return Bench(argv[2], argc == 4 ? argv[3] : NULL);
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "compact") == 0) {
+	return Compact(argv[2], argc == 4 ? strtoll(argv[3], NULL, 10) : RETENTION_RAW_DAYS);
+    }
+    if (argc == 3 && strcmp(argv[1], "tiers") == 0) return Tiers(argv[2]);
+    if (argc == 3 && strcmp(argv[1], "log") == 0) return Log(argv[2], 0);
+    if (argc == 3 && strcmp(argv[1], "follow") == 0) return Log(argv[2], 1);
+    printf("usage: %s convert data.txt data.wdb\n"
+	   "       %s dump data.wdb\n"
+	   "       %s synth out.wdb rows\n"
+	   "       %s bench data.wdb [data.txt]\n"
+	   "       %s compact directory [days]\n"
+	   "       %s tiers directory\n"
+	   "       %s log data.log\n"
+	   "       %s follow data.log\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -1,42 +1,522 @@
-from http.server import BaseHTTPRequestHandler, HTTPServer
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
 import cgi
-from datetime import datetime
+import collections
+import json
+import os
+import queue
+import re
+import struct
+import sys
+import threading
+import time
+import zlib
+from datetime import datetime, timedelta
 
-data_reservoir = []
+# Boards send their ID in an X-Device-Id header, each device gets its own
+# DEVICES_DIR/<id>/data.txt and data.wdb. Uploads without one, from boards
+# older than the header, keep going to data.txt and data.wdb right here.
+DEVICE_HEADER = 'X-Device-Id'
+DEVICES_DIR = "devices"
+DEVICE_ID = re.compile(r'[A-Za-z0-9_-]{1,32}')
 
-content_length = 13
-class RequestHandler(BaseHTTPRequestHandler):
-    def do_POST(self):
-        constant_length = int(self.headers['Content-Length'])
-        post_data = self.rfile.read(content_length)
-        print(f"Received data: {post_data.decode('utf-8')}")
+# Binary columnar copy of data.txt for the monitor, see monitor/datafile.h
+WDB_FILE = "data.wdb"
+WDB_HEADER = struct.Struct('<4sIIIQ')
+WDB_HEADER_SIZE = 64
+WDB_ROW_COUNT_OFFSET = 16
+WDB_BLOCK_ROWS = 4096
 
-        current_datetime = datetime.now().strftime("%Y-%m-%d %H:%M:%S")
+# Write-ahead log, data.log next to data.txt and data.wdb, in the format
+# ingest writes, see monitor/journal.h. One thread commits the uploads that
+# came in while it was busy with the last ones: each device's rows go into
+# its log in one record, one fsync per log, and only then to data.txt and
+# data.wdb and are the uploads answered. Rows the files don't take stay in
+# memory until they do, they are in the log already. Once a log is
+# LOG_CHECKPOINT_SIZE both files are synced and the log starts over. At
+# start the files are cut back to each log's checkpoint, which drops torn
+# lines and rows, and its rows are appended again.
+LOG_FILE = "data.log"
+LOG_MAGIC = b'WJL1'
+LOG_VERSION = 1
+LOG_HEADER = struct.Struct('<4sIQQQ') # magic, version, generation, text size, row count
+LOG_HEADER_SIZE = 64
+LOG_RECORD = struct.Struct('<II') # count, crc
+LOG_ROW = struct.Struct('<qdd')
+LOG_RECORD_ROWS = 4096
+LOG_CHECKPOINT_SIZE = int(os.environ.get("LOG_CHECKPOINT_SIZE", 4 * 1024 * 1024)) # less for crashtest.py
 
-        data_formatted = current_datetime + ' ' + post_data.decode('utf-8') + '\n'
-        try:
-            with open("data.txt", "a") as file:
-                if data_reservoir:
-                    for line in data_reservoir:
-                        file.write(line)
-                    data_reservoir.clear()
-                    print("Reservoir dumped")
-                file.write(data_formatted)
-                file.close()
-        except Exception as e:
-            data_reservoir.append(data_formatted)
-            print("Open file fail, data saved to reservoir")
+# Batched upload, POST /batch with a binary body, all little endian:
+#   header: magic b'WB', version (u8), flags (u8), count (u16), clock (u32)
+#   count samples: captured_at (u32), temperature (f32), pressure (f32)
+# version 1: captured_at and clock are device millis(), clock taken at send time,
+#            each sample is placed by its age relative to the arrival time
+# version 2: captured_at is seconds since boot. With BATCH_ANCHORED set, clock is
+#            the epoch the device booted at (from NTP), otherwise it is the
+#            device uptime in seconds at send time and samples are placed by age
+# version 3: header: magic b'WB', version (u8), flags (u8), count (u16),
+#                    boot_epoch (u32, 0 unless BATCH_ANCHORED), uptime (u32, at send time)
+#            count 6 byte packed samples, a 48 bit little endian integer:
+#              bits  0-16 capture uptime in seconds modulo 2^17
+#              bits 17-30 temperature, signed hundredths of a degree
+#              bits 31-47 pressure in Pa (hundredths of a millibar)
+#            see esp32script/Sample.h
+BATCH_MAGIC = b'WB'
+BATCH_HEADER = struct.Struct('<2sBBHI')
+BATCH_SAMPLE = struct.Struct('<Iff')
+BATCH_ANCHORED = 0x01
+PACKED_HEADER = struct.Struct('<2sBBHII')
+PACKED_SAMPLE_SIZE = 6
+SAMPLE_TIME_RANGE = 1 << 17
+
+# Ingest rate and write latency: a line every STATS_INTERVAL seconds while
+# uploads come in, and the same as JSON at GET /stats, see Stats.as_json()
+STATS_INTERVAL = 10.0
+STATS_WRITES_KEPT = 10000 # quantiles are over the last this many writes
+
+def quantile(values, q):
+    if not values:
+        return 0.0
+    ordered = sorted(values)
+    return ordered[int(q * (len(ordered) - 1))]
+
+class Stats:
+    def __init__(self):
+        self.started = self.last_line = time.monotonic()
+        self.requests = self.rows = 0 # since the last line
+        self.interval_writes = []
+        self.total_requests = self.total_rows = 0
+        self.request_rate = self.row_rate = 0.0
+        self.writes = collections.deque(maxlen=STATS_WRITES_KEPT)
+        self.write_count = 0
+        self.write_seconds = 0.0
+        self.write_max = 0.0
+
+    # one commit, of requests uploads
+    def record(self, requests, rows, seconds):
+        self.requests += requests
+        self.rows += rows
+        self.interval_writes.append(seconds)
+        self.writes.append(seconds)
+        self.write_count += 1
+        self.write_seconds += seconds
+        self.write_max = max(self.write_max, seconds)
+        now = time.monotonic()
+        if now - self.last_line >= STATS_INTERVAL:
+            self.print_line(now)
+
+    def print_line(self, now):
+        elapsed = now - self.last_line
+        self.request_rate = self.requests / elapsed
+        self.row_rate = self.rows / elapsed
+        print(f"{self.request_rate:.0f} requests/s, {self.row_rate:.0f} rows/s, write ms "
+              f"p50 {quantile(self.interval_writes, 0.5) * 1000:.3f}  "
+              f"p99 {quantile(self.interval_writes, 0.99) * 1000:.3f}  "
+              f"max {max(self.interval_writes, default=0) * 1000:.3f}")
+        self.total_requests += self.requests
+        self.total_rows += self.rows
+        self.requests = self.rows = 0
+        self.interval_writes = []
+        self.last_line = now
+
+    def as_json(self):
+        writes = list(self.writes)
+        return json.dumps({
+            "uptime": round(time.monotonic() - self.started, 1),
+            "requests": self.total_requests + self.requests,
+            "rows": self.total_rows + self.rows,
+            "requests_per_second": round(self.request_rate, 1),
+            "rows_per_second": round(self.row_rate, 1),
+            "write_ms": {
+                "count": self.write_count,
+                "mean": self.write_seconds / self.write_count * 1000 if self.write_count else 0.0,
+                "p50": quantile(writes, 0.5) * 1000,
+                "p90": quantile(writes, 0.9) * 1000,
+                "p99": quantile(writes, 0.99) * 1000,
+                "max": self.write_max * 1000,
+            },
+        })
+
+stats = Stats()
+
+def format_line(stamp, temperature, pressure):
+    return f"{stamp.strftime('%Y-%m-%d %H:%M:%S')} {temperature:5.2f} {pressure:7.2f}\n"
+
+def device_directory(device):
+    if device is None:
+        return ""
+    directory = os.path.join(DEVICES_DIR, device)
+    os.makedirs(directory, exist_ok=True)
+    return directory
+
+def append_text(directory, rows):
+    """all of the rows or none, a failed write is cut off again"""
+    path = os.path.join(directory, "data.txt")
+    size = os.path.getsize(path) if os.path.exists(path) else 0
+    try:
+        with open(path, "a") as file:
+            file.writelines(format_line(*row) for row in rows)
+    except Exception:
+        if os.path.exists(path):
+            os.truncate(path, size)
+        raise
+
+def append_wdb(directory, rows):
+    path = os.path.join(directory, WDB_FILE)
+    if not os.path.exists(path):
+        with open(path, "wb") as file:
+            file.write(WDB_HEADER.pack(b'WDB1', 1, WDB_BLOCK_ROWS, 0, 0).ljust(WDB_HEADER_SIZE, b'\0'))
+    with open(path, "r+b") as file:
+        magic, version, block_rows, _, row_count = WDB_HEADER.unpack(file.read(WDB_HEADER.size))
+        if magic != b'WDB1' or version != 1:
+            raise ValueError(f"{path} is not a version 1 .wdb file")
+        for stamp, temperature, pressure in rows:
+            block, row = divmod(row_count, block_rows)
+            base = WDB_HEADER_SIZE + block * block_rows * 24
+            if row == 0:
+                file.truncate(base + block_rows * 24) # allocate the whole block
+            for column, value in enumerate((struct.pack('<q', int(stamp.timestamp())),
+                                            struct.pack('<d', temperature),
+                                            struct.pack('<d', pressure))):
+                file.seek(base + (column * block_rows + row) * 8)
+                file.write(value)
+            row_count += 1
+        # rows first, count last, readers never see half written rows
+        file.flush()
+        file.seek(WDB_ROW_COUNT_OFFSET)
+        file.write(struct.pack('<Q', row_count))
+
+def sync_file(path):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+    finally:
+        os.close(fd)
+
+def wdb_row_count(path):
+    if not os.path.exists(path):
+        return 0
+    with open(path, "rb") as file:
+        return WDB_HEADER.unpack(file.read(WDB_HEADER.size))[4]
+
+class DeviceLog:
+    """One device's data.log, see LOG_FILE"""
+    def __init__(self, directory):
+        self.directory = directory
+        self.path = os.path.join(directory, LOG_FILE)
+        self.fd = os.open(self.path, os.O_RDWR | os.O_CREAT, 0o644)
+        self.generation = 0
+        self.size = 0
+        # logged rows each file has yet to take
+        self.unapplied = {append_text: [], append_wdb: []}
+
+    def file(self, name):
+        return os.path.join(self.directory, name)
+
+    def record_crc(self, data):
+        return zlib.crc32(data, zlib.crc32(struct.pack('<Q', self.generation)))
+
+    def recover(self):
+        """cuts the files back to the checkpoint and appends the log's rows again"""
+        length = os.fstat(self.fd).st_size
+        header = os.pread(self.fd, LOG_HEADER_SIZE, 0)
+        intact = len(header) == LOG_HEADER_SIZE and \
+            struct.unpack_from('<I', header, 32)[0] == zlib.crc32(header[:32])
+        magic, version, generation, text_size, row_count = LOG_HEADER.unpack_from(header.ljust(LOG_HEADER_SIZE, b'\0'))
+        if not intact or magic != LOG_MAGIC or version != LOG_VERSION:
+            # empty, or a checkpoint caught halfway: the files were synced
+            if length > 0:
+                os.ftruncate(self.fd, 0)
+                print(f"{self.path}: torn header, {length} bytes dropped")
+            self.checkpoint()
+            return
+        self.generation = generation
+        rows = []
+        offset = LOG_HEADER_SIZE
+        while True:
+            head = os.pread(self.fd, LOG_RECORD.size, offset)
+            if len(head) < LOG_RECORD.size:
+                break
+            count, crc = LOG_RECORD.unpack(head)
+            if count == 0 or count > LOG_RECORD_ROWS:
+                break
+            data = os.pread(self.fd, count * LOG_ROW.size, offset + LOG_RECORD.size)
+            if len(data) < count * LOG_ROW.size or self.record_crc(data) != crc:
+                break
+            rows.extend((datetime.fromtimestamp(stamp), temperature, pressure)
+                        for stamp, temperature, pressure in LOG_ROW.iter_unpack(data))
+            offset += LOG_RECORD.size + len(data)
+        self.size = offset
+        # a file smaller than the checkpoint was replaced since, it is left alone
+        text = self.file("data.txt")
+        if os.path.exists(text) and os.path.getsize(text) > text_size:
+            os.truncate(text, text_size)
+        wdb = self.file(WDB_FILE)
+        if wdb_row_count(wdb) > row_count:
+            with open(wdb, "r+b") as file:
+                file.seek(WDB_ROW_COUNT_OFFSET)
+                file.write(struct.pack('<Q', row_count))
+                blocks = -(-row_count // WDB_BLOCK_ROWS)
+                file.truncate(WDB_HEADER_SIZE + blocks * WDB_BLOCK_ROWS * 24)
+        if rows or length > offset:
+            print(f"{self.path}: {len(rows)} rows recovered, {length - offset} bytes of torn tail dropped")
+        self.apply(rows)
+        self.checkpoint()
+
+    def append(self, rows):
+        """one record per LOG_RECORD_ROWS rows, synced, raises if it can't be"""
+        offset = self.size
+        for first in range(0, len(rows), LOG_RECORD_ROWS):
+            data = b''.join(LOG_ROW.pack(int(stamp.timestamp()), temperature, pressure)
+                            for stamp, temperature, pressure in rows[first:first + LOG_RECORD_ROWS])
+            record = LOG_RECORD.pack(len(data) // LOG_ROW.size, self.record_crc(data)) + data
+            # a failed write leaves a torn record, the next one goes over it
+            if os.pwrite(self.fd, record, offset) != len(record):
+                raise OSError("short write to " + self.path)
+            offset += len(record)
+        os.fdatasync(self.fd)
+        self.size = offset
+
+    def apply(self, rows):
+        """appends logged rows to data.txt and data.wdb, checkpoints when due"""
+        for append, pending in self.unapplied.items():
+            pending.extend(rows)
+            try:
+                append(self.directory, pending)
+                pending.clear()
+            except Exception as e:
+                print(f"Can't write {self.directory or 'default'}'s files, {len(pending)} rows kept for later: {e}")
+        if self.size >= LOG_CHECKPOINT_SIZE:
+            try:
+                self.checkpoint()
+            except OSError as e:
+                print(f"Checkpoint of {self.path} failed: {e}")
+
+    def checkpoint(self):
+        """syncs the files and starts the log over, unless rows are still to be written"""
+        if any(self.unapplied.values()):
+            return
+        text = self.file("data.txt")
+        wdb = self.file(WDB_FILE)
+        for path in (text, wdb):
+            if os.path.exists(path):
+                sync_file(path)
+        self.generation += 1
+        header = LOG_HEADER.pack(LOG_MAGIC, LOG_VERSION, self.generation,
+                                 os.path.getsize(text) if os.path.exists(text) else 0, wdb_row_count(wdb))
+        header = (header + struct.pack('<I', zlib.crc32(header))).ljust(LOG_HEADER_SIZE, b'\0')
+        os.pwrite(self.fd, header, 0)
+        os.fdatasync(self.fd)
+        os.ftruncate(self.fd, LOG_HEADER_SIZE)
+        self.size = LOG_HEADER_SIZE
 
+class Upload:
+    def __init__(self, device, rows):
+        self.device = device
+        self.rows = rows
+        self.saved = False
+        self.done = threading.Event()
+
+class Committer(threading.Thread):
+    """Commits uploads in groups, see LOG_FILE"""
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.uploads = queue.Queue()
+        self.logs = {}
+
+    def log(self, device):
+        log = self.logs.get(device)
+        if log is None:
+            log = DeviceLog(device_directory(device))
+            log.recover()
+            self.logs[device] = log
+        return log
+
+    def recover(self):
+        """every device that has a log, before anything is uploaded"""
+        if os.path.exists(LOG_FILE):
+            self.log(None)
+        if os.path.isdir(DEVICES_DIR):
+            for device in sorted(os.listdir(DEVICES_DIR)):
+                if DEVICE_ID.fullmatch(device) and os.path.exists(os.path.join(DEVICES_DIR, device, LOG_FILE)):
+                    self.log(device)
+
+    def save(self, device, rows):
+        """returns once the rows are logged, False if they couldn't be"""
+        upload = Upload(device, rows)
+        self.uploads.put(upload)
+        upload.done.wait()
+        return upload.saved
+
+    def run(self):
+        while True:
+            uploads = [self.uploads.get()]
+            while True:
+                try:
+                    uploads.append(self.uploads.get_nowait())
+                except queue.Empty:
+                    break
+            self.commit(uploads)
+
+    def commit(self, uploads):
+        start = time.perf_counter()
+        devices = {}
+        for upload in uploads:
+            devices.setdefault(upload.device, []).append(upload)
+        for device, group in devices.items():
+            rows = [row for upload in group for row in upload.rows]
+            try:
+                log = self.log(device)
+                log.append(rows)
+            except Exception as e:
+                print(f"Can't log {device or 'default'}'s rows, the uploads are answered with 503: {e}")
+                continue
+            log.apply(rows)
+            for upload in group:
+                upload.saved = True
+        stats.record(len(uploads), sum(len(upload.rows) for upload in uploads), time.perf_counter() - start)
+        for upload in uploads:
+            upload.done.set()
+
+committer = Committer()
+
+def sample_time(version, flags, clock, captured_at, arrival):
+    if version == 1:
+        age = ((clock - captured_at) & 0xFFFFFFFF) / 1000.0 # millis() wraps every 49 days
+        return arrival - timedelta(seconds=age)
+    if flags & BATCH_ANCHORED:
+        return datetime.fromtimestamp(clock + captured_at)
+    return arrival - timedelta(seconds=clock - captured_at)
+
+def unpack_sample(raw):
+    bits = int.from_bytes(raw, 'little')
+    centi_degrees = (bits >> 17) & 0x3FFF
+    if centi_degrees & 0x2000:
+        centi_degrees -= 0x4000
+    return bits & (SAMPLE_TIME_RANGE - 1), centi_degrees / 100.0, ((bits >> 31) & 0x1FFFF) / 100.0
+
+def decode_packed_batch(body, arrival):
+    if len(body) < PACKED_HEADER.size:
+        raise ValueError("batch too short")
+    magic, version, flags, count, boot_epoch, uptime = PACKED_HEADER.unpack_from(body, 0)
+    if len(body) != PACKED_HEADER.size + count * PACKED_SAMPLE_SIZE:
+        raise ValueError("batch length does not match count")
+    rows = []
+    for offset in range(PACKED_HEADER.size, len(body), PACKED_SAMPLE_SIZE):
+        captured_low, temperature, pressure = unpack_sample(body[offset:offset + PACKED_SAMPLE_SIZE])
+        age = (uptime - captured_low) & (SAMPLE_TIME_RANGE - 1)
+        if flags & BATCH_ANCHORED:
+            stamp = datetime.fromtimestamp(boot_epoch + uptime - age)
+        else:
+            stamp = arrival - timedelta(seconds=age)
+        rows.append((stamp, temperature, pressure))
+    return rows
+
+def decode_batch(body, arrival):
+    if len(body) >= 3 and body[:2] == BATCH_MAGIC and body[2] == 3:
+        return decode_packed_batch(body, arrival)
+    if len(body) < BATCH_HEADER.size:
+        raise ValueError("batch too short")
+    magic, version, flags, count, clock = BATCH_HEADER.unpack_from(body, 0)
+    if magic != BATCH_MAGIC or version not in (1, 2):
+        raise ValueError("unknown batch format")
+    if len(body) != BATCH_HEADER.size + count * BATCH_SAMPLE.size:
+        raise ValueError("batch length does not match count")
+    rows = []
+    for captured_at, temperature, pressure in BATCH_SAMPLE.iter_unpack(body[BATCH_HEADER.size:]):
+        stamp = sample_time(version, flags, clock, captured_at, arrival)
+        rows.append((stamp, temperature, pressure))
+    return rows
+
+# Text upload: "TT.TT PPPP.PP" from old boards, new boards append the capture
+# time as epoch seconds once their clock is synced
+def decode_text(body, arrival):
+    fields = body.split()
+    stamp = datetime.fromtimestamp(int(fields[2])) if len(fields) == 3 else arrival
+    return (stamp, float(fields[0]), float(fields[1]))
+
+class RequestHandler(BaseHTTPRequestHandler):
+    def do_GET(self):
+        if self.path != '/stats':
+            self.send_response(404)
+            self.send_header("Content-type", "text/plain")
+            self.end_headers()
+            self.wfile.write(b"not found")
+            return
+        body = stats.as_json().encode('utf-8')
         self.send_response(200)
+        self.send_header("Content-type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_POST(self):
+        device = self.headers.get(DEVICE_HEADER)
+        if device is not None and not DEVICE_ID.fullmatch(device):
+            self.rfile.read(int(self.headers['Content-Length']))
+            self.send_response(400)
+            self.send_header("Content-type", "text/plain")
+            self.end_headers()
+            self.wfile.write(b"bad device id")
+            return
+        if self.path == '/batch':
+            self.handle_batch(device)
+            return
+        arrival = datetime.now()
+        post_data = self.rfile.read(int(self.headers['Content-Length']))
+        print(f"Received data from {device or 'default'}: {post_data.decode('utf-8', 'replace')}")
+        try:
+            row = decode_text(post_data.decode('utf-8'), arrival)
+        except (ValueError, IndexError, OverflowError, OSError) as e:
+            print(f"Bad upload: {e}")
+            self.send_response(400)
+            self.send_header("Content-type", "text/plain")
+            self.end_headers()
+            self.wfile.write(b"expected temperature and pressure")
+            return
+
+        if self.save(device, [row]):
+            self.send_response(200)
+            self.send_header("Content-type", "text/plain")
+            self.end_headers()
+            self.wfile.write(b"Data received and saved successfully")
+
+    # the board sends the rows again if they aren't answered with 200
+    def save(self, device, rows):
+        if committer.save(device, rows):
+            return True
+        self.send_response(503)
         self.send_header("Content-type", "text/plain")
         self.end_headers()
-        self.wfile.write(b"Data received and saved successfully")
+        self.wfile.write(b"not saved, try again")
+        return False
+
+    def handle_batch(self, device):
+        arrival = datetime.now()
+        body = self.rfile.read(int(self.headers['Content-Length']))
+        try:
+            rows = decode_batch(body, arrival)
+        except ValueError as e:
+            print(f"Bad batch: {e}")
+            self.send_response(400)
+            self.send_header("Content-type", "text/plain")
+            self.end_headers()
+            self.wfile.write(str(e).encode('utf-8'))
+            return
+        print(f"Received batch of {len(rows)} samples from {device or 'default'}")
+        if self.save(device, rows):
+            self.send_response(200)
+            self.send_header("Content-type", "text/plain")
+            self.end_headers()
+            self.wfile.write(b"Batch received and saved successfully")
 
-def run_server():
-    server_address = ('', 8000)
-    httpd = HTTPServer(server_address, RequestHandler)
-    print('Server is running on port 8000')
+def run_server(port=8000):
+    server_address = ('', port)
+    committer.recover()
+    committer.start()
+    httpd = ThreadingHTTPServer(server_address, RequestHandler)
+    print(f'Server is running on port {port}')
     httpd.serve_forever()
 
+# usage: python3 server.py [port]
 if __name__ == '__main__':
-    run_server()
+    run_server(int(sys.argv[1]) if len(sys.argv) > 1 else 8000)
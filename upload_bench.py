@@ -0,0 +1,84 @@
+# Loopback benchmark of the two upload paths in server.py
+# usage: python3 upload_bench.py [samples] [batch size]
+# Posts the same samples once per request (what send_data() does) and in
+# binary batches (what dump_batches() does), prints samples/sec for both.
+import contextlib
+import http.client
+import io
+import os
+import struct
+import sys
+import tempfile
+import threading
+import time
+from http.server import HTTPServer
+
+import server
+
+def start_server():
+    server.committer.start() # the handlers hand it their rows, see server.LOG_FILE
+    httpd = HTTPServer(('127.0.0.1', 0), server.RequestHandler)
+    httpd.RequestHandlerClass.log_message = lambda *args: None
+    thread = threading.Thread(target=httpd.serve_forever, daemon=True)
+    thread.start()
+    return httpd
+
+def make_samples(count):
+    # 5 s apart, same jitter as data.txt
+    return [(i * 5, 24.5 + (i % 7) * 0.01, 1023.9 + (i % 5) * 0.02) for i in range(count)]
+
+def post(port, path, body, content_type):
+    connection = http.client.HTTPConnection('127.0.0.1', port)
+    connection.request('POST', path, body, {'Content-Type': content_type})
+    response = connection.getresponse()
+    response.read()
+    connection.close()
+    return response.status
+
+def per_sample(port, samples):
+    for _, temperature, pressure in samples:
+        body = f"{temperature:5.2f} {pressure:7.2f}".encode('utf-8')
+        if post(port, '/', body, 'application/x-www-form-urlencoded') != 200:
+            raise RuntimeError("per sample post failed")
+
+# same packing as esp32script/Sample.h
+def pack_sample(captured_at, temperature, pressure):
+    bits = (captured_at % server.SAMPLE_TIME_RANGE) \
+        | ((round(temperature * 100) & 0x3FFF) << 17) \
+        | (round(pressure * 100) << 31)
+    return bits.to_bytes(server.PACKED_SAMPLE_SIZE, 'little')
+
+def batched(port, samples, batch_size):
+    for start in range(0, len(samples), batch_size):
+        chunk = samples[start:start + batch_size]
+        uptime = chunk[-1][0]
+        body = server.PACKED_HEADER.pack(server.BATCH_MAGIC, 3, 0, len(chunk), 0, uptime)
+        body += b''.join(pack_sample(*sample) for sample in chunk)
+        if post(port, '/batch', body, 'application/octet-stream') != 200:
+            raise RuntimeError("batch post failed")
+
+def measure(name, count, function, *args):
+    start = time.perf_counter()
+    with contextlib.redirect_stdout(io.StringIO()):
+        function(*args)
+    elapsed = time.perf_counter() - start
+    print(f"{name:12s} {count:8d} samples {elapsed:8.3f} s {count / elapsed:12.1f} samples/s")
+    return count / elapsed
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 6000
+    batch_size = int(sys.argv[2]) if len(sys.argv) > 2 else 256
+    samples = make_samples(count)
+    with tempfile.TemporaryDirectory() as directory:
+        os.chdir(directory) # server.py appends to ./data.txt
+        httpd = start_server()
+        port = httpd.server_address[1]
+        single = measure("per-sample", count, per_sample, port, samples)
+        batch = measure(f"batch/{batch_size}", count, batched, port, samples, batch_size)
+        httpd.shutdown()
+        with open("data.txt") as file:
+            rows = sum(1 for _ in file)
+    print(f"speedup {batch / single:.1f}x, {rows} rows written")
+
+if __name__ == '__main__':
+    main()